@@ -0,0 +1,923 @@
+#define _GNU_SOURCE // posix_openpt, ptsname, pipe2
+
+#include "comitoz.bench.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>      // errno, EINTR, EAGAIN
+#include <fcntl.h>      // open, fcntl, O_RDWR, O_NOCTTY, O_CLOEXEC, O_NONBLOCK
+#include <poll.h>       // poll, POLLIN, POLLOUT
+#include <signal.h>     // signal, SIGPIPE, SIG_IGN
+#include <stdlib.h>     // malloc, realloc, free, strtol, qsort, posix_openpt
+#include <stdio.h>      // fprintf, fopen, fclose, perror, snprintf
+#include <string.h>     // memcpy, memmove, memcmp, memmem, memchr, strcmp
+#include <sys/ioctl.h>  // ioctl, TIOCSCTTY
+#include <sys/socket.h> // socket, connect
+#include <sys/types.h>  // pid_t
+#include <sys/un.h>     // struct sockaddr_un
+#include <sys/wait.h>   // waitpid
+#include <termios.h>    // tcgetattr, tcsetattr, ECHO
+#include <unistd.h>     // fork, execv, dup2, read, write, setsid, getopt,
+                        // usleep, unlink
+
+
+/*** Implementations ***/
+
+int add_result(result_list_t* list,
+               const char*    benchmark,
+               const char*    transport,
+               long           param,
+               const char*    metric,
+               double         value,
+               const char*    unit)
+{
+    if (list->count == list->cap)
+    {
+        size_t new_cap = list->cap > 0 ? list->cap * 2 : 32;
+        result_t* grown = realloc(list->results, new_cap * sizeof(result_t));
+        if (grown == NULL)
+        {
+            return 1;
+        }
+        list->results = grown;
+        list->cap = new_cap;
+    }
+
+    result_t* r = &list->results[list->count++];
+    r->benchmark = benchmark;
+    r->transport = transport;
+    r->param = param;
+    r->metric = metric;
+    r->value = value;
+    r->unit = unit;
+
+    return 0;
+}
+
+void write_results(const result_list_t* list,
+                   result_format_t      format,
+                   FILE*                out)
+{
+    size_t i;
+    switch (format)
+    {
+        case FORMAT_JSON:
+        {
+            fprintf(out, "[\n");
+            for (i = 0; i < list->count; ++i)
+            {
+                const result_t* r = &list->results[i];
+                fprintf(
+                    out,
+                    "  {\"benchmark\": \"%s\", \"transport\": \"%s\", "
+                    "\"param\": %ld, \"metric\": \"%s\", \"value\": %.3f, "
+                    "\"unit\": \"%s\"}%s\n",
+                    r->benchmark,
+                    r->transport,
+                    r->param,
+                    r->metric,
+                    r->value,
+                    r->unit,
+                    i + 1 < list->count ? "," : ""
+                );
+            }
+            fprintf(out, "]\n");
+            break;
+        }
+        case FORMAT_CSV:
+        default:
+        {
+            fprintf(out, "benchmark,transport,param,metric,value,unit\n");
+            for (i = 0; i < list->count; ++i)
+            {
+                const result_t* r = &list->results[i];
+                fprintf(
+                    out,
+                    "%s,%s,%ld,%s,%.3f,%s\n",
+                    r->benchmark,
+                    r->transport,
+                    r->param,
+                    r->metric,
+                    r->value,
+                    r->unit
+                );
+            }
+            break;
+        }
+    }
+}
+
+int start_shell_pty(shell_proc_t* shell, char* const argv[])
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1)
+    {
+        perror("could not open a pty");
+        return 1;
+    }
+    const char* slave_name = ptsname(master);
+    int slave = slave_name != NULL
+        ? open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC)
+        : -1;
+    if (slave == -1)
+    {
+        perror("could not open the pty slave");
+        close(master);
+        return 1;
+    }
+
+    // Nobody wants to read back what they just typed
+    struct termios tio;
+    if (tcgetattr(slave, &tio) == 0)
+    {
+        tio.c_lflag &= ~(tcflag_t)(ECHO | ECHONL);
+        tcsetattr(slave, TCSANOW, &tio);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork() failed!");
+        close(slave);
+        close(master);
+        return 1;
+    }
+    if (pid == 0)
+    {
+        // New session, with the pty as its controlling terminal
+        setsid();
+        ioctl(slave, TIOCSCTTY, 0);
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    close(slave);
+    shell->pid = pid;
+    shell->to_shell = master;
+    shell->from_shell = master;
+
+    return 0;
+}
+
+int start_shell_pipes(shell_proc_t* shell,
+                      char* const   argv[],
+                      bool          read_output,
+                      int           extra_fd)
+{
+    int in_pipe[2];
+    int out_pipe[2] = {-1, -1};
+    if (pipe2(in_pipe, O_CLOEXEC) == -1
+        || (read_output && pipe2(out_pipe, O_CLOEXEC) == -1))
+    {
+        perror("pipe2() failed!");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork() failed!");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        int out_fd = read_output
+            ? out_pipe[1]
+            : open("/dev/null", O_WRONLY);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(out_fd, STDERR_FILENO);
+        if (extra_fd == 3) // Already there, but still `O_CLOEXEC`
+        {
+            fcntl(3, F_SETFD, 0);
+        }
+        else if (extra_fd != -1)
+        {
+            dup2(extra_fd, 3); // `dup2()` leaves out `O_CLOEXEC`
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    if (read_output)
+    {
+        close(out_pipe[1]);
+    }
+    shell->pid = pid;
+    shell->to_shell = in_pipe[1];
+    shell->from_shell = out_pipe[0];
+
+    return 0;
+}
+
+int await_prompt(shell_proc_t* shell)
+{
+    const size_t prompt_len = strlen(BENCH_PROMPT);
+    char buf[4096];
+    char tail[2] = {'\0', '\0'}; // Last two bytes read, across reads
+
+    while (1)
+    {
+        ssize_t bytes_read = read(shell->from_shell, buf, sizeof(buf));
+        if (bytes_read <= 0)
+        {
+            return 1;
+        }
+
+        if (bytes_read >= 2)
+        {
+            tail[0] = buf[bytes_read - 2];
+            tail[1] = buf[bytes_read - 1];
+        }
+        else
+        {
+            tail[0] = tail[1];
+            tail[1] = buf[0];
+        }
+        if (memcmp(tail, BENCH_PROMPT, prompt_len) == 0)
+        {
+            return 0;
+        }
+    }
+}
+
+int finish_shell(shell_proc_t* shell)
+{
+    close(shell->to_shell);
+    if (shell->from_shell != -1 && shell->from_shell != shell->to_shell)
+    {
+        // Let it finish saying whatever it has to say
+        char buf[4096];
+        while (read(shell->from_shell, buf, sizeof(buf)) > 0) {}
+        close(shell->from_shell);
+    }
+
+    int wstatus;
+    if (waitpid(shell->pid, &wstatus, 0) == -1)
+    {
+        perror("waitpid() failed!");
+        return -1;
+    }
+
+    return wstatus;
+}
+
+int write_all(int fd, const char* buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0)
+        {
+            return 1;
+        }
+        buf += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+int record_latencies(result_list_t* list,
+                     const char*    benchmark,
+                     const char*    transport,
+                     uint64_t*      samples,
+                     size_t         count)
+{
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+
+    double total = 0;
+    size_t i;
+    for (i = 0; i < count; ++i)
+    {
+        total += (double)samples[i];
+    }
+
+    // Nearest-rank percentiles
+    size_t p50 = (count * 50 + 99) / 100;
+    size_t p99 = (count * 99 + 99) / 100;
+    p50 = p50 > 0 ? p50 - 1 : 0;
+    p99 = p99 > 0 ? p99 - 1 : 0;
+
+    return add_result(list, benchmark, transport, 0, "p50",
+                      (double)samples[p50] / 1e3, "us")
+        || add_result(list, benchmark, transport, 0, "p99",
+                      (double)samples[p99] / 1e3, "us")
+        || add_result(list, benchmark, transport, 0, "mean",
+                      total / (double)count / 1e3, "us");
+}
+
+int bench_round_trip(result_list_t* list,
+                     const char*    shell_path,
+                     transport_t    transport,
+                     const char*    benchmark,
+                     const char*    line,
+                     long           iterations)
+{
+    char shell_arg[4096];
+    char interactive_arg[] = "-i";
+    snprintf(shell_arg, sizeof(shell_arg), "%s", shell_path);
+    char* argv[] = {shell_arg, NULL, NULL};
+    if (transport == TRANSPORT_PIPE)
+    {
+        argv[1] = interactive_arg; // Pipes don't get prompted otherwise
+    }
+
+    shell_proc_t shell;
+    int r = transport == TRANSPORT_PTY
+        ? start_shell_pty(&shell, argv)
+        : start_shell_pipes(&shell, argv, true, -1);
+    if (r != 0)
+    {
+        return r;
+    }
+
+    uint64_t* samples = malloc((size_t)iterations * sizeof(uint64_t));
+    if (samples == NULL || await_prompt(&shell) != 0) // The first prompt
+    {
+        fprintf(stderr, "%s: shell did not start\n", benchmark);
+        free(samples);
+        finish_shell(&shell);
+        return 1;
+    }
+
+    size_t line_len = strlen(line);
+    long i;
+    for (i = 0; i < iterations; ++i)
+    {
+        uint64_t start = monotonic_ns();
+        if (write_all(shell.to_shell, line, line_len) != 0
+            || await_prompt(&shell) != 0)
+        {
+            fprintf(stderr, "%s: shell went away\n", benchmark);
+            free(samples);
+            finish_shell(&shell);
+            return 1;
+        }
+        samples[i] = monotonic_ns() - start;
+    }
+
+    write_all(shell.to_shell, "exit\n", 5);
+    finish_shell(&shell);
+
+    const char* transport_name = transport == TRANSPORT_PTY ? "pty" : "pipe";
+    r = record_latencies(
+        list,
+        benchmark,
+        transport_name,
+        samples,
+        (size_t)iterations
+    );
+    free(samples);
+
+    return r;
+}
+
+int time_batch(const char* shell_path,
+               const char* line,
+               long        count,
+               double*     secs)
+{
+    // Build the whole input up front, so that only the shell is being timed
+    size_t line_len = strlen(line);
+    size_t input_len = line_len * (size_t)count;
+    char* input = malloc(input_len);
+    if (input == NULL)
+    {
+        perror("malloc() failed!");
+        return 1;
+    }
+    long i;
+    for (i = 0; i < count; ++i)
+    {
+        memcpy(input + (size_t)i * line_len, line, line_len);
+    }
+
+    char shell_arg[4096];
+    snprintf(shell_arg, sizeof(shell_arg), "%s", shell_path);
+    char* argv[] = {shell_arg, NULL};
+
+    uint64_t start = monotonic_ns();
+    shell_proc_t shell;
+    if (start_shell_pipes(&shell, argv, false, -1) != 0)
+    {
+        free(input);
+        return 1;
+    }
+    int w = write_all(shell.to_shell, input, input_len);
+    int wstatus = finish_shell(&shell);
+    *secs = (double)(monotonic_ns() - start) / 1e9;
+    free(input);
+
+    if (w != 0 || wstatus == -1 || !WIFEXITED(wstatus))
+    {
+        fprintf(stderr, "batch: shell did not finish cleanly\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int bench_batch(result_list_t* list, const char* shell_path, long iterations)
+{
+    double true_secs, blank_secs, parse_secs;
+    if (time_batch(shell_path, "true\n", iterations, &true_secs) != 0)
+    {
+        return 1;
+    }
+    if (add_result(list, "batch_true", "pipe", 0, "commands_per_sec",
+                   (double)iterations / true_secs, "1/s") != 0)
+    {
+        return 1;
+    }
+
+    // Spawning swamps everything else, so the parser gets many more lines
+    // to chew on
+    long lines = iterations * 100;
+    if (time_batch(shell_path, "\n", lines, &blank_secs) != 0
+        || time_batch(
+               shell_path,
+               "cd . -v w$$ two three four five < in.$$ > out.$$\n",
+               lines,
+               &parse_secs
+           ) != 0)
+    {
+        return 1;
+    }
+
+    return add_result(list, "batch_blank", "pipe", 0, "lines_per_sec",
+                      (double)lines / blank_secs, "1/s")
+        || add_result(list, "batch_parse", "pipe", 0, "lines_per_sec",
+                      (double)lines / parse_secs, "1/s")
+        || add_result(list, "parse_cost", "pipe", 0, "per_line",
+                      (parse_secs - blank_secs) / (double)lines * 1e9, "ns");
+}
+
+int bench_background(result_list_t* list,
+                     const char*    shell_path,
+                     long           concurrency)
+{
+    // The jobs block on `release[0]` until we close `release[1]`
+    int release[2];
+    if (pipe2(release, O_CLOEXEC) == -1)
+    {
+        perror("pipe2() failed!");
+        return 1;
+    }
+
+    char shell_arg[4096];
+    char jobs_arg[] = "-j0"; // Nothing gets queued
+    snprintf(shell_arg, sizeof(shell_arg), "%s", shell_path);
+    char* argv[] = {shell_arg, jobs_arg, NULL};
+
+    uint64_t start = monotonic_ns();
+    shell_proc_t shell;
+    if (start_shell_pipes(&shell, argv, true, release[0]) != 0)
+    {
+        close(release[0]);
+        close(release[1]);
+        return 1;
+    }
+    close(release[0]);
+
+    const char job_line[] = "cat /dev/fd/3 &\n";
+    long i;
+    for (i = 0; i < concurrency; ++i)
+    {
+        if (write_all(shell.to_shell, job_line, sizeof(job_line) - 1) != 0)
+        {
+            break;
+        }
+    }
+
+    // Every launch gets a "background pid is N" line
+    const char launched_msg[] = "background pid is";
+    const size_t msg_len = sizeof(launched_msg) - 1;
+    char buf[4096 + sizeof(launched_msg)];
+    size_t carry = 0;
+    long launched = 0;
+    while (launched < concurrency)
+    {
+        ssize_t bytes_read = read(
+            shell.from_shell,
+            buf + carry,
+            sizeof(buf) - carry
+        );
+        if (bytes_read <= 0)
+        {
+            break;
+        }
+        size_t len = carry + (size_t)bytes_read;
+        const char* pos = buf;
+        const char* found;
+        while ((found = memmem(pos, len - (size_t)(pos - buf),
+                               launched_msg, msg_len)) != NULL)
+        {
+            launched++;
+            pos = found + msg_len;
+        }
+
+        // Keep a possibly split-up message around for next time
+        carry = len - (size_t)(pos - buf) < msg_len
+            ? len - (size_t)(pos - buf)
+            : msg_len - 1;
+        memmove(buf, buf + len - carry, carry);
+    }
+    uint64_t launch_ns = monotonic_ns() - start;
+
+    // Let them all go; at EOF the shell waits for them and exits
+    uint64_t release_start = monotonic_ns();
+    close(release[1]);
+    int wstatus = finish_shell(&shell);
+    uint64_t reap_ns = monotonic_ns() - release_start;
+
+    if (launched < concurrency || wstatus == -1)
+    {
+        fprintf(
+            stderr,
+            "background: only %ld of %ld jobs launched\n",
+            launched,
+            concurrency
+        );
+        return 1;
+    }
+
+    double n = (double)concurrency;
+    return add_result(list, "background", "pipe", concurrency,
+                      "launches_per_sec", n / ((double)launch_ns / 1e9),
+                      "1/s")
+        || add_result(list, "background", "pipe", concurrency,
+                      "reaps_per_sec", n / ((double)reap_ns / 1e9), "1/s")
+        || add_result(list, "background", "pipe", concurrency,
+                      "jobs_per_sec",
+                      n / ((double)(launch_ns + reap_ns) / 1e9), "1/s");
+}
+
+int connect_when_ready(const char* path)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int tries;
+    for (tries = 0; tries < 500; ++tries) // Five seconds' worth
+    {
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock == -1)
+        {
+            return -1;
+        }
+        if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) == 0)
+        {
+            return sock;
+        }
+        close(sock);
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+long count_replies(char* buf, size_t* len, const char* prefix)
+{
+    const size_t prefix_len = strlen(prefix);
+    long found = 0;
+    char* line = buf;
+    char* newline;
+    while ((newline = memchr(line, '\n', *len - (size_t)(line - buf)))
+           != NULL)
+    {
+        if ((size_t)(newline - line) >= prefix_len
+            && memcmp(line, prefix, prefix_len) == 0)
+        {
+            found++;
+        }
+        line = newline + 1;
+    }
+
+    *len -= (size_t)(line - buf);
+    memmove(buf, line, *len);
+
+    return found;
+}
+
+int time_submissions(int       watcher,
+                     int       submitter,
+                     long      submissions,
+                     uint64_t* submit_ns,
+                     uint64_t* total_ns)
+{
+    // Done events go to the watcher, so it has to be watching first
+    char buf[65536];
+    size_t watch_len = 0;
+    const char watch_req[] = "watch\n";
+    if (write_all(watcher, watch_req, sizeof(watch_req) - 1) != 0)
+    {
+        return 1;
+    }
+    while (count_replies(buf, &watch_len, "watching") == 0)
+    {
+        ssize_t bytes_read = read(
+            watcher,
+            buf + watch_len,
+            sizeof(buf) - watch_len
+        );
+        if (bytes_read <= 0)
+        {
+            return 1;
+        }
+        watch_len += (size_t)bytes_read;
+    }
+
+    const char run_req[] = "run true\n";
+    const size_t req_len = sizeof(run_req) - 1;
+    size_t requests_len = (size_t)submissions * req_len;
+    char* requests = malloc(requests_len);
+    if (requests == NULL)
+    {
+        perror("malloc() failed!");
+        return 1;
+    }
+    long i;
+    for (i = 0; i < submissions; ++i)
+    {
+        memcpy(requests + (size_t)i * req_len, run_req, req_len);
+    }
+
+    // Replies have to be read as requests go out, or both sides could end up
+    // stuck on full buffers
+    char replies[65536];
+    size_t replies_len = 0;
+    size_t sent = 0;
+    long accepted = 0;
+    long finished = 0;
+    int ret = 0;
+    uint64_t start = monotonic_ns();
+    while (!ret && (accepted < submissions || finished < submissions))
+    {
+        struct pollfd fds[2] = {
+            {submitter, POLLIN | (sent < requests_len ? POLLOUT : 0), 0},
+            {watcher, POLLIN, 0}
+        };
+        int ready = poll(fds, 2, 10000);
+        if (ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            fprintf(
+                stderr,
+                "server: stalled at %ld of %ld accepted, %ld finished\n",
+                accepted,
+                submissions,
+                finished
+            );
+            ret = 1;
+            break;
+        }
+
+        if (fds[0].revents & POLLOUT)
+        {
+            ssize_t written = write(
+                submitter,
+                requests + sent,
+                requests_len - sent
+            );
+            if (written < 0 && errno != EAGAIN)
+            {
+                perror("server: write() failed");
+                ret = 1;
+            }
+            sent += written > 0 ? (size_t)written : 0;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t bytes_read = read(
+                submitter,
+                replies + replies_len,
+                sizeof(replies) - replies_len
+            );
+            if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN))
+            {
+                ret = 1;
+            }
+            replies_len += bytes_read > 0 ? (size_t)bytes_read : 0;
+            accepted += count_replies(replies, &replies_len, "job ");
+            if (accepted >= submissions && *submit_ns == 0)
+            {
+                *submit_ns = monotonic_ns() - start;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t bytes_read = read(
+                watcher,
+                buf + watch_len,
+                sizeof(buf) - watch_len
+            );
+            if (bytes_read <= 0)
+            {
+                ret = 1;
+            }
+            watch_len += bytes_read > 0 ? (size_t)bytes_read : 0;
+            finished += count_replies(buf, &watch_len, "done ");
+        }
+    }
+    *total_ns = monotonic_ns() - start;
+
+    free(requests);
+
+    return ret;
+}
+
+int bench_server(result_list_t* list,
+                 const char*    shell_path,
+                 long           submissions)
+{
+    // The shell's own `-j` cap, so submissions queue up rather than waiting
+    // on `fork()`s
+    char shell_arg[4096];
+    char socket_flag[] = "-S";
+    char socket_path[108];
+    snprintf(shell_arg, sizeof(shell_arg), "%s", shell_path);
+    snprintf(
+        socket_path,
+        sizeof(socket_path),
+        "/tmp/smallsh-bench-%ld.sock",
+        (long)getpid()
+    );
+    char* argv[] = {shell_arg, socket_flag, socket_path, NULL};
+
+    shell_proc_t shell;
+    if (start_shell_pipes(&shell, argv, false, -1) != 0)
+    {
+        return 1;
+    }
+
+    uint64_t submit_ns = 0;
+    uint64_t total_ns = 0;
+    int ret = 1;
+    int watcher = connect_when_ready(socket_path);
+    int submitter = connect_when_ready(socket_path);
+    if (watcher == -1
+        || submitter == -1
+        || fcntl(submitter, F_SETFL, O_NONBLOCK) == -1)
+    {
+        fprintf(stderr, "server: could not connect to %s\n", socket_path);
+    }
+    else
+    {
+        ret = time_submissions(
+            watcher,
+            submitter,
+            submissions,
+            &submit_ns,
+            &total_ns
+        );
+    }
+    if (submitter != -1)
+    {
+        close(submitter);
+    }
+    if (watcher != -1)
+    {
+        close(watcher);
+    }
+
+    // A daemon-mode shell keeps serving after EOF, so it has to be told
+    const char exit_line[] = "exit\n";
+    write_all(shell.to_shell, exit_line, sizeof(exit_line) - 1);
+    finish_shell(&shell);
+    unlink(socket_path); // In case it didn't get to
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    double n = (double)submissions;
+    return add_result(list, "server", "socket", 0, "submits_per_sec",
+                      n / ((double)submit_ns / 1e9), "1/s")
+        || add_result(list, "server", "socket", 0, "jobs_per_sec",
+                      n / ((double)total_ns / 1e9), "1/s");
+}
+
+void usage(void)
+{
+    const char msg[] =
+        "usage: smallsh-bench [-n iterations] [-f csv|json] [-o file] "
+        "[shell]\n";
+    write_all(STDERR_FILENO, msg, sizeof(msg) - 1);
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = BENCH_DEFAULT_ITERATIONS;
+    result_format_t format = FORMAT_CSV;
+    const char* out_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:o:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': // Samples per latency, lines per batch
+            {
+                iterations = strtol(optarg, NULL, 10);
+                if (iterations <= 0)
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'f': // Output format
+            {
+                if (strcmp(optarg, "csv") == 0)
+                {
+                    format = FORMAT_CSV;
+                }
+                else if (strcmp(optarg, "json") == 0)
+                {
+                    format = FORMAT_JSON;
+                }
+                else
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'o': // Output file, instead of stdout
+            {
+                out_path = optarg;
+                break;
+            }
+            default:
+            {
+                usage();
+                return 2;
+            }
+        }
+    }
+    if (optind < argc - 1)
+    {
+        usage();
+        return 2;
+    }
+    const char* shell_path = optind < argc ? argv[optind] : "./smallsh";
+
+    // Jobs we leave behind on failure shouldn't take us down with them
+    signal(SIGPIPE, SIG_IGN);
+
+    result_list_t list = {NULL, 0, 0};
+    const long concurrency[] = {10, 100, 1000};
+    const transport_t transports[] = {TRANSPORT_PTY, TRANSPORT_PIPE};
+    int ret = 0;
+    size_t i;
+    for (i = 0; i < sizeof(transports) / sizeof(transports[0]) && !ret; ++i)
+    {
+        ret = bench_round_trip(&list, shell_path, transports[i],
+                               "prompt_round_trip", "\n", iterations)
+            || bench_round_trip(&list, shell_path, transports[i],
+                                "spawn_latency", "true\n", iterations);
+    }
+    if (!ret)
+    {
+        ret = bench_batch(&list, shell_path, iterations);
+    }
+    for (i = 0; i < sizeof(concurrency) / sizeof(concurrency[0]) && !ret; ++i)
+    {
+        ret = bench_background(&list, shell_path, concurrency[i]);
+    }
+    if (!ret)
+    {
+        ret = bench_server(&list, shell_path, BENCH_SERVER_SUBMISSIONS);
+    }
+
+    FILE* out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL)
+    {
+        perror("could not open output file");
+        free(list.results);
+        return 1;
+    }
+    write_results(&list, format, out);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    free(list.results);
+
+    return ret;
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <stdio.h>     // FILE
+#include <sys/types.h> // pid_t
+
+
+/*** Constants ***/
+
+// What the shell prints when it's ready for another line.
+#define BENCH_PROMPT ": "
+
+// Default number of samples (for latencies) or lines (for throughput).
+#define BENCH_DEFAULT_ITERATIONS 2000
+
+// Submissions sent to a daemon-mode shell, per round of the socket
+// benchmark.
+#define BENCH_SERVER_SUBMISSIONS 5000
+
+
+/*** `typedef`s ***/
+
+// How results get written out.
+typedef enum {FORMAT_CSV, FORMAT_JSON} result_format_t;
+
+// How the driver talks to the shell under test.
+//
+// * `TRANSPORT_PTY` - The shell's stdin, stdout, and stderr are the slave
+//                     side of a pseudo-terminal, so it prompts as it would
+//                     for a person.
+// * `TRANSPORT_PIPE` - Plain pipes, with `-i` to get the shell to prompt
+//                      anyway.
+typedef enum {TRANSPORT_PTY, TRANSPORT_PIPE} transport_t;
+
+// One measurement.
+typedef struct
+{
+    const char* benchmark; // What was measured, e.g. "spawn_latency"
+    const char* transport; // "pty" or "pipe"
+    long        param;     // Concurrency and the like; 0 if not applicable
+    const char* metric;    // e.g. "p50", "commands_per_sec"
+    double      value;
+    const char* unit;      // e.g. "us", "1/s"
+} result_t;
+
+// Every measurement taken so far, in order.
+typedef struct
+{
+    result_t* results;
+    size_t    count;
+    size_t    cap;
+} result_list_t;
+
+// A running shell under test.
+typedef struct
+{
+    pid_t pid;
+    int   to_shell;   // Where its input gets written
+    int   from_shell; // Where its output gets read from (may be the same
+                      // descriptor as `to_shell`, for a pty)
+} shell_proc_t;
+
+
+/*** Forward declarations ***/
+
+// Records a measurement.
+//
+// ## Parameters:
+// * `list` - Where to record it.
+// * `benchmark`, `transport`, `param`, `metric`, `value`, `unit` - See
+//   `result_t`. The strings must outlive the list.
+//
+// **Returns** non-zero if out of memory.
+int add_result(result_list_t* list,
+               const char*    benchmark,
+               const char*    transport,
+               long           param,
+               const char*    metric,
+               double         value,
+               const char*    unit);
+
+// Writes out every measurement.
+//
+// ## Parameters:
+// * `list` - The measurements.
+// * `format` - CSV (with a header row) or a JSON array of objects.
+// * `out` - Where to write them.
+void write_results(const result_list_t* list,
+                   result_format_t      format,
+                   FILE*                out);
+
+// Starts the shell with its stdin, stdout, and stderr on a fresh
+// pseudo-terminal, with echo turned off.
+//
+// ## Parameters:
+// * `shell` - Set up to describe the running shell.
+// * `argv` - `NULL`-terminated `argv` for the shell; `argv[0]` is the path.
+//
+// **Returns** non-zero on failure.
+int start_shell_pty(shell_proc_t* shell, char* const argv[]);
+
+// Starts the shell on pipes.
+//
+// ## Parameters:
+// * `shell` - Set up to describe the running shell.
+// * `argv` - `NULL`-terminated `argv` for the shell; `argv[0]` is the path.
+// * `read_output` - Should the shell's stdout and stderr come back to us? If
+//                   not, they go to /dev/null, and `from_shell` is -1.
+// * `extra_fd` - A descriptor for the shell to inherit as fd 3, or -1.
+//
+// **Returns** non-zero on failure.
+int start_shell_pipes(shell_proc_t* shell,
+                      char* const   argv[],
+                      bool          read_output,
+                      int           extra_fd);
+
+// Reads the shell's output until it has printed a prompt and then gone
+// quiet, i.e. until what's been read so far ends with `BENCH_PROMPT`.
+//
+// **Returns** non-zero if the shell went away first.
+int await_prompt(shell_proc_t* shell);
+
+// Closes our ends of the shell's input and output, and waits for it to exit.
+//
+// **Returns** the shell's wait status, or -1 on failure.
+int finish_shell(shell_proc_t* shell);
+
+// Writes the whole of a buffer, retrying on short writes.
+//
+// **Returns** non-zero on failure.
+int write_all(int fd, const char* buf, size_t size);
+
+// Orders two `uint64_t`s, for `qsort()`.
+int compare_u64(const void* a, const void* b);
+
+// Sorts latency samples and records their p50, p99, and mean.
+//
+// ## Parameters:
+// * `list` - Where to record the results.
+// * `benchmark`, `transport` - See `result_t`.
+// * `samples` - Latencies, in nanoseconds. Sorted in place.
+// * `count` - How many samples there are.
+//
+// **Returns** non-zero if out of memory.
+int record_latencies(result_list_t* list,
+                     const char*    benchmark,
+                     const char*    transport,
+                     uint64_t*      samples,
+                     size_t         count);
+
+// Measures how long it takes from sending the shell a line to it prompting
+// for the next one.
+//
+// ## Parameters:
+// * `list` - Where to record the results.
+// * `shell_path` - The shell to run.
+// * `transport` - How to talk to it.
+// * `benchmark` - Name to record the results under.
+// * `line` - What to send, newline included.
+// * `iterations` - How many round trips to time.
+//
+// **Returns** non-zero on failure.
+int bench_round_trip(result_list_t* list,
+                     const char*    shell_path,
+                     transport_t    transport,
+                     const char*    benchmark,
+                     const char*    line,
+                     long           iterations);
+
+// Feeds the shell the same line over and over through a pipe, with no
+// prompting, and times it from start to exit.
+//
+// ## Parameters:
+// * `shell_path` - The shell to run.
+// * `line` - The line, newline included.
+// * `count` - How many times to repeat it.
+// * `secs` - Set to how long the shell took.
+//
+// **Returns** non-zero on failure.
+int time_batch(const char* shell_path,
+               const char* line,
+               long        count,
+               double*     secs);
+
+// Measures batch throughput for `true`, and the per-line cost of parsing and
+// dispatching a line (a `cd .` with a dozen words) over that of a blank one.
+//
+// ## Parameters:
+// * `list` - Where to record the results.
+// * `shell_path` - The shell to run.
+// * `iterations` - How many lines to send for each.
+//
+// **Returns** non-zero on failure.
+int bench_batch(result_list_t* list, const char* shell_path, long iterations);
+
+// Measures how fast the shell launches and then reaps a given number of
+// background jobs that are all running at the same time.
+//
+// Each job is a `cat` of a pipe that the driver holds the only write end
+// of, so none of them can finish until every one has been launched and the
+// driver closes it.
+//
+// ## Parameters:
+// * `list` - Where to record the results.
+// * `shell_path` - The shell to run.
+// * `concurrency` - How many jobs to run at once.
+//
+// **Returns** non-zero on failure.
+int bench_background(result_list_t* list,
+                     const char*    shell_path,
+                     long           concurrency);
+
+// Connects to a daemon-mode shell's socket, waiting for the shell to make it
+// if need be.
+//
+// **Returns** the connected socket, or -1 if it didn't turn up in time.
+int connect_when_ready(const char* path);
+
+// Counts the lines in a buffer that start with a given prefix, carrying any
+// partial line over to the next call.
+//
+// ## Parameters:
+// * `buf` - What's been read; a partial last line is moved to the start.
+// * `len` - How much of `buf` is filled; set to the length of the partial
+//           line left behind.
+// * `prefix` - What to look for at the start of each line.
+//
+// **Returns** how many whole lines started with `prefix`.
+long count_replies(char* buf, size_t* len, const char* prefix);
+
+// Pipelines `run true` submissions to a daemon-mode shell and waits for
+// every one to be accepted and then finish.
+//
+// ## Parameters:
+// * `watcher` - Connected to the shell; gets turned into a `watch`.
+// * `submitter` - Connected to the shell, and non-blocking.
+// * `submissions` - How many to send.
+// * `submit_ns` - Set to how long it took for every one to be accepted.
+// * `total_ns` - Set to how long it took for every one to finish.
+//
+// **Returns** non-zero on failure.
+int time_submissions(int       watcher,
+                     int       submitter,
+                     long      submissions,
+                     uint64_t* submit_ns,
+                     uint64_t* total_ns);
+
+// Measures how fast a daemon-mode shell (`-S`) takes command submissions
+// over its socket, and how fast it gets through them.
+//
+// Submissions of `true` are pipelined over one connection as fast as the
+// shell will take them, while a second connection watches for them
+// finishing.
+//
+// ## Parameters:
+// * `list` - Where to record the results.
+// * `shell_path` - The shell to run.
+// * `submissions` - How many commands to submit.
+//
+// **Returns** non-zero on failure.
+int bench_server(result_list_t* list,
+                 const char*    shell_path,
+                 long           submissions);
+
+// Prints out how to invoke the driver.
+void usage(void);
+
+// Runs every benchmark against a shell binary, and writes out the results.
+//
+// ## Parameters:
+// * `argc` - Number of arguments passed in.
+// * `argv` - `[-n iterations] [-f csv|json] [-o file] [shell]`. The shell
+//            defaults to "./smallsh".
+//
+// **Returns** non-zero on failure.
+int main(int argc, char** argv);
@@ -0,0 +1,1132 @@
+#pragma once
+
+#include "comitoz.output.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>     // errno, EINTR, EPIPE, ERANGE
+#include <fcntl.h>     // open, O_RDONLY, O_CLOEXEC
+#include <limits.h>    // INT_MAX
+#include <signal.h>    // sig_atomic_t, SIGINT, SIGPIPE, SIGTERM
+#include <stdint.h>    // uintptr_t
+#include <stdlib.h>    // malloc, realloc, free, getenv, strtoll, strtoull
+#include <string.h>    // memcpy, strchr, strcmp, strerror, strlen
+#include <sys/stat.h>  // stat, lstat, fstat, S_IS*
+#include <sys/uio.h>   // struct iovec
+#include <unistd.h>    // read, close, getcwd, eaccess, isatty
+
+
+/*** Constants ***/
+
+// What a fast built-in returns when it would rather the real utility
+// handled this particular invocation: an option it doesn't know, a corner
+// case where it can't be sure of matching the real thing exactly, or
+// running out of memory. Nothing has been written at that point, so the
+// line can simply be run the usual way instead.
+#define BUILTIN_DECLINE (-1)
+
+// What a fast built-in returns for something that would have killed the
+// real utility with signal `signo`, e.g. writing to a pipe nobody reads.
+#define BUILTIN_SIGNALED(signo) (-1 - (signo))
+
+// How much `fast_cat()` moves at a time.
+#define BUILTIN_CAT_CHUNK 65536
+
+// Widths and precisions bigger than this make `fast_printf()` decline.
+#define BUILTIN_MAX_WIDTH 4096
+
+
+/*** Globals ***/
+
+// Set by the shell's `SIGTERM` handler (see comitoz.smallsh.c). A fast
+// built-in that could go on forever gives up once it's set, as the real
+// utility would have been killed.
+extern volatile sig_atomic_t shutdown_requested;
+
+
+/*** `typedef`s ***/
+
+// A growable buffer that a built-in's output is put together in, so that
+// it can still decline right up until the output is written in one go.
+typedef struct
+{
+    char*  data;
+    size_t len;
+    size_t cap;
+} builtin_buf_t;
+
+// A fast built-in: an in-process stand-in for a small external utility.
+//
+// ## Parameters:
+// * `argc` - How many arguments there are, including the command name.
+// * `args` - The `NULL`-terminated arguments, `args[0]` being the name.
+//
+// **Returns** the exit status the real utility would have had,
+// `BUILTIN_SIGNALED()` if it would have been killed, or `BUILTIN_DECLINE`.
+typedef int (*fast_builtin_fn)(int argc, char* const* args);
+
+// One entry of the fast built-in table.
+typedef struct
+{
+    const char*     name;
+    fast_builtin_fn fn;
+} fast_builtin_t;
+
+
+/*** Implementations ***/
+
+// Makes sure a buffer has room for `extra` more bytes.
+//
+// **Returns** zero on success, or non-zero if out of memory.
+int builtin_buf_reserve(builtin_buf_t* buf, size_t extra)
+{
+    if (buf->cap - buf->len >= extra)
+    {
+        return 0;
+    }
+
+    size_t cap = buf->cap > 0 ? buf->cap : 256;
+    while (cap - buf->len < extra)
+    {
+        cap *= 2;
+    }
+    char* data = realloc(buf->data, cap);
+    if (data == NULL)
+    {
+        return 1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+
+    return 0;
+}
+
+// Appends bytes to a buffer.
+//
+// **Returns** zero on success, or non-zero if out of memory.
+int builtin_buf_append(builtin_buf_t* buf, const char* str, size_t size)
+{
+    if (builtin_buf_reserve(buf, size) != 0)
+    {
+        return 1;
+    }
+    memcpy(buf->data + buf->len, str, size);
+    buf->len += size;
+
+    return 0;
+}
+
+// Appends `count` copies of a byte to a buffer.
+//
+// **Returns** zero on success, or non-zero if out of memory.
+int builtin_buf_fill(builtin_buf_t* buf, char c, size_t count)
+{
+    if (builtin_buf_reserve(buf, count) != 0)
+    {
+        return 1;
+    }
+    memset(buf->data + buf->len, c, count);
+    buf->len += count;
+
+    return 0;
+}
+
+// Prints "`name`: `what`: `strerror(err)`" to stderr, the way coreutils
+// reports errors.
+void builtin_error(const char* name, const char* what, int err)
+{
+    const char* parts[] = {name, ": ", what, ": ", strerror(err), "\n"};
+    struct iovec iov[sizeof(parts) / sizeof(parts[0])];
+    size_t i;
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+    {
+        iov[i].iov_base = (void*)(uintptr_t)parts[i];
+        iov[i].iov_len = strlen(parts[i]);
+    }
+    write_iov(STDERR_FILENO, iov, (int)i);
+}
+
+// Writes a built-in's output to stdout, and frees the buffer.
+//
+// **Returns** the built-in's exit status: `status` if all went well, 1 (and
+// a message) for a write error, or `BUILTIN_SIGNALED(SIGPIPE)` if nobody is
+// reading.
+int builtin_finish(const char* name, builtin_buf_t* buf, int status)
+{
+    int err = write_direct(STDOUT_FILENO, buf->data, buf->len);
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = buf->cap = 0;
+
+    if (err == EPIPE)
+    {
+        return BUILTIN_SIGNALED(SIGPIPE);
+    }
+    if (err != 0)
+    {
+        builtin_error(name, "write error", err);
+
+        return 1;
+    }
+
+    return status;
+}
+
+// Does the real utility do something special for this invocation, i.e.
+// print its help or version?
+bool builtin_is_help(int argc, char* const* args)
+{
+    return argc == 2
+        && (strcmp(args[1], "--help") == 0
+            || strcmp(args[1], "--version") == 0);
+}
+
+// Appends the character that a backslash escape in `echo -e` or a `printf`
+// format stands for, and steps past it.
+//
+// ## Parameters:
+// * `buf` - Where the character goes.
+// * `pos` - Points just past the backslash. Updated.
+// * `for_echo` - Is this for `echo -e` rather than `printf`? For `echo`,
+//                octal escapes start with "0", and "\"" isn't an escape.
+//
+// **Returns** 0 if all is well, 1 for "\c" (stop printing altogether), or
+// `BUILTIN_DECLINE` for escapes that are best left to the real thing, or
+// when out of memory.
+int builtin_escape(builtin_buf_t* buf, const char** pos, bool for_echo)
+{
+    const char* p = *pos;
+    char c = *p++;
+    if (c == '"' && !for_echo)
+    {
+        *pos = p;
+        return builtin_buf_append(buf, &c, 1) != 0 ? BUILTIN_DECLINE : 0;
+    }
+    switch (c)
+    {
+        case '\\': break;
+        case 'a':  c = '\a';   break;
+        case 'b':  c = '\b';   break;
+        case 'e':  c = '\033'; break;
+        case 'f':  c = '\f';   break;
+        case 'n':  c = '\n';   break;
+        case 'r':  c = '\r';   break;
+        case 't':  c = '\t';   break;
+        case 'v':  c = '\v';   break;
+        case 'c':
+        {
+            *pos = p;
+            return 1;
+        }
+        case 'x':
+        {
+            int value = 0;
+            int digits;
+            for (digits = 0; digits < 2; ++digits, ++p)
+            {
+                int d;
+                if (*p >= '0' && *p <= '9')      d = *p - '0';
+                else if (*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+                else if (*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+                else break;
+                value = value * 16 + d;
+            }
+            if (digits == 0) // Not an escape after all (or an error, for
+            {                // `printf`)
+                return BUILTIN_DECLINE;
+            }
+            c = (char)value;
+            break;
+        }
+        case 'u': // Unicode is a whole other kettle of fish
+        case 'U':
+        {
+            return BUILTIN_DECLINE;
+        }
+        default:
+        {
+            int value = 0;
+            int digits = 0;
+            if (c >= '0' && c <= '7')
+            {
+                if (c == '0' && for_echo)
+                {
+                    c = *p; // "\0" itself doesn't count as a digit
+                    if (c >= '0' && c <= '7')
+                    {
+                        p++;
+                    }
+                }
+                if (c >= '0' && c <= '7')
+                {
+                    value = c - '0';
+                    digits = 1;
+                }
+                for (; digits > 0 && digits < 3; ++digits, ++p)
+                {
+                    if (*p < '0' || *p > '7')
+                    {
+                        break;
+                    }
+                    value = value * 8 + (*p - '0');
+                }
+                c = (char)value;
+                break;
+            }
+
+            // Anything else is just a backslash, and then itself
+            if (builtin_buf_append(buf, "\\", 1) != 0)
+            {
+                return BUILTIN_DECLINE;
+            }
+            if (c == '\0')
+            {
+                *pos = p - 1;
+                return 0;
+            }
+            break;
+        }
+    }
+
+    *pos = p;
+
+    return builtin_buf_append(buf, &c, 1) != 0 ? BUILTIN_DECLINE : 0;
+}
+
+// `echo [-neE] [string...]`, as coreutils does it.
+int fast_echo(int argc, char* const* args)
+{
+    if (builtin_is_help(argc, args))
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    // Leading arguments made up only of "n", "e", and "E" are options
+    bool newline = true;
+    bool escapes = false;
+    int i;
+    for (i = 1; i < argc && args[i][0] == '-' && args[i][1] != '\0'; ++i)
+    {
+        if (args[i][strspn(args[i] + 1, "neE") + 1] != '\0')
+        {
+            break;
+        }
+        const char* opt;
+        for (opt = args[i] + 1; *opt != '\0'; ++opt)
+        {
+            switch (*opt)
+            {
+                case 'n': newline = false; break;
+                case 'e': escapes = true;  break;
+                default:  escapes = false; break;
+            }
+        }
+    }
+
+    builtin_buf_t buf = {NULL, 0, 0};
+    for (; i < argc; ++i)
+    {
+        const char* arg = args[i];
+        if (!escapes)
+        {
+            if (builtin_buf_append(&buf, arg, strlen(arg)) != 0)
+            {
+                free(buf.data);
+                return BUILTIN_DECLINE;
+            }
+        }
+        while (escapes && *arg != '\0')
+        {
+            size_t run = strcspn(arg, "\\");
+            int r = builtin_buf_append(&buf, arg, run) != 0
+                ? BUILTIN_DECLINE
+                : 0;
+            arg += run;
+            if (r == 0 && arg[0] == '\\' && arg[1] == '\0')
+            {
+                r = builtin_buf_append(&buf, arg++, 1) != 0
+                    ? BUILTIN_DECLINE
+                    : 0;
+            }
+            else if (r == 0 && arg[0] == '\\')
+            {
+                arg++;
+                r = builtin_escape(&buf, &arg, true);
+            }
+            if (r == BUILTIN_DECLINE)
+            {
+                free(buf.data);
+                return BUILTIN_DECLINE;
+            }
+            if (r == 1) // "\c"
+            {
+                return builtin_finish(args[0], &buf, 0);
+            }
+        }
+        if (i < argc - 1 && builtin_buf_append(&buf, " ", 1) != 0)
+        {
+            free(buf.data);
+            return BUILTIN_DECLINE;
+        }
+    }
+    if (newline && builtin_buf_append(&buf, "\n", 1) != 0)
+    {
+        free(buf.data);
+        return BUILTIN_DECLINE;
+    }
+
+    return builtin_finish(args[0], &buf, 0);
+}
+
+// `true`, which ignores its arguments.
+int fast_true(int argc, char* const* args)
+{
+    return builtin_is_help(argc, args) ? BUILTIN_DECLINE : 0;
+}
+
+// `false`, which ignores its arguments.
+int fast_false(int argc, char* const* args)
+{
+    return builtin_is_help(argc, args) ? BUILTIN_DECLINE : 1;
+}
+
+// `pwd [-L|-P]`. Like coreutils' (and unlike a shell's), the default is
+// `-P`: the directory with every symbolic link resolved.
+int fast_pwd(int argc, char* const* args)
+{
+    bool logical = false;
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(args[i], "-L") == 0)
+        {
+            logical = true;
+        }
+        else if (strcmp(args[i], "-P") == 0)
+        {
+            logical = false;
+        }
+        else // Anything else gets a warning or an error
+        {
+            return BUILTIN_DECLINE;
+        }
+    }
+
+    // `-L` prints $PWD, as long as it's absolute, has no "." or ".."
+    // components, and really is where we are
+    builtin_buf_t buf = {NULL, 0, 0};
+    const char* pwd = logical ? getenv("PWD") : NULL;
+    if (pwd != NULL && pwd[0] == '/'
+        && strstr(pwd, "/./") == NULL && strstr(pwd, "/../") == NULL)
+    {
+        size_t len = strlen(pwd);
+        struct stat pwd_stat;
+        struct stat dot_stat;
+        if ((len < 2 || strcmp(pwd + len - 2, "/.") != 0)
+            && (len < 3 || strcmp(pwd + len - 3, "/..") != 0)
+            && stat(pwd, &pwd_stat) == 0 && stat(".", &dot_stat) == 0
+            && pwd_stat.st_dev == dot_stat.st_dev
+            && pwd_stat.st_ino == dot_stat.st_ino)
+        {
+            if (builtin_buf_append(&buf, pwd, len) != 0
+                || builtin_buf_append(&buf, "\n", 1) != 0)
+            {
+                free(buf.data);
+                return BUILTIN_DECLINE;
+            }
+
+            return builtin_finish(args[0], &buf, 0);
+        }
+    }
+
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) // e.g. the directory has been removed out from under
+    {                // us, which the real thing has its own ways around
+        return BUILTIN_DECLINE;
+    }
+    int r = builtin_buf_append(&buf, cwd, strlen(cwd)) != 0
+         || builtin_buf_append(&buf, "\n", 1) != 0;
+    free(cwd);
+    if (r != 0)
+    {
+        free(buf.data);
+        return BUILTIN_DECLINE;
+    }
+
+    return builtin_finish(args[0], &buf, 0);
+}
+
+// Parses an integer operand the way `test` does: optional blanks, an
+// optional sign, decimal digits, and optional blanks.
+//
+// **Returns** zero on success, or non-zero if it isn't one (or won't fit).
+int test_integer(const char* str, long long* value)
+{
+    char* end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    if (end == str || errno == ERANGE)
+    {
+        return 1;
+    }
+    while (*end == ' ' || *end == '\t')
+    {
+        end++;
+    }
+
+    return *end != '\0';
+}
+
+// `test` with a single argument: is it non-empty?
+int test_one(const char* arg)
+{
+    return arg[0] != '\0' ? 0 : 1;
+}
+
+// `test` with a unary operator.
+//
+// **Returns** the exit status, or `BUILTIN_DECLINE` if `op` isn't one.
+int test_unary(const char* op, const char* arg)
+{
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    struct stat st;
+    switch (op[1])
+    {
+        case 'n': return arg[0] != '\0' ? 0 : 1;
+        case 'z': return arg[0] == '\0' ? 0 : 1;
+        case 'e': return stat(arg, &st) == 0 ? 0 : 1;
+        case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode)  ? 0 : 1;
+        case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode)  ? 0 : 1;
+        case 'b': return stat(arg, &st) == 0 && S_ISBLK(st.st_mode)  ? 0 : 1;
+        case 'c': return stat(arg, &st) == 0 && S_ISCHR(st.st_mode)  ? 0 : 1;
+        case 'p': return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode) ? 0 : 1;
+        case 'S': return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode) ? 0 : 1;
+        case 's': return stat(arg, &st) == 0 && st.st_size > 0       ? 0 : 1;
+        case 'u': return stat(arg, &st) == 0 && (st.st_mode & S_ISUID)
+                         ? 0 : 1;
+        case 'g': return stat(arg, &st) == 0 && (st.st_mode & S_ISGID)
+                         ? 0 : 1;
+        case 'k': return stat(arg, &st) == 0 && (st.st_mode & S_ISVTX)
+                         ? 0 : 1;
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+        case 'r': return eaccess(arg, R_OK) == 0 ? 0 : 1;
+        case 'w': return eaccess(arg, W_OK) == 0 ? 0 : 1;
+        case 'x': return eaccess(arg, X_OK) == 0 ? 0 : 1;
+        case 't':
+        {
+            long long fd;
+            if (test_integer(arg, &fd) != 0 || fd < 0 || fd > INT_MAX)
+            {
+                return BUILTIN_DECLINE;
+            }
+            return isatty((int)fd) ? 0 : 1;
+        }
+        default:  return BUILTIN_DECLINE;
+    }
+}
+
+// Compares two files' modification times.
+//
+// **Returns** negative, zero, or positive, like `strcmp()`.
+int test_compare_mtime(const struct stat* a, const struct stat* b)
+{
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+    {
+        return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+    }
+    if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec)
+    {
+        return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// `test` with a binary operator.
+//
+// **Returns** the exit status, or `BUILTIN_DECLINE` if `op` isn't one (or
+// the operands are integers `test` would complain about).
+int test_binary(const char* left, const char* op, const char* right)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    {
+        return strcmp(left, right) == 0 ? 0 : 1;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+        return strcmp(left, right) != 0 ? 0 : 1;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0
+        || strcmp(op, "-ef") == 0)
+    {
+        struct stat left_stat;
+        struct stat right_stat;
+        bool have_left = stat(left, &left_stat) == 0;
+        bool have_right = stat(right, &right_stat) == 0;
+        bool result;
+        if (op[1] == 'e')
+        {
+            result = have_left && have_right
+                && left_stat.st_dev == right_stat.st_dev
+                && left_stat.st_ino == right_stat.st_ino;
+        }
+        else if (op[1] == 'n')
+        {
+            result = have_left
+                && (!have_right
+                    || test_compare_mtime(&left_stat, &right_stat) > 0);
+        }
+        else
+        {
+            result = have_right
+                && (!have_left
+                    || test_compare_mtime(&left_stat, &right_stat) < 0);
+        }
+
+        return result ? 0 : 1;
+    }
+
+    // Everything else is a comparison of integers
+    static const char* const int_ops[] = {
+        "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+    };
+    size_t which;
+    for (which = 0; which < sizeof(int_ops) / sizeof(int_ops[0]); ++which)
+    {
+        if (strcmp(op, int_ops[which]) == 0)
+        {
+            break;
+        }
+    }
+    long long a;
+    long long b;
+    if (which == sizeof(int_ops) / sizeof(int_ops[0])
+        || test_integer(left, &a) != 0 || test_integer(right, &b) != 0)
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    bool result;
+    switch (which)
+    {
+        case 0:  result = a == b; break;
+        case 1:  result = a != b; break;
+        case 2:  result = a <  b; break;
+        case 3:  result = a <= b; break;
+        case 4:  result = a >  b; break;
+        default: result = a >= b; break;
+    }
+
+    return result ? 0 : 1;
+}
+
+// Flips the exit status of a `test`, unless it declined.
+int test_negate(int r)
+{
+    return r == BUILTIN_DECLINE ? r : !r;
+}
+
+// Is `op` one of `test`'s binary operators? "-a" and "-o" aren't counted:
+// coreutils hands them to its full expression parser, where they can just
+// as well be unary.
+bool test_is_binary(const char* op)
+{
+    static const char* const ops[] = {
+        "=", "==", "!=", "<", ">", "-nt", "-ot", "-ef",
+        "-eq", "-ne", "-lt", "-le", "-gt", "-ge"
+    };
+    size_t i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+    {
+        if (strcmp(op, ops[i]) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// `test` with two arguments.
+int test_two(char* const* a)
+{
+    if (strcmp(a[0], "!") == 0)
+    {
+        return test_negate(test_one(a[1]));
+    }
+
+    return test_unary(a[0], a[1]);
+}
+
+// `test` with three arguments.
+int test_three(char* const* a)
+{
+    if (test_is_binary(a[1]))
+    {
+        return test_binary(a[0], a[1], a[2]);
+    }
+    if (strcmp(a[0], "!") == 0)
+    {
+        return test_negate(test_two(a + 1));
+    }
+    if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0)
+    {
+        return test_one(a[1]);
+    }
+
+    return BUILTIN_DECLINE;
+}
+
+// `test expression` and `[ expression ]`, for up to four arguments, going
+// by the number of them as POSIX lays out. Longer expressions (and the
+// ambiguous corners of shorter ones) are left to the real thing.
+int fast_test(int argc, char* const* args)
+{
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (builtin_is_help(argc, args)
+            || argc < 2 || strcmp(args[argc - 1], "]") != 0)
+        {
+            return BUILTIN_DECLINE;
+        }
+        argc--;
+    }
+
+    char* const* a = args + 1;
+    switch (argc - 1)
+    {
+        case 0:  return 1;
+        case 1:  return test_one(a[0]);
+        case 2:  return test_two(a);
+        case 3:  return test_three(a);
+        case 4:
+        {
+            if (strcmp(a[0], "!") == 0)
+            {
+                return test_negate(test_three(a + 1));
+            }
+            if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0)
+            {
+                return test_two(a + 1);
+            }
+            return BUILTIN_DECLINE;
+        }
+        default: return BUILTIN_DECLINE;
+    }
+}
+
+// Formats one `printf` conversion into a buffer: "%s", "%c", or one of
+// "diouxX", with any flags, width, and precision.
+//
+// ## Parameters:
+// * `buf` - Where the result goes.
+// * `flags` - Any of "-+ #0" that were given.
+// * `width` - Minimum field width, or 0.
+// * `precision` - Precision, or -1.
+// * `conv` - The conversion character.
+// * `arg` - The argument, or "" if they've run out.
+//
+// **Returns** zero on success, or `BUILTIN_DECLINE` if the argument isn't a
+// number `printf` would take without complaint, or when out of memory.
+int printf_convert(builtin_buf_t* buf,
+                   const char*    flags,
+                   int            width,
+                   int            precision,
+                   char           conv,
+                   const char*    arg)
+{
+    bool left_align = strchr(flags, '-') != NULL;
+
+    // The body of the field, before padding to `width`
+    char digits[72];
+    const char* body = digits;
+    size_t body_len;
+    char prefix[3] = "";
+    size_t zeros = 0;
+    if (conv == 's' || conv == 'c')
+    {
+        body = arg;
+        body_len = strlen(arg);
+        if (conv == 'c')
+        {
+            body_len = 1; // The `'\0'`, if `arg` is empty
+        }
+        else if (precision >= 0 && (size_t)precision < body_len)
+        {
+            body_len = (size_t)precision;
+        }
+    }
+    else
+    {
+        // A quote means the value of the character that follows, which is
+        // best left to the real thing
+        if (arg[0] == '\'' || arg[0] == '"')
+        {
+            return BUILTIN_DECLINE;
+        }
+        char* end;
+        unsigned long long magnitude;
+        bool negative = false;
+        errno = 0;
+        if (conv == 'd' || conv == 'i')
+        {
+            long long value = strtoll(arg, &end, 0);
+            negative = value < 0;
+            magnitude = negative
+                ? 0ULL - (unsigned long long)value
+                : (unsigned long long)value;
+        }
+        else
+        {
+            magnitude = strtoull(arg, &end, 0);
+        }
+        if (*end != '\0' || errno == ERANGE)
+        {
+            return BUILTIN_DECLINE;
+        }
+
+        unsigned base = conv == 'o' ? 8 : (conv == 'x' || conv == 'X')
+                      ? 16 : 10;
+        const char* numerals = conv == 'X'
+            ? "0123456789ABCDEF"
+            : "0123456789abcdef";
+        char* p = digits + sizeof(digits);
+        unsigned long long rest = magnitude;
+        while (rest > 0)
+        {
+            *--p = numerals[rest % base];
+            rest /= base;
+        }
+        if (magnitude == 0 && precision != 0)
+        {
+            *--p = '0';
+        }
+        body = p;
+        body_len = (size_t)(digits + sizeof(digits) - p);
+
+        if (negative)
+        {
+            strcpy(prefix, "-");
+        }
+        else if ((conv == 'd' || conv == 'i') && strchr(flags, '+') != NULL)
+        {
+            strcpy(prefix, "+");
+        }
+        else if ((conv == 'd' || conv == 'i') && strchr(flags, ' ') != NULL)
+        {
+            strcpy(prefix, " ");
+        }
+        else if (strchr(flags, '#') != NULL && magnitude != 0 && base == 16)
+        {
+            strcpy(prefix, conv == 'X' ? "0X" : "0x");
+        }
+
+        if (precision >= 0 && (size_t)precision > body_len)
+        {
+            zeros = (size_t)precision - body_len;
+        }
+        else if (conv == 'o' && strchr(flags, '#') != NULL
+                 && (body_len == 0 || body[0] != '0'))
+        {
+            zeros = 1;
+        }
+        else if (precision < 0 && !left_align && strchr(flags, '0') != NULL
+                 && width > 0
+                 && (size_t)width > strlen(prefix) + body_len)
+        {
+            zeros = (size_t)width - strlen(prefix) - body_len;
+        }
+    }
+
+    size_t field_len = strlen(prefix) + zeros + body_len;
+    size_t pad = width > 0 && (size_t)width > field_len
+        ? (size_t)width - field_len
+        : 0;
+    if ((!left_align && builtin_buf_fill(buf, ' ', pad) != 0)
+        || builtin_buf_append(buf, prefix, strlen(prefix)) != 0
+        || builtin_buf_fill(buf, '0', zeros) != 0
+        || builtin_buf_append(buf, body, body_len) != 0
+        || (left_align && builtin_buf_fill(buf, ' ', pad) != 0))
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    return 0;
+}
+
+// Reads the decimal number at `*pos` for a `printf` width or precision.
+//
+// **Returns** the number (0 if there are no digits), or -1 if it's too big
+// to be worth doing here.
+int printf_number(const char** pos)
+{
+    int value = 0;
+    while (**pos >= '0' && **pos <= '9')
+    {
+        value = value * 10 + (**pos - '0');
+        (*pos)++;
+        if (value > BUILTIN_MAX_WIDTH)
+        {
+            return -1;
+        }
+    }
+
+    return value;
+}
+
+// `printf format [argument...]`, for the "%s", "%c", "%%", and "diouxX"
+// conversions, with flags, widths, and precisions (but not "*"). The format
+// is reused for as long as there are arguments left, as coreutils does.
+int fast_printf(int argc, char* const* args)
+{
+    // No format is an error, and one starting with "-" might be an option
+    if (argc < 2 || args[1][0] == '-')
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    const char* format = args[1];
+    int next_arg = 2;
+    builtin_buf_t buf = {NULL, 0, 0};
+    bool stopped = false;
+    int used;
+    do
+    {
+        used = 0;
+        const char* p = format;
+        while (*p != '\0' && !stopped)
+        {
+            size_t run = strcspn(p, "%\\");
+            if (builtin_buf_append(&buf, p, run) != 0)
+            {
+                free(buf.data);
+                return BUILTIN_DECLINE;
+            }
+            p += run;
+
+            int r = 0;
+            if (*p == '\\')
+            {
+                p++;
+                r = builtin_escape(&buf, &p, false);
+                stopped = r == 1;
+            }
+            else if (p[0] == '%' && p[1] == '%')
+            {
+                r = builtin_buf_append(&buf, "%", 1) != 0
+                    ? BUILTIN_DECLINE
+                    : 0;
+                p += 2;
+            }
+            else if (*p == '%')
+            {
+                p++;
+                char flags[8];
+                size_t flag_count = 0;
+                while (strchr("-+ #0", *p) != NULL && *p != '\0'
+                       && flag_count < sizeof(flags) - 1)
+                {
+                    flags[flag_count++] = *p++;
+                }
+                flags[flag_count] = '\0';
+
+                // A "." on its own is a precision of 0
+                int width = printf_number(&p);
+                int precision = -1;
+                bool too_wide = width == -1;
+                if (*p == '.')
+                {
+                    p++;
+                    precision = printf_number(&p);
+                    too_wide = too_wide || precision == -1;
+                }
+
+                const char* arg = next_arg < argc ? args[next_arg] : "";
+                if (too_wide || *p == '\0' || strchr("sdiouxXc", *p) == NULL)
+                {
+                    r = BUILTIN_DECLINE;
+                }
+                else
+                {
+                    r = printf_convert(&buf, flags, width, precision, *p,
+                                       arg);
+                    if (next_arg < argc)
+                    {
+                        next_arg++;
+                        used++;
+                    }
+                    p++;
+                }
+            }
+
+            if (r == BUILTIN_DECLINE)
+            {
+                free(buf.data);
+                return BUILTIN_DECLINE;
+            }
+        }
+
+        // A format with nothing to use the arguments up gets a warning
+        if (used == 0 && next_arg < argc && !stopped)
+        {
+            free(buf.data);
+            return BUILTIN_DECLINE;
+        }
+    } while (used > 0 && next_arg < argc && !stopped);
+
+    return builtin_finish(args[0], &buf, 0);
+}
+
+// `cat [file...]`, with no options. "-" (or no files at all) is stdin.
+int fast_cat(int argc, char* const* args)
+{
+    // Options, input that a person is typing (which ^C has to be able to
+    // interrupt), and a file being read into itself are all left to the
+    // real thing
+    struct stat out_stat;
+    bool out_is_file = fstat(STDOUT_FILENO, &out_stat) == 0
+        && S_ISREG(out_stat.st_mode);
+    bool reads_stdin = argc < 2;
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        struct stat in_stat;
+        if (strcmp(args[i], "-") == 0)
+        {
+            reads_stdin = true;
+        }
+        else if (args[i][0] == '-')
+        {
+            return BUILTIN_DECLINE;
+        }
+        else if (out_is_file && stat(args[i], &in_stat) == 0
+                 && in_stat.st_dev == out_stat.st_dev
+                 && in_stat.st_ino == out_stat.st_ino)
+        {
+            return BUILTIN_DECLINE;
+        }
+    }
+    if (reads_stdin)
+    {
+        struct stat in_stat;
+        if (isatty(STDIN_FILENO)
+            || (out_is_file && fstat(STDIN_FILENO, &in_stat) == 0
+                && in_stat.st_dev == out_stat.st_dev
+                && in_stat.st_ino == out_stat.st_ino))
+        {
+            return BUILTIN_DECLINE;
+        }
+    }
+
+    char* chunk = malloc(BUILTIN_CAT_CHUNK);
+    if (chunk == NULL)
+    {
+        return BUILTIN_DECLINE;
+    }
+
+    int status = 0;
+    i = argc < 2 ? 0 : 1;
+    for (; i < argc; ++i)
+    {
+        const char* name = i == 0 ? "-" : args[i];
+        int fd = STDIN_FILENO;
+        if (strcmp(name, "-") != 0)
+        {
+            fd = open(name, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                builtin_error(args[0], name, errno);
+                status = 1;
+                continue;
+            }
+        }
+
+        ssize_t bytes_read;
+        while ((bytes_read = read(fd, chunk, BUILTIN_CAT_CHUNK)) != 0)
+        {
+            if (shutdown_requested)
+            {
+                status = BUILTIN_SIGNALED(SIGTERM);
+                i = argc;
+                break;
+            }
+            if (bytes_read == -1)
+            {
+                // Only `SIGINT` and `SIGTSTP` interrupt the shell's reads,
+                // and the real thing would have been stopped in its tracks
+                if (errno == EINTR)
+                {
+                    status = BUILTIN_SIGNALED(SIGINT);
+                    i = argc;
+                }
+                else
+                {
+                    builtin_error(args[0], name, errno);
+                    status = 1;
+                }
+                break;
+            }
+
+            int err = write_direct(STDOUT_FILENO, chunk, (size_t)bytes_read);
+            if (err != 0)
+            {
+                if (err == EPIPE)
+                {
+                    status = BUILTIN_SIGNALED(SIGPIPE);
+                }
+                else
+                {
+                    builtin_error(args[0], "write error", err);
+                    status = 1;
+                }
+                i = argc;
+                break;
+            }
+        }
+
+        if (fd != STDIN_FILENO)
+        {
+            close(fd);
+        }
+    }
+    free(chunk);
+
+    return status;
+}
+
+// Finds the fast built-in for a command name.
+//
+// **Returns** the built-in, or `NULL` if the command isn't one.
+fast_builtin_fn fast_builtin_lookup(const char* name)
+{
+    // The first letter or two is enough to pick the only candidate
+    static const fast_builtin_t table[] = {
+        {"[",      fast_test},
+        {"cat",    fast_cat},
+        {"echo",   fast_echo},
+        {"false",  fast_false},
+        {"printf", fast_printf},
+        {"pwd",    fast_pwd},
+        {"test",   fast_test},
+        {"true",   fast_true}
+    };
+
+    const fast_builtin_t* candidate;
+    switch (name[0])
+    {
+        case '[': candidate = &table[0]; break;
+        case 'c': candidate = &table[1]; break;
+        case 'e': candidate = &table[2]; break;
+        case 'f': candidate = &table[3]; break;
+        case 'p': candidate = name[1] == 'r' ? &table[4] : &table[5]; break;
+        case 't': candidate = name[1] == 'e' ? &table[6] : &table[7]; break;
+        default:  return NULL;
+    }
+
+    return strcmp(name, candidate->name) == 0 ? candidate->fn : NULL;
+}
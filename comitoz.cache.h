@@ -0,0 +1,626 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <dirent.h>    // fdopendir, readdir, closedir, struct dirent
+#include <errno.h>     // errno, ENOMEM, ENOENT, EEXIST
+#include <fcntl.h>     // open, openat, O_*, AT_FDCWD
+#include <stdint.h>    // uint32_t, uint64_t, int32_t, UINT32_MAX
+#include <stdio.h>     // renameat, snprintf
+#include <stdlib.h>    // malloc, realloc, free, qsort, strtol
+#include <string.h>    // memcmp, memcpy, strlen, strrchr, strspn
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/stat.h>  // struct stat, fstat, fstatat, mkdir, futimens
+#include <sys/types.h> // ssize_t, off_t
+#include <unistd.h>    // pwrite, close, unlink, unlinkat, getpid
+
+
+/*** Constants ***/
+
+// Where the store is, under `$HOME`, when `-C` doesn't say.
+#define CACHE_DIR_NAME ".smallsh_cache"
+
+// Last four bytes of every blob: "smrc" as written by a little-endian
+// machine.
+#define CACHE_MAGIC 0x63726d73U
+
+// Bumped whenever the blob layout (or what goes into a key) changes, so
+// that old blobs are missed rather than misread.
+#define CACHE_VERSION 1
+
+// Default cap on the size of every blob in a store put together, in bytes.
+#define CACHE_DEFAULT_CAP (256 * 1024 * 1024)
+
+// Input files up to this size are part of a key by their contents. Bigger
+// ones only by their identity, size, and mtime.
+#define CACHE_HASH_INPUT_MAX (16 * 1024 * 1024)
+
+// Blobs are named for their key's hash, in this many hex digits.
+#define CACHE_NAME_LEN 16
+
+// Starting capacity of a key.
+#define CACHE_KEY_MIN_CAP 256
+
+
+/*** `typedef`s ***/
+
+// The end of every blob.
+//
+// A blob is a command's stdout, then its key, then this, so that the output
+// can be written into it as the command runs without knowing how long it'll
+// be. The whole blob is `mmap()`ed to look it up and to play it back.
+typedef struct
+{
+    uint64_t output_len; // How much stdout there is, from the start
+    uint32_t key_len;    // How long the key after it is
+    int32_t  exit_value; // What the command exited with
+    uint32_t version;    // `CACHE_VERSION`
+    uint32_t magic;      // `CACHE_MAGIC`
+} cache_trailer_t;
+
+// Everything a command's result depends on, as far as we can tell, run
+// together. Each field is preceded by its length, so that no two different
+// sets of fields come out the same.
+typedef struct
+{
+    char*  data;
+    size_t len;
+    size_t cap;
+    bool   failed; // Ran out of memory at some point
+} cache_key_t;
+
+// A directory of blobs, named for their keys' hashes, with a cap on their
+// total size. Past the cap, the least recently used go first, which is
+// known by their mtimes: a blob is touched whenever it's played back.
+typedef struct
+{
+    char*    dir;     // Where the blobs are
+    int      dir_fd;  // Open on `dir`, or -1 if it hasn't been opened yet
+    uint64_t cap;     // Most bytes of blobs kept
+    uint64_t held;    // Bytes of blobs, as of the last count plus what has
+                      // been added since
+    unsigned temps;   // Temporary names handed out so far
+} cache_store_t;
+
+// A blob that was found, mapped in.
+typedef struct
+{
+    char*       map;
+    size_t      map_len;
+    const char* output;     // The command's stdout, in `map`
+    uint64_t    output_len;
+    int         exit_value;
+} cache_blob_t;
+
+// A blob's name, size, and last use, while picking what to evict.
+typedef struct
+{
+    char     name[CACHE_NAME_LEN + 1];
+    uint64_t size;
+    int64_t  used_sec;
+    int64_t  used_nsec;
+} cache_entry_t;
+
+
+/*** Implementations ***/
+
+// Sets up a store that isn't open yet.
+//
+// ## Parameters:
+// * `store` - The store.
+// * `dir` - Where it is; `malloc()`ed, and taken over by the store.
+// * `cap` - Most bytes of blobs kept.
+void cache_store_init(cache_store_t* store, char* dir, uint64_t cap)
+{
+    store->dir = dir;
+    store->dir_fd = -1;
+    store->cap = cap;
+    store->held = 0;
+    store->temps = 0;
+}
+
+// Parses a store given as "dir[,max_mib]", e.g. "/tmp/cache" or
+// "/tmp/cache,1024". The cap defaults to `CACHE_DEFAULT_CAP`.
+//
+// ## Parameters:
+// * `spec` - The store.
+// * `dir` - Set to the directory, `malloc()`ed.
+// * `cap` - Set to the cap, in bytes.
+//
+// **Returns** whether `spec` made sense.
+bool cache_spec_parse(const char* spec, char** dir, uint64_t* cap)
+{
+    const char* comma = strrchr(spec, ',');
+    size_t dir_len = comma != NULL ? (size_t)(comma - spec) : strlen(spec);
+    *cap = CACHE_DEFAULT_CAP;
+    if (comma != NULL)
+    {
+        char* end;
+        long mib = strtol(comma + 1, &end, 10);
+        if (end == comma + 1 || *end != '\0' || mib <= 0
+            || mib > 1024 * 1024)
+        {
+            return false;
+        }
+        *cap = (uint64_t)mib * 1024 * 1024;
+    }
+    if (dir_len == 0 || (*dir = malloc(dir_len + 1)) == NULL)
+    {
+        return false;
+    }
+    memcpy(*dir, spec, dir_len);
+    (*dir)[dir_len] = '\0';
+
+    return true;
+}
+
+// Hashes some bytes (FNV-1a), carrying on from an earlier hash.
+uint64_t cache_hash(uint64_t hash, const char* data, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Sets up an empty key.
+void cache_key_init(cache_key_t* key)
+{
+    key->data = NULL;
+    key->len = 0;
+    key->cap = 0;
+    key->failed = false;
+}
+
+// Adds a field to a key.
+void cache_key_add(cache_key_t* key, const void* data, size_t len)
+{
+    uint32_t field_len = len < UINT32_MAX ? (uint32_t)len : UINT32_MAX;
+    size_t needed = key->len + sizeof(field_len) + field_len;
+    if (key->failed)
+    {
+        return;
+    }
+    if (needed > key->cap)
+    {
+        size_t cap = key->cap > 0 ? key->cap : CACHE_KEY_MIN_CAP;
+        while (cap < needed)
+        {
+            cap *= 2;
+        }
+        char* grown = realloc(key->data, cap);
+        if (grown == NULL)
+        {
+            key->failed = true;
+            return;
+        }
+        key->data = grown;
+        key->cap = cap;
+    }
+
+    memcpy(key->data + key->len, &field_len, sizeof(field_len));
+    memcpy(key->data + key->len + sizeof(field_len), data, field_len);
+    key->len = needed;
+}
+
+// Adds a string to a key, or an empty field for `NULL`, which is different
+// from an empty string.
+void cache_key_add_str(cache_key_t* key, const char* str)
+{
+    if (str == NULL)
+    {
+        cache_key_add(key, "", 0);
+        return;
+    }
+    cache_key_add(key, str, strlen(str) + 1);
+}
+
+// Adds a file's identity, size, and mtime to a key.
+void cache_key_add_stat(cache_key_t* key, const struct stat* st)
+{
+    uint64_t fields[5] = {
+        (uint64_t)st->st_dev,
+        (uint64_t)st->st_ino,
+        (uint64_t)st->st_size,
+        (uint64_t)st->st_mtim.tv_sec,
+        (uint64_t)st->st_mtim.tv_nsec
+    };
+    cache_key_add(key, fields, sizeof(fields));
+}
+
+// Adds an input file to a key: its contents, by their hash, if it's a
+// regular file no bigger than `CACHE_HASH_INPUT_MAX`, or otherwise its
+// identity, size, and mtime.
+//
+// **Returns** zero, or an `errno` value if the file can't be read.
+int cache_key_add_input(cache_key_t* key, const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size > CACHE_HASH_INPUT_MAX)
+    {
+        cache_key_add_stat(key, &st);
+        close(fd);
+        return 0;
+    }
+
+    uint64_t fields[2] = {(uint64_t)st.st_size, 14695981039346656037ULL};
+    if (st.st_size > 0)
+    {
+        void* map = mmap(
+            NULL,
+            (size_t)st.st_size,
+            PROT_READ,
+            MAP_PRIVATE,
+            fd,
+            0
+        );
+        if (map == MAP_FAILED)
+        {
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        fields[1] = cache_hash(fields[1], map, (size_t)st.st_size);
+        munmap(map, (size_t)st.st_size);
+    }
+    cache_key_add(key, fields, sizeof(fields));
+    close(fd);
+
+    return 0;
+}
+
+// Frees a key's storage.
+void cache_key_free(cache_key_t* key)
+{
+    free(key->data);
+    cache_key_init(key);
+}
+
+// Names the blob for a key: its hash, in hex.
+void cache_name(const cache_key_t* key, char name[CACHE_NAME_LEN + 1])
+{
+    uint64_t hash = cache_hash(14695981039346656037ULL, key->data, key->len);
+    snprintf(
+        name,
+        CACHE_NAME_LEN + 1,
+        "%016llx",
+        (unsigned long long)hash
+    );
+}
+
+// Is this the name of a blob (and not, e.g., of a temporary file)?
+bool cache_is_blob_name(const char* name)
+{
+    return strlen(name) == CACHE_NAME_LEN
+        && strspn(name, "0123456789abcdef") == CACHE_NAME_LEN;
+}
+
+// Totals up every blob in the store.
+void cache_count(cache_store_t* store)
+{
+    int fd = openat(store->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (dir == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    store->held = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (cache_is_blob_name(entry->d_name)
+            && fstatat(store->dir_fd, entry->d_name, &st, 0) == 0)
+        {
+            store->held += (uint64_t)st.st_size;
+        }
+    }
+    closedir(dir);
+}
+
+// Opens a store, creating its directory if need be (but not its parents),
+// and totals up what's in it.
+//
+// **Returns** zero, or an `errno` value.
+int cache_open(cache_store_t* store)
+{
+    if (store->dir_fd != -1)
+    {
+        return 0;
+    }
+    if (mkdir(store->dir, 0700) == -1 && errno != EEXIST)
+    {
+        return errno;
+    }
+    store->dir_fd = open(store->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd == -1)
+    {
+        return errno;
+    }
+    cache_count(store);
+
+    return 0;
+}
+
+// Looks up a key, and maps in its blob if it has one. A blob whose key
+// doesn't match (a hash collision) or that doesn't hold together is a miss.
+// A hit counts as a use, for eviction.
+//
+// ## Parameters:
+// * `store` - The store, opened.
+// * `key` - The key.
+// * `blob` - Set to the blob on a hit; `cache_blob_close()` it after.
+//
+// **Returns** whether it was a hit.
+bool cache_lookup(cache_store_t*     store,
+                  const cache_key_t* key,
+                  cache_blob_t*      blob)
+{
+    char name[CACHE_NAME_LEN + 1];
+    cache_name(key, name);
+    int fd = openat(store->dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cache_trailer_t))
+    {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Everything has to add up, and the key has to be the same one
+    size_t size = (size_t)st.st_size;
+    cache_trailer_t trailer;
+    memcpy(&trailer, map + size - sizeof(trailer), sizeof(trailer));
+    if (trailer.magic != CACHE_MAGIC || trailer.version != CACHE_VERSION
+        || trailer.key_len != key->len
+        || trailer.output_len != size - sizeof(trailer) - key->len
+        || memcmp(map + trailer.output_len, key->data, key->len) != 0)
+    {
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+
+    futimens(fd, NULL);
+    close(fd);
+    blob->map = map;
+    blob->map_len = size;
+    blob->output = map;
+    blob->output_len = trailer.output_len;
+    blob->exit_value = trailer.exit_value;
+
+    return true;
+}
+
+// Unmaps a blob.
+void cache_blob_close(cache_blob_t* blob)
+{
+    munmap(blob->map, blob->map_len);
+    blob->map = NULL;
+}
+
+// Starts a blob: an empty file in the store, under a temporary name, for a
+// command's stdout to go into.
+//
+// ## Parameters:
+// * `store` - The store, opened.
+// * `path` - Set to the file's full path, `malloc()`ed.
+//
+// **Returns** the file, open for reading and writing, or -1 on failure (see
+// `errno`).
+int cache_begin(cache_store_t* store, char** path)
+{
+    size_t dir_len = strlen(store->dir);
+    size_t path_size = dir_len + sizeof("/tmp.4294967295.4294967295");
+    *path = malloc(path_size);
+    if (*path == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(
+        *path,
+        path_size,
+        "%s/tmp.%d.%u",
+        store->dir,
+        (int)getpid(),
+        store->temps++
+    );
+
+    int fd = open(*path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        int err = errno;
+        free(*path);
+        *path = NULL;
+        errno = err;
+    }
+
+    return fd;
+}
+
+// Throws away a blob that was started, but won't be finished.
+void cache_abort(int fd, char* path)
+{
+    close(fd);
+    unlink(path);
+    free(path);
+}
+
+// Compares what to evict, least recently used first.
+int cache_compare_entries(const void* a, const void* b)
+{
+    const cache_entry_t* x = a;
+    const cache_entry_t* y = b;
+    if (x->used_sec != y->used_sec)
+    {
+        return x->used_sec < y->used_sec ? -1 : 1;
+    }
+    if (x->used_nsec != y->used_nsec)
+    {
+        return x->used_nsec < y->used_nsec ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Gets a store back under its cap, going by a fresh count (other shells may
+// share it), by removing its least recently used blobs. It's taken down to
+// 7/8ths of the cap, so that eviction doesn't happen on every addition.
+void cache_evict(cache_store_t* store)
+{
+    int fd = openat(store->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR* dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (dir == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    cache_entry_t* entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    store->held = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (!cache_is_blob_name(dirent->d_name)
+            || fstatat(store->dir_fd, dirent->d_name, &st, 0) == -1)
+        {
+            continue;
+        }
+        if (count == cap)
+        {
+            cap = cap > 0 ? cap * 2 : 64;
+            cache_entry_t* grown = realloc(entries, cap * sizeof(*grown));
+            if (grown == NULL)
+            {
+                break;
+            }
+            entries = grown;
+        }
+        memcpy(entries[count].name, dirent->d_name, CACHE_NAME_LEN + 1);
+        entries[count].size = (uint64_t)st.st_size;
+        entries[count].used_sec = (int64_t)st.st_mtim.tv_sec;
+        entries[count].used_nsec = (int64_t)st.st_mtim.tv_nsec;
+        store->held += (uint64_t)st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(cache_entry_t), cache_compare_entries);
+    uint64_t target = store->cap - store->cap / 8;
+    size_t i;
+    for (i = 0; i < count && store->held > target; ++i)
+    {
+        if (unlinkat(store->dir_fd, entries[i].name, 0) == 0)
+        {
+            store->held -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+// Finishes a blob: puts its key and trailer after the output, and renames
+// it into place, replacing any blob for the same hash. Evicts if that puts
+// the store over its cap.
+//
+// ## Parameters:
+// * `store` - The store, opened.
+// * `fd` - From `cache_begin()`; closed.
+// * `path` - Likewise; `free()`d.
+// * `key` - The command's key.
+// * `exit_value` - What it exited with.
+//
+// **Returns** zero, or an `errno` value, in which case the blob is thrown
+// away.
+int cache_commit(cache_store_t*     store,
+                 int                fd,
+                 char*              path,
+                 const cache_key_t* key,
+                 int                exit_value)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        int err = errno;
+        cache_abort(fd, path);
+        return err;
+    }
+
+    cache_trailer_t trailer;
+    trailer.output_len = (uint64_t)st.st_size;
+    trailer.key_len = (uint32_t)key->len;
+    trailer.exit_value = exit_value;
+    trailer.version = CACHE_VERSION;
+    trailer.magic = CACHE_MAGIC;
+
+    char name[CACHE_NAME_LEN + 1];
+    cache_name(key, name);
+    off_t at = st.st_size;
+    if (pwrite(fd, key->data, key->len, at) != (ssize_t)key->len
+        || pwrite(fd, &trailer, sizeof(trailer), at + (off_t)key->len)
+               != (ssize_t)sizeof(trailer)
+        || renameat(AT_FDCWD, path, store->dir_fd, name) == -1)
+    {
+        int err = errno;
+        cache_abort(fd, path);
+        return err;
+    }
+    close(fd);
+    free(path);
+
+    store->held += trailer.output_len + key->len + sizeof(trailer);
+    if (store->held > store->cap)
+    {
+        cache_evict(store);
+    }
+
+    return 0;
+}
+
+// Closes a store.
+void cache_store_destroy(cache_store_t* store)
+{
+    if (store->dir_fd != -1)
+    {
+        close(store->dir_fd);
+        store->dir_fd = -1;
+    }
+    free(store->dir);
+    store->dir = NULL;
+}
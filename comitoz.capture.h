@@ -0,0 +1,417 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>        // errno, EAGAIN, EINTR, EIO
+#include <fcntl.h>        // fcntl, pipe2, splice, fallocate, F_SETOWN,
+                          // O_ASYNC, FALLOC_FL_PUNCH_HOLE
+#include <stdint.h>       // uint64_t
+#include <stdlib.h>       // malloc, free, strtol
+#include <sys/mman.h>     // memfd_create, MFD_CLOEXEC
+#include <sys/sendfile.h> // sendfile
+#include <sys/types.h>    // pid_t, off_t
+#include <unistd.h>       // close, ftruncate, getpid, sysconf
+
+
+/*** Constants ***/
+
+// Default cap on how much of one job's output is kept, in bytes.
+#define CAPTURE_DEFAULT_JOB_CAP (64 * 1024)
+
+// Default cap on how much output is kept across every job, in bytes.
+#define CAPTURE_DEFAULT_TOTAL_CAP (4 * 1024 * 1024)
+
+// Most captures of finished jobs that are kept, however little they hold,
+// since each one is a descriptor. Past this, the oldest are dropped.
+#define CAPTURE_MAX_DONE 256
+
+// Most bytes moved from a job's pipe in one `splice()`.
+#define CAPTURE_CHUNK 65536
+
+
+/*** `typedef`s ***/
+
+// The output of one background job. Everything the job writes to stdout or
+// stderr goes down a pipe, and the shell moves it from there into a `memfd`
+// that is used as a ring: byte N of the output lives at offset N modulo the
+// store's `job_cap`, so a job that writes more than that overwrites its
+// oldest output.
+typedef struct capture
+{
+    pid_t           pid;     // The job's last PID, which it's known by; 0
+                             // until it has been launched
+    int             pipe_fd; // Read end of what the job writes to
+                             // (non-blocking), or -1 once it's closed
+    int             mem_fd;  // The ring
+    uint64_t        written; // Bytes the job has written, all told
+    size_t          held;    // How much is still kept: the last `held`
+                             // bytes of `written`
+    struct capture* prev;    // Neighbours in the store, oldest first
+    struct capture* next;
+} capture_t;
+
+// Every job's captured output, with caps on how much is kept for each job
+// and for all of them together. Past the total cap, the oldest output goes
+// first.
+typedef struct
+{
+    capture_t* head;      // Oldest first
+    capture_t* tail;
+    size_t     job_cap;   // Ring size for each job; 0 if capturing is off
+    size_t     total_cap; // Never less than `job_cap`
+    size_t     held;      // Summed over every capture
+    int        count;     // How many captures there are
+    int        open;      // How many of them still have a pipe
+} capture_store_t;
+
+
+/*** Implementations ***/
+
+// Sets up an empty store.
+//
+// ## Parameters:
+// * `store` - The store.
+// * `job_cap` - Most bytes kept for one job, or 0 to not capture at all.
+// * `total_cap` - Most bytes kept for every job together. Raised to
+//                 `job_cap` if it's any less.
+void capture_store_init(capture_store_t* store,
+                        size_t           job_cap,
+                        size_t           total_cap)
+{
+    store->head = NULL;
+    store->tail = NULL;
+    store->job_cap = job_cap;
+    store->total_cap = total_cap > job_cap ? total_cap : job_cap;
+    store->held = 0;
+    store->count = 0;
+    store->open = 0;
+}
+
+// Parses caps given as "job_kib[,total_kib]", e.g. "64" or "64,4096". The
+// total defaults to `CAPTURE_DEFAULT_TOTAL_CAP`.
+//
+// ## Parameters:
+// * `spec` - The caps.
+// * `job_cap`, `total_cap` - Set to the caps, in bytes.
+//
+// **Returns** whether `spec` made sense.
+bool capture_caps_parse(const char* spec, size_t* job_cap, size_t* total_cap)
+{
+    char* end;
+    long job_kib = strtol(spec, &end, 10);
+    long total_kib = CAPTURE_DEFAULT_TOTAL_CAP / 1024;
+    if (*end == ',')
+    {
+        total_kib = strtol(end + 1, &end, 10);
+    }
+    if (end == spec || *end != '\0' || job_kib <= 0 || total_kib <= 0
+        || job_kib > 1024 * 1024 || total_kib > 64 * 1024 * 1024)
+    {
+        return false;
+    }
+
+    *job_cap = (size_t)job_kib * 1024;
+    *total_cap = (size_t)total_kib * 1024;
+
+    return true;
+}
+
+// Starts capturing a job that's about to be launched. The read end of its
+// pipe sends the shell `SIGIO` whenever there's something to read.
+//
+// ## Parameters:
+// * `store` - Where the capture goes, newest.
+// * `write_fd` - Set to the write end of the pipe, `O_CLOEXEC`, for the
+//                job's stdout and stderr. The caller closes it once the job
+//                has been launched.
+//
+// **Returns** the new capture, or `NULL` on failure (see `errno`).
+capture_t* capture_new(capture_store_t* store, int* write_fd)
+{
+    capture_t* capture = malloc(sizeof(capture_t));
+    if (capture == NULL)
+    {
+        return NULL;
+    }
+
+    int pipe_fds[2];
+    capture->mem_fd = memfd_create("smallsh-capture", MFD_CLOEXEC);
+    if (capture->mem_fd == -1)
+    {
+        free(capture);
+        return NULL;
+    }
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1
+        || fcntl(pipe_fds[0], F_SETOWN, getpid()) == -1
+        || fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK | O_ASYNC) == -1)
+    {
+        int err = errno;
+        close(capture->mem_fd);
+        free(capture);
+        errno = err;
+        return NULL;
+    }
+
+    capture->pid = 0;
+    capture->pipe_fd = pipe_fds[0];
+    capture->written = 0;
+    capture->held = 0;
+    capture->prev = store->tail;
+    capture->next = NULL;
+    if (store->tail != NULL)
+    {
+        store->tail->next = capture;
+    }
+    else
+    {
+        store->head = capture;
+    }
+    store->tail = capture;
+    store->count++;
+    store->open++;
+    *write_fd = pipe_fds[1];
+
+    return capture;
+}
+
+// Takes a capture out of its store, and closes and `free()`s it.
+void capture_free(capture_store_t* store, capture_t* capture)
+{
+    if (capture->prev != NULL)
+    {
+        capture->prev->next = capture->next;
+    }
+    else
+    {
+        store->head = capture->next;
+    }
+    if (capture->next != NULL)
+    {
+        capture->next->prev = capture->prev;
+    }
+    else
+    {
+        store->tail = capture->prev;
+    }
+
+    if (capture->pipe_fd != -1)
+    {
+        close(capture->pipe_fd);
+        store->open--;
+    }
+    close(capture->mem_fd);
+    store->held -= capture->held;
+    store->count--;
+    free(capture);
+}
+
+// Gives the pages under part of a ring back, rounding inwards to whole
+// pages.
+//
+// ## Parameters:
+// * `capture` - The capture.
+// * `ring_size` - How big its ring is.
+// * `from` - Where the part starts in the job's output (not in the ring).
+// * `len` - How long it is; no more than `ring_size`.
+void capture_punch(const capture_t* capture,
+                   size_t           ring_size,
+                   uint64_t         from,
+                   size_t           len)
+{
+    const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    while (len > 0)
+    {
+        // The part may wrap around the end of the ring, in which case it's
+        // done in two pieces
+        uint64_t start = from % ring_size;
+        uint64_t piece = ring_size - start < len ? ring_size - start : len;
+        uint64_t first_page = (start + page - 1) / page * page;
+        uint64_t end_page = (start + piece) / page * page;
+        if (end_page > first_page)
+        {
+            fallocate(
+                capture->mem_fd,
+                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)first_page,
+                (off_t)(end_page - first_page)
+            );
+        }
+        from += piece;
+        len -= (size_t)piece;
+    }
+}
+
+// Throws away the oldest part of what a capture holds.
+//
+// ## Parameters:
+// * `store` - The capture's store.
+// * `capture` - The capture.
+// * `len` - How much to throw away; no more than it holds.
+void capture_evict(capture_store_t* store, capture_t* capture, size_t len)
+{
+    if (len == capture->held) // All of it, which is easy
+    {
+        ftruncate(capture->mem_fd, 0);
+    }
+    else
+    {
+        capture_punch(
+            capture,
+            store->job_cap,
+            capture->written - capture->held,
+            len
+        );
+    }
+    capture->held -= len;
+    store->held -= len;
+}
+
+// Moves whatever a job has written so far from its pipe into its ring,
+// without it passing through user space. Closes the pipe once the job (and
+// anything it left running) is done with it.
+//
+// **Returns** zero, or an `errno` value if the pipe couldn't be read.
+int capture_fill(capture_store_t* store, capture_t* capture)
+{
+    while (capture->pipe_fd != -1)
+    {
+        loff_t at = (loff_t)(capture->written % store->job_cap);
+        size_t room = store->job_cap - (size_t)at;
+        ssize_t moved = splice(
+            capture->pipe_fd,
+            NULL,
+            capture->mem_fd,
+            &at,
+            room < CAPTURE_CHUNK ? room : CAPTURE_CHUNK,
+            SPLICE_F_NONBLOCK
+        );
+        if (moved > 0)
+        {
+            // Past the cap, each byte in replaces the oldest one kept
+            capture->written += (uint64_t)moved;
+            size_t gained = store->job_cap - capture->held;
+            gained = (size_t)moved < gained ? (size_t)moved : gained;
+            capture->held += gained;
+            store->held += gained;
+            continue;
+        }
+        if (moved == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved == -1 && errno == EAGAIN) // Nothing more for now
+        {
+            return 0;
+        }
+
+        int err = moved == 0 ? 0 : errno;
+        close(capture->pipe_fd);
+        capture->pipe_fd = -1;
+        store->open--;
+        return err;
+    }
+
+    return 0;
+}
+
+// Moves every job's output into its ring, then keeps the total under its
+// cap by throwing away the oldest output. Captures of jobs that are done
+// and have had everything thrown away are dropped, as are the oldest ones
+// past `CAPTURE_MAX_DONE`.
+void capture_drain(capture_store_t* store)
+{
+    capture_t* capture;
+    for (capture = store->head; capture != NULL; capture = capture->next)
+    {
+        capture_fill(store, capture);
+    }
+
+    capture = store->head;
+    while (capture != NULL)
+    {
+        capture_t* next = capture->next;
+        if (store->held > store->total_cap && capture->held > 0)
+        {
+            size_t over = store->held - store->total_cap;
+            capture_evict(
+                store,
+                capture,
+                over < capture->held ? over : capture->held
+            );
+        }
+        if (capture->pipe_fd == -1
+            && (capture->held == 0
+                || store->count - store->open > CAPTURE_MAX_DONE))
+        {
+            capture_free(store, capture);
+        }
+        capture = next;
+    }
+}
+
+// Finds the newest capture of a job.
+//
+// ## Parameters:
+// * `store` - Where to look.
+// * `pid` - The job's last PID.
+//
+// **Returns** the capture, or `NULL` if there isn't one (any more).
+capture_t* capture_find(capture_store_t* store, pid_t pid)
+{
+    capture_t* capture;
+    for (capture = store->tail; capture != NULL; capture = capture->prev)
+    {
+        if (capture->pid == pid)
+        {
+            return capture;
+        }
+    }
+
+    return NULL;
+}
+
+// Writes out everything a capture holds, oldest first, straight from its
+// ring with `sendfile()`.
+//
+// ## Parameters:
+// * `store` - The capture's store.
+// * `capture` - The capture.
+// * `out_fd` - Where to write it.
+//
+// **Returns** zero, or an `errno` value.
+int capture_send(const capture_store_t* store,
+                 const capture_t*       capture,
+                 int                    out_fd)
+{
+    uint64_t from = capture->written - capture->held;
+    size_t left = capture->held;
+    while (left > 0)
+    {
+        // Up to the end of the ring, and then from its start
+        off_t at = (off_t)(from % store->job_cap);
+        size_t piece = store->job_cap - (size_t)at;
+        piece = piece < left ? piece : left;
+        ssize_t sent = sendfile(out_fd, capture->mem_fd, &at, piece);
+        if (sent <= 0)
+        {
+            if (sent == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            return sent == 0 ? EIO : errno;
+        }
+        from += (uint64_t)sent;
+        left -= (size_t)sent;
+    }
+
+    return 0;
+}
+
+// Drops every capture in a store.
+void capture_store_destroy(capture_store_t* store)
+{
+    while (store->head != NULL)
+    {
+        capture_free(store, store->head);
+    }
+}
@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+
+#include "comitoz.client.h"
+#include "comitoz.reader.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>      // errno, ENAMETOOLONG
+#include <poll.h>       // poll, POLLIN
+#include <signal.h>     // signal, SIGPIPE, SIG_IGN
+#include <stdio.h>      // printf, snprintf, fputs, fflush, perror
+#include <stdlib.h>     // malloc, free, getenv, strtol
+#include <string.h>     // memcpy, strlen, strncmp, strrchr
+#include <sys/socket.h> // socket, connect, shutdown
+#include <sys/un.h>     // struct sockaddr_un
+#include <unistd.h>     // read, write, close, getopt
+
+
+/*** Implementations ***/
+
+int connect_server(const char* path)
+{
+    struct sockaddr_un addr = {0};
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, path_len + 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+    {
+        return -1;
+    }
+    if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+char* join_request(char** words, int count, size_t* len)
+{
+    size_t total = 0;
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        total += strlen(words[i]) + 1;
+    }
+
+    char* line = malloc(total + 1);
+    if (line == NULL)
+    {
+        return NULL;
+    }
+    char* p = line;
+    for (i = 0; i < count; ++i)
+    {
+        size_t word_len = strlen(words[i]);
+        memcpy(p, words[i], word_len);
+        p += word_len;
+        *p++ = i + 1 < count ? ' ' : '\n';
+    }
+    *len = (size_t)(p - line);
+
+    return line;
+}
+
+int write_all(int fd, const char* buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        buf += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+int send_request(int            sock,
+                 line_reader_t* replies,
+                 const char*    request,
+                 size_t         len)
+{
+    if (write_all(sock, request, len) != 0)
+    {
+        perror("could not send the request");
+        return 1;
+    }
+
+    bool watching = strncmp(request, "watch\n", 6) == 0;
+    char* line;
+    ssize_t line_len;
+    while ((line_len = reader_next_line(replies, &line)) != READER_EOF)
+    {
+        if (line_len < 0)
+        {
+            if (line_len == READER_INTERRUPTED)
+            {
+                continue;
+            }
+            perror("could not read the reply");
+            return 1;
+        }
+
+        printf("%s\n", line);
+        fflush(stdout);
+        if (!watching)
+        {
+            return strncmp(line, "error", 5) == 0;
+        }
+    }
+
+    return !watching;
+}
+
+int run_and_wait(int sock, line_reader_t* replies, const char* command)
+{
+    // Watching first means the "done" can't be missed, however quickly the
+    // job finishes
+    size_t command_len = strlen(command);
+    char* request = malloc(command_len + 16);
+    if (request == NULL)
+    {
+        perror("malloc() failed!");
+        return 1;
+    }
+    memcpy(request, "watch\nrun ", 10);
+    memcpy(request + 10, command, command_len);
+    request[10 + command_len] = '\n';
+    int sent = write_all(sock, request, command_len + 11);
+    free(request);
+    if (sent != 0)
+    {
+        perror("could not send the request");
+        return 1;
+    }
+
+    char done_prefix[32] = "";
+    size_t prefix_len = 0;
+    char* line;
+    ssize_t line_len;
+    while ((line_len = reader_next_line(replies, &line)) != READER_EOF)
+    {
+        if (line_len == READER_INTERRUPTED)
+        {
+            continue;
+        }
+        if (line_len < 0)
+        {
+            break;
+        }
+
+        if (strncmp(line, "job ", 4) == 0 && prefix_len == 0)
+        {
+            printf("%s\n", line);
+            fflush(stdout);
+            prefix_len = (size_t)snprintf(
+                done_prefix,
+                sizeof(done_prefix),
+                "done %s ",
+                line + 4
+            );
+        }
+        else if (prefix_len > 0 &&
+                 strncmp(line, done_prefix, prefix_len) == 0)
+        {
+            // "exit value N" or "terminated by signal N"
+            printf("%s\n", line);
+            int value = (int)strtol(strrchr(line, ' ') + 1, NULL, 10);
+            if (strncmp(line + prefix_len, "exit value ", 11) == 0)
+            {
+                return value;
+            }
+            return 128 + value;
+        }
+    }
+
+    fputs("the shell went away\n", stderr);
+    return 1;
+}
+
+int pump_requests(int sock, line_reader_t* replies)
+{
+    replies->polled = true;
+    bool stdin_open = true;
+    int ret = 0;
+    while (1)
+    {
+        struct pollfd fds[2] = {
+            {sock, POLLIN, 0},
+            {STDIN_FILENO, POLLIN, 0}
+        };
+        if (poll(fds, stdin_open ? 2 : 1, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll() failed!");
+            return 1;
+        }
+
+        // Requests go out as they come, whole lines or not
+        if (stdin_open && (fds[1].revents & (POLLIN | POLLHUP)))
+        {
+            char buf[65536];
+            ssize_t bytes_read = read(STDIN_FILENO, buf, sizeof(buf));
+            if (bytes_read <= 0)
+            {
+                shutdown(sock, SHUT_WR); // The shell hangs up once it's
+                stdin_open = false;      // replied to everything
+            }
+            else if (write_all(sock, buf, (size_t)bytes_read) != 0)
+            {
+                perror("could not send requests");
+                return 1;
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            replies->readable = true;
+            char* line;
+            ssize_t line_len;
+            while ((line_len = reader_next_line(replies, &line)) >= 0)
+            {
+                printf("%s\n", line);
+                if (strncmp(line, "error", 5) == 0)
+                {
+                    ret = 1;
+                }
+            }
+            fflush(stdout);
+            if (line_len == READER_EOF)
+            {
+                return ret;
+            }
+            if (line_len == READER_ERROR)
+            {
+                perror("could not read replies");
+                return 1;
+            }
+        }
+    }
+}
+
+void usage(void)
+{
+    fputs(
+        "usage: smallsh-client [-s socket] [-w] [request words...]\n"
+        "requests: run <command line> | status <id> | watch\n",
+        stderr
+    );
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = getenv(CLIENT_SOCKET_ENV);
+    bool wait_for_job = false;
+    int opt;
+
+    // The words are the request's, options and all
+    while ((opt = getopt(argc, argv, "+s:w")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': // Where the shell's socket is
+            {
+                path = optarg;
+                break;
+            }
+            case 'w': // Run the words as a command line, and wait for it
+            {
+                wait_for_job = true;
+                break;
+            }
+            default:
+            {
+                usage();
+                return 2;
+            }
+        }
+    }
+    if (path == NULL || (wait_for_job && optind == argc))
+    {
+        usage();
+        return 2;
+    }
+
+    // A shell that goes away mid-request is reported, not fatal
+    signal(SIGPIPE, SIG_IGN);
+
+    int sock = connect_server(path);
+    if (sock == -1)
+    {
+        perror("could not connect to the shell");
+        return 1;
+    }
+    line_reader_t replies;
+    if (reader_open(&replies, sock, true) != 0)
+    {
+        perror("reader_open() failed!");
+        close(sock);
+        return 1;
+    }
+
+    int ret;
+    if (optind == argc)
+    {
+        ret = pump_requests(sock, &replies);
+    }
+    else
+    {
+        size_t len;
+        char* request = join_request(argv + optind, argc - optind, &len);
+        if (request == NULL)
+        {
+            perror("malloc() failed!");
+            ret = 1;
+        }
+        else if (wait_for_job)
+        {
+            request[len - 1] = '\0';
+            ret = run_and_wait(sock, &replies, request);
+        }
+        else
+        {
+            ret = send_request(sock, &replies, request, len);
+        }
+        free(request);
+    }
+
+    reader_close(&replies);
+
+    return ret;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "comitoz.reader.h"
+#include "comitoz.utils.h"
+
+
+/*** Constants ***/
+
+// Where the socket is looked for when `-s` isn't given.
+#define CLIENT_SOCKET_ENV "SMALLSH_SOCKET"
+
+
+/*** Forward declarations ***/
+
+// Connects to a daemon-mode shell.
+//
+// ## Parameters:
+// * `path` - The shell's socket (its `-S`).
+//
+// **Returns** the connected socket, or -1 on failure (see `errno`).
+int connect_server(const char* path);
+
+// Joins words into one request line, with spaces between them and a newline
+// on the end.
+//
+// ## Parameters:
+// * `words` - The words.
+// * `count` - How many there are.
+// * `len` - Set to the length of the line.
+//
+// **Returns** the line, `malloc()`ed, or `NULL` if out of memory.
+char* join_request(char** words, int count, size_t* len);
+
+// Writes the whole of a buffer, however many `write()`s it takes.
+//
+// **Returns** non-zero on failure (see `errno`).
+int write_all(int fd, const char* buf, size_t size);
+
+// Sends one request and prints its reply. A `watch` request keeps printing
+// events until the shell hangs up.
+//
+// ## Parameters:
+// * `sock` - Connected to the shell.
+// * `replies` - Reads from `sock`.
+// * `request` - The request line, newline included.
+// * `len` - Its length.
+//
+// **Returns** 0, or 1 if the shell replied with an error (or not at all).
+int send_request(int            sock,
+                 line_reader_t* replies,
+                 const char*    request,
+                 size_t         len);
+
+// Submits a command line and waits for it to finish, printing its ID and
+// then its "done" event.
+//
+// ## Parameters:
+// * `sock` - Connected to the shell.
+// * `replies` - Reads from `sock`.
+// * `command` - The command line, without `run` or a newline.
+//
+// **Returns** the job's exit value, or 128 plus the signal that terminated
+// it, or 1 if the shell went away first.
+int run_and_wait(int sock, line_reader_t* replies, const char* command);
+
+// Sends stdin to the shell a line at a time, and prints every reply, until
+// stdin runs out and every reply is in.
+//
+// **Returns** 0, or 1 on failure.
+int pump_requests(int sock, line_reader_t* replies);
+
+// Prints out how to invoke the client.
+void usage(void);
+
+// Talks to a daemon-mode shell.
+//
+// ## Parameters:
+// * `argc` - Number of arguments passed in.
+// * `argv` - `[-s socket] [-w] [request words...]`. With no words, requests
+//            are read from stdin. `-w` takes the words as a command line to
+//            run, and waits for it.
+//
+// **Returns** 0 on success, 1 on failure, 2 on bad usage, or (with `-w`)
+// the job's exit status.
+int main(int argc, char** argv);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>  // ENOMEM
+#include <stdlib.h> // realloc, free
+#include <string.h> // memset
+
+
+/*** Constants ***/
+
+// Starting number of job numbers an outcome table has room for.
+#define DAG_MIN_CAP 64
+
+
+/*** `typedef`s ***/
+
+// What became of a job, as far as the jobs waiting on it are concerned.
+typedef enum
+{
+    DAG_PENDING,   // Not done yet (or there's no such job)
+    DAG_SUCCEEDED, // Exited with 0
+    DAG_FAILED     // Exited with anything else, was killed, couldn't be
+                   // launched, or was cancelled
+} dag_outcome_t;
+
+// The outcome of every job, by job number, so that a job can be made to
+// wait on one that's already done. One byte per job number ever given out.
+typedef struct
+{
+    unsigned char* outcomes; // Each a `dag_outcome_t`
+    size_t         cap;      // How many job numbers `outcomes` covers
+} dag_t;
+
+
+/*** Implementations ***/
+
+// Sets up a table with nothing done.
+void dag_init(dag_t* dag)
+{
+    dag->outcomes = NULL;
+    dag->cap = 0;
+}
+
+// Records what became of a job.
+//
+// ## Parameters:
+// * `dag` - The table.
+// * `id` - The job's number.
+// * `outcome` - What became of it.
+//
+// **Returns** zero, or `ENOMEM`.
+int dag_record(dag_t* dag, int id, dag_outcome_t outcome)
+{
+    if (id <= 0)
+    {
+        return 0;
+    }
+    if ((size_t)id >= dag->cap)
+    {
+        size_t cap = dag->cap > 0 ? dag->cap : DAG_MIN_CAP;
+        while (cap <= (size_t)id)
+        {
+            cap *= 2;
+        }
+        unsigned char* grown = realloc(dag->outcomes, cap);
+        if (grown == NULL)
+        {
+            return ENOMEM;
+        }
+        memset(grown + dag->cap, DAG_PENDING, cap - dag->cap);
+        dag->outcomes = grown;
+        dag->cap = cap;
+    }
+    dag->outcomes[id] = (unsigned char)outcome;
+
+    return 0;
+}
+
+// Looks up what became of a job.
+dag_outcome_t dag_outcome(const dag_t* dag, int id)
+{
+    return id > 0 && (size_t)id < dag->cap
+        ? (dag_outcome_t)dag->outcomes[id]
+        : DAG_PENDING;
+}
+
+// Decides whether a job that waits on others can go: not if any of them
+// failed, and only once all of them have succeeded.
+//
+// ## Parameters:
+// * `dag` - The table.
+// * `deps` - The numbers of the jobs it waits on.
+// * `dep_count` - How many there are.
+// * `failed` - Set to the number of one that failed, if any did.
+//
+// **Returns** `DAG_FAILED` if any failed, `DAG_SUCCEEDED` if every one
+// succeeded, and otherwise `DAG_PENDING`.
+dag_outcome_t dag_check(const dag_t* dag,
+                        const int*   deps,
+                        int          dep_count,
+                        int*         failed)
+{
+    dag_outcome_t result = DAG_SUCCEEDED;
+    int i;
+    for (i = 0; i < dep_count; ++i)
+    {
+        dag_outcome_t outcome = dag_outcome(dag, deps[i]);
+        if (outcome == DAG_FAILED)
+        {
+            *failed = deps[i];
+            return DAG_FAILED;
+        }
+        if (outcome == DAG_PENDING)
+        {
+            result = DAG_PENDING;
+        }
+    }
+
+    return result;
+}
+
+// Frees a table's storage.
+void dag_destroy(dag_t* dag)
+{
+    free(dag->outcomes);
+    dag_init(dag);
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>       // errno, ENOMEM
+#include <signal.h>      // kill, killpg, SIGTERM, SIGKILL, SIGCONT
+#include <stdint.h>      // uint64_t, SIZE_MAX
+#include <stdlib.h>      // realloc, free, strtod
+#include <sys/timerfd.h> // timerfd_create, timerfd_settime, TFD_*
+#include <sys/types.h>   // pid_t
+#include <time.h>        // struct itimerspec, CLOCK_MONOTONIC
+#include <unistd.h>      // read, close
+
+
+/*** Constants ***/
+
+// How long a timed-out job (or one being shut down) gets between its
+// `SIGTERM` and its `SIGKILL`, by default.
+#define DEADLINE_DEFAULT_GRACE_NS 5000000000u
+
+// The heap index of a deadline that isn't in the heap.
+#define DEADLINE_IDLE SIZE_MAX
+
+// Starting number of slots in a deadline heap.
+#define DEADLINE_MIN_SLOTS 16
+
+
+/*** `typedef`s ***/
+
+// When a job's time is up. First its processes get `SIGTERM`, and then,
+// if they're still around after the grace period, `SIGKILL`.
+typedef struct
+{
+    uint64_t     at_ns;      // `monotonic_ns()` when it next fires
+    uint64_t     grace_ns;   // From `SIGTERM` to `SIGKILL`
+    bool         terminated; // Has the `SIGTERM` gone out yet?
+    const pid_t* pids;       // The job's processes; reaped ones are 0
+    int          pid_count;
+    pid_t        pgid;       // The job's process group, which is signalled
+                             // instead if it has one; otherwise 0
+    size_t       index;      // Where it is in the heap, or `DEADLINE_IDLE`
+} deadline_t;
+
+// Every pending deadline, in a binary min-heap by when they fire, with one
+// `timerfd` shared between them that's always armed for the soonest.
+typedef struct
+{
+    deadline_t** heap;
+    size_t       count;
+    size_t       cap;
+    int          timer_fd; // Readable once the soonest deadline has come
+    uint64_t     armed_ns; // What `timer_fd` is set for; 0 if disarmed
+} deadline_heap_t;
+
+
+/*** Implementations ***/
+
+// Sets up a deadline that isn't set for anything yet.
+//
+// ## Parameters:
+// * `deadline` - The deadline.
+// * `pids` - The processes it's for. Must outlive it; PIDs that are reaped
+//            should be zeroed.
+// * `pid_count` - How many there are.
+void deadline_init(deadline_t* deadline, const pid_t* pids, int pid_count)
+{
+    deadline->at_ns = 0;
+    deadline->grace_ns = DEADLINE_DEFAULT_GRACE_NS;
+    deadline->terminated = false;
+    deadline->pids = pids;
+    deadline->pid_count = pid_count;
+    deadline->pgid = 0;
+    deadline->index = DEADLINE_IDLE;
+}
+
+// Parses a duration: a number of seconds, possibly fractional, optionally
+// followed by "s", "m", or "h", e.g. "30", "1.5", "10m".
+//
+// **Returns** whether it made sense; if so, `ns` is set to it.
+bool deadline_parse_duration(const char* str, uint64_t* ns)
+{
+    char* end;
+    double secs = strtod(str, &end);
+    if (end == str || secs < 0 || secs > 1e9)
+    {
+        return false;
+    }
+
+    double unit = *end == 'h' ? 3600 : *end == 'm' ? 60 : 1;
+    if (*end == 'h' || *end == 'm' || *end == 's')
+    {
+        end++;
+    }
+    if (*end != '\0')
+    {
+        return false;
+    }
+
+    *ns = (uint64_t)(secs * unit * 1e9);
+
+    return true;
+}
+
+// Sets up an empty heap.
+//
+// **Returns** zero on success, or an `errno` value.
+int deadline_heap_init(deadline_heap_t* heap)
+{
+    heap->heap = NULL;
+    heap->count = 0;
+    heap->cap = 0;
+    heap->armed_ns = 0;
+    heap->timer_fd = timerfd_create(
+        CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC
+    );
+
+    return heap->timer_fd != -1 ? 0 : errno;
+}
+
+// Puts the heap's timer on the soonest deadline, or turns it off if there
+// are none. Nothing is done if it's already right.
+void deadline_heap_arm(deadline_heap_t* heap)
+{
+    uint64_t at_ns = heap->count > 0 ? heap->heap[0]->at_ns : 0;
+    if (at_ns == heap->armed_ns)
+    {
+        return;
+    }
+
+    // A time already gone by goes off straight away; all zeroes disarms it
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    spec.it_value.tv_sec = (time_t)(at_ns / 1000000000u);
+    spec.it_value.tv_nsec = (long)(at_ns % 1000000000u);
+    timerfd_settime(heap->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+    heap->armed_ns = at_ns;
+}
+
+// Swaps two entries of the heap, keeping their indices right.
+void deadline_heap_swap(deadline_heap_t* heap, size_t a, size_t b)
+{
+    deadline_t* temp = heap->heap[a];
+    heap->heap[a] = heap->heap[b];
+    heap->heap[b] = temp;
+    heap->heap[a]->index = a;
+    heap->heap[b]->index = b;
+}
+
+// Moves an entry up or down the heap until it's in order.
+void deadline_heap_fix(deadline_heap_t* heap, size_t i)
+{
+    while (i > 0 && heap->heap[i]->at_ns < heap->heap[(i - 1) / 2]->at_ns)
+    {
+        deadline_heap_swap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (1)
+    {
+        size_t least = i;
+        size_t child;
+        for (child = 2 * i + 1; child <= 2 * i + 2; ++child)
+        {
+            if (child < heap->count
+                && heap->heap[child]->at_ns < heap->heap[least]->at_ns)
+            {
+                least = child;
+            }
+        }
+        if (least == i)
+        {
+            return;
+        }
+        deadline_heap_swap(heap, i, least);
+        i = least;
+    }
+}
+
+// Sets a deadline to fire at a given time, adding it to the heap if it
+// isn't already in it.
+//
+// ## Parameters:
+// * `heap` - The heap.
+// * `deadline` - The deadline, set up with `deadline_init()`.
+// * `at_ns` - When it should fire (`SIGTERM`), by `monotonic_ns()`.
+//
+// **Returns** zero on success, or an `errno` value.
+int deadline_set(deadline_heap_t* heap, deadline_t* deadline, uint64_t at_ns)
+{
+    if (deadline->index == DEADLINE_IDLE)
+    {
+        if (heap->count == heap->cap)
+        {
+            size_t cap = heap->cap > 0 ? heap->cap * 2 : DEADLINE_MIN_SLOTS;
+            deadline_t** grown = realloc(heap->heap, cap * sizeof(*grown));
+            if (grown == NULL)
+            {
+                return ENOMEM;
+            }
+            heap->heap = grown;
+            heap->cap = cap;
+        }
+        deadline->index = heap->count;
+        heap->heap[heap->count++] = deadline;
+    }
+
+    deadline->at_ns = at_ns;
+    deadline->terminated = false;
+    deadline_heap_fix(heap, deadline->index);
+    deadline_heap_arm(heap);
+
+    return 0;
+}
+
+// Takes a deadline out of the heap, if it's in it.
+void deadline_clear(deadline_heap_t* heap, deadline_t* deadline)
+{
+    size_t i = deadline->index;
+    if (i == DEADLINE_IDLE)
+    {
+        return;
+    }
+
+    deadline->index = DEADLINE_IDLE;
+    heap->count--;
+    if (i < heap->count)
+    {
+        heap->heap[i] = heap->heap[heap->count];
+        heap->heap[i]->index = i;
+        deadline_heap_fix(heap, i);
+    }
+    deadline_heap_arm(heap);
+}
+
+// Sends a signal to a deadline's job: its whole process group (whatever
+// the job started included) if it has one, or else every one of its
+// processes that's still around. A `SIGTERM` is followed by a `SIGCONT`, so
+// that a stopped job gets it too.
+void deadline_signal(const deadline_t* deadline, int signo)
+{
+    if (deadline->pgid > 0)
+    {
+        killpg(deadline->pgid, signo);
+    }
+    else
+    {
+        int i;
+        for (i = 0; i < deadline->pid_count; ++i)
+        {
+            if (deadline->pids[i] > 0)
+            {
+                kill(deadline->pids[i], signo);
+            }
+        }
+    }
+
+    if (signo == SIGTERM)
+    {
+        deadline_signal(deadline, SIGCONT);
+    }
+}
+
+// Fires every deadline that has come due: a first `SIGTERM`, which puts the
+// deadline off by its grace period, and then a `SIGKILL`, which takes it out
+// of the heap.
+//
+// **Returns** how many deadlines fired.
+int deadline_heap_fire(deadline_heap_t* heap)
+{
+    // Whether or not the timer went off, it's read, so that it's only
+    // readable again when it next goes off
+    uint64_t expirations;
+    ssize_t ignored = read(heap->timer_fd, &expirations, sizeof(expirations));
+    (void)ignored;
+
+    uint64_t now = monotonic_ns();
+    int fired = 0;
+    while (heap->count > 0 && heap->heap[0]->at_ns <= now)
+    {
+        deadline_t* deadline = heap->heap[0];
+        if (!deadline->terminated)
+        {
+            deadline_signal(deadline, SIGTERM);
+            deadline->terminated = true;
+            deadline->at_ns = now + deadline->grace_ns;
+            deadline_heap_fix(heap, 0);
+        }
+        else
+        {
+            deadline_signal(deadline, SIGKILL);
+            deadline_clear(heap, deadline);
+        }
+        fired++;
+    }
+    deadline_heap_arm(heap);
+
+    return fired;
+}
+
+// Frees a heap's storage and closes its timer. The deadlines themselves
+// belong to whoever set them.
+void deadline_heap_destroy(deadline_heap_t* heap)
+{
+    size_t i;
+    for (i = 0; i < heap->count; ++i)
+    {
+        heap->heap[i]->index = DEADLINE_IDLE;
+    }
+    free(heap->heap);
+    heap->heap = NULL;
+    heap->count = 0;
+    heap->cap = 0;
+    if (heap->timer_fd != -1)
+    {
+        close(heap->timer_fd);
+        heap->timer_fd = -1;
+    }
+}
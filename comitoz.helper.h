@@ -0,0 +1,221 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>       // errno, EINTR
+#include <sched.h>       // CLONE_PARENT, cpu_set_t
+#include <signal.h>      // SIGCHLD
+#include <stdint.h>      // int32_t, uint32_t, uint64_t, uintptr_t
+#include <string.h>      // memcpy, memset
+#include <sys/socket.h>  // sendmsg, recvmsg, SCM_RIGHTS, CMSG_*
+#include <sys/syscall.h> // SYS_clone
+#include <sys/types.h>   // pid_t, ssize_t
+#include <sys/uio.h>     // struct iovec
+#include <unistd.h>      // syscall
+
+
+/*** Constants ***/
+
+// Biggest request the helper will take, all strings included. Anything
+// bigger is launched the old way.
+#define HELPER_MAX_REQUEST 65536
+
+// Every launch request carries exactly this many descriptors: the child's
+// stdin, stdout, and stderr.
+#define HELPER_FD_COUNT 3
+
+// `helper_request_t` flags.
+#define HELPER_BACKGROUND  0x01 // Run the child as a background process
+#define HELPER_EXEC_PATH   0x02 // A cached path to `execv()` is included
+#define HELPER_INPUT_FILE  0x04 // A "<" file name is included
+#define HELPER_OUTPUT_FILE 0x08 // A ">" file name is included
+#define HELPER_INPUT_FD    0x10 // The stdin descriptor is a pipe, not just
+                                // the shell's own stdin
+#define HELPER_OUTPUT_FD   0x20 // The stdout descriptor is a pipe, not just
+                                // the shell's own stdout
+#define HELPER_AFFINITY    0x40 // Pin the child to `affinity`
+#define HELPER_PGROUP      0x80 // Put the child in process group `pgid`
+
+
+/*** `typedef`s ***/
+
+// What the shell is asking the helper to do.
+//
+// * `HELPER_EXEC` - Start a command.
+// * `HELPER_RELAY` - Start a relay stage (see `fork_relay()`).
+// * `HELPER_CHDIR` - Change directory to keep up with the shell.
+// * `HELPER_SETENV` - Set an environment variable to keep up with the
+//                     shell's exported variables.
+// * `HELPER_UNSETENV` - Remove an environment variable likewise.
+//
+// Only launches get a response.
+typedef enum
+{
+    HELPER_EXEC,
+    HELPER_RELAY,
+    HELPER_CHDIR,
+    HELPER_SETENV,
+    HELPER_UNSETENV
+} helper_op_t;
+
+// The fixed part of a request. It's followed by `'\0'`-terminated strings,
+// in this order, with the optional ones there only if their flag is set:
+// the command (or directory for `HELPER_CHDIR`, "NAME=value" for
+// `HELPER_SETENV`, or name for `HELPER_UNSETENV`), the cached exec path, the
+// "<" file, the ">" file, and then `argc` arguments.
+typedef struct
+{
+    int32_t   op;           // See `helper_op_t`
+    int32_t   flags;        // `HELPER_*` flags
+    int32_t   argc;         // How many arguments follow the other strings
+    uint32_t  sig_default;  // Signals (bit N for signal N) to reset to
+                            // `SIG_DFL` in the child
+    uint32_t  sig_ignore;   // Signals to ignore in the child
+    uint32_t  strings_len;  // Total size of the strings that follow
+    int32_t   pgid;         // With `HELPER_PGROUP`, the group to join, or
+                            // 0 to lead a new one
+    uint64_t  trace_ticket; // Ticket of the `TRACE_FORK` event the shell
+                            // will fill in, for the child's `TRACE_EXEC`
+    cpu_set_t affinity;     // CPUs to pin the child to, with
+                            // `HELPER_AFFINITY`
+} helper_request_t;
+
+// The helper's answer to a launch request.
+typedef struct
+{
+    int32_t pid; // The child, or -1 if it couldn't be created
+    int32_t err; // Why not, if `pid` is -1; otherwise the `errno` from
+                 // `execv()`ing the cached path, or 0 if that went fine
+} helper_response_t;
+
+
+/*** Implementations ***/
+
+// Sends one message over a `SOCK_SEQPACKET` socket, along with some
+// descriptors.
+//
+// ## Parameters:
+// * `sock` - The socket.
+// * `msg` - What to send.
+// * `len` - How big it is.
+// * `fds` - Descriptors to pass along (duplicated into the receiver).
+// * `fd_count` - How many there are; may be 0.
+//
+// **Returns** zero on success, or an `errno` value.
+int helper_send(int sock, const void* msg, size_t len, const int* fds,
+                int fd_count)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)(uintptr_t)msg;
+    iov.iov_len = len;
+
+    union
+    {
+        char           buf[CMSG_SPACE(sizeof(int) * HELPER_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if (fd_count > 0)
+    {
+        size_t fds_len = sizeof(int) * (size_t)fd_count;
+        header.msg_control = control.buf;
+        header.msg_controllen = CMSG_SPACE(fds_len);
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds_len);
+        memcpy(CMSG_DATA(cmsg), fds, fds_len);
+    }
+
+    while (sendmsg(sock, &header, MSG_NOSIGNAL) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return errno;
+        }
+    }
+
+    return 0;
+}
+
+// Receives one message from a `SOCK_SEQPACKET` socket, along with any
+// descriptors that came with it (which arrive `O_CLOEXEC`).
+//
+// ## Parameters:
+// * `sock` - The socket.
+// * `buf` - Where to put the message.
+// * `cap` - How big `buf` is.
+// * `fds` - Where to put the descriptors; room for `HELPER_FD_COUNT`.
+// * `fd_count` - Set to how many descriptors came.
+//
+// **Returns** the size of the message, 0 if the other end has hung up, or -1
+// on failure (see `errno`).
+ssize_t helper_recv(int sock, void* buf, size_t cap, int* fds, int* fd_count)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = cap;
+
+    union
+    {
+        char           buf[CMSG_SPACE(sizeof(int) * HELPER_FD_COUNT)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+
+    ssize_t len;
+    while ((len = recvmsg(sock, &header, MSG_CMSG_CLOEXEC)) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+
+    *fd_count = 0;
+    struct cmsghdr* cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&header);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&header, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (count > HELPER_FD_COUNT)
+            {
+                count = HELPER_FD_COUNT;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (size_t)count);
+            *fd_count = count;
+        }
+    }
+
+    return len;
+}
+
+// Like `fork()`, except that the new process is a sibling rather than a
+// child: its parent is our parent. That way children the helper starts
+// belong to the shell, which can wait for them (and gets their `SIGCHLD`s)
+// just as if it had forked them itself.
+//
+// This is a raw `clone()`, so none of `fork()`'s `pthread_atfork()` handlers
+// run; the child should stick to async-signal-safe functions until it
+// `exec()`s or exits.
+//
+// **Returns** what `fork()` would.
+pid_t fork_sibling(void)
+{
+    return (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+}
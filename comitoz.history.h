@@ -0,0 +1,614 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>     // errno, EINVAL, EINTR, EIO, EBADF, ENOMEM
+#include <fcntl.h>     // open, O_RDWR, O_CREAT, O_APPEND, O_CLOEXEC
+#include <stddef.h>    // offsetof
+#include <stdint.h>    // uint32_t, uint64_t, int32_t, int64_t, UINT32_MAX
+#include <stdio.h>     // snprintf
+#include <stdlib.h>    // malloc, realloc, free, qsort, qsort_r
+#include <string.h>    // memcpy, memset, strcmp, strlen, strncmp
+#include <sys/mman.h>  // mmap, munmap
+#include <sys/stat.h>  // struct stat, fstat
+#include <sys/types.h> // off_t, ssize_t
+#include <time.h>      // time_t, struct tm, localtime_r, strftime
+#include <unistd.h>    // close, lseek, pread, pwrite, write
+
+
+/*** Constants ***/
+
+// First four bytes of a history log: "hist" as written by a little-endian
+// machine.
+#define HISTORY_MAGIC 0x74736968U
+
+// Bumped whenever the layout of the log changes. A log with any other
+// version is left alone, rather than appended to.
+#define HISTORY_VERSION 1
+
+// Last four bytes of every entry, so that a torn or foreign one shows up
+// when walking backwards.
+#define HISTORY_ENTRY_MAGIC 0x79727465U
+
+// Every entry starts on a multiple of this.
+#define HISTORY_ALIGN 8
+
+// `history_entry_t` flags.
+#define HISTORY_RUNNING    0x01 // The outcome isn't in yet (or never came)
+#define HISTORY_BACKGROUND 0x02 // Ran as a background job
+#define HISTORY_SIGNALED   0x04 // `status` is the signal that killed it
+
+// Where the log goes, in the home directory, unless HISTFILE says otherwise.
+#define HISTORY_FILE_NAME ".smallsh_history"
+
+// How many entries a bare `history` shows.
+#define HISTORY_DEFAULT_COUNT 16
+
+
+/*** `typedef`s ***/
+
+// The start of a history log. Entries follow, one after the other.
+typedef struct
+{
+    uint32_t magic;   // `HISTORY_MAGIC`
+    uint32_t version; // `HISTORY_VERSION`
+    uint64_t unused;  // Keeps the first entry aligned
+} history_header_t;
+
+// One command line in the log. It's followed by the line itself, without
+// its newline but with a `'\0'`, then padding up to `HISTORY_ALIGN`, then a
+// `history_trailer_t`. Entries are only ever appended; the one thing that
+// changes afterwards is the outcome (`flags` through `duration_ns`), which
+// is filled in once the command is done.
+typedef struct
+{
+    uint32_t size;        // Of the whole entry, trailer included
+    uint32_t line_len;    // Not counting the `'\0'`
+    int64_t  started_at;  // Wall-clock time the line was run
+    uint32_t flags;       // `HISTORY_*` flags
+    int32_t  status;      // Exit value, or with `HISTORY_SIGNALED`, the
+                          // signal that killed it
+    uint64_t duration_ns; // How long it took
+} history_entry_t;
+
+// The end of an entry, which says where it started.
+typedef struct
+{
+    uint32_t size;  // Same as the entry's
+    uint32_t magic; // `HISTORY_ENTRY_MAGIC`
+} history_trailer_t;
+
+// A history log, open for appending, and mapped in for reading once
+// something needs to read it.
+//
+// Opening the log costs the same however big it is: nothing is read but the
+// header. Showing the last few entries walks backwards from the end, via
+// the trailers, so it only touches the last few pages. Searching by prefix
+// uses an index of every entry sorted by line, which is built the first
+// time it's needed and brought up to date with new entries after that.
+typedef struct
+{
+    int       fd;          // The log, opened `O_APPEND`, or -1
+    int       outcome_fd;  // The log again, without `O_APPEND`, since Linux
+                           // appends every `pwrite()` to an `O_APPEND` file
+    char*     map;         // The log as of the last `history_map()`, or
+                           // `NULL`
+    size_t    map_len;     // How much of it is mapped
+    uint64_t* index;       // Entry offsets, sorted by line, then offset
+    size_t    index_count; // How many entries are in `index`
+    size_t    indexed_to;  // Where the first entry not in `index` starts
+} history_t;
+
+
+/*** Implementations ***/
+
+// Sets up a history that isn't open. Everything but `history_open()` is a
+// no-op on it.
+void history_init(history_t* history)
+{
+    history->fd = -1;
+    history->outcome_fd = -1;
+    history->map = NULL;
+    history->map_len = 0;
+    history->index = NULL;
+    history->index_count = 0;
+    history->indexed_to = sizeof(history_header_t);
+}
+
+// Writes all of a buffer at the end of the log, in one `write()` so that
+// several shells can share a log without interleaving their entries.
+//
+// **Returns** zero on success, or an `errno` value.
+int history_write(int fd, const void* buf, size_t len)
+{
+    ssize_t written;
+    while ((written = write(fd, buf, len)) == -1 && errno == EINTR)
+    {
+    }
+    if (written == -1)
+    {
+        return errno;
+    }
+
+    return (size_t)written == len ? 0 : EIO;
+}
+
+// Opens (or creates) a history log.
+//
+// ## Parameters:
+// * `history` - Set up to read and append to the log.
+// * `path` - Where the log is.
+//
+// **Returns** zero on success, or an `errno` value (`EINVAL` if the file
+// isn't a history log of this version).
+int history_open(history_t* history, const char* path)
+{
+    history_init(history);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    history_header_t header;
+    ssize_t got = pread(fd, &header, sizeof(header), 0);
+    int err = 0;
+    if (got == 0) // A brand new log
+    {
+        header.magic = HISTORY_MAGIC;
+        header.version = HISTORY_VERSION;
+        header.unused = 0;
+        err = history_write(fd, &header, sizeof(header));
+    }
+    else if (got != (ssize_t)sizeof(header)
+             || header.magic != HISTORY_MAGIC
+             || header.version != HISTORY_VERSION)
+    {
+        err = got == -1 ? errno : EINVAL;
+    }
+    int outcome_fd = -1;
+    if (err == 0 && (outcome_fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        close(fd);
+        return err;
+    }
+    history->fd = fd;
+    history->outcome_fd = outcome_fd;
+
+    return 0;
+}
+
+// Appends a command line to the log, with its outcome still to come.
+//
+// ## Parameters:
+// * `history` - The log.
+// * `line` - The line, which may end in a newline (which is left out).
+// * `started_at` - When it was run.
+//
+// **Returns** the entry's offset in the log, for `history_finish()`, or -1
+// if it couldn't be added.
+int64_t history_add(history_t* history, const char* line, time_t started_at)
+{
+    if (history->fd == -1)
+    {
+        return -1;
+    }
+
+    size_t line_len = strlen(line);
+    if (line_len > 0 && line[line_len - 1] == '\n')
+    {
+        line_len--;
+    }
+    size_t size = sizeof(history_entry_t) + line_len + 1;
+    size = (size + HISTORY_ALIGN - 1) / HISTORY_ALIGN * HISTORY_ALIGN;
+    size += sizeof(history_trailer_t);
+    if (size > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    char* buf = calloc(1, size);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+    history_entry_t* entry = (history_entry_t*)buf;
+    entry->size = (uint32_t)size;
+    entry->line_len = (uint32_t)line_len;
+    entry->started_at = (int64_t)started_at;
+    entry->flags = HISTORY_RUNNING;
+    memcpy(buf + sizeof(history_entry_t), line, line_len);
+    history_trailer_t* trailer =
+        (history_trailer_t*)(buf + size - sizeof(history_trailer_t));
+    trailer->size = (uint32_t)size;
+    trailer->magic = HISTORY_ENTRY_MAGIC;
+
+    // With `O_APPEND`, our own offset ends up just past what we wrote, even
+    // if another shell appended in the meantime
+    int err = history_write(history->fd, buf, size);
+    free(buf);
+    off_t end = err == 0 ? lseek(history->fd, 0, SEEK_CUR) : -1;
+
+    return end >= (off_t)size ? (int64_t)end - (int64_t)size : -1;
+}
+
+// Fills in how a command turned out.
+//
+// ## Parameters:
+// * `history` - The log.
+// * `offset` - The entry, from `history_add()`.
+// * `status` - Its exit value, or the signal that killed it.
+// * `signaled` - Was it killed by a signal?
+// * `duration_ns` - How long it took.
+// * `background` - Did it run as a background job?
+void history_finish(history_t* history,
+                    int64_t    offset,
+                    int        status,
+                    bool       signaled,
+                    uint64_t   duration_ns,
+                    bool       background)
+{
+    if (history->fd == -1 || offset < 0)
+    {
+        return;
+    }
+
+    struct
+    {
+        uint32_t flags;
+        int32_t  status;
+        uint64_t duration_ns;
+    } outcome;
+    outcome.flags = (background ? HISTORY_BACKGROUND : 0)
+        | (signaled ? HISTORY_SIGNALED : 0);
+    outcome.status = status;
+    outcome.duration_ns = duration_ns;
+
+    off_t at = (off_t)offset + (off_t)offsetof(history_entry_t, flags);
+    while (pwrite(history->outcome_fd, &outcome, sizeof(outcome), at) == -1
+           && errno == EINTR)
+    {
+    }
+}
+
+// Maps in the whole log as it is now, if it has grown since last time.
+//
+// **Returns** zero on success, or an `errno` value.
+int history_map(history_t* history)
+{
+    struct stat st;
+    if (fstat(history->fd, &st) == -1)
+    {
+        return errno;
+    }
+    size_t len = (size_t)st.st_size;
+    if (len <= history->map_len)
+    {
+        return 0;
+    }
+
+    char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, history->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return errno;
+    }
+    if (history->map != NULL)
+    {
+        munmap(history->map, history->map_len);
+    }
+    history->map = map;
+    history->map_len = len;
+
+    return 0;
+}
+
+// Checks over the entry at an offset in the mapped log.
+//
+// **Returns** the entry, or `NULL` if there isn't a whole, sane one there.
+const history_entry_t* history_entry_at(const history_t* history,
+                                        uint64_t         offset)
+{
+    if (offset < sizeof(history_header_t)
+        || offset % HISTORY_ALIGN != 0
+        || offset + sizeof(history_entry_t) + sizeof(history_trailer_t)
+           > history->map_len)
+    {
+        return NULL;
+    }
+
+    const history_entry_t* entry =
+        (const history_entry_t*)(history->map + offset);
+    size_t fixed = sizeof(history_entry_t) + sizeof(history_trailer_t);
+    if (entry->size > history->map_len - offset
+        || entry->size % HISTORY_ALIGN != 0
+        || entry->size < fixed
+        || (uint64_t)entry->line_len + 1 > entry->size - fixed
+        || ((const char*)(entry + 1))[entry->line_len] != '\0')
+    {
+        return NULL;
+    }
+
+    const history_trailer_t* trailer = (const history_trailer_t*)(
+        history->map + offset + entry->size - sizeof(history_trailer_t)
+    );
+
+    return trailer->magic == HISTORY_ENTRY_MAGIC
+           && trailer->size == entry->size
+        ? entry
+        : NULL;
+}
+
+// Gets the text of an entry.
+const char* history_entry_line(const history_entry_t* entry)
+{
+    return (const char*)(entry + 1);
+}
+
+// Finds the entry that ends where another begins, going by its trailer.
+//
+// ## Parameters:
+// * `history` - The log, mapped in.
+// * `end` - Where the next entry starts (or the end of the log).
+//
+// **Returns** the offset of the entry before `end`, or 0 if there isn't one
+// (or it's damaged).
+uint64_t history_prev(const history_t* history, uint64_t end)
+{
+    if (end < sizeof(history_header_t) + sizeof(history_trailer_t)
+        || end > history->map_len)
+    {
+        return 0;
+    }
+
+    const history_trailer_t* trailer = (const history_trailer_t*)(
+        history->map + end - sizeof(history_trailer_t)
+    );
+    if (trailer->magic != HISTORY_ENTRY_MAGIC
+        || trailer->size > end - sizeof(history_header_t))
+    {
+        return 0;
+    }
+    uint64_t offset = end - trailer->size;
+    const history_entry_t* entry = history_entry_at(history, offset);
+
+    return entry != NULL && offset + entry->size == end ? offset : 0;
+}
+
+// Orders two entries (given by offset) by line, then by offset, for
+// `qsort_r()`.
+int history_compare(const void* a, const void* b, void* map)
+{
+    uint64_t offset_a = *(const uint64_t*)a;
+    uint64_t offset_b = *(const uint64_t*)b;
+    int cmp = strcmp(
+        history_entry_line((const history_entry_t*)((char*)map + offset_a)),
+        history_entry_line((const history_entry_t*)((char*)map + offset_b))
+    );
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+// Orders two offsets, for `qsort()`: i.e. puts entries in the order they
+// were run.
+int history_compare_offsets(const void* a, const void* b)
+{
+    uint64_t offset_a = *(const uint64_t*)a;
+    uint64_t offset_b = *(const uint64_t*)b;
+
+    return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+// Brings the prefix index up to date with whatever has been appended since
+// it was last looked at, building it from scratch the first time. New
+// entries are sorted on their own, then merged in.
+//
+// **Returns** zero on success, or an `errno` value.
+int history_index_update(history_t* history)
+{
+    int err = history_map(history);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    // Collect the new entries, stopping short at anything damaged
+    size_t new_cap = 64;
+    size_t new_count = 0;
+    uint64_t* fresh = malloc(new_cap * sizeof(uint64_t));
+    if (fresh == NULL)
+    {
+        return ENOMEM;
+    }
+    uint64_t offset = history->indexed_to;
+    const history_entry_t* entry;
+    while ((entry = history_entry_at(history, offset)) != NULL)
+    {
+        if (new_count == new_cap)
+        {
+            uint64_t* grown = realloc(fresh, 2 * new_cap * sizeof(uint64_t));
+            if (grown == NULL)
+            {
+                free(fresh);
+                return ENOMEM;
+            }
+            fresh = grown;
+            new_cap *= 2;
+        }
+        fresh[new_count++] = offset;
+        offset += entry->size;
+    }
+    if (new_count == 0)
+    {
+        free(fresh);
+        return 0;
+    }
+    qsort_r(fresh, new_count, sizeof(uint64_t), history_compare, history->map);
+
+    uint64_t* merged = malloc(
+        (history->index_count + new_count) * sizeof(uint64_t)
+    );
+    if (merged == NULL)
+    {
+        free(fresh);
+        return ENOMEM;
+    }
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+    while (i < history->index_count || j < new_count)
+    {
+        if (j == new_count
+            || (i < history->index_count
+                && history_compare(
+                       &history->index[i],
+                       &fresh[j],
+                       history->map
+                   ) < 0))
+        {
+            merged[k++] = history->index[i++];
+        }
+        else
+        {
+            merged[k++] = fresh[j++];
+        }
+    }
+    free(fresh);
+    free(history->index);
+    history->index = merged;
+    history->index_count = k;
+    history->indexed_to = offset;
+
+    return 0;
+}
+
+// Finds every entry whose line starts with a prefix, via the index.
+//
+// ## Parameters:
+// * `history` - The log.
+// * `prefix` - What to look for.
+// * `first` - Set to where the matches start in `history->index`.
+//
+// **Returns** how many matches there are (which sit together in the index,
+// in order by line), or -1 on failure (see `errno`).
+ssize_t history_search(history_t* history, const char* prefix, size_t* first)
+{
+    if (history->fd == -1)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    int err = history_index_update(history);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+
+    // Lines starting with the prefix sort together, right after anything
+    // that sorts before the prefix itself
+    size_t prefix_len = strlen(prefix);
+    size_t lo = 0;
+    size_t hi = history->index_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const history_entry_t* entry = (const history_entry_t*)(
+            history->map + history->index[mid]
+        );
+        if (strcmp(history_entry_line(entry), prefix) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    *first = lo;
+
+    size_t end = lo;
+    hi = history->index_count;
+    while (end < hi)
+    {
+        size_t mid = end + (hi - end) / 2;
+        const history_entry_t* entry = (const history_entry_t*)(
+            history->map + history->index[mid]
+        );
+        if (strncmp(history_entry_line(entry), prefix, prefix_len) == 0)
+        {
+            end = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    return (ssize_t)(end - lo);
+}
+
+// Writes out when an entry was run and how it turned out, to go in front of
+// its line, e.g. "2024-05-01 12:00:03  exit 0        0.004s  ". A command
+// killed by a signal shows as "signal N", and one whose outcome isn't in as
+// "running".
+//
+// **Returns** the length of the text, as `snprintf()` does.
+int history_format(const history_entry_t* entry, char* buf, size_t size)
+{
+    char when[32];
+    time_t started_at = (time_t)entry->started_at;
+    struct tm tm;
+    if (localtime_r(&started_at, &tm) == NULL
+        || strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm) == 0)
+    {
+        when[0] = '\0';
+    }
+
+    char outcome[32];
+    if (entry->flags & HISTORY_RUNNING)
+    {
+        snprintf(outcome, sizeof(outcome), "running");
+    }
+    else if (entry->flags & HISTORY_SIGNALED)
+    {
+        snprintf(outcome, sizeof(outcome), "signal %d", entry->status);
+    }
+    else
+    {
+        snprintf(outcome, sizeof(outcome), "exit %d", entry->status);
+    }
+
+    return snprintf(
+        buf,
+        size,
+        "%s  %-10s %8.3fs  ",
+        when,
+        outcome,
+        (double)entry->duration_ns / 1e9
+    );
+}
+
+// Closes the log and `free()`s everything that goes with it.
+void history_close(history_t* history)
+{
+    if (history->map != NULL)
+    {
+        munmap(history->map, history->map_len);
+    }
+    if (history->fd != -1)
+    {
+        close(history->fd);
+        close(history->outcome_fd);
+    }
+    free(history->index);
+    history_init(history);
+}
@@ -0,0 +1,603 @@
+#pragma once
+
+#include "comitoz.deadline.h"
+#include "comitoz.placement.h"
+#include "comitoz.utils.h"
+
+#include <stdint.h>       // uint32_t, uint64_t, int64_t
+#include <stdio.h>        // snprintf
+#include <stdlib.h>       // calloc, malloc, free
+#include <string.h>       // memcpy, memset, strlen
+#include <sys/resource.h> // struct rusage
+#include <sys/types.h>    // pid_t
+#include <time.h>         // time_t, time
+
+
+/*** Constants ***/
+
+// Starting (and smallest) number of slots in a job table's PID index. Always
+// a power of two.
+#define JOB_TABLE_MIN_SLOTS 64
+
+// Marks a PID index slot whose entry was removed. Empty slots have a PID of 0.
+#define JOB_SLOT_TOMBSTONE (-1)
+
+
+/*** `typedef`s ***/
+
+// Where a job is in its life.
+typedef enum
+{
+    JOB_RUNNING, // At least one process is still going
+    JOB_STOPPED, // Some process was stopped (e.g. by ^Z), and none has been
+                 // continued since
+    JOB_DONE     // Every process has been reaped, and the job is waiting to
+                 // be reported
+} job_state_t;
+
+// What a job's processes used, summed over every stage that has been reaped.
+typedef struct
+{
+    uint64_t wall_ns;        // Launch to last reap; 0 until the job is done
+    uint64_t user_us;        // User CPU time
+    uint64_t sys_us;         // System CPU time
+    long     max_rss_kb;     // Biggest peak RSS of any one stage
+    long     minor_faults;   // Page faults served without any I/O
+    long     major_faults;   // Page faults that had to go to disk
+    long     vol_switches;   // Gave up the CPU (e.g. to wait on I/O)
+    long     invol_switches; // Had the CPU taken away
+} job_usage_t;
+
+// A background pipeline, tracked as one unit. Allocated in one piece by
+// `job_new()`, along with its PIDs and command line.
+typedef struct job
+{
+    int          id;           // Job number, unique within a shell session
+    job_state_t  state;        // See `job_state_t`
+    int          pid_count;    // Number of stages
+    int          live;         // How many of `pids` have yet to be reaped
+    pid_t        pgid;         // Its process group, or 0 if it's in the
+                               // shell's
+    pid_t        last_pid;     // PID of the last stage, which the job is
+                               // known by
+    int          wstatus;      // Wait status of the last stage, once it's
+                               // reaped
+    bool         report_usage; // Should `usage` be included when it's
+                               // reported as done?
+    job_usage_t  usage;        // See `job_usage_t`
+    placement_t  placement;    // Which CPUs it was pinned to, if any
+    int64_t      history_at;   // Offset of its line's history entry, to
+                               // fill in the outcome, or -1
+    uint64_t     submit_id;    // Daemon-mode submission it's running, or 0
+    deadline_t   deadline;     // When it gets killed, if it has a `timeout`
+    uint64_t     start_ns;     // `monotonic_ns()` when the job was launched
+    uint64_t     exited_ns;    // And when its last process exited, as near
+                               // as can be told; 0 until it's done
+    time_t       started_at;   // Wall-clock time the job was launched
+    char*        command_line; // What the user typed, more or less
+    struct job*  prev;         // Neighbours in the table's list of jobs
+    struct job*  next;
+    struct job*  next_done;    // Next in the table's list of finished jobs
+    pid_t        pids[];       // One per stage; reaped (or never started)
+                               // ones are 0
+} job_t;
+
+// One entry in a job table's PID index.
+typedef struct
+{
+    pid_t  pid;   // 0 if empty, `JOB_SLOT_TOMBSTONE` if removed
+    int    index; // Which stage of `job` this is
+    job_t* job;
+} job_slot_t;
+
+// All of the shell's background jobs, indexed by PID so that a reaped child
+// can be matched up with its job in O(1).
+//
+// The index is an open-addressed hash table with linear probing, which grows
+// when it gets too full and shrinks back down when it gets too empty.
+typedef struct
+{
+    job_slot_t* slots;      // The PID index
+    size_t      slot_count; // Size of `slots`; a power of two
+    size_t      used;       // Slots holding a live entry
+    size_t      tombstones; // Slots holding a removed entry
+    job_t*      head;       // Every job, oldest first
+    job_t*      tail;
+    int         count;      // How many jobs there are
+    int         next_id;    // Job number for the next job added
+    job_t*      done_head;  // Finished jobs, in the order they finished
+    job_t*      done_tail;
+} job_table_t;
+
+
+/*** Implementations ***/
+
+// Adds what one reaped process used onto a running total.
+//
+// ## Parameters:
+// * `usage` - The total.
+// * `ru` - The process's usage, as filled in by `wait4()`.
+void job_usage_add(job_usage_t* usage, const struct rusage* ru)
+{
+    usage->user_us += (uint64_t)ru->ru_utime.tv_sec * 1000000u
+        + (uint64_t)ru->ru_utime.tv_usec;
+    usage->sys_us += (uint64_t)ru->ru_stime.tv_sec * 1000000u
+        + (uint64_t)ru->ru_stime.tv_usec;
+    if (ru->ru_maxrss > usage->max_rss_kb) // Stages run side by side, but
+    {                                      // peaks don't usually coincide
+        usage->max_rss_kb = ru->ru_maxrss;
+    }
+    usage->minor_faults += ru->ru_minflt;
+    usage->major_faults += ru->ru_majflt;
+    usage->vol_switches += ru->ru_nvcsw;
+    usage->invol_switches += ru->ru_nivcsw;
+}
+
+// Writes out usage as a single line of text (without a newline), e.g.
+// "real 1.002s user 0.950s sys 0.010s rss 2048KiB faults 120/0 ctxsw 3/41".
+// Faults are minor/major; context switches are voluntary/involuntary.
+//
+// ## Parameters:
+// * `usage` - What to write out.
+// * `buf` - Where to write it.
+// * `size` - How big `buf` is.
+//
+// **Returns** the length of the text, as `snprintf()` does.
+int job_usage_format(const job_usage_t* usage, char* buf, size_t size)
+{
+    return snprintf(
+        buf,
+        size,
+        "real %.3fs user %.3fs sys %.3fs rss %ldKiB faults %ld/%ld "
+        "ctxsw %ld/%ld",
+        (double)usage->wall_ns / 1e9,
+        (double)usage->user_us / 1e6,
+        (double)usage->sys_us / 1e6,
+        usage->max_rss_kb,
+        usage->minor_faults,
+        usage->major_faults,
+        usage->vol_switches,
+        usage->invol_switches
+    );
+}
+
+// Sets up an empty job table.
+//
+// **Returns** zero on success, or an `errno` value.
+int job_table_init(job_table_t* table)
+{
+    table->slot_count = JOB_TABLE_MIN_SLOTS;
+    table->slots = calloc(table->slot_count, sizeof(job_slot_t));
+    table->used = 0;
+    table->tombstones = 0;
+    table->head = NULL;
+    table->tail = NULL;
+    table->count = 0;
+    table->next_id = 1;
+    table->done_head = NULL;
+    table->done_tail = NULL;
+
+    return table->slots != NULL ? 0 : ENOMEM;
+}
+
+// Hashes a PID into a slot number. PIDs are mostly sequential, so they get
+// scattered with a multiplicative hash to keep probe runs short.
+size_t job_table_hash(const job_table_t* table, pid_t pid)
+{
+    return (size_t)(((uint32_t)pid * 2654435769u) >> 7)
+        & (table->slot_count - 1);
+}
+
+// Puts a PID into the index without any resizing; there must be room.
+void job_table_place(job_table_t* table, pid_t pid, job_t* job, int index)
+{
+    size_t slot = job_table_hash(table, pid);
+    while (table->slots[slot].pid > 0)
+    {
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+
+    if (table->slots[slot].pid == JOB_SLOT_TOMBSTONE)
+    {
+        table->tombstones--;
+    }
+    table->slots[slot].pid = pid;
+    table->slots[slot].index = index;
+    table->slots[slot].job = job;
+    table->used++;
+}
+
+// Rebuilds the PID index with a new number of slots, dropping tombstones.
+//
+// **Returns** zero on success, or an `errno` value (and the index is left as
+// it was).
+int job_table_resize(job_table_t* table, size_t slot_count)
+{
+    job_slot_t* old_slots = table->slots;
+    size_t old_count = table->slot_count;
+
+    table->slots = calloc(slot_count, sizeof(job_slot_t));
+    if (table->slots == NULL)
+    {
+        table->slots = old_slots;
+        return ENOMEM;
+    }
+    table->slot_count = slot_count;
+    table->used = 0;
+    table->tombstones = 0;
+
+    size_t i;
+    for (i = 0; i < old_count; ++i)
+    {
+        if (old_slots[i].pid > 0)
+        {
+            job_table_place(
+                table,
+                old_slots[i].pid,
+                old_slots[i].job,
+                old_slots[i].index
+            );
+        }
+    }
+    free(old_slots);
+
+    return 0;
+}
+
+// Allocates a job, with room for its PIDs and command line.
+//
+// ## Parameters:
+// * `pids` - One PID per stage. Ones that are 0 never got started.
+// * `pid_count` - How many stages there are.
+// * `command_line` - Text describing the job.
+//
+// **Returns** the new job, not yet in any table, or `NULL` if out of memory.
+job_t* job_new(const pid_t* pids, int pid_count, const char* command_line)
+{
+    size_t line_len = strlen(command_line) + 1;
+    job_t* job = malloc(
+        sizeof(job_t) + (size_t)pid_count * sizeof(pid_t) + line_len
+    );
+    if (job == NULL)
+    {
+        return NULL;
+    }
+
+    job->id = 0;
+    job->state = JOB_RUNNING;
+    job->pid_count = pid_count;
+    job->live = 0;
+    job->pgid = 0;
+    job->last_pid = pids[pid_count - 1];
+    job->wstatus = 0;
+    job->report_usage = false;
+    memset(&job->usage, 0, sizeof(job->usage));
+    memset(&job->placement, 0, sizeof(job->placement));
+    job->placement.policy = PLACE_INHERIT;
+    job->placement.cpu = -1;
+    job->placement.node = -1;
+    job->history_at = -1;
+    job->submit_id = 0;
+    deadline_init(&job->deadline, job->pids, pid_count);
+    job->start_ns = monotonic_ns();
+    job->exited_ns = 0;
+    job->started_at = time(NULL);
+    job->prev = NULL;
+    job->next = NULL;
+    job->next_done = NULL;
+
+    int i;
+    for (i = 0; i < pid_count; ++i)
+    {
+        job->pids[i] = pids[i];
+        if (pids[i] > 0)
+        {
+            job->live++;
+        }
+    }
+    job->command_line = (char*)(job->pids + pid_count);
+    memcpy(job->command_line, command_line, line_len);
+
+    return job;
+}
+
+// Adds a job to a table, indexing each of its live PIDs and giving it a job
+// number, unless it already has one from `job_table_reserve_id()`.
+//
+// **Returns** zero on success, or an `errno` value.
+int job_table_add(job_table_t* table, job_t* job)
+{
+    // Keep the load (tombstones included) under 3/4
+    if ((table->used + table->tombstones + (size_t)job->pid_count) * 4
+        > table->slot_count * 3)
+    {
+        size_t slot_count = table->slot_count;
+        while ((table->used + (size_t)job->pid_count) * 2 > slot_count)
+        {
+            slot_count *= 2;
+        }
+        int r = job_table_resize(table, slot_count);
+        if (r != 0)
+        {
+            return r;
+        }
+    }
+
+    int i;
+    for (i = 0; i < job->pid_count; ++i)
+    {
+        if (job->pids[i] > 0)
+        {
+            job_table_place(table, job->pids[i], job, i);
+        }
+    }
+
+    if (job->id == 0)
+    {
+        job->id = table->next_id++;
+    }
+    job->prev = table->tail;
+    job->next = NULL;
+    if (table->tail != NULL)
+    {
+        table->tail->next = job;
+    }
+    else
+    {
+        table->head = job;
+    }
+    table->tail = job;
+    table->count++;
+
+    return 0;
+}
+
+// Finds the slot holding a PID.
+//
+// **Returns** a pointer to the slot, or `NULL` if the PID isn't indexed.
+job_slot_t* job_table_slot(job_table_t* table, pid_t pid)
+{
+    size_t slot = job_table_hash(table, pid);
+    while (table->slots[slot].pid != 0)
+    {
+        if (table->slots[slot].pid == pid)
+        {
+            return &table->slots[slot];
+        }
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+
+    return NULL;
+}
+
+// Finds the job a PID belongs to.
+//
+// **Returns** the job, or `NULL` if the PID isn't one of a job's (or has
+// been reaped).
+job_t* job_table_find(job_table_t* table, pid_t pid)
+{
+    job_slot_t* slot = job_table_slot(table, pid);
+
+    return slot != NULL ? slot->job : NULL;
+}
+
+// Hands out a job number ahead of time, for a job that isn't added until
+// later (e.g. because it's queued).
+int job_table_reserve_id(job_table_t* table)
+{
+    return table->next_id++;
+}
+
+// Finds a job by its number. Jobs added with reserved numbers needn't be in
+// order, so every job is looked at.
+//
+// **Returns** the job, or `NULL` if there's no such job (any more).
+job_t* job_table_find_id(job_table_t* table, int id)
+{
+    job_t* job;
+    for (job = table->tail; job != NULL; job = job->prev)
+    {
+        if (job->id == id)
+        {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+// Records that one of a job's processes has been reaped, taking it out of the
+// PID index. Once the last one goes, the job moves onto the table's list of
+// finished jobs.
+//
+// ## Parameters:
+// * `table` - The table to look in.
+// * `pid` - The reaped process.
+// * `wstatus` - Its wait status.
+// * `ru` - What it used, as filled in by `wait4()`, or `NULL` if unknown.
+//
+// **Returns** the job the process belonged to, or `NULL` if it didn't belong
+// to any.
+job_t* job_table_reaped(job_table_t*         table,
+                        pid_t                pid,
+                        int                  wstatus,
+                        const struct rusage* ru)
+{
+    job_slot_t* slot = job_table_slot(table, pid);
+    if (slot == NULL)
+    {
+        return NULL;
+    }
+
+    job_t* job = slot->job;
+    int index = slot->index;
+    slot->pid = JOB_SLOT_TOMBSTONE;
+    slot->job = NULL;
+    table->used--;
+    table->tombstones++;
+
+    if (index == job->pid_count - 1) // The last stage speaks for the whole
+    {                                // pipeline
+        job->wstatus = wstatus;
+    }
+    job->pids[index] = 0;
+    job->live--;
+    if (ru != NULL)
+    {
+        job_usage_add(&job->usage, ru);
+    }
+
+    if (job->live == 0)
+    {
+        job->exited_ns = monotonic_ns();
+        job->usage.wall_ns = job->exited_ns - job->start_ns;
+        job->state = JOB_DONE;
+        job->next_done = NULL;
+        if (table->done_tail != NULL)
+        {
+            table->done_tail->next_done = job;
+        }
+        else
+        {
+            table->done_head = job;
+        }
+        table->done_tail = job;
+    }
+
+    return job;
+}
+
+// Pops the oldest finished job off of the table's list of finished jobs.
+//
+// **Returns** the job, still in the table, or `NULL` if none are finished.
+job_t* job_table_pop_done(job_table_t* table)
+{
+    job_t* job = table->done_head;
+    if (job != NULL)
+    {
+        table->done_head = job->next_done;
+        if (table->done_head == NULL)
+        {
+            table->done_tail = NULL;
+        }
+        job->next_done = NULL;
+    }
+
+    return job;
+}
+
+// Says whether every job in a table is stopped, which is to say that none
+// of them will get anywhere without being continued.
+//
+// **Returns** `true` if there's at least one job, and every job is stopped.
+bool job_table_all_stopped(const job_table_t* table)
+{
+    const job_t* job;
+    for (job = table->head; job != NULL; job = job->next)
+    {
+        if (job->state != JOB_STOPPED)
+        {
+            return false;
+        }
+    }
+
+    return table->head != NULL;
+}
+
+// Takes a finished job off of the table's list of finished jobs, wherever
+// it is in it, e.g. to report it some other way.
+void job_table_take_done(job_table_t* table, job_t* job)
+{
+    job_t* prev = NULL;
+    job_t* cur;
+    for (cur = table->done_head; cur != NULL; cur = cur->next_done)
+    {
+        if (cur == job)
+        {
+            if (prev != NULL)
+            {
+                prev->next_done = job->next_done;
+            }
+            else
+            {
+                table->done_head = job->next_done;
+            }
+            if (table->done_tail == job)
+            {
+                table->done_tail = prev;
+            }
+            job->next_done = NULL;
+            return;
+        }
+        prev = cur;
+    }
+}
+
+// Takes a job out of a table, along with any of its PIDs that are still
+// indexed, and `free()`s it. Also shrinks the PID index if it has gotten
+// mostly empty, so that a burst of jobs doesn't pin memory forever.
+void job_table_remove(job_table_t* table, job_t* job)
+{
+    int i;
+    for (i = 0; i < job->pid_count; ++i)
+    {
+        job_slot_t* slot = job->pids[i] > 0
+            ? job_table_slot(table, job->pids[i])
+            : NULL;
+        if (slot != NULL)
+        {
+            slot->pid = JOB_SLOT_TOMBSTONE;
+            slot->job = NULL;
+            table->used--;
+            table->tombstones++;
+        }
+    }
+
+    if (job->prev != NULL)
+    {
+        job->prev->next = job->next;
+    }
+    else
+    {
+        table->head = job->next;
+    }
+    if (job->next != NULL)
+    {
+        job->next->prev = job->prev;
+    }
+    else
+    {
+        table->tail = job->prev;
+    }
+    table->count--;
+    free(job);
+
+    if (table->slot_count > JOB_TABLE_MIN_SLOTS
+        && table->used * 8 < table->slot_count)
+    {
+        job_table_resize(table, table->slot_count / 2);
+    }
+    else if (table->used == 0 && table->tombstones > 0)
+    {
+        // Nothing live to rehash, so just wipe the tombstones
+        memset(table->slots, 0, table->slot_count * sizeof(job_slot_t));
+        table->tombstones = 0;
+    }
+}
+
+// `free()`s every job in a table, along with the table's own storage.
+void job_table_destroy(job_table_t* table)
+{
+    job_t* job = table->head;
+    while (job != NULL)
+    {
+        job_t* next = job->next;
+        free(job);
+        job = next;
+    }
+    free(table->slots);
+    table->slots = NULL;
+    table->head = NULL;
+    table->tail = NULL;
+    table->count = 0;
+}
@@ -0,0 +1,422 @@
+#pragma once
+
+#include "comitoz.output.h"
+#include "comitoz.utils.h"
+#include "comitoz.vars.h"
+
+#include <errno.h>     // ENOMEM
+#include <stddef.h>    // max_align_t
+#include <stdint.h>    // uintptr_t
+#include <stdlib.h>    // malloc, free
+#include <string.h>    // memcpy, strcspn, strlen
+#include <sys/types.h> // ssize_t, pid_t
+
+
+/*** Constants ***/
+
+// Smallest block an arena will allocate.
+#define ARENA_MIN_BLOCK 4096
+
+// Alignment of everything `arena_alloc()` hands out.
+#define ARENA_ALIGN (_Alignof(max_align_t))
+
+
+/*** `typedef`s ***/
+
+// One chunk of an arena's memory. Blocks form a stack, newest first.
+typedef struct arena_block
+{
+    struct arena_block* prev; // The block that filled up before this one
+    size_t              cap;  // Size of `data`
+    size_t              used; // How much of `data` has been handed out
+    char                data[];
+} arena_block_t;
+
+// A bump allocator for everything that only lives as long as one command
+// line: tokens, `argv` arrays, and the like.
+//
+// Allocating is a pointer bump, and there is no freeing of individual
+// allocations; the whole arena is reset in one go between lines. Resetting
+// coalesces the blocks into one big enough for the biggest line so far, so
+// in the steady state the arena never goes back to `malloc()` at all.
+typedef struct
+{
+    arena_block_t* block;     // The block being allocated from, or `NULL`
+    size_t         total_cap; // Combined size of every block
+} arena_t;
+
+// What a token is, as far as the parser is concerned.
+typedef enum
+{
+    TOKEN_WORD,       // An ordinary word, after expansion
+    TOKEN_INPUT,      // "<"
+    TOKEN_OUTPUT,     // ">"
+    TOKEN_BACKGROUND, // "&"
+    TOKEN_PIPE        // "|"
+} token_kind_t;
+
+// One token of a command line.
+typedef struct
+{
+    token_kind_t kind;
+    char*        text; // `'\0'`-terminated, in the arena
+} token_t;
+
+// What each kind of `$` expands to.
+typedef struct
+{
+    const var_table_t* vars;    // "$NAME" and "${NAME}"
+    const char*        pid_str; // "$$", already formatted
+    size_t             pid_len; // The length of `pid_str`
+    int                status;  // "$?"
+    pid_t              last_bg; // "$!", or 0 if nothing's been backgrounded
+} lex_env_t;
+
+
+/*** Implementations ***/
+
+// Sets up an empty arena. Nothing is allocated until it's first used.
+void arena_init(arena_t* arena)
+{
+    arena->block = NULL;
+    arena->total_cap = 0;
+}
+
+// Pushes a fresh block with room for at least `size` bytes.
+//
+// **Returns** zero on success, or an `errno` value.
+int arena_push_block(arena_t* arena, size_t size)
+{
+    size_t cap = arena->block != NULL ? arena->block->cap * 2 : 0;
+    if (cap < ARENA_MIN_BLOCK)
+    {
+        cap = ARENA_MIN_BLOCK;
+    }
+    if (cap < size)
+    {
+        cap = size;
+    }
+
+    arena_block_t* block = malloc(sizeof(arena_block_t) + cap);
+    if (block == NULL)
+    {
+        return ENOMEM;
+    }
+    block->prev = arena->block;
+    block->cap = cap;
+    block->used = 0;
+    arena->block = block;
+    arena->total_cap += cap;
+
+    return 0;
+}
+
+// Makes sure the current block has at least `size` free bytes after its
+// top, without handing them out yet. Whatever is written there can then be
+// kept with `arena_commit()`.
+//
+// **Returns** a pointer to the top of the arena, or `NULL` if out of memory.
+char* arena_reserve(arena_t* arena, size_t size)
+{
+    if (arena->block == NULL || arena->block->cap - arena->block->used < size)
+    {
+        if (arena_push_block(arena, size) != 0)
+        {
+            return NULL;
+        }
+    }
+
+    return arena->block->data + arena->block->used;
+}
+
+// Hands out `size` bytes from the top of the arena, which must already have
+// been reserved with `arena_reserve()`.
+void arena_commit(arena_t* arena, size_t size)
+{
+    arena->block->used += size;
+}
+
+// Allocates from the arena, suitably aligned for anything.
+//
+// **Returns** the memory, which lives until the next `arena_reset()`, or
+// `NULL` if out of memory.
+void* arena_alloc(arena_t* arena, size_t size)
+{
+    // Ask for enough extra to line up the start, wherever it ends up
+    char* top = arena_reserve(arena, size + ARENA_ALIGN - 1);
+    if (top == NULL)
+    {
+        return NULL;
+    }
+    size_t misalign = (uintptr_t)top % ARENA_ALIGN;
+    size_t pad = misalign != 0 ? ARENA_ALIGN - misalign : 0;
+    arena_commit(arena, pad + size);
+
+    return top + pad;
+}
+
+// Throws away everything allocated from the arena. If it took more than one
+// block to hold it all, they are swapped for a single block as big as all of
+// them put together, so that next time it fits in one.
+void arena_reset(arena_t* arena)
+{
+    if (arena->block == NULL)
+    {
+        return;
+    }
+
+    if (arena->block->prev == NULL)
+    {
+        arena->block->used = 0;
+        return;
+    }
+
+    size_t total_cap = arena->total_cap;
+    while (arena->block != NULL)
+    {
+        arena_block_t* prev = arena->block->prev;
+        free(arena->block);
+        arena->block = prev;
+    }
+    arena->total_cap = 0;
+    arena_push_block(arena, total_cap);
+}
+
+// `free()`s everything the arena holds.
+void arena_destroy(arena_t* arena)
+{
+    while (arena->block != NULL)
+    {
+        arena_block_t* prev = arena->block->prev;
+        free(arena->block);
+        arena->block = prev;
+    }
+    arena->total_cap = 0;
+}
+
+// Works out what the `$` at the start of some text expands to, if anything:
+// "$$" (the shell's PID), "$?" (the last foreground command's status), "$!"
+// (the PID of the last background job), or a variable as "$NAME" or
+// "${NAME}". A variable that isn't set expands to nothing.
+//
+// ## Parameters:
+// * `text` - The text, starting at the `$`.
+// * `env` - What everything expands to.
+// * `num_buf` - Somewhere to format "$?" or "$!" into.
+// * `value` - Set to point at what it expands to.
+// * `value_len` - Set to the length of `value`.
+//
+// **Returns** how many characters of `text` the expansion takes up, or 0 if
+// the `$` is just a `$`.
+size_t lex_dollar(const char*      text,
+                  const lex_env_t* env,
+                  char*            num_buf,
+                  const char**     value,
+                  size_t*          value_len)
+{
+    switch (text[1])
+    {
+        case '$':
+            *value = env->pid_str;
+            *value_len = env->pid_len;
+            return 2;
+        case '?':
+            *value = num_buf;
+            *value_len = format_int(num_buf, env->status);
+            return 2;
+        case '!':
+            *value = num_buf;
+            *value_len = env->last_bg > 0
+                ? format_int(num_buf, env->last_bg)
+                : 0;
+            return 2;
+        default:
+            break;
+    }
+
+    bool braced = text[1] == '{';
+    const char* name = text + (braced ? 2 : 1);
+    size_t name_len = var_name_len(name);
+    if (name_len == 0 || (braced && name[name_len] != '}'))
+    {
+        return 0;
+    }
+
+    *value = var_get(env->vars, name, name_len);
+    *value_len = *value != NULL ? strlen(*value) : 0;
+
+    return name_len + (braced ? 3 : 1);
+}
+
+// Copies one word into the arena, expanding as it goes, up to the next
+// space, newline, or the end of the text.
+//
+// ## Parameters:
+// * `arena` - Where the word goes.
+// * `pos` - Where the word starts; moved past it.
+// * `left` - How much text there is from `*pos` on, which is as long as
+//            the word can get without any expansions making it longer.
+// * `env` - What `$`s expand to, or `NULL` to leave them as they are.
+//
+// **Returns** the word, or `NULL` if out of memory.
+char* lex_word(arena_t*         arena,
+               const char**     pos,
+               size_t           left,
+               const lex_env_t* env)
+{
+    size_t cap = left + 1;
+    char* text = arena_reserve(arena, cap);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    // Copy over runs of ordinary characters in bulk, stopping only for
+    // separators and possible expansions
+    const char* p = *pos;
+    const char* end = p + left;
+    char* out = text;
+    char num_buf[INT_STR_SIZE];
+    while (1)
+    {
+        size_t run = strcspn(p, env != NULL ? " \n$" : " \n");
+        memcpy(out, p, run);
+        out += run;
+        p += run;
+        if (*p != '$')
+        {
+            break;
+        }
+
+        const char* value;
+        size_t value_len;
+        size_t taken = lex_dollar(p, env, num_buf, &value, &value_len);
+        if (taken == 0)
+        {
+            *out++ = *p++;
+            continue;
+        }
+        p += taken;
+
+        // Whatever's left of the line still has to fit after the value
+        size_t used = (size_t)(out - text);
+        size_t needed = used + value_len + (size_t)(end - p) + 1;
+        if (needed > cap)
+        {
+            cap = 2 * needed;
+            char* moved = arena_reserve(arena, cap);
+            if (moved == NULL)
+            {
+                return NULL;
+            }
+            if (moved != text) // It didn't fit in the block, so the word so
+            {                  // far is abandoned in the old one
+                memcpy(moved, text, used);
+                text = moved;
+                out = text + used;
+            }
+        }
+        memcpy(out, value, value_len);
+        out += value_len;
+    }
+    *out++ = '\0';
+    arena_commit(arena, (size_t)(out - text));
+    *pos = p;
+
+    return text;
+}
+
+// Expands every `$` in a word, as `lex_line()` would have.
+//
+// **Returns** the expanded word, in the arena, or `NULL` if out of memory.
+char* lex_expand(arena_t* arena, const char* word, const lex_env_t* env)
+{
+    return lex_word(arena, &word, strlen(word), env);
+}
+
+// Splits a command line into tokens in one pass, expanding every `$` (see
+// `lex_dollar()`) as it goes. The token array and every token's text are
+// written straight into the arena.
+//
+// Tokens are separated by spaces and newlines. "<", ">", "&", and "|" are
+// only operators when they stand alone as a token, and never come out of an
+// expansion; nor does an expansion ever split a word in two, or make one
+// disappear.
+//
+// ## Parameters:
+// * `arena` - Where the tokens go.
+// * `line` - The command line.
+// * `env` - What `$`s expand to, or `NULL` to leave them as they are.
+// * `tokens` - Set to point at the array of tokens.
+//
+// **Returns** how many tokens there are, or -1 if out of memory.
+ssize_t lex_line(arena_t*         arena,
+                 const char*      line,
+                 const lex_env_t* env,
+                 token_t**        tokens)
+{
+    size_t token_cap = 16;
+    size_t token_count = 0;
+    token_t* toks = arena_alloc(arena, token_cap * sizeof(token_t));
+    if (toks == NULL)
+    {
+        return -1;
+    }
+
+    const char* pos = line;
+    const char* end = line + strlen(line);
+    while (1)
+    {
+        while (*pos == ' ' || *pos == '\n')
+        {
+            pos++;
+        }
+        if (*pos == '\0')
+        {
+            break;
+        }
+
+        const char* start = pos;
+        char* text = lex_word(arena, &pos, (size_t)(end - pos), env);
+        if (text == NULL)
+        {
+            return -1;
+        }
+
+        // Make room for another token, abandoning the old array in the arena
+        if (token_count == token_cap)
+        {
+            token_t* grown = arena_alloc(
+                arena,
+                2 * token_cap * sizeof(token_t)
+            );
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            memcpy(grown, toks, token_cap * sizeof(token_t));
+            toks = grown;
+            token_cap *= 2;
+        }
+
+        token_kind_t kind = TOKEN_WORD;
+        if (pos - start == 1)
+        {
+            switch (*start)
+            {
+                case '<': kind = TOKEN_INPUT;      break;
+                case '>': kind = TOKEN_OUTPUT;     break;
+                case '&': kind = TOKEN_BACKGROUND; break;
+                case '|': kind = TOKEN_PIPE;       break;
+                default:                           break;
+            }
+        }
+        toks[token_count].kind = kind;
+        toks[token_count].text = text;
+        token_count++;
+    }
+
+    *tokens = toks;
+
+    return (ssize_t)token_count;
+}
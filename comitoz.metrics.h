@@ -0,0 +1,648 @@
+#pragma once
+
+#include "comitoz.deadline.h"
+#include "comitoz.output.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>       // errno, ENOMEM, EINVAL
+#include <fcntl.h>       // open, O_*
+#include <stdint.h>      // uint64_t, UINT64_MAX
+#include <stdio.h>       // rename, snprintf
+#include <stdlib.h>      // malloc, free
+#include <string.h>      // memset, memcpy, strlen, strrchr
+#include <sys/timerfd.h> // timerfd_create, timerfd_settime, TFD_*
+#include <time.h>        // time_t, time, struct itimerspec, CLOCK_MONOTONIC
+#include <unistd.h>      // read, close, getpid, unlink
+
+
+/*** Constants ***/
+
+// Buckets in a histogram. Bucket `i` is for up to `1us * 4^i`, so the last
+// bound is about four and a half minutes, and past it is one more bucket
+// for everything longer.
+#define METRICS_BUCKETS 16
+
+// Upper bound of the first bucket, in nanoseconds.
+#define METRICS_FIRST_BOUND_NS 1000u
+
+// How often the metrics are written out, when `-M` doesn't say.
+#define METRICS_DEFAULT_INTERVAL_NS 15000000000u
+
+// Most output formatted in one go.
+#define METRICS_LINE_MAX 512
+
+
+/*** `typedef`s ***/
+
+// How a pipeline stage was launched.
+typedef enum
+{
+    METRICS_SPAWN_FORK,   // `fork()` and `exec()`
+    METRICS_SPAWN_SPAWN,  // `posix_spawnp()`
+    METRICS_SPAWN_HELPER, // Asked of the spawn helper
+    METRICS_SPAWN_RELAY,  // A relay, with no command of its own
+    METRICS_SPAWN_TYPES   // How many there are
+} metrics_spawn_t;
+
+// How long something took, counted into buckets of fixed bounds, so that
+// observing one more takes no memory.
+typedef struct
+{
+    uint64_t buckets[METRICS_BUCKETS]; // How many fell in each (not added
+                                       // up, unlike Prometheus's)
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} metrics_histogram_t;
+
+// Everything the shell keeps count of. It's all fixed-size, so updating it
+// never allocates.
+typedef struct
+{
+    uint64_t            commands;    // Commands parsed (or read from an
+                                     // image), not counting blank lines
+    metrics_histogram_t spawns[METRICS_SPAWN_TYPES]; // Launch to PID back,
+                                                     // per stage
+    uint64_t            spawn_failures[METRICS_SPAWN_TYPES];
+    metrics_histogram_t fg_wait;     // Waiting on foreground pipelines
+    metrics_histogram_t reap_lag;    // From a background job exiting to it
+                                     // being reported
+    int                 jobs_live;   // Background jobs in the job table
+    int                 jobs_peak;   // The most there have been at once
+    time_t              started_at;  // When the shell started
+} metrics_t;
+
+// Where the metrics are written out, and how often. Each write goes to a
+// temporary file next to `path`, which is then renamed over it, so that
+// whoever reads it only ever sees a whole file.
+typedef struct
+{
+    char*    path;        // Where they go, or `NULL` if they don't
+    char*    temp_path;   // `path` with ".PID.tmp" on the end, which
+                          // Prometheus's textfile collector ignores
+    uint64_t interval_ns; // How often
+    uint64_t next_ns;     // `monotonic_ns()` when they're next due
+    int      timer_fd;    // Readable once they're due, or -1
+    bool     failing;     // Did the last write fail? (So that it's only
+                          // complained about once)
+} metrics_export_t;
+
+
+/*** Implementations ***/
+
+// Sets up metrics with nothing counted yet.
+void metrics_init(metrics_t* metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->started_at = time(NULL);
+}
+
+// **Returns** the upper bound of a histogram bucket, in nanoseconds, or
+// `UINT64_MAX` for the last one.
+uint64_t metrics_bound_ns(int bucket)
+{
+    return bucket < METRICS_BUCKETS - 1
+        ? (uint64_t)METRICS_FIRST_BOUND_NS << (2 * bucket)
+        : UINT64_MAX;
+}
+
+// Counts one more observation into a histogram.
+//
+// ## Parameters:
+// * `histogram` - The histogram.
+// * `ns` - How long it took.
+void metrics_observe(metrics_histogram_t* histogram, uint64_t ns)
+{
+    int bucket = 0;
+    while (ns > metrics_bound_ns(bucket))
+    {
+        bucket++;
+    }
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_ns += ns;
+    if (ns > histogram->max_ns)
+    {
+        histogram->max_ns = ns;
+    }
+}
+
+// Notes how many background jobs there are now.
+void metrics_set_jobs(metrics_t* metrics, int live)
+{
+    metrics->jobs_live = live;
+    if (live > metrics->jobs_peak)
+    {
+        metrics->jobs_peak = live;
+    }
+}
+
+// Estimates a quantile of a histogram: the bound of the bucket it falls in,
+// or the biggest observation if that's any less.
+//
+// ## Parameters:
+// * `histogram` - The histogram; not empty.
+// * `q` - Which quantile, from 0 to 1.
+//
+// **Returns** the estimate, in nanoseconds.
+uint64_t metrics_quantile(const metrics_histogram_t* histogram, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double)histogram->count + 0.5);
+    rank = rank > 0 ? rank : 1;
+
+    uint64_t seen = 0;
+    int bucket;
+    for (bucket = 0; bucket < METRICS_BUCKETS - 1; ++bucket)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    uint64_t bound = metrics_bound_ns(bucket);
+
+    return bound < histogram->max_ns ? bound : histogram->max_ns;
+}
+
+// Writes out a length of time for people, e.g. "850ns", "12.3us", "1.50s".
+//
+// ## Parameters:
+// * `buf` - Where to write it.
+// * `size` - How big `buf` is.
+// * `ns` - The length of time.
+//
+// **Returns** how long it came out.
+int metrics_format_ns(char* buf, size_t size, uint64_t ns)
+{
+    int len;
+    if (ns < 1000u)
+    {
+        len = snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    }
+    else if (ns < 1000000u)
+    {
+        len = snprintf(buf, size, "%.1fus", (double)ns / 1e3);
+    }
+    else if (ns < 1000000000u)
+    {
+        len = snprintf(buf, size, "%.1fms", (double)ns / 1e6);
+    }
+    else
+    {
+        len = snprintf(buf, size, "%.2fs", (double)ns / 1e9);
+    }
+
+    return len < (int)size ? len : (int)size - 1;
+}
+
+// Writes out one line of `metrics_print()`'s summary of a histogram.
+void metrics_print_histogram(output_t*                  out,
+                             const char*                name,
+                             const metrics_histogram_t* histogram)
+{
+    char line[METRICS_LINE_MAX];
+    int len = snprintf(
+        line,
+        sizeof(line),
+        "%-15s %llu",
+        name,
+        (unsigned long long)histogram->count
+    );
+    output_append(out, line, (size_t)len);
+
+    if (histogram->count > 0)
+    {
+        const char* labels[4] = {"mean", "p50", "p99", "max"};
+        uint64_t values[4] = {
+            histogram->sum_ns / histogram->count,
+            metrics_quantile(histogram, 0.5),
+            metrics_quantile(histogram, 0.99),
+            histogram->max_ns
+        };
+        int i;
+        for (i = 0; i < 4; ++i)
+        {
+            char value[32];
+            metrics_format_ns(value, sizeof(value), values[i]);
+            len = snprintf(line, sizeof(line), "  %s %s", labels[i], value);
+            output_append(out, line, (size_t)len);
+        }
+    }
+    output_append(out, "\n", 1);
+}
+
+// Writes out the metrics for people, one line each. Quantiles are only as
+// fine as the buckets they fall in.
+//
+// ## Parameters:
+// * `metrics` - What to write out.
+// * `out` - Where to write it.
+void metrics_print(const metrics_t* metrics, output_t* out)
+{
+    static const char* const spawn_names[METRICS_SPAWN_TYPES] = {
+        "spawn fork", "spawn spawn", "spawn helper", "spawn relay"
+    };
+
+    char line[METRICS_LINE_MAX];
+    int len = snprintf(
+        line,
+        sizeof(line),
+        "commands        %llu\n"
+        "background jobs %d live, %d peak\n",
+        (unsigned long long)metrics->commands,
+        metrics->jobs_live,
+        metrics->jobs_peak
+    );
+    output_append(out, line, (size_t)len);
+
+    int type;
+    for (type = 0; type < METRICS_SPAWN_TYPES; ++type)
+    {
+        const metrics_histogram_t* spawns = &metrics->spawns[type];
+        if (spawns->count > 0 || metrics->spawn_failures[type] > 0)
+        {
+            metrics_print_histogram(out, spawn_names[type], spawns);
+        }
+    }
+
+    uint64_t failures = 0;
+    for (type = 0; type < METRICS_SPAWN_TYPES; ++type)
+    {
+        failures += metrics->spawn_failures[type];
+    }
+    len = snprintf(
+        line,
+        sizeof(line),
+        "fork failures   %llu\n",
+        (unsigned long long)failures
+    );
+    output_append(out, line, (size_t)len);
+
+    metrics_print_histogram(out, "foreground wait", &metrics->fg_wait);
+    metrics_print_histogram(out, "reap lag", &metrics->reap_lag);
+}
+
+// Adds to what's been gathered, unless something already failed to go out.
+//
+// **Returns** `err` if it isn't zero, or else what `output_append()` does.
+int metrics_append(output_t* out, int err, const char* str, size_t size)
+{
+    return err != 0 ? err : output_append(out, str, size);
+}
+
+// Writes out one histogram in Prometheus's text format, without its `HELP`
+// and `TYPE` lines.
+//
+// ## Parameters:
+// * `out` - Where to write it.
+// * `name` - The metric's name, without "_bucket" and the like.
+// * `labels` - Any labels besides `le`, e.g. "type=\"fork\",", or "".
+// * `histogram` - The histogram.
+//
+// **Returns** zero on success, or an `errno` value.
+int metrics_write_histogram(output_t*                  out,
+                            const char*                name,
+                            const char*                labels,
+                            const metrics_histogram_t* histogram)
+{
+    int err = 0;
+    char line[METRICS_LINE_MAX];
+    uint64_t below = 0;
+    int bucket;
+    for (bucket = 0; bucket < METRICS_BUCKETS; ++bucket)
+    {
+        char bound[32] = "+Inf";
+        if (bucket < METRICS_BUCKETS - 1)
+        {
+            snprintf(
+                bound,
+                sizeof(bound),
+                "%.9g",
+                (double)metrics_bound_ns(bucket) / 1e9
+            );
+        }
+        below += histogram->buckets[bucket];
+        int len = snprintf(
+            line,
+            sizeof(line),
+            "%s_bucket{%sle=\"%s\"} %llu\n",
+            name,
+            labels,
+            bound,
+            (unsigned long long)below
+        );
+        err = metrics_append(out, err, line, (size_t)len);
+    }
+
+    // Without the trailing comma, the other labels make a set of their own
+    char set[METRICS_LINE_MAX] = "";
+    size_t labels_len = strlen(labels);
+    if (labels_len > 0)
+    {
+        snprintf(set, sizeof(set), "{%.*s}", (int)labels_len - 1, labels);
+    }
+    int len = snprintf(
+        line,
+        sizeof(line),
+        "%s_sum%s %.9f\n%s_count%s %llu\n",
+        name,
+        set,
+        (double)histogram->sum_ns / 1e9,
+        name,
+        set,
+        (unsigned long long)histogram->count
+    );
+
+    return metrics_append(out, err, line, (size_t)len);
+}
+
+// Writes out the metrics in Prometheus's text exposition format.
+//
+// ## Parameters:
+// * `metrics` - What to write out.
+// * `out` - Where to write it.
+//
+// **Returns** zero on success, or an `errno` value.
+int metrics_write(const metrics_t* metrics, output_t* out)
+{
+    static const char* const spawn_labels[METRICS_SPAWN_TYPES] = {
+        "type=\"fork\",",
+        "type=\"spawn\",",
+        "type=\"helper\",",
+        "type=\"relay\","
+    };
+    static const char spawn_help[] =
+        "# HELP smallsh_spawn_seconds Time to launch one pipeline stage.\n"
+        "# TYPE smallsh_spawn_seconds histogram\n";
+    static const char failures_help[] =
+        "# HELP smallsh_fork_failures_total Pipeline stages that couldn't "
+        "be launched.\n"
+        "# TYPE smallsh_fork_failures_total counter\n";
+    static const char wait_help[] =
+        "# HELP smallsh_foreground_wait_seconds Time spent waiting on "
+        "foreground pipelines.\n"
+        "# TYPE smallsh_foreground_wait_seconds histogram\n";
+    static const char lag_help[] =
+        "# HELP smallsh_reap_lag_seconds Time from a background job exiting "
+        "to it being reported.\n"
+        "# TYPE smallsh_reap_lag_seconds histogram\n";
+
+    char line[METRICS_LINE_MAX];
+    int len = snprintf(
+        line,
+        sizeof(line),
+        "# HELP smallsh_start_time_seconds When the shell started.\n"
+        "# TYPE smallsh_start_time_seconds gauge\n"
+        "smallsh_start_time_seconds %lld\n"
+        "# HELP smallsh_commands_total Commands parsed.\n"
+        "# TYPE smallsh_commands_total counter\n"
+        "smallsh_commands_total %llu\n",
+        (long long)metrics->started_at,
+        (unsigned long long)metrics->commands
+    );
+    int err = output_append(out, line, (size_t)len);
+
+    len = snprintf(
+        line,
+        sizeof(line),
+        "# HELP smallsh_background_jobs Background jobs in the job table.\n"
+        "# TYPE smallsh_background_jobs gauge\n"
+        "smallsh_background_jobs %d\n"
+        "# HELP smallsh_background_jobs_peak Most background jobs at once.\n"
+        "# TYPE smallsh_background_jobs_peak gauge\n"
+        "smallsh_background_jobs_peak %d\n",
+        metrics->jobs_live,
+        metrics->jobs_peak
+    );
+    err = metrics_append(out, err, line, (size_t)len);
+
+    err = metrics_append(out, err, spawn_help, sizeof(spawn_help) - 1);
+    int type;
+    for (type = 0; type < METRICS_SPAWN_TYPES && err == 0; ++type)
+    {
+        err = metrics_write_histogram(
+            out,
+            "smallsh_spawn_seconds",
+            spawn_labels[type],
+            &metrics->spawns[type]
+        );
+    }
+
+    err = metrics_append(out, err, failures_help, sizeof(failures_help) - 1);
+    for (type = 0; type < METRICS_SPAWN_TYPES; ++type)
+    {
+        len = snprintf(
+            line,
+            sizeof(line),
+            "smallsh_fork_failures_total{%.*s} %llu\n",
+            (int)strlen(spawn_labels[type]) - 1,
+            spawn_labels[type],
+            (unsigned long long)metrics->spawn_failures[type]
+        );
+        err = metrics_append(out, err, line, (size_t)len);
+    }
+
+    err = metrics_append(out, err, wait_help, sizeof(wait_help) - 1);
+    if (err == 0)
+    {
+        err = metrics_write_histogram(
+            out,
+            "smallsh_foreground_wait_seconds",
+            "",
+            &metrics->fg_wait
+        );
+    }
+
+    err = metrics_append(out, err, lag_help, sizeof(lag_help) - 1);
+    if (err == 0)
+    {
+        err = metrics_write_histogram(
+            out,
+            "smallsh_reap_lag_seconds",
+            "",
+            &metrics->reap_lag
+        );
+    }
+
+    return err;
+}
+
+// Sets up an export that doesn't go anywhere.
+void metrics_export_init(metrics_export_t* export)
+{
+    export->path = NULL;
+    export->temp_path = NULL;
+    export->interval_ns = METRICS_DEFAULT_INTERVAL_NS;
+    export->next_ns = 0;
+    export->timer_fd = -1;
+    export->failing = false;
+}
+
+// Parses an export given as "path[,interval]", e.g. "/run/sh.prom" or
+// "/run/sh.prom,1m". The interval is a duration, as taken by `timeout`,
+// and defaults to `METRICS_DEFAULT_INTERVAL_NS`.
+//
+// ## Parameters:
+// * `spec` - The export.
+// * `path` - Set to the path, `malloc()`ed.
+// * `interval_ns` - Set to the interval.
+//
+// **Returns** whether `spec` made sense.
+bool metrics_export_parse(const char* spec,
+                          char**      path,
+                          uint64_t*   interval_ns)
+{
+    const char* comma = strrchr(spec, ',');
+    size_t path_len = comma != NULL ? (size_t)(comma - spec) : strlen(spec);
+    *interval_ns = METRICS_DEFAULT_INTERVAL_NS;
+    if (comma != NULL
+        && (!deadline_parse_duration(comma + 1, interval_ns)
+            || *interval_ns < 1000000u))
+    {
+        return false;
+    }
+    if (path_len == 0)
+    {
+        return false;
+    }
+
+    *path = malloc(path_len + 1);
+    if (*path == NULL)
+    {
+        return false;
+    }
+    memcpy(*path, spec, path_len);
+    (*path)[path_len] = '\0';
+
+    return true;
+}
+
+// Puts the export's timer on when it's next due.
+//
+// ## Parameters:
+// * `export` - The export.
+// * `at_ns` - When, by `monotonic_ns()`.
+void metrics_export_arm(metrics_export_t* export, uint64_t at_ns)
+{
+    export->next_ns = at_ns;
+
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    spec.it_value.tv_sec = (time_t)(export->next_ns / 1000000000u);
+    spec.it_value.tv_nsec = (long)(export->next_ns % 1000000000u);
+    timerfd_settime(export->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Starts exporting. Nothing is written yet, but the first write is due
+// straight away.
+//
+// ## Parameters:
+// * `export` - The export, set up with `metrics_export_init()`.
+// * `path` - Where the metrics go; `malloc()`ed, and taken over by the
+//            export.
+// * `interval_ns` - How often.
+//
+// **Returns** zero on success, or an `errno` value.
+int metrics_export_open(metrics_export_t* export,
+                        char*             path,
+                        uint64_t          interval_ns)
+{
+    export->path = path;
+    export->interval_ns = interval_ns;
+
+    char suffix[INT_STR_SIZE + 6] = ".";
+    size_t suffix_len = 1 + format_int(suffix + 1, getpid());
+    memcpy(suffix + suffix_len, ".tmp", 5);
+    suffix_len += 4;
+    size_t path_len = strlen(path);
+    export->temp_path = malloc(path_len + suffix_len + 1);
+    if (export->temp_path == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(export->temp_path, path, path_len);
+    memcpy(export->temp_path + path_len, suffix, suffix_len + 1);
+
+    export->timer_fd = timerfd_create(
+        CLOCK_MONOTONIC,
+        TFD_NONBLOCK | TFD_CLOEXEC
+    );
+    if (export->timer_fd == -1)
+    {
+        return errno;
+    }
+    metrics_export_arm(export, monotonic_ns());
+
+    return 0;
+}
+
+// **Returns** whether an export is due to be written.
+bool metrics_export_due(const metrics_export_t* export)
+{
+    return export->timer_fd != -1 && monotonic_ns() >= export->next_ns;
+}
+
+// Writes the metrics out to a temporary file, and then renames it over the
+// export's path, and puts the timer on the next one. A write that fails is
+// simply tried again next time.
+//
+// ## Parameters:
+// * `export` - The export, opened with `metrics_export_open()`.
+// * `metrics` - What to write out.
+//
+// **Returns** zero on success, or an `errno` value.
+int metrics_export_write(metrics_export_t* export, const metrics_t* metrics)
+{
+    // Whether or not the timer went off, it's read, so that it's only
+    // readable again when it next goes off
+    uint64_t expirations;
+    ssize_t ignored = read(export->timer_fd, &expirations, sizeof(expirations));
+    (void)ignored;
+    metrics_export_arm(export, monotonic_ns() + export->interval_ns);
+
+    output_t out;
+    out.fd = open(
+        export->temp_path,
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+        0644
+    );
+    if (out.fd == -1)
+    {
+        return errno;
+    }
+    out.len = 0;
+
+    int err = metrics_write(metrics, &out);
+    int flush_err = output_flush(&out);
+    err = err != 0 ? err : flush_err;
+    if (close(out.fd) != 0 && err == 0)
+    {
+        err = errno;
+    }
+    if (err == 0 && rename(export->temp_path, export->path) != 0)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        unlink(export->temp_path);
+    }
+
+    return err;
+}
+
+// Stops exporting, taking the last file written away with it, so that a
+// shell that's gone isn't still reported on.
+void metrics_export_close(metrics_export_t* export)
+{
+    if (export->timer_fd != -1)
+    {
+        close(export->timer_fd);
+        unlink(export->path);
+    }
+    free(export->path);
+    free(export->temp_path);
+    metrics_export_init(export);
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>     // errno, EINTR
+#include <stdint.h>    // uintptr_t
+#include <string.h>    // memcpy, strlen
+#include <sys/types.h> // ssize_t
+#include <sys/uio.h>   // writev, struct iovec
+
+
+/*** Constants ***/
+
+// How much output is gathered before it has to go out, no matter what.
+#define OUTPUT_BUFFER_SIZE 4096
+
+// Room for any `long long` formatted in decimal, sign and `'\0'` included.
+#define INT_STR_SIZE 21
+
+
+/*** `typedef`s ***/
+
+// Output headed for one descriptor, gathered up so that a message made of
+// several pieces (or several messages, e.g. every background job reported
+// before a prompt) goes out in one system call.
+typedef struct
+{
+    int    fd;   // Where it all goes
+    size_t len;  // How much of `data` is waiting to go out
+    char   data[OUTPUT_BUFFER_SIZE];
+} output_t;
+
+
+/*** Implementations ***/
+
+// Formats an integer in decimal, without allocating or touching the locale.
+// Async-signal-safe.
+//
+// ## Parameters:
+// * `buf` - Where the digits go, followed by a `'\0'`; `INT_STR_SIZE` bytes
+//           is always enough.
+// * `value` - The integer.
+//
+// **Returns** the length of the result, not counting the `'\0'`.
+size_t format_int(char* buf, long long value)
+{
+    // Work with the magnitude as unsigned, so that the most negative value
+    // doesn't overflow
+    unsigned long long magnitude = value < 0
+        ? 0ULL - (unsigned long long)value
+        : (unsigned long long)value;
+
+    char digits[INT_STR_SIZE];
+    char* p = digits + sizeof(digits);
+    do
+    {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+    {
+        *--p = '-';
+    }
+
+    size_t len = (size_t)(digits + sizeof(digits) - p);
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+
+    return len;
+}
+
+// Writes out every piece of an `iovec` array with as few `writev()`s as
+// possible (one, unless the descriptor takes a partial write). Async-signal-
+// safe, and leaves `errno` as it found it.
+//
+// ## Parameters:
+// * `fd` - Where to write.
+// * `iov` - The pieces. Modified as the writing goes.
+// * `count` - How many pieces there are.
+//
+// **Returns** zero on success, or an `errno` value.
+int write_iov(int fd, struct iovec* iov, int count)
+{
+    int saved_errno = errno;
+    int err = 0;
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+
+        // Skip over whatever made it out
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    errno = saved_errno;
+
+    return err;
+}
+
+// Writes a string straight out, skipping any `output_t` buffering. Async-
+// signal-safe, so it's what signal handlers print with.
+//
+// **Returns** zero on success, or an `errno` value.
+int write_direct(int fd, const char* str, size_t size)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)(uintptr_t)str;
+    iov.iov_len = size;
+
+    return write_iov(fd, &iov, 1);
+}
+
+// Sends whatever has been gathered.
+//
+// **Returns** zero on success, or an `errno` value. Either way, the buffer
+// is empty afterwards.
+int output_flush(output_t* out)
+{
+    if (out->len == 0)
+    {
+        return 0;
+    }
+
+    struct iovec iov;
+    iov.iov_base = out->data;
+    iov.iov_len = out->len;
+    out->len = 0;
+
+    return write_iov(out->fd, &iov, 1);
+}
+
+// Adds to what's been gathered. Something too big to fit goes out right
+// away, in the same `writev()` as everything before it.
+//
+// **Returns** zero on success, or an `errno` value.
+int output_append(output_t* out, const char* str, size_t size)
+{
+    if (size <= OUTPUT_BUFFER_SIZE - out->len)
+    {
+        memcpy(out->data + out->len, str, size);
+        out->len += size;
+
+        return 0;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = out->data;
+    iov[0].iov_len = out->len;
+    iov[1].iov_base = (void*)(uintptr_t)str;
+    iov[1].iov_len = size;
+    out->len = 0;
+
+    return write_iov(out->fd, iov, 2);
+}
+
+// Adds a `'\0'`-terminated string to what's been gathered.
+//
+// **Returns** zero on success, or an `errno` value.
+int output_str(output_t* out, const char* str)
+{
+    return output_append(out, str, strlen(str));
+}
+
+// Adds an integer, in decimal, to what's been gathered.
+//
+// **Returns** zero on success, or an `errno` value.
+int output_int(output_t* out, long long value)
+{
+    char num_str[INT_STR_SIZE];
+    size_t len = format_int(num_str, value);
+
+    return output_append(out, num_str, len);
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <stdint.h>    // uint64_t
+#include <stdlib.h>    // calloc, malloc, free
+#include <string.h>    // memcpy, strchr, strcmp, strdup, strlen
+#include <sys/stat.h>  // stat, S_ISREG
+#include <unistd.h>    // access, X_OK
+
+
+/*** Constants ***/
+
+// Starting number of slots in a PATH cache. Always a power of two.
+#define PATH_CACHE_MIN_SLOTS 32
+
+// What `execvp()` searches when there is no PATH at all.
+#define PATH_CACHE_DEFAULT_PATH "/bin:/usr/bin"
+
+
+/*** `typedef`s ***/
+
+// A command name and the absolute path it resolved to. Allocated in one
+// piece, with both strings following the struct.
+typedef struct
+{
+    char*    name; // What the user typed
+    char*    path; // Where it was found
+    uint64_t hits; // How many launches skipped the PATH scan thanks to it
+} path_entry_t;
+
+// Remembers where in the PATH each command was found, so that launching it
+// again can go straight to `execve()` instead of `execvp()` trying every
+// directory in turn.
+//
+// The whole thing is thrown away whenever the PATH changes.
+typedef struct
+{
+    path_entry_t** slots;      // Open-addressed by name, linear probing
+    size_t         slot_count; // Size of `slots`; a power of two
+    size_t         count;      // How many slots are filled
+    char*          path_var;   // The PATH the entries were resolved against
+    uint64_t       hits;       // Lookups answered from the cache
+    uint64_t       misses;     // Lookups that had to scan the PATH
+} path_cache_t;
+
+
+/*** Implementations ***/
+
+// Sets up an empty PATH cache.
+//
+// **Returns** zero on success, or an `errno` value.
+int path_cache_init(path_cache_t* cache)
+{
+    cache->slot_count = PATH_CACHE_MIN_SLOTS;
+    cache->slots = calloc(cache->slot_count, sizeof(path_entry_t*));
+    cache->count = 0;
+    cache->path_var = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache->slots != NULL ? 0 : ENOMEM;
+}
+
+// FNV-1a, which is plenty for short command names.
+size_t path_cache_hash(const char* name)
+{
+    uint64_t h = 14695981039346656037u;
+    for (; *name != '\0'; ++name)
+    {
+        h ^= (unsigned char)*name;
+        h *= 1099511628211u;
+    }
+
+    return (size_t)h;
+}
+
+// Finds the slot that holds a name, or the empty slot where it would go.
+path_entry_t** path_cache_slot(path_cache_t* cache, const char* name)
+{
+    size_t slot = path_cache_hash(name) & (cache->slot_count - 1);
+    while (cache->slots[slot] != NULL
+           && strcmp(cache->slots[slot]->name, name) != 0)
+    {
+        slot = (slot + 1) & (cache->slot_count - 1);
+    }
+
+    return &cache->slots[slot];
+}
+
+// Forgets every entry (but not the hit and miss counts).
+void path_cache_clear(path_cache_t* cache)
+{
+    size_t i;
+    for (i = 0; i < cache->slot_count; ++i)
+    {
+        free(cache->slots[i]);
+        cache->slots[i] = NULL;
+    }
+    cache->count = 0;
+}
+
+// Forgets one entry, e.g. because `execve()`ing its path failed.
+void path_cache_forget(path_cache_t* cache, const char* name)
+{
+    path_entry_t** slot = path_cache_slot(cache, name);
+    if (*slot == NULL)
+    {
+        return;
+    }
+    free(*slot);
+    *slot = NULL;
+    cache->count--;
+
+    // Re-seat everything in the probe run after the hole, so that lookups
+    // don't stop short at it
+    size_t i = (size_t)(slot - cache->slots);
+    for (i = (i + 1) & (cache->slot_count - 1);
+         cache->slots[i] != NULL;
+         i = (i + 1) & (cache->slot_count - 1))
+    {
+        path_entry_t* entry = cache->slots[i];
+        cache->slots[i] = NULL;
+        *path_cache_slot(cache, entry->name) = entry;
+    }
+}
+
+// Scans a PATH for an executable regular file with the given name, the way
+// `execvp()` would.
+//
+// ## Parameters:
+// * `path_var` - The PATH to scan.
+// * `name` - The command name. Must not contain a '/'.
+//
+// **Returns** a `malloc()`ed absolute path, or `NULL` if there is no such
+// command (or it was only found via a relative PATH entry, which is no use
+// to remember since it changes with the working directory).
+char* path_cache_resolve(const char* path_var, const char* name)
+{
+    size_t name_len = strlen(name);
+    const char* dir = path_var;
+    while (1)
+    {
+        const char* dir_end = strchr(dir, ':');
+        size_t dir_len = dir_end != NULL
+            ? (size_t)(dir_end - dir)
+            : strlen(dir);
+
+        // An empty entry means "."
+        const char* prefix = dir_len > 0 ? dir : ".";
+        size_t prefix_len = dir_len > 0 ? dir_len : 1;
+
+        char* candidate = malloc(prefix_len + 1 + name_len + 1);
+        memcpy(candidate, prefix, prefix_len);
+        candidate[prefix_len] = '/';
+        memcpy(candidate + prefix_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode)
+            && access(candidate, X_OK) == 0)
+        {
+            if (prefix[0] == '/')
+            {
+                return candidate;
+            }
+
+            // Found via a relative entry, so `execvp()` will have to sort
+            // this one out every time
+            free(candidate);
+            return NULL;
+        }
+        free(candidate);
+
+        if (dir_end == NULL)
+        {
+            return NULL;
+        }
+        dir = dir_end + 1;
+    }
+}
+
+// Looks up where a command lives, scanning the PATH and remembering the
+// answer if it isn't already known. The cache starts over if the PATH has
+// changed since the last lookup.
+//
+// ## Parameters:
+// * `cache` - The cache to look in.
+// * `name` - The command name.
+// * `path_var` - The PATH, or `NULL` if there isn't one.
+//
+// **Returns** the absolute path to `execve()`, which stays valid until the
+// next call that modifies the cache, or `NULL` if the command has to be left
+// to `execvp()` (it has a '/' in it, it isn't in the PATH, or it was found
+// via a relative PATH entry).
+const char* path_cache_lookup(path_cache_t* cache,
+                              const char*   name,
+                              const char*   path_var)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return NULL;
+    }
+
+    if (path_var == NULL)
+    {
+        path_var = PATH_CACHE_DEFAULT_PATH;
+    }
+    if (cache->path_var == NULL || strcmp(cache->path_var, path_var) != 0)
+    {
+        path_cache_clear(cache);
+        free(cache->path_var);
+        cache->path_var = strdup(path_var);
+    }
+
+    path_entry_t** slot = path_cache_slot(cache, name);
+    if (*slot != NULL)
+    {
+        (*slot)->hits++;
+        cache->hits++;
+
+        return (*slot)->path;
+    }
+
+    cache->misses++;
+    char* path = path_cache_resolve(path_var, name);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    size_t name_len = strlen(name) + 1;
+    size_t path_len = strlen(path) + 1;
+    path_entry_t* entry = malloc(sizeof(path_entry_t) + name_len + path_len);
+    entry->name = (char*)(entry + 1);
+    entry->path = entry->name + name_len;
+    memcpy(entry->name, name, name_len);
+    memcpy(entry->path, path, path_len);
+    entry->hits = 0;
+    free(path);
+
+    // Keep the load under 1/2
+    if ((cache->count + 1) * 2 > cache->slot_count)
+    {
+        path_entry_t** old_slots = cache->slots;
+        size_t old_count = cache->slot_count;
+        cache->slot_count *= 2;
+        cache->slots = calloc(cache->slot_count, sizeof(path_entry_t*));
+
+        size_t i;
+        for (i = 0; i < old_count; ++i)
+        {
+            if (old_slots[i] != NULL)
+            {
+                *path_cache_slot(cache, old_slots[i]->name) = old_slots[i];
+            }
+        }
+        free(old_slots);
+        slot = path_cache_slot(cache, name);
+    }
+    *slot = entry;
+    cache->count++;
+
+    return entry->path;
+}
+
+// `free()`s everything a PATH cache holds.
+void path_cache_destroy(path_cache_t* cache)
+{
+    path_cache_clear(cache);
+    free(cache->slots);
+    free(cache->path_var);
+    cache->slots = NULL;
+    cache->path_var = NULL;
+}
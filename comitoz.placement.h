@@ -0,0 +1,510 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <dirent.h>    // opendir, readdir, closedir
+#include <errno.h>     // EINVAL, EINTR
+#include <fcntl.h>     // open, O_RDONLY, O_CLOEXEC
+#include <limits.h>    // INT_MAX
+#include <sched.h>     // cpu_set_t, CPU_*, sched_getaffinity
+#include <stdio.h>     // snprintf
+#include <stdlib.h>    // strtol
+#include <string.h>    // memset, strcmp, strncmp
+#include <sys/types.h> // ssize_t
+#include <unistd.h>    // read, close
+
+
+/*** Constants ***/
+
+// Where the kernel describes the NUMA nodes, one "nodeN" directory each.
+#define PLACE_SYSFS_NODES "/sys/devices/system/node"
+
+// Most NUMA nodes that are kept track of; the CPUs of any more are lumped
+// in with the last one.
+#define PLACE_MAX_NODES 64
+
+
+/*** `typedef`s ***/
+
+// How background jobs are placed on CPUs.
+//
+// * `PLACE_INHERIT` - They run wherever the shell may, and the scheduler
+//                     picks.
+// * `PLACE_ROUND_ROBIN` - Each job is pinned to one CPU, taking them in
+//                         turn.
+// * `PLACE_PACK` - Each job is pinned to whichever CPU has the fewest
+//                  placed jobs running, filling the first NUMA node before
+//                  moving on to the next.
+// * `PLACE_SPREAD` - Each job gets every CPU of whichever NUMA node has the
+//                    fewest placed jobs running, so that jobs are spread
+//                    across nodes and each keeps to its own memory.
+// * `PLACE_CPUS` - Pinned to a set given by the user.
+typedef enum
+{
+    PLACE_INHERIT,
+    PLACE_ROUND_ROBIN,
+    PLACE_PACK,
+    PLACE_SPREAD,
+    PLACE_CPUS
+} place_policy_t;
+
+// Where a job should go: a policy, or (for `PLACE_CPUS`) an exact set.
+typedef struct
+{
+    place_policy_t policy;
+    cpu_set_t      cpus;   // Only for `PLACE_CPUS`
+} place_request_t;
+
+// Where a job was put.
+typedef struct
+{
+    place_policy_t policy; // How it was picked
+    int            cpu;    // The CPU it's counted against, or -1
+    int            node;   // The node it's counted against (an index into
+                           // the placer's nodes, not a node number), or -1
+    cpu_set_t      cpus;   // What it was pinned to, unless `PLACE_INHERIT`
+} placement_t;
+
+// The machine's CPUs and NUMA nodes, as far as the shell is allowed to use
+// them, and how many placed jobs are running on each.
+typedef struct
+{
+    cpu_set_t allowed;                    // The shell's own affinity
+    int       node_count;                 // At least 1
+    int       node_ids[PLACE_MAX_NODES];  // The "N" in "nodeN"
+    cpu_set_t nodes[PLACE_MAX_NODES];     // Each node's allowed CPUs
+    int       node_load[PLACE_MAX_NODES]; // Placed jobs running per node
+    int       cpu_load[CPU_SETSIZE];      // Placed jobs running per CPU
+    int       next_cpu;                   // Where round-robin looks next
+} placer_t;
+
+
+/*** Implementations ***/
+
+// Parses a CPU list in the kernel's format, e.g. "0-3,8,10-11".
+//
+// ## Parameters:
+// * `text` - The list. Stops at the end of the string or a newline.
+// * `set` - Set to the CPUs listed.
+//
+// **Returns** zero on success, or `EINVAL` if it isn't a CPU list.
+int place_parse_cpulist(const char* text, cpu_set_t* set)
+{
+    CPU_ZERO(set);
+    const char* pos = text;
+    while (*pos != '\0' && *pos != '\n')
+    {
+        char* end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos || first < 0 || *pos == '-' || *pos == '+')
+        {
+            return EINVAL;
+        }
+        pos = end;
+        if (*pos == '-')
+        {
+            last = strtol(++pos, &end, 10);
+            if (end == pos || last < first || *pos == '-' || *pos == '+')
+            {
+                return EINVAL;
+            }
+            pos = end;
+        }
+        if (last >= CPU_SETSIZE)
+        {
+            return EINVAL;
+        }
+
+        long cpu;
+        for (cpu = first; cpu <= last; ++cpu)
+        {
+            CPU_SET((size_t)cpu, set);
+        }
+
+        if (*pos == ',')
+        {
+            pos++;
+        }
+        else if (*pos != '\0' && *pos != '\n')
+        {
+            return EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+// Writes out a CPU set as a CPU list, e.g. "0-3,8".
+//
+// **Returns** the length of the text, as `snprintf()` does.
+int place_format_cpulist(const cpu_set_t* set, char* buf, size_t size)
+{
+    int len = 0;
+    int cpu = 0;
+    while (cpu < CPU_SETSIZE)
+    {
+        if (!CPU_ISSET((size_t)cpu, set))
+        {
+            cpu++;
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET((size_t)last + 1, set))
+        {
+            last++;
+        }
+
+        size_t used = (size_t)len < size ? (size_t)len : size;
+        len += last > cpu
+            ? snprintf(buf + used, size - used, "%s%d-%d",
+                       len > 0 ? "," : "", cpu, last)
+            : snprintf(buf + used, size - used, "%s%d",
+                       len > 0 ? "," : "", cpu);
+        cpu = last + 1;
+    }
+    if (len == 0 && size > 0)
+    {
+        buf[0] = '\0';
+    }
+
+    return len;
+}
+
+// Reads one of a node's files from sysfs, e.g. its "cpulist".
+//
+// **Returns** zero on success, or an `errno` value.
+int place_read_node_file(int         node_id,
+                         const char* name,
+                         char*       buf,
+                         size_t      size)
+{
+    char path[128];
+    snprintf(
+        path,
+        sizeof(path),
+        PLACE_SYSFS_NODES "/node%d/%s",
+        node_id,
+        name
+    );
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    ssize_t len;
+    while ((len = read(fd, buf, size - 1)) == -1 && errno == EINTR) {}
+    int err = len == -1 ? errno : 0;
+    close(fd);
+    buf[len > 0 ? len : 0] = '\0';
+
+    return err;
+}
+
+// Finds out which CPUs the shell may use, and how they're split up into
+// NUMA nodes. Without NUMA information, every CPU counts as one node.
+//
+// **Returns** zero on success, or an `errno` value.
+int placer_init(placer_t* placer)
+{
+    memset(placer, 0, sizeof(*placer));
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &placer->allowed) == -1)
+    {
+        return errno;
+    }
+
+    // Nodes are taken in order of their number, whatever order the
+    // directory lists them in
+    int ids[PLACE_MAX_NODES];
+    int id_count = 0;
+    DIR* dir = opendir(PLACE_SYSFS_NODES);
+    struct dirent* entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        char* end;
+        if (strncmp(entry->d_name, "node", 4) != 0)
+        {
+            continue;
+        }
+        long id = strtol(entry->d_name + 4, &end, 10);
+        if (end == entry->d_name + 4 || *end != '\0'
+            || id < 0 || id > INT_MAX || id_count == PLACE_MAX_NODES)
+        {
+            continue;
+        }
+
+        int i;
+        for (i = id_count++; i > 0 && ids[i - 1] > id; --i)
+        {
+            ids[i] = ids[i - 1];
+        }
+        ids[i] = (int)id;
+    }
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+
+    // Each node gets whichever of its CPUs we're allowed; nodes with none
+    // (or only memory) are left out
+    cpu_set_t covered;
+    CPU_ZERO(&covered);
+    int i;
+    for (i = 0; i < id_count; ++i)
+    {
+        char text[4096];
+        cpu_set_t cpus;
+        if (place_read_node_file(ids[i], "cpulist", text, sizeof(text)) != 0
+            || place_parse_cpulist(text, &cpus) != 0)
+        {
+            continue;
+        }
+        CPU_AND(&cpus, &cpus, &placer->allowed);
+        if (CPU_COUNT(&cpus) == 0)
+        {
+            continue;
+        }
+
+        int n = placer->node_count++;
+        placer->node_ids[n] = ids[i];
+        placer->nodes[n] = cpus;
+        CPU_OR(&covered, &covered, &cpus);
+    }
+
+    // Anything not in a node (which is everything, without NUMA) becomes
+    // one more, with no number of its own unless it's the only one
+    cpu_set_t rest;
+    CPU_XOR(&rest, &placer->allowed, &covered);
+    if (CPU_COUNT(&rest) > 0 && placer->node_count < PLACE_MAX_NODES)
+    {
+        int n = placer->node_count++;
+        placer->node_ids[n] = n == 0 ? 0 : -1;
+        placer->nodes[n] = rest;
+    }
+    else if (CPU_COUNT(&rest) > 0)
+    {
+        CPU_OR(
+            &placer->nodes[PLACE_MAX_NODES - 1],
+            &placer->nodes[PLACE_MAX_NODES - 1],
+            &rest
+        );
+    }
+
+    return 0;
+}
+
+// Picks where a job should go, and counts it as running there.
+//
+// ## Parameters:
+// * `placer` - The CPUs and nodes.
+// * `request` - How the job should be placed.
+// * `placement` - Set to where it was put.
+void placer_place(placer_t*              placer,
+                  const place_request_t* request,
+                  placement_t*           placement)
+{
+    placement->policy = request->policy;
+    placement->cpu = -1;
+    placement->node = -1;
+    CPU_ZERO(&placement->cpus);
+
+    switch (request->policy)
+    {
+        case PLACE_ROUND_ROBIN:
+        {
+            int tries;
+            int cpu = placer->next_cpu;
+            for (tries = 0; tries < CPU_SETSIZE; ++tries)
+            {
+                if (CPU_ISSET((size_t)cpu, &placer->allowed))
+                {
+                    break;
+                }
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            }
+            placer->next_cpu = (cpu + 1) % CPU_SETSIZE;
+            placement->cpu = cpu;
+            break;
+        }
+        case PLACE_PACK:
+        {
+            // The first CPU with the least on it, going node by node
+            int n;
+            for (n = 0; n < placer->node_count; ++n)
+            {
+                int cpu;
+                for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET((size_t)cpu, &placer->nodes[n])
+                        && (placement->cpu == -1
+                            || placer->cpu_load[cpu]
+                               < placer->cpu_load[placement->cpu]))
+                    {
+                        placement->cpu = cpu;
+                    }
+                }
+            }
+            break;
+        }
+        case PLACE_SPREAD:
+        {
+            int n;
+            int best = 0;
+            for (n = 1; n < placer->node_count; ++n)
+            {
+                if (placer->node_load[n] < placer->node_load[best])
+                {
+                    best = n;
+                }
+            }
+            placement->node = best;
+            placement->cpus = placer->nodes[placement->node];
+            placer->node_load[placement->node]++;
+            break;
+        }
+        case PLACE_CPUS:
+        {
+            placement->cpus = request->cpus;
+            break;
+        }
+        case PLACE_INHERIT:
+        default:
+        {
+            break;
+        }
+    }
+
+    if (placement->cpu != -1)
+    {
+        CPU_SET((size_t)placement->cpu, &placement->cpus);
+        placer->cpu_load[placement->cpu]++;
+    }
+}
+
+// Stops counting a job against wherever it was placed, once it's done.
+void placer_release(placer_t* placer, const placement_t* placement)
+{
+    if (placement->cpu != -1)
+    {
+        placer->cpu_load[placement->cpu]--;
+    }
+    if (placement->node != -1)
+    {
+        placer->node_load[placement->node]--;
+    }
+}
+
+// Looks up a placement policy by the name it's given on the command line:
+// "none", "rr", "pack", or "spread".
+//
+// **Returns** `true` if there is one by that name.
+bool place_policy_parse(const char* name, place_policy_t* policy)
+{
+    if (strcmp(name, "none") == 0)
+    {
+        *policy = PLACE_INHERIT;
+    }
+    else if (strcmp(name, "rr") == 0)
+    {
+        *policy = PLACE_ROUND_ROBIN;
+    }
+    else if (strcmp(name, "pack") == 0)
+    {
+        *policy = PLACE_PACK;
+    }
+    else if (strcmp(name, "spread") == 0)
+    {
+        *policy = PLACE_SPREAD;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// Parses a placement as given to `on`: a policy name (see
+// `place_policy_parse()`), "nodeN" for every CPU of a NUMA node, or a CPU
+// list. An explicit set has to include at least one CPU we're allowed.
+//
+// ## Parameters:
+// * `placer` - The CPUs and nodes.
+// * `spec` - What was given.
+// * `request` - Set to the placement asked for.
+//
+// **Returns** `true` if `spec` makes sense.
+bool place_request_parse(const placer_t*  placer,
+                         const char*      spec,
+                         place_request_t* request)
+{
+    if (place_policy_parse(spec, &request->policy))
+    {
+        return true;
+    }
+
+    request->policy = PLACE_CPUS;
+    if (strncmp(spec, "node", 4) == 0)
+    {
+        char* end;
+        long id = strtol(spec + 4, &end, 10);
+        int n;
+        for (n = 0; n < placer->node_count; ++n)
+        {
+            if (end != spec + 4 && *end == '\0' && placer->node_ids[n] == id)
+            {
+                request->cpus = placer->nodes[n];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    cpu_set_t usable;
+    if (place_parse_cpulist(spec, &request->cpus) != 0)
+    {
+        return false;
+    }
+    CPU_AND(&usable, &request->cpus, &placer->allowed);
+
+    return CPU_COUNT(&usable) > 0;
+}
+
+// Writes out where a job was put, e.g. "cpu 3", "node 1, cpus 0-15",
+// "cpus 0-3,8", or "any" for wherever the scheduler likes.
+//
+// **Returns** the length of the text, as `snprintf()` does.
+int placement_format(const placer_t*    placer,
+                     const placement_t* placement,
+                     char*              buf,
+                     size_t             size)
+{
+    int len;
+    if (placement->policy == PLACE_INHERIT)
+    {
+        return snprintf(buf, size, "any");
+    }
+    if (placement->cpu != -1)
+    {
+        return snprintf(buf, size, "cpu %d", placement->cpu);
+    }
+    if (placement->node != -1 && placer->node_ids[placement->node] >= 0)
+    {
+        len = snprintf(
+            buf,
+            size,
+            "node %d, cpus ",
+            placer->node_ids[placement->node]
+        );
+    }
+    else
+    {
+        len = snprintf(buf, size, "cpus ");
+    }
+
+    size_t used = (size_t)len < size ? (size_t)len : size;
+
+    return len + place_format_cpulist(&placement->cpus, buf + used,
+                                      size - used);
+}
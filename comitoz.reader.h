@@ -0,0 +1,293 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>     // errno, EINTR, EAGAIN, EWOULDBLOCK
+#include <stdlib.h>    // malloc, realloc, free
+#include <string.h>    // memchr, memcpy, memmove
+#include <sys/mman.h>  // mmap, munmap, madvise
+#include <sys/stat.h>  // fstat, S_ISREG
+#include <sys/types.h> // ssize_t, off_t
+#include <unistd.h>    // read, lseek, close
+
+
+/*** Constants ***/
+
+// Size of the blocks that are `read()` from non-file input, and the
+// starting size of the buffer that holds them.
+#define READER_BLOCK 65536
+
+// `reader_next_line()` results that aren't line lengths.
+#define READER_EOF         (-1)
+#define READER_INTERRUPTED (-2)
+#define READER_ERROR       (-3)
+#define READER_WOULD_BLOCK (-4)
+
+
+/*** `typedef`s ***/
+
+// Hands out input one line at a time, without going through stdio.
+//
+// Regular files are `mmap()`ed whole and scanned in place; anything else
+// (terminals, pipes, sockets) is `read()` in large blocks. Either way, lines
+// are found with `memchr()`, which glibc vectorizes.
+typedef struct
+{
+    int    fd;        // Where the input comes from
+    bool   owns_fd;   // Should `reader_close()` close `fd`?
+    bool   eof;       // Has `fd` reported EOF yet? (Block mode only.)
+    bool   polled;    // Is `fd` waited on with `epoll`? If so, it's only
+                      // `read()` while `readable` is set, which reading
+                      // clears (block mode only)
+    bool   readable;  // See `polled`
+
+    // Mapped mode
+    char*  map;       // The whole file, or `NULL` in block mode
+    size_t map_len;   // Size of the mapping
+    size_t map_pos;   // Offset of the first unconsumed byte
+
+    // Block mode; also the scratch space that mapped-mode lines are copied
+    // into so that they can be `'\0'`-terminated
+    char*  buf;       // Buffered input
+    size_t buf_cap;   // Allocated size of `buf`
+    size_t buf_start; // Offset of the first unconsumed byte in `buf`
+    size_t buf_end;   // Offset just past the last valid byte in `buf`
+} line_reader_t;
+
+
+/*** Implementations ***/
+
+// Sets up a reader on an already-open file descriptor.
+//
+// ## Parameters:
+// * `reader` - The reader to initialize.
+// * `fd` - Where to read lines from.
+// * `owns_fd` - Should the reader close `fd` when it's done with it?
+//
+// **Returns** zero on success, or an `errno` value.
+int reader_open(line_reader_t* reader, int fd, bool owns_fd)
+{
+    reader->fd = fd;
+    reader->owns_fd = owns_fd;
+    reader->eof = false;
+    reader->polled = false;
+    reader->readable = false;
+    reader->map = NULL;
+    reader->map_len = 0;
+    reader->map_pos = 0;
+    reader->buf_start = 0;
+    reader->buf_end = 0;
+    reader->buf_cap = READER_BLOCK;
+    reader->buf = malloc(reader->buf_cap);
+    if (reader->buf == NULL)
+    {
+        return ENOMEM;
+    }
+
+    // Regular files get mapped in one go, starting from wherever the file
+    // offset happens to be
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+        && offset >= 0 && offset < st.st_size)
+    {
+        void* map = mmap(
+            NULL,
+            (size_t)st.st_size,
+            PROT_READ,
+            MAP_PRIVATE,
+            fd,
+            0
+        );
+        if (map != MAP_FAILED)
+        {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_len = (size_t)st.st_size;
+            reader->map_pos = (size_t)offset;
+        }
+    }
+
+    return 0;
+}
+
+// Tears down a reader, unmapping and closing whatever it holds.
+void reader_close(line_reader_t* reader)
+{
+    if (reader->map != NULL)
+    {
+        munmap(reader->map, reader->map_len);
+        reader->map = NULL;
+    }
+    free(reader->buf);
+    reader->buf = NULL;
+    if (reader->owns_fd)
+    {
+        close(reader->fd);
+    }
+}
+
+// Makes room for at least `needed` bytes in the reader's buffer.
+//
+// **Returns** zero on success, or an `errno` value.
+int reader_reserve(line_reader_t* reader, size_t needed)
+{
+    if (needed <= reader->buf_cap)
+    {
+        return 0;
+    }
+
+    size_t new_cap = reader->buf_cap;
+    while (new_cap < needed)
+    {
+        new_cap *= 2;
+    }
+    char* new_buf = realloc(reader->buf, new_cap);
+    if (new_buf == NULL)
+    {
+        return ENOMEM;
+    }
+    reader->buf = new_buf;
+    reader->buf_cap = new_cap;
+
+    return 0;
+}
+
+// Gets the next line of input, with its trailing newline replaced by a
+// `'\0'`. A last line with no newline at all is still a line.
+//
+// ## Parameters:
+// * `reader` - The reader to pull from.
+// * `line` - Set to point at the line, which stays valid until the next call.
+//
+// **Returns** the length of the line (not counting the `'\0'`), or one of
+// `READER_EOF`, `READER_INTERRUPTED` (a signal arrived before a whole line
+// did; try again), `READER_WOULD_BLOCK` (no whole line yet, and `fd` is
+// non-blocking or `polled`; wait for it to be readable and try again), or
+// `READER_ERROR` (see `errno`).
+ssize_t reader_next_line(line_reader_t* reader, char** line)
+{
+    if (reader->map != NULL) // Mapped mode
+    {
+        if (reader->map_pos >= reader->map_len)
+        {
+            return READER_EOF;
+        }
+
+        const char* start = reader->map + reader->map_pos;
+        size_t avail = reader->map_len - reader->map_pos;
+        const char* newline = memchr(start, '\n', avail);
+        size_t len = newline != NULL ? (size_t)(newline - start) : avail;
+
+        // The mapping is read-only, so the line is copied out to be
+        // terminated
+        if (reader_reserve(reader, len + 1) != 0)
+        {
+            errno = ENOMEM;
+            return READER_ERROR;
+        }
+        memcpy(reader->buf, start, len);
+        reader->buf[len] = '\0';
+        reader->map_pos += newline != NULL ? len + 1 : len;
+
+        *line = reader->buf;
+        return (ssize_t)len;
+    }
+
+    // Block mode
+    size_t scanned = reader->buf_start;
+    while (1)
+    {
+        char* newline = memchr(
+            reader->buf + scanned,
+            '\n',
+            reader->buf_end - scanned
+        );
+        bool tail = reader->eof && reader->buf_end > reader->buf_start;
+        if (newline != NULL || tail)
+        {
+            // Got a whole line (or the unterminated tail of the input)
+            char* start = reader->buf + reader->buf_start;
+            char* stop = newline != NULL
+                ? newline
+                : reader->buf + reader->buf_end;
+            size_t len = (size_t)(stop - start);
+            if (newline == NULL) // Need room for the `'\0'`
+            {
+                if (reader_reserve(reader, reader->buf_end + 1) != 0)
+                {
+                    errno = ENOMEM;
+                    return READER_ERROR;
+                }
+                start = reader->buf + reader->buf_start;
+            }
+            start[len] = '\0';
+            reader->buf_start += newline != NULL ? len + 1 : len;
+
+            *line = start;
+            return (ssize_t)len;
+        }
+        if (reader->eof)
+        {
+            return READER_EOF;
+        }
+        if (reader->polled)
+        {
+            if (!reader->readable)
+            {
+                return READER_WOULD_BLOCK;
+            }
+            reader->readable = false;
+        }
+        scanned = reader->buf_end;
+
+        // Shift the partial line down to the front, and then make sure
+        // there's a whole block's worth of room after it
+        if (reader->buf_start > 0)
+        {
+            size_t partial = reader->buf_end - reader->buf_start;
+            memmove(reader->buf, reader->buf + reader->buf_start, partial);
+            scanned -= reader->buf_start;
+            reader->buf_start = 0;
+            reader->buf_end = partial;
+        }
+        if (reader_reserve(reader, reader->buf_end + READER_BLOCK) != 0)
+        {
+            errno = ENOMEM;
+            return READER_ERROR;
+        }
+
+        ssize_t bytes_read = read(
+            reader->fd,
+            reader->buf + reader->buf_end,
+            reader->buf_cap - reader->buf_end
+        );
+        if (bytes_read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return READER_WOULD_BLOCK;
+            }
+            return errno == EINTR ? READER_INTERRUPTED : READER_ERROR;
+        }
+        if (bytes_read == 0)
+        {
+            reader->eof = true;
+        }
+        reader->buf_end += (size_t)bytes_read;
+    }
+}
+
+// Points the underlying file offset at the first unconsumed byte, so that a
+// child process sharing the descriptor (a script on the shell's stdin, say)
+// picks up where the shell left off instead of at the start of the file.
+//
+// Only meaningful in mapped mode on a descriptor the reader doesn't own (the
+// ones it does own are `O_CLOEXEC`), and a no-op otherwise.
+void reader_sync_offset(line_reader_t* reader)
+{
+    if (reader->map != NULL && !reader->owns_fd)
+    {
+        lseek(reader->fd, (off_t)reader->map_pos, SEEK_SET);
+    }
+}
@@ -0,0 +1,663 @@
+#pragma once
+
+#include "comitoz.lexer.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>     // errno, ENOMEM, EINVAL, EINTR
+#include <fcntl.h>     // open, O_RDONLY, O_CLOEXEC
+#include <stdint.h>    // uint32_t, uint64_t, int64_t, UINT32_MAX
+#include <stdio.h>     // rename
+#include <stdlib.h>    // malloc, calloc, realloc, free, mkstemp
+#include <string.h>    // memcmp, memcpy, memset, strchr, strlen
+#include <sys/mman.h>  // mmap, munmap, madvise
+#include <sys/stat.h>  // struct stat, fstat, fchmod
+#include <sys/types.h> // ssize_t
+#include <unistd.h>    // write, close, unlink, geteuid
+
+
+/*** Constants ***/
+
+// First four bytes of every image: "smsh" as written by a little-endian
+// machine. An image from a machine of the other byte order won't match.
+#define SCRIPT_IMAGE_MAGIC 0x68736d73U
+
+// Bumped whenever the layout of an image (or what the parser makes of a
+// line) changes, so that old images are recompiled rather than misread.
+#define SCRIPT_IMAGE_VERSION 2
+
+// Added to a script's path to get the path of its image.
+#define SCRIPT_IMAGE_SUFFIX ".smc"
+
+// Stands in for a word index where there's no word (e.g. no "<" file).
+#define SCRIPT_NONE UINT32_MAX
+
+// `script_command_t` flags.
+#define SCRIPT_BACKGROUND   0x01 // The line ended in "&"
+#define SCRIPT_SYNTAX_ERROR 0x02 // The line had an empty pipeline stage
+
+// `script_word_t` parts.
+#define SCRIPT_WORD_EXPAND 0x80000000U // Has a `$` to expand when it's run
+#define SCRIPT_WORD_OFFSET 0x7fffffffU // Where its text is
+
+// Starting number of slots in the table of distinct words seen while
+// compiling. Always a power of two.
+#define SCRIPT_INTERN_MIN_SLOTS 1024
+
+
+/*** `typedef`s ***/
+
+// The start of a compiled script image.
+//
+// An image is the script after lexing and parsing, laid out so that it can
+// be `mmap()`ed and run in place: this header, then the commands, stages,
+// and words tables, then every word's text, `'\0'`-terminated. Everything
+// refers to everything else by index or offset, never by pointer, so the
+// image means the same thing wherever it gets mapped. Blank lines and
+// comments aren't in it at all.
+//
+// The image is only good for the exact file it was compiled from, which is
+// what the `source_*` fields are for.
+typedef struct
+{
+    uint32_t magic;             // `SCRIPT_IMAGE_MAGIC`
+    uint32_t version;           // `SCRIPT_IMAGE_VERSION`
+    uint32_t command_count;     // Entries in the commands table
+    uint32_t stage_count;       // Entries in the stages table
+    uint32_t word_count;        // Entries in the words table
+    uint32_t strings_len;       // Size of the text that follows the tables
+    uint64_t source_size;       // The script's `st_size`...
+    int64_t  source_mtime_sec;  // ...`st_mtim`...
+    int64_t  source_mtime_nsec;
+    uint64_t source_dev;        // ...and identity, when it was compiled
+    uint64_t source_ino;
+} script_header_t;
+
+// One line of the script that does something.
+typedef struct
+{
+    uint32_t first_stage; // Index of its first stage
+    uint32_t stage_count; // How many stages the pipeline has
+    uint32_t flags;       // `SCRIPT_BACKGROUND` and `SCRIPT_SYNTAX_ERROR`
+    uint32_t line_len;    // Length of the original line, for tracing
+} script_command_t;
+
+// One stage of a pipeline. Its arguments are consecutive in the words
+// table.
+typedef struct
+{
+    uint32_t first_word;  // Index of `argv[0]`
+    uint32_t argc;        // How many arguments there are; may be 0
+    uint32_t input_file;  // Word index of the "<" file, or `SCRIPT_NONE`
+    uint32_t output_file; // Word index of the ">" file, or `SCRIPT_NONE`
+} script_stage_t;
+
+// One word: where its text starts, relative to the strings, with
+// `SCRIPT_WORD_EXPAND` set if it has a `$`. That's left as-is in the text,
+// since what it expands to (the shell's PID, a variable) isn't known until
+// the line is run. Words with the same text share it.
+typedef uint32_t script_word_t;
+
+// A compiled script, ready to run, either `mmap()`ed from its image file or
+// freshly built in memory.
+typedef struct
+{
+    char*                   base;     // The whole image
+    size_t                  size;     // How big it is
+    bool                    mapped;   // Unmap `base`, rather than `free()`?
+    const script_header_t*  header;
+    const script_command_t* commands;
+    const script_stage_t*   stages;
+    const script_word_t*    words;
+    char*                   strings;
+    uint32_t                next;     // The next command to run
+} script_image_t;
+
+// Collects the tables for an image while a script is compiled. Each table
+// grows like a vector.
+typedef struct
+{
+    script_command_t* commands;
+    size_t            command_count;
+    size_t            command_cap;
+    script_stage_t*   stages;
+    size_t            stage_count;
+    size_t            stage_cap;
+    script_word_t*    words;
+    size_t            word_count;
+    size_t            word_cap;
+    char*             strings;
+    size_t            strings_len;
+    size_t            strings_cap;
+    uint32_t*         interned;      // Open-addressed by text, linear
+                                     // probing: offset + 1 of each distinct
+                                     // word, or 0 for an empty slot
+    size_t            interned_cap;  // Size of `interned`; a power of two
+    size_t            interned_count;
+} script_builder_t;
+
+
+/*** Implementations ***/
+
+// Sets up an empty builder. Nothing is allocated until it's first used.
+void script_builder_init(script_builder_t* builder)
+{
+    memset(builder, 0, sizeof(*builder));
+}
+
+// `free()`s everything a builder holds.
+void script_builder_destroy(script_builder_t* builder)
+{
+    free(builder->commands);
+    free(builder->stages);
+    free(builder->words);
+    free(builder->strings);
+    free(builder->interned);
+    script_builder_init(builder);
+}
+
+// Makes room for one more element at the end of one of a builder's tables.
+// No table may outgrow what a `uint32_t` can index.
+//
+// ## Parameters:
+// * `table` - The table, which may be moved.
+// * `cap` - How many elements it has room for; updated.
+// * `needed` - How many elements it has to have room for.
+// * `elem_size` - How big an element is.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_reserve(void** table, size_t* cap, size_t needed, size_t elem_size)
+{
+    if (needed <= *cap)
+    {
+        return 0;
+    }
+    if (needed > UINT32_MAX)
+    {
+        return EINVAL;
+    }
+
+    size_t new_cap = *cap > 0 ? *cap * 2 : 256;
+    while (new_cap < needed)
+    {
+        new_cap *= 2;
+    }
+    void* grown = realloc(*table, new_cap * elem_size);
+    if (grown == NULL)
+    {
+        return ENOMEM;
+    }
+    *table = grown;
+    *cap = new_cap;
+
+    return 0;
+}
+
+// Hashes a word's text (FNV-1a).
+uint64_t script_hash(const char* text, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Doubles the table of distinct words, re-inserting each one.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_intern_grow(script_builder_t* builder)
+{
+    size_t new_cap = builder->interned_cap > 0
+        ? builder->interned_cap * 2
+        : SCRIPT_INTERN_MIN_SLOTS;
+    uint32_t* slots = calloc(new_cap, sizeof(uint32_t));
+    if (slots == NULL)
+    {
+        return ENOMEM;
+    }
+
+    size_t i;
+    for (i = 0; i < builder->interned_cap; ++i)
+    {
+        uint32_t entry = builder->interned[i];
+        if (entry == 0)
+        {
+            continue;
+        }
+        const char* text = builder->strings + entry - 1;
+        size_t slot = script_hash(text, strlen(text)) & (new_cap - 1);
+        while (slots[slot] != 0)
+        {
+            slot = (slot + 1) & (new_cap - 1);
+        }
+        slots[slot] = entry;
+    }
+    free(builder->interned);
+    builder->interned = slots;
+    builder->interned_cap = new_cap;
+
+    return 0;
+}
+
+// Finds where a word's text is in the strings, copying it in if it isn't
+// there yet.
+//
+// **Returns** the offset of the text, or `SCRIPT_NONE` if out of room.
+uint32_t script_intern(script_builder_t* builder, const char* text)
+{
+    // Keep the table at most half full
+    if (2 * (builder->interned_count + 1) > builder->interned_cap
+        && script_intern_grow(builder) != 0)
+    {
+        return SCRIPT_NONE;
+    }
+
+    size_t len = strlen(text) + 1;
+    size_t slot = script_hash(text, len - 1) & (builder->interned_cap - 1);
+    while (builder->interned[slot] != 0)
+    {
+        uint32_t offset = builder->interned[slot] - 1;
+        if (memcmp(builder->strings + offset, text, len) == 0)
+        {
+            return offset;
+        }
+        slot = (slot + 1) & (builder->interned_cap - 1);
+    }
+
+    void* strings = builder->strings;
+    if (builder->strings_len + len > SCRIPT_WORD_OFFSET
+        || script_reserve(
+               &strings,
+               &builder->strings_cap,
+               builder->strings_len + len,
+               1
+           ) != 0)
+    {
+        return SCRIPT_NONE;
+    }
+    builder->strings = strings;
+
+    uint32_t offset = (uint32_t)builder->strings_len;
+    memcpy(builder->strings + offset, text, len);
+    builder->strings_len += len;
+    builder->interned[slot] = offset + 1;
+    builder->interned_count++;
+
+    return offset;
+}
+
+// Adds a word, with any "$$" left to be expanded later.
+//
+// **Returns** the index of the word, or `SCRIPT_NONE` if out of room.
+uint32_t script_add_word(script_builder_t* builder, const char* text)
+{
+    void* words = builder->words;
+    int err = script_reserve(
+        &words,
+        &builder->word_cap,
+        builder->word_count + 1,
+        sizeof(script_word_t)
+    );
+    builder->words = words;
+    uint32_t offset = err == 0 ? script_intern(builder, text) : SCRIPT_NONE;
+    if (offset == SCRIPT_NONE)
+    {
+        return SCRIPT_NONE;
+    }
+
+    builder->words[builder->word_count] = offset
+        | (strchr(text, '$') != NULL ? SCRIPT_WORD_EXPAND : 0);
+
+    return (uint32_t)builder->word_count++;
+}
+
+// Adds a pipeline stage, whose arguments must be the last `argc` words
+// added before its redirection targets.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_add_stage(script_builder_t* builder,
+                     uint32_t          first_word,
+                     uint32_t          argc,
+                     uint32_t          input_file,
+                     uint32_t          output_file)
+{
+    void* stages = builder->stages;
+    int err = script_reserve(
+        &stages,
+        &builder->stage_cap,
+        builder->stage_count + 1,
+        sizeof(script_stage_t)
+    );
+    builder->stages = stages;
+    if (err != 0)
+    {
+        return err;
+    }
+
+    script_stage_t* stage = &builder->stages[builder->stage_count++];
+    stage->first_word = first_word;
+    stage->argc = argc;
+    stage->input_file = input_file;
+    stage->output_file = output_file;
+
+    return 0;
+}
+
+// Adds a command, made of the last `stage_count` stages added.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_add_command(script_builder_t* builder,
+                       uint32_t          stage_count,
+                       uint32_t          flags,
+                       size_t            line_len)
+{
+    void* commands = builder->commands;
+    int err = script_reserve(
+        &commands,
+        &builder->command_cap,
+        builder->command_count + 1,
+        sizeof(script_command_t)
+    );
+    builder->commands = commands;
+    if (err != 0)
+    {
+        return err;
+    }
+
+    script_command_t* command = &builder->commands[builder->command_count++];
+    command->first_stage = (uint32_t)builder->stage_count - stage_count;
+    command->stage_count = stage_count;
+    command->flags = flags;
+    command->line_len = line_len > UINT32_MAX
+        ? UINT32_MAX
+        : (uint32_t)line_len;
+
+    return 0;
+}
+
+// Points an image's tables into its `base`, which must already have been
+// checked to be big enough for what its header says.
+void script_image_locate(script_image_t* image)
+{
+    const script_header_t* header = (const script_header_t*)image->base;
+    char* pos = image->base + sizeof(script_header_t);
+
+    image->header = header;
+    image->commands = (const script_command_t*)pos;
+    pos += header->command_count * sizeof(script_command_t);
+    image->stages = (const script_stage_t*)pos;
+    pos += header->stage_count * sizeof(script_stage_t);
+    image->words = (const script_word_t*)pos;
+    pos += header->word_count * sizeof(script_word_t);
+    image->strings = pos;
+    image->next = 0;
+}
+
+// Works out how big an image with these tables is.
+//
+// **Returns** the size, in bytes.
+size_t script_image_size(const script_header_t* header)
+{
+    return sizeof(script_header_t)
+        + header->command_count * sizeof(script_command_t)
+        + header->stage_count * sizeof(script_stage_t)
+        + header->word_count * sizeof(script_word_t)
+        + header->strings_len;
+}
+
+// Lays out everything a builder collected as an image in memory.
+//
+// ## Parameters:
+// * `builder` - The tables. Left as they were.
+// * `source` - `fstat()` of the script that was compiled.
+// * `image` - Set up to run the script.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_image_build(const script_builder_t* builder,
+                       const struct stat*      source,
+                       script_image_t*         image)
+{
+    script_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SCRIPT_IMAGE_MAGIC;
+    header.version = SCRIPT_IMAGE_VERSION;
+    header.command_count = (uint32_t)builder->command_count;
+    header.stage_count = (uint32_t)builder->stage_count;
+    header.word_count = (uint32_t)builder->word_count;
+    header.strings_len = (uint32_t)builder->strings_len;
+    header.source_size = (uint64_t)source->st_size;
+    header.source_mtime_sec = (int64_t)source->st_mtim.tv_sec;
+    header.source_mtime_nsec = (int64_t)source->st_mtim.tv_nsec;
+    header.source_dev = (uint64_t)source->st_dev;
+    header.source_ino = (uint64_t)source->st_ino;
+
+    // An empty script still needs its strings to end in a `'\0'`
+    if (builder->strings_len == 0)
+    {
+        header.strings_len = 1;
+    }
+
+    image->size = script_image_size(&header);
+    image->base = malloc(image->size);
+    image->mapped = false;
+    if (image->base == NULL)
+    {
+        return ENOMEM;
+    }
+
+    char* pos = image->base;
+    memcpy(pos, &header, sizeof(header));
+    pos += sizeof(header);
+    memcpy(
+        pos,
+        builder->commands,
+        builder->command_count * sizeof(script_command_t)
+    );
+    pos += builder->command_count * sizeof(script_command_t);
+    memcpy(pos, builder->stages, builder->stage_count * sizeof(script_stage_t));
+    pos += builder->stage_count * sizeof(script_stage_t);
+    memcpy(pos, builder->words, builder->word_count * sizeof(script_word_t));
+    pos += builder->word_count * sizeof(script_word_t);
+    memcpy(pos, builder->strings, builder->strings_len);
+    pos[header.strings_len - 1] = '\0';
+
+    script_image_locate(image);
+
+    return 0;
+}
+
+// Writes an image out to a file. It's written under a temporary name and
+// then renamed into place, so anyone else who has the old image mapped keeps
+// the old one, and nobody ever maps half of one.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_image_save(const script_image_t* image, const char* path)
+{
+    size_t path_len = strlen(path);
+    char* temp_path = malloc(path_len + sizeof(".XXXXXX"));
+    if (temp_path == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(temp_path, path, path_len);
+    memcpy(temp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(temp_path);
+    if (fd == -1)
+    {
+        int err = errno;
+        free(temp_path);
+        return err;
+    }
+    fchmod(fd, 0644);
+
+    int err = 0;
+    const char* pos = image->base;
+    size_t left = image->size;
+    while (left > 0)
+    {
+        ssize_t written = write(fd, pos, left);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        pos += written;
+        left -= (size_t)written;
+    }
+    if (close(fd) == -1 && err == 0)
+    {
+        err = errno;
+    }
+    if (err == 0 && rename(temp_path, path) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        unlink(temp_path);
+    }
+    free(temp_path);
+
+    return err;
+}
+
+// Maps in a script's image, if it has one that's still good: same layout
+// version, compiled from the script exactly as it is now, and written by
+// either us or the script's owner.
+//
+// The tables aren't checked here, so that starting up doesn't have to touch
+// every page of a big image; `script_image_word()` and friends do it as the
+// commands are run.
+//
+// ## Parameters:
+// * `image` - Set up to run the script.
+// * `path` - Where the image is.
+// * `source` - `fstat()` of the script.
+//
+// **Returns** zero on success, or an `errno` value.
+int script_image_load(script_image_t*    image,
+                      const char*        path,
+                      const struct stat* source)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1
+        || (size_t)st.st_size < sizeof(script_header_t)
+        || (st.st_uid != geteuid() && st.st_uid != source->st_uid))
+    {
+        close(fd);
+        return EINVAL;
+    }
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return errno;
+    }
+
+    const script_header_t* header = map;
+    if (header->magic != SCRIPT_IMAGE_MAGIC
+        || header->version != SCRIPT_IMAGE_VERSION
+        || header->source_size != (uint64_t)source->st_size
+        || header->source_mtime_sec != (int64_t)source->st_mtim.tv_sec
+        || header->source_mtime_nsec != (int64_t)source->st_mtim.tv_nsec
+        || header->source_dev != (uint64_t)source->st_dev
+        || header->source_ino != (uint64_t)source->st_ino
+        || header->strings_len == 0
+        || script_image_size(header) != (size_t)st.st_size
+        || ((const char*)map)[st.st_size - 1] != '\0')
+    {
+        munmap(map, (size_t)st.st_size);
+        return EINVAL;
+    }
+
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    image->base = map;
+    image->size = (size_t)st.st_size;
+    image->mapped = true;
+    script_image_locate(image);
+
+    return 0;
+}
+
+// Unmaps or `free()`s an image.
+void script_image_close(script_image_t* image)
+{
+    if (image->base == NULL)
+    {
+        return;
+    }
+    if (image->mapped)
+    {
+        munmap(image->base, image->size);
+    }
+    else
+    {
+        free(image->base);
+    }
+    image->base = NULL;
+}
+
+// Gets a word's text, with every `$` expanded. Words without one are used
+// right where they sit in the image.
+//
+// ## Parameters:
+// * `image` - The image.
+// * `index` - Which word.
+// * `arena` - Where an expanded word goes.
+// * `env` - What `$`s expand to.
+//
+// **Returns** the text, or `NULL` if out of memory or the image is corrupt.
+char* script_image_word(const script_image_t* image,
+                        uint32_t              index,
+                        arena_t*              arena,
+                        const lex_env_t*      env)
+{
+    if (index >= image->header->word_count)
+    {
+        return NULL;
+    }
+    script_word_t word = image->words[index];
+    uint32_t offset = word & SCRIPT_WORD_OFFSET;
+    if (offset >= image->header->strings_len)
+    {
+        return NULL;
+    }
+    if ((word & SCRIPT_WORD_EXPAND) == 0)
+    {
+        return image->strings + offset;
+    }
+
+    return lex_expand(arena, image->strings + offset, env);
+}
+
+// Works out where a script's image lives: right beside it.
+//
+// **Returns** a `malloc()`ed path, or `NULL` if out of memory.
+char* script_image_path(const char* script_path)
+{
+    size_t len = strlen(script_path);
+    char* path = malloc(len + sizeof(SCRIPT_IMAGE_SUFFIX));
+    if (path != NULL)
+    {
+        memcpy(path, script_path, len);
+        memcpy(path + len, SCRIPT_IMAGE_SUFFIX, sizeof(SCRIPT_IMAGE_SUFFIX));
+    }
+
+    return path;
+}
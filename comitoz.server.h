@@ -0,0 +1,599 @@
+#pragma once
+
+#include "comitoz.output.h"
+#include "comitoz.reader.h"
+#include "comitoz.utils.h"
+
+#include <errno.h>        // errno, EINTR, EAGAIN, ENOMEM, EPIPE, etc.
+#include <stdint.h>       // uint64_t
+#include <stdlib.h>       // malloc, realloc, calloc, free
+#include <string.h>       // memcpy, memmove, strlen
+#include <sys/epoll.h>    // epoll_create1, epoll_ctl, struct epoll_event
+#include <sys/eventfd.h>  // eventfd, EFD_NONBLOCK, EFD_CLOEXEC
+#include <sys/socket.h>   // socket, bind, listen, accept4, SOCK_*
+#include <sys/stat.h>     // lstat, umask, S_ISSOCK
+#include <sys/types.h>    // ssize_t
+#include <sys/un.h>       // struct sockaddr_un
+#include <unistd.h>       // read, write, close, unlink
+
+
+/*** Constants ***/
+
+// How many connections can be waiting to be accepted.
+#define SERVER_BACKLOG 128
+
+// How many submissions are remembered for `status`. Always a power of two.
+// Older ones are forgotten, whether or not they're done.
+#define SERVER_RESULT_SLOTS 65536
+
+// Most output that can pile up for a client that isn't reading it, before
+// it's hung up on.
+#define SERVER_MAX_OUTPUT (4 * 1024 * 1024)
+
+// Most events taken from `epoll_wait()` at once.
+#define SERVER_MAX_EVENTS 64
+
+
+/*** `typedef`s ***/
+
+// Where a submission has got to.
+//
+// * `SUBMIT_UNKNOWN` - Never submitted, or long enough ago to be forgotten.
+// * `SUBMIT_QUEUED` - Waiting under the `-j` cap.
+// * `SUBMIT_RUNNING` - Launched, and not yet reaped.
+// * `SUBMIT_DONE` - Finished; `status` and `is_term` are its outcome.
+typedef enum
+{
+    SUBMIT_UNKNOWN,
+    SUBMIT_QUEUED,
+    SUBMIT_RUNNING,
+    SUBMIT_DONE
+} submit_state_t;
+
+// What's remembered about one submission.
+typedef struct
+{
+    uint64_t       id;      // Which submission this slot holds, or 0
+    submit_state_t state;
+    int            status;  // Exit value, or terminating signal if
+    bool           is_term; // `is_term`
+} server_result_t;
+
+// One connection to the server. Requests are read a line at a time, and
+// replies are gathered up and sent without ever blocking.
+typedef struct server_client
+{
+    int                   fd;
+    line_reader_t         reader;      // Requests, in non-blocking mode
+    char*                 out;         // Replies and events not yet sent
+    size_t                out_len;
+    size_t                out_cap;
+    uint32_t              events;      // What `epoll` is watching for
+    bool                  reading;     // Still taking requests? Not once
+                                       // it's sent EOF.
+    bool                  hung_up;     // To be dropped
+    bool                  watching;    // Gets every "done" event?
+    struct server_client* prev;        // Neighbours in the list of clients
+    struct server_client* next;
+} server_client_t;
+
+// Daemon mode: a Unix socket that takes command lines to run as background
+// jobs, waited on with `epoll` alongside stdin.
+//
+// Each line a client sends is a request, and gets one line back:
+//
+// * `run <command line>` - Runs the command line as if it ended in `&`.
+//                          Replies `job <id>`.
+// * `status <id>` - Replies `status <id> ` and then `queued`, `running`,
+//                   `exit value N`, `terminated by signal N`, or `unknown`.
+// * `watch` - Replies `watching`, and from then on sends `done <id> exit
+//             value N` (or `terminated by signal N`) as every submission
+//             finishes.
+//
+// Anything else gets `error <reason>`.
+typedef struct
+{
+    int              listen_fd;   // -1 if not serving
+    int              epoll_fd;
+    int              wake_fd;     // An `eventfd` that `SIGCHLD` pokes, so
+                                  // that `epoll_wait()` can't sleep through
+                                  // it; -1 if not serving
+    char*            path;        // Where the socket is, to remove it
+    uint64_t         next_id;     // Last submission ID handed out
+    server_result_t* results;     // Indexed by ID, modulo the slot count
+    server_client_t* clients;     // Every connection, most recent first
+    long             watchers;    // How many clients are watching
+    char*            line;        // Scratch space for submitted lines
+    size_t           line_cap;
+} server_t;
+
+
+/*** Implementations ***/
+
+// Sets up a server that isn't serving, so that it can be closed (or its
+// `wake_fd` looked at) whether or not it's ever opened.
+void server_init(server_t* server)
+{
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+    server->wake_fd = -1;
+    server->path = NULL;
+    server->next_id = 0;
+    server->results = NULL;
+    server->clients = NULL;
+    server->watchers = 0;
+    server->line = NULL;
+    server->line_cap = 0;
+}
+
+// Adds a descriptor to the server's `epoll` set.
+//
+// ## Parameters:
+// * `server` - The server.
+// * `fd` - What to watch.
+// * `events` - e.g. `EPOLLIN`.
+// * `tag` - Comes back with each event, to tell descriptors apart.
+//
+// **Returns** zero on success, or an `errno` value.
+int server_watch(server_t* server, int fd, uint32_t events, void* tag)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = tag;
+
+    return epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0
+        ? 0
+        : errno;
+}
+
+// Starts listening on a Unix socket. The socket is only for its owner, and a
+// stale one left at `path` by a server that didn't get to clean up is
+// replaced.
+//
+// ## Parameters:
+// * `server` - Set up by `server_init()`.
+// * `path` - Where the socket goes.
+//
+// **Returns** zero on success, or an `errno` value.
+int server_open(server_t* server, const char* path)
+{
+    struct sockaddr_un addr = {0};
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(addr.sun_path))
+    {
+        return ENAMETOOLONG;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, path_len + 1);
+
+    server->results = calloc(SERVER_RESULT_SLOTS, sizeof(server_result_t));
+    server->path = malloc(path_len + 1);
+    if (server->results == NULL || server->path == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(server->path, path, path_len + 1);
+
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    server->listen_fd = socket(
+        AF_UNIX,
+        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        0
+    );
+    if (server->listen_fd == -1)
+    {
+        return errno;
+    }
+    mode_t old_mask = umask(0077);
+    int bound = bind(
+        server->listen_fd,
+        (const struct sockaddr*)&addr,
+        sizeof(addr)
+    );
+    umask(old_mask);
+    if (bound == -1 || listen(server->listen_fd, SERVER_BACKLOG) == -1)
+    {
+        int err = errno;
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return err;
+    }
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->epoll_fd == -1 || server->wake_fd == -1)
+    {
+        return errno;
+    }
+
+    int err = server_watch(server, server->listen_fd, EPOLLIN,
+                           &server->listen_fd);
+    return err != 0
+        ? err
+        : server_watch(server, server->wake_fd, EPOLLIN, &server->wake_fd);
+}
+
+// Takes in every connection that's waiting.
+//
+// **Returns** zero on success, or an `errno` value (out of memory or
+// descriptors, say). A connection that can't be kept is just closed.
+int server_accept(server_t* server)
+{
+    while (1)
+    {
+        int fd = accept4(
+            server->listen_fd,
+            NULL,
+            NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC
+        );
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return errno == EAGAIN ? 0 : errno; // Nothing more to take
+        }
+
+        server_client_t* client = malloc(sizeof(server_client_t));
+        if (client == NULL || reader_open(&client->reader, fd, true) != 0)
+        {
+            free(client);
+            close(fd);
+            return ENOMEM;
+        }
+        client->reader.polled = true;
+        client->fd = fd;
+        client->out = NULL;
+        client->out_len = 0;
+        client->out_cap = 0;
+        client->events = EPOLLIN;
+        client->reading = true;
+        client->hung_up = false;
+        client->watching = false;
+        client->prev = NULL;
+        client->next = server->clients;
+        if (client->next != NULL)
+        {
+            client->next->prev = client;
+        }
+        server->clients = client;
+
+        if (server_watch(server, fd, EPOLLIN, client) != 0)
+        {
+            reader_close(&client->reader);
+            server->clients = client->next;
+            if (client->next != NULL)
+            {
+                client->next->prev = NULL;
+            }
+            free(client);
+        }
+    }
+}
+
+// Hangs up on a client, and forgets it. Closing its descriptor takes it out
+// of the `epoll` set. Only safe between batches of events, since a client
+// can have more than one in a batch.
+void server_drop(server_t* server, server_client_t* client)
+{
+    if (client->watching)
+    {
+        server->watchers--;
+    }
+    if (client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        server->clients = client->next;
+    }
+    if (client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+
+    reader_close(&client->reader);
+    free(client->out);
+    free(client);
+}
+
+// Sends as much of a client's pending output as it will take, and waits for
+// `EPOLLOUT` if there's more (and `EPOLLIN` while it's still reading).
+//
+// **Returns** zero on success, or an `errno` value if the client has to be
+// dropped.
+int server_flush(server_t* server, server_client_t* client)
+{
+    size_t sent = 0;
+    while (sent < client->out_len)
+    {
+        ssize_t written = write(
+            client->fd,
+            client->out + sent,
+            client->out_len - sent
+        );
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            return errno;
+        }
+        sent += (size_t)written;
+    }
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
+
+    uint32_t events = (client->reading ? EPOLLIN : 0)
+        | (client->out_len > 0 ? EPOLLOUT : 0);
+    if (events != client->events)
+    {
+        struct epoll_event event;
+        event.events = events;
+        event.data.ptr = client;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &event)
+            == -1)
+        {
+            return errno;
+        }
+        client->events = events;
+    }
+
+    return 0;
+}
+
+// Sends what's pending to every client, and drops the ones that have been
+// hung up on, or that are done (sent EOF, and have had every reply).
+void server_sweep(server_t* server)
+{
+    server_client_t* client = server->clients;
+    while (client != NULL)
+    {
+        server_client_t* next = client->next;
+        if (!client->hung_up && server_flush(server, client) != 0)
+        {
+            client->hung_up = true;
+        }
+        if (client->hung_up || (!client->reading && client->out_len == 0))
+        {
+            server_drop(server, client);
+        }
+        client = next;
+    }
+}
+
+// Adds to what's waiting to go out to a client. One that's out of memory,
+// or has let too much pile up, is marked as hung up on.
+//
+// **Returns** zero on success, or an `errno` value.
+int server_send(server_client_t* client, const char* str, size_t len)
+{
+    if (client->hung_up)
+    {
+        return EPIPE;
+    }
+    if (client->out_len + len > client->out_cap)
+    {
+        if (client->out_len + len > SERVER_MAX_OUTPUT)
+        {
+            client->hung_up = true;
+            return ENOBUFS;
+        }
+        size_t new_cap = client->out_cap > 0 ? client->out_cap : 256;
+        while (new_cap < client->out_len + len)
+        {
+            new_cap *= 2;
+        }
+        char* grown = realloc(client->out, new_cap);
+        if (grown == NULL)
+        {
+            client->hung_up = true;
+            return ENOMEM;
+        }
+        client->out = grown;
+        client->out_cap = new_cap;
+    }
+    memcpy(client->out + client->out_len, str, len);
+    client->out_len += len;
+
+    return 0;
+}
+
+// Copies a submitted command line into the server's scratch space, with an
+// `&` word on the end if it hasn't already got one.
+//
+// **Returns** the copy, or `NULL` if out of memory.
+char* server_job_line(server_t* server, const char* line)
+{
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+    {
+        len--;
+    }
+    if (len + 3 > server->line_cap)
+    {
+        size_t new_cap = server->line_cap > 0 ? server->line_cap : 256;
+        while (new_cap < len + 3)
+        {
+            new_cap *= 2;
+        }
+        char* grown = realloc(server->line, new_cap);
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        server->line = grown;
+        server->line_cap = new_cap;
+    }
+
+    memcpy(server->line, line, len);
+    if (len < 2 || line[len - 1] != '&'
+        || (line[len - 2] != ' ' && line[len - 2] != '\t'))
+    {
+        server->line[len++] = ' ';
+        server->line[len++] = '&';
+    }
+    server->line[len] = '\0';
+
+    return server->line;
+}
+
+// Formats where a submission has got to, e.g. "exit value 0".
+//
+// ## Parameters:
+// * `result` - The submission, or `NULL` if it's unknown.
+// * `buf` - Where the text goes, `'\0'`-terminated. 48 bytes is plenty.
+//
+// **Returns** the length of the text.
+size_t server_format_result(const server_result_t* result, char* buf)
+{
+    const char* text = "unknown";
+    if (result != NULL)
+    {
+        switch (result->state)
+        {
+            case SUBMIT_QUEUED:
+            {
+                text = "queued";
+                break;
+            }
+            case SUBMIT_RUNNING:
+            {
+                text = "running";
+                break;
+            }
+            case SUBMIT_DONE:
+            {
+                text = result->is_term
+                    ? "terminated by signal "
+                    : "exit value ";
+                break;
+            }
+            case SUBMIT_UNKNOWN:
+            default:
+            {
+                break;
+            }
+        }
+    }
+
+    size_t len = strlen(text);
+    memcpy(buf, text, len + 1);
+    if (result != NULL && result->state == SUBMIT_DONE)
+    {
+        len += format_int(buf + len, result->status);
+    }
+
+    return len;
+}
+
+// Looks up a submission.
+//
+// **Returns** what's remembered about it, or `NULL` if it's unknown.
+server_result_t* server_result(server_t* server, uint64_t id)
+{
+    server_result_t* result =
+        &server->results[id & (SERVER_RESULT_SLOTS - 1)];
+
+    return id != 0 && result->id == id ? result : NULL;
+}
+
+// Hands out the next submission ID, and starts remembering it as queued.
+uint64_t server_submit(server_t* server)
+{
+    uint64_t id = ++server->next_id;
+    server_result_t* result =
+        &server->results[id & (SERVER_RESULT_SLOTS - 1)];
+    result->id = id;
+    result->state = SUBMIT_QUEUED;
+    result->status = 0;
+    result->is_term = false;
+
+    return id;
+}
+
+// Records that a submission has been launched.
+void server_started(server_t* server, uint64_t id)
+{
+    server_result_t* result = server_result(server, id);
+    if (result != NULL)
+    {
+        result->state = SUBMIT_RUNNING;
+    }
+}
+
+// Records how a submission ended, and tells every watching client.
+//
+// ## Parameters:
+// * `server` - The server.
+// * `id` - The submission.
+// * `status` - Its exit value, or the signal that terminated it.
+// * `is_term` - Was it terminated by a signal?
+void server_finished(server_t* server, uint64_t id, int status, bool is_term)
+{
+    server_result_t done = {id, SUBMIT_DONE, status, is_term};
+    server_result_t* result = server_result(server, id);
+    if (result != NULL)
+    {
+        *result = done;
+    }
+    if (server->watchers == 0)
+    {
+        return;
+    }
+
+    char event[96] = "done ";
+    size_t len = 5;
+    len += format_int(event + len, (long long)id);
+    event[len++] = ' ';
+    len += server_format_result(&done, event + len);
+    event[len++] = '\n';
+
+    server_client_t* client;
+    for (client = server->clients; client != NULL; client = client->next)
+    {
+        if (client->watching)
+        {
+            server_send(client, event, len);
+        }
+    }
+}
+
+// Stops serving: hangs up on every client, and removes the socket.
+void server_close(server_t* server)
+{
+    while (server->clients != NULL)
+    {
+        server_drop(server, server->clients);
+    }
+    if (server->listen_fd != -1)
+    {
+        close(server->listen_fd);
+        unlink(server->path);
+    }
+    if (server->epoll_fd != -1)
+    {
+        close(server->epoll_fd);
+    }
+    if (server->wake_fd != -1)
+    {
+        close(server->wake_fd);
+    }
+    free(server->path);
+    free(server->results);
+    free(server->line);
+    server_init(server);
+}
@@ -1,25 +1,138 @@
+#define _GNU_SOURCE // environ, and the Linux-specific syscall wrappers
+
 #include "comitoz.smallsh.h"
+#include "comitoz.builtins.h"
+#include "comitoz.capture.h"
+#include "comitoz.deadline.h"
+#include "comitoz.history.h"
+#include "comitoz.jobs.h"
+#include "comitoz.lexer.h"
+#include "comitoz.output.h"
+#include "comitoz.pathcache.h"
+#include "comitoz.placement.h"
+#include "comitoz.reader.h"
+#include "comitoz.script.h"
+#include "comitoz.trace.h"
 #include "comitoz.utils.h"
+#include "comitoz.vars.h"
 
-#include <fcntl.h>     // open, close
-#include <signal.h>    // sigaction, sigfillset, SIG_IGN, SIG_DFL, kill
-#include <stdlib.h>    // malloc, realloc, free, getenv
-#include <stdio.h>     // getline, perror
-#include <string.h>    // memmove, strtok, strcmp, strcpy, strlen
+#include <errno.h>     // errno, EIO, ENOMEM, EINVAL
+#include <fcntl.h>     // open, close, pipe2, splice, tee
+#include <poll.h>      // poll, ppoll, POLLIN
+#include <sched.h>     // sched_setaffinity, cpu_set_t
+#include <signal.h>    // sigaction, sigfillset, sigprocmask, SIG_IGN, kill
+#include <spawn.h>     // posix_spawnp, posix_spawnattr_*, posix_spawn_file_*
+#include <stdlib.h>    // malloc, realloc, free, getenv, strtol, mkstemp
+#include <stdio.h>     // perror, printf, fdopen
+#include <string.h>    // strtok, strcmp, strcpy, stpcpy, strlen, memset
+#include <sys/resource.h> // getrusage, struct rusage
+#include <sys/socket.h> // socketpair
+#include <sys/stat.h>  // fstat, S_ISREG
 #include <sys/types.h> // pid_t
-#include <sys/wait.h>  // waitpid
-#include <unistd.h>    // chdir, getcwd, getpid, fork, exec, dup2, etc.
+#include <sys/wait.h>  // wait4, waitid, waitpid
+#include <termios.h>   // tcgetattr, tcsetattr, struct termios
+#include <unistd.h>    // chdir, getcwd, getpid, fork, exec, dup2, getopt, etc.
 
 
 /*** (The Dreaded) Globals ***/
 int status = 0;
 bool status_is_term = false;
 
-pid_t* children;
-int child_count = 0;
-int child_capacity;
+output_t stdout_buf = {STDOUT_FILENO, 0, ""}; // Everything the shell itself
+output_t stderr_buf = {STDERR_FILENO, 0, ""}; // prints goes through these
+
+job_table_t jobs;
+volatile sig_atomic_t sigchld_pending = 0;
+volatile uint64_t sigchld_at_ns = 0; // When the first `SIGCHLD` since the
+                                     // last reaping came in, or 0
+volatile sig_atomic_t sigchld_woke = 0; // Did one come in while waiting on
+                                        // input?
+
+path_cache_t path_cache;
+
+history_t history;      // The history log; not open unless interactive
+int64_t history_at = -1; // Offset of the current line's history entry, or
+                         // -1 if it has none (or a job has taken it over)
+
+server_t server = {-1, -1, -1, NULL, 0, NULL, NULL, 0, NULL, 0}; // `-S`
+uint64_t submit_id = 0; // The daemon-mode submission the current line is
+                        // running, or 0 if it isn't one (or a job has taken
+                        // it over)
+
+var_table_t vars;     // Every shell variable; the exported ones are `environ`
+pid_t last_bg_pid = 0; // What "$!" expands to; 0 until something's been
+                       // backgrounded
+
+arena_t command_arena; // Everything parsed from the current line lives here
+pid_t shell_pid;
+char pid_str[INT_STR_SIZE]; // Our PID, formatted once and for all for "$$"
+size_t pid_str_len;
+
+trace_ring_t* trace = NULL; // `NULL` if it couldn't be set up
 
 bool allow_bg = true;
+bool fast_builtins = true; // Run `echo` and friends in-process?
+bool script_images = true; // Run scripts from compiled images?
+
+job_usage_t fg_usage;         // What the last foreground job used
+bool report_bg_usage = false; // Add usage to every "is done" message?
+bool timing_command = false;  // Is the current line under `time`?
+
+int max_jobs = 0; // Cap on running background jobs; zero means no cap
+pending_job_t* pending_head = NULL;
+pending_job_t* pending_tail = NULL;
+int pending_count = 0;
+int reserved_job_id = 0; // The job number the job being launched was given
+                         // when it was queued, or 0 for the next one
+
+pending_job_t* held_head = NULL; // Jobs waiting on others (`after`), oldest
+pending_job_t* held_tail = NULL; // first
+dag_t dag;                       // What became of every job, by number
+int* line_deps = NULL;  // The jobs the current line is `after`
+int line_dep_count = 0;
+
+placer_t placer;                  // The CPUs and NUMA nodes jobs go on
+place_request_t default_placement; // Where `&` jobs go (from `-p`); zeroed
+                                   // is `PLACE_INHERIT`
+place_request_t line_placement;    // Where the current line's jobs go
+bool placing_command = false;      // Is the current line under `on`?
+const cpu_set_t* child_affinity = NULL; // What the children being launched
+                                        // get pinned to, or `NULL`
+int child_stderr = -1; // Where the children being launched send their
+                       // stderr, or -1 for the shell's own
+int child_stdout = -1; // Where the last of them sends its stdout, or -1 for
+                       // wherever it would anyway
+pid_t child_pgid = -1; // The process group they go in: 0 for a new one, or
+                       // -1 for the shell's own
+
+bool job_control = false; // Do foreground jobs get the terminal? Only if
+                          // we're interactive, and in its foreground
+pid_t shell_pgid;
+struct termios shell_tmodes; // The terminal as we found it
+
+capture_store_t captures = {NULL, NULL, 0, 0, 0, 0, 0}; // Background jobs'
+                                                        // output (`-c`)
+volatile sig_atomic_t capture_pending = 0;
+
+cache_store_t results = {NULL, -1, 0, 0, 0}; // For `cached` (`-C`); opened
+                                             // when it's first used
+bool caching_command = false; // Is a `cached` pipeline being run?
+bool cache_tee_ok = false;    // Did its output all make it into the cache?
+
+deadline_heap_t deadlines = {NULL, 0, 0, -1, 0}; // Every job's `timeout`
+uint64_t command_timeout_ns = 0; // The current line's `timeout`, or 0
+uint64_t command_grace_ns = DEADLINE_DEFAULT_GRACE_NS; // And its `-k`
+uint64_t shutdown_grace_ns = DEADLINE_DEFAULT_GRACE_NS; // From `-g`
+volatile sig_atomic_t shutdown_requested = 0;
+
+spawn_engine_t spawn_engine = ENGINE_HELPER;
+
+int helper_sock = -1; // Our end of the socket to the spawn helper, or -1 if
+                      // there's no helper
+pid_t helper_pid = -1;
+
+metrics_t metrics; // What `stats` (and `-M`) report
+metrics_export_t metrics_out = {NULL, NULL, 0, 0, -1, false}; // `-M`
 
 
 /*** Implementation ***/
@@ -30,454 +143,5698 @@ void SIGTSTP_main(int signo)
 {
     allow_bg = !allow_bg;
 
+    // Whatever the shell was in the middle of printing is left alone
     if (allow_bg)
     {
-        fwrite_stdout("\nExiting foreground-only mode", 29);
+        write_direct(STDOUT_FILENO, "\nExiting foreground-only mode", 29);
     }
     else
     {
-        fwrite_stdout("\nEntering foreground-only mode (& is now ignored)", 49);
+        write_direct(
+            STDOUT_FILENO,
+            "\nEntering foreground-only mode (& is now ignored)",
+            49
+        );
     }
 }
 
-void kill_children(void)
+void SIGCHLD_main(int signo)
 {
-    // Won't somebody, please, think of the children?
-    int i;
-    for (i = 0; i < child_count; ++i)
+    (void)signo;
+    sigchld_pending = 1;
+    sigchld_woke = 1;
+
+    // A job exited no later than this, which is as near as reaping it can
+    // tell (see `reap_children()`)
+    if (sigchld_at_ns == 0)
     {
-        kill(children[i], SIGTERM);
+        sigchld_at_ns = monotonic_ns();
     }
 
-    child_count = 0;
+    // The server sleeps in `epoll_wait()`, which has to be woken to go
+    // reaping
+    wake_server();
 }
 
-int exec_command(const char*  command,
-                 char* const* args,
-                 const char*  input_file,
-                 const char*  output_file,
-                 bool         background)
+void SIGIO_main(int signo)
 {
-    pid_t spawned_pid = fork(); // Immediately fork and handle child and
-                                // parent separately
-    switch (spawned_pid)
-    {
-        case -1:
-        {
-            perror("fork() failed!"); // Yikes
-
-            return 1;
-        }
-        case 0:  // In the child process
-        {
-            // If this is a foreground process, we want it to accept `SIGINT`s
-            // normally instead of ignoring them. If this is a background
-            // process then we want to ignore `SIGINT`s using `SIG_IGN`
-            struct sigaction SIGINT_action = {0};
-            if (background)
-            {
-                SIGINT_action.sa_handler = SIG_IGN;
-            }
-            else
-            {
-                SIGINT_action.sa_handler = SIG_DFL;
-            }
-            sigaction(SIGINT, &SIGINT_action, NULL);
-
-            int input_fd  = -1;
-            int output_fd = -1;
-            // Redirect inputs and outputs as necessary
-            if (input_file != NULL || background)
-            {
-                // Open for reading
-                input_fd = open(
-                    input_file != NULL ? input_file : "/dev/null",
-                    O_RDONLY
-                );
-                if (input_fd == -1)
-                {
-                    write_stderr("cannot open ", 12);
-                    write_stderr(input_file, strlen(input_file));
-                    fwrite_stderr(" for input\n", 11);
-                    exit(1);
-                    break;
-                }
+    (void)signo;
+    capture_pending = 1;
+    wake_server();
+}
 
-                // Do the actual redirecion
-                if (dup2(input_fd, STDIN_FILENO) == -1)
-                {
-                    perror("dup2() failed!");
-                    exit(1);
-                    break;
-                }
-            }
-            if (output_file != NULL || background)
-            {
-                // Open for writing
-                output_fd = open(
-                    output_file != NULL ? output_file : "/dev/null",
-                    O_WRONLY | O_CREAT | O_TRUNC,
-                    0644
-                );
-                if (output_fd == -1)
-                {
-                    write_stderr("cannot open ", 12);
-                    write_stderr(output_file, strlen(output_file));
-                    fwrite_stderr(" for output\n", 12);
-                    exit(1);
-                    break;
-                }
+void SIGTERM_main(int signo)
+{
+    (void)signo;
+    shutdown_requested = 1;
+    wake_server();
+}
 
-                // Do the actual redirection
-                if (dup2(output_fd, STDOUT_FILENO) == -1)
-                {
-                    perror("dup2() failed!");
-                    exit(1);
-                    break;
-                }
-            }
+void wake_server(void)
+{
+    if (server.wake_fd != -1)
+    {
+        int saved_errno = errno;
+        uint64_t one = 1;
+        ssize_t ignored = write(server.wake_fd, &one, sizeof(one));
+        (void)ignored;
+        errno = saved_errno;
+    }
+}
 
-            // `exec()` away
-            if (execvp(command, args) == -1)
-            {
-                // Youch
-                write_stderr(command, strlen(command));
-                fwrite_stderr(": no such file or directory\n", 28);
-                exit(1);
-            }
+void kill_children(void)
+{
+    // Won't somebody, please, think of the children? Every job gets the
+    // same treatment as one whose `timeout` is up, all at once.
+    uint64_t now = monotonic_ns();
+    job_t* job;
+    for (job = jobs.head; job != NULL; job = job->next)
+    {
+        job->deadline.grace_ns = shutdown_grace_ns;
+        if (deadline_set(&deadlines, &job->deadline, now) != 0)
+        {
+            deadline_signal(&job->deadline, SIGTERM); // No `SIGKILL` later
+        }
+    }
+    deadline_heap_fire(&deadlines);
 
+    // They're reaped and reported as usual, but only for so long
+    uint64_t give_up_ns = now + shutdown_grace_ns + SHUTDOWN_KILL_WAIT_NS;
+    while (jobs.count > 0 && monotonic_ns() < give_up_ns)
+    {
+        if (jobs.done_head == NULL
+            && await_child(P_ALL, 0, WEXITED, give_up_ns) == -1
+            && errno != EINTR)
+        {
             break;
         }
-        default: // In the parent process
+        sigchld_pending = 1;
+        if (handle_bg_processes() != 0)
         {
-            if (background) // This is started as a background process
-            {
-                // So alert the user as to its PID
-                write_stdout("background pid is ", 18);
-                char num_str[12];
-                sprintf(num_str, "%d\n", spawned_pid);
-                fwrite_stdout(num_str, strlen(num_str));
-
-                // Allocate space to store more child PIDs if needed
-                if (child_count >= child_capacity)
-                {
-                    child_capacity *= 2;
-                    children = realloc(
-                        children,
-                        child_capacity * sizeof(pid_t)
-                    );
-                }
-                // Register new child process
-                children[child_count] = spawned_pid;
-                child_count++;
-            }
-            else // Otherwise this is a foregrounded process
-            {
-                int wstatus;
-                // So we wait for it to complete
-                while (waitpid(spawned_pid, &wstatus, 0) == -1) {}
-
-                // And then set the "status" (and maybe alert the user)
-                // depending on how it completed
-                if (WIFEXITED(wstatus)) // Child terminated normally
-                {
-                    status = WEXITSTATUS(wstatus);
-                    status_is_term = false;
-                }
-                else                    // Child was killed by a signal
-                {
-                    status = WTERMSIG(wstatus);
-                    status_is_term = true;
-
-                    write_stdout("terminated by signal ", 21);
-                    char num_str[12];
-                    sprintf(num_str, "%d\n", status);
-                    fwrite_stdout(num_str, strlen(num_str));
-                }
-            }
-
             break;
         }
     }
+    output_flush(&stdout_buf);
 
-    return 0;
+    for (job = jobs.head; job != NULL; job = job->next)
+    {
+        deadline_clear(&deadlines, &job->deadline);
+    }
+    job_table_destroy(&jobs);
 }
 
-int handle_bg_processes(void)
+int await_child(idtype_t idtype, id_t id, int options, uint64_t until_ns)
 {
-    int i;
-    for (i = 0; i < child_count; ++i)
+    siginfo_t info;
+    // Only a child can end it, unless there are timers to keep an eye on
+    if (deadlines.count == 0 && metrics_out.timer_fd == -1 && until_ns == 0)
     {
-        int wstatus;
-        // Try to gather up the finished child process, but don't wait for
-        // it if it's still going
-        pid_t waited = waitpid(children[i], &wstatus, WNOHANG);
-        switch (waited)
+        return waitid(idtype, id, &info, options | WNOWAIT);
+    }
+
+    // `SIGCHLD` is held off until `ppoll()` is sleeping, so that a child
+    // that exits just after the check still wakes it
+    sigset_t chld_set;
+    sigset_t wait_mask;
+    sigemptyset(&chld_set);
+    sigaddset(&chld_set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_set, &wait_mask);
+
+    info.si_pid = 0;
+    int r = waitid(idtype, id, &info, options | WNOWAIT | WNOHANG);
+    int err = errno;
+    if (r == 0 && info.si_pid == 0) // Nothing yet
+    {
+        struct timespec timeout;
+        const struct timespec* timeout_ptr = NULL;
+        if (until_ns != 0)
         {
-            case -1: // Oh no
-            {
-                perror("waitpid() failed!");
+            uint64_t now = monotonic_ns();
+            uint64_t left = until_ns > now ? until_ns - now : 0;
+            timeout.tv_sec = (time_t)(left / 1000000000u);
+            timeout.tv_nsec = (long)(left % 1000000000u);
+            timeout_ptr = &timeout;
+        }
+        struct pollfd timers[2] = {
+            {deadlines.timer_fd, POLLIN, 0},
+            {metrics_out.timer_fd, POLLIN, 0}
+        };
+        r = -1;
+        err = ppoll(timers, 2, timeout_ptr, &wait_mask) == -1
+            && errno != EINTR
+            ? errno
+            : EINTR;
+    }
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
 
-                return 1;
-            }
-            case 0:  // It's still going, so we leave it alone and do nothing
-            {
-                break;
-            }
-            default: // We got one
-            {
-                // Report dead child process
-                write_stdout("background pid ", 15);
-                char num_str[64];
-                if (WIFEXITED(wstatus)) // Bg process exited normally
-                {
-                    sprintf(
-                        num_str,
-                        "%d is done: exit value %d\n",
-                        children[i],
-                        WEXITSTATUS(wstatus)
-                    );
-                }
-                else                    // Bg process was killed by a signal
-                {
-                    sprintf(
-                        num_str,
-                        "%d is done: terminated by signal %d\n",
-                        children[i],
-                        WTERMSIG(wstatus)
-                    );
-                }
-                fwrite_stdout(num_str, strlen(num_str));
+    deadline_heap_fire(&deadlines);
+    export_metrics();
+    errno = err;
 
-                // Remove dead child PID from `children` array (treating the
-                // array like a `std::vector`, but less C++ and more C89)
-                int trailing_entries = child_count - i - 1;
-                if (trailing_entries > 0)
-                {
-                    memmove(
-                        &children[i],
-                        &children[i + 1],
-                        trailing_entries * sizeof(pid_t)
-                    );
-                }
+    return r;
+}
 
-                child_count--;
-                i--;
+void set_child_SIGINT(bool background)
+{
+    // If this is a foreground process, we want it to accept `SIGINT`s
+    // normally instead of ignoring them. If this is a background process then
+    // we want to ignore `SIGINT`s using `SIG_IGN`
+    struct sigaction SIGINT_action = {0};
+    if (background)
+    {
+        SIGINT_action.sa_handler = SIG_IGN;
+    }
+    else
+    {
+        SIGINT_action.sa_handler = SIG_DFL;
+    }
+    sigaction(SIGINT, &SIGINT_action, NULL);
+}
 
-                break;
-            }
-        }
+void set_child_pgroup(void)
+{
+    if (child_pgid != -1)
+    {
+        setpgid(0, child_pgid);
     }
 
-    return 0;
+    struct sigaction SIGTTOU_action = {0};
+    SIGTTOU_action.sa_handler = SIG_DFL;
+    sigaction(SIGTTOU, &SIGTTOU_action, NULL);
 }
 
-int process_command(char* line)
+int open_redirect(const char* path, bool for_output)
 {
-    int ret = 0;
+    int fd;
+    if (for_output)
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    else
+    {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
 
-    char* token = strtok(line, " \n");
-    // Handle blank lines and comments
-    if (token == NULL || token[0] == '#')
+    if (fd == -1)
     {
-        return 0;
+        output_str(&stderr_buf, "cannot open ");
+        output_str(&stderr_buf, path);
+        output_str(&stderr_buf, for_output ? " for output\n" : " for input\n");
+        output_flush(&stderr_buf);
     }
 
-    // State management for the parsing
-    char* command = NULL;
-    char* args[512 + 2]; // Guaranteed to handle 512 (or less) main arguments
-    int argc = 1; // Start with "1 argument" since the first one is always
-                  // just the command
-    char* input_file = NULL;
-    bool looking_for_input = false;
-    char* output_file = NULL;
-    bool looking_for_output = false;
-    bool background = false; // Foreground by default
+    return fd;
+}
 
-    // Parse command, one token at a time
-    while (token != NULL)
+pid_t fork_command(const char*  command,
+                   const char*  exec_path,
+                   char* const* args,
+                   const char*  input_file,
+                   const char*  output_file,
+                   int          input_fd,
+                   int          output_fd,
+                   bool         background)
+{
+    // When going straight to a cached path, the child reports back through
+    // this pipe if that path turned out to be no good. A successful
+    // `exec()` closes it without a word.
+    int report_fds[2] = {-1, -1};
+    if (exec_path != NULL && pipe2(report_fds, O_CLOEXEC) == -1)
     {
-        background = false;
+        exec_path = NULL;
+    }
 
-        if (strcmp(token, "<") == 0)
-        {
-            looking_for_input = true;
-        }
-        else if (strcmp(token, ">") == 0)
-        {
-            looking_for_output = true;
-        }
-        else if (strcmp(token, "&") == 0)
+    uint64_t fork_ns = monotonic_ns();
+    uint64_t fork_ticket = trace_reserve(trace);
+    pid_t spawned_pid = fork(); // Immediately fork and handle child and
+                                // parent separately
+    if (spawned_pid != 0) // In the parent process (or `fork()` failed)
+    {
+        trace_fill(trace, fork_ticket, fork_ns, TRACE_FORK, spawned_pid, 0);
+        if (exec_path != NULL)
         {
-            if (allow_bg) // This variable is toggled on receipt of a `SIGTSTP`
+            close(report_fds[1]);
+
+            int exec_errno;
+            if (spawned_pid > 0
+                && read(report_fds[0], &exec_errno, sizeof(exec_errno))
+                   == sizeof(exec_errno)
+                && (exec_errno == ENOENT || exec_errno == ENOEXEC))
             {
-                background = true;
+                path_cache_forget(&path_cache, command);
             }
-        }
-        else if (looking_for_input)
-        {
-            input_file = expand_pid(token);
-            looking_for_input = false;
-        }
-        else if (looking_for_output)
-        {
-            output_file = expand_pid(token);
-            looking_for_output = false;
-        }
-        else if (command == NULL)
-        {
-            command = expand_pid(token);
-        }
-        else
-        {
-            args[argc] = expand_pid(token);
-            argc++;
+            close(report_fds[0]);
         }
 
-        token = strtok(NULL, " \n");
+        return spawned_pid;
     }
 
-    args[0] = command; // First arg is always the command name
-    args[argc] = NULL; // Last "arg" is just a `NULL` terminator
+    // In the child process
+    exec_child(
+        command,
+        exec_path,
+        args,
+        input_file,
+        output_file,
+        input_fd,
+        output_fd,
+        background,
+        report_fds[1],
+        fork_ticket
+    );
+}
 
-    // Start doing stuff based on the parsed command, built-ins first.
-    if (strcmp(command, "exit") == 0) // `exit` built-in command
+void exec_child(const char*  command,
+                const char*  exec_path,
+                char* const* args,
+                const char*  input_file,
+                const char*  output_file,
+                int          input_fd,
+                int          output_fd,
+                bool         background,
+                int          report_fd,
+                uint64_t     fork_ticket)
+{
+    set_child_SIGINT(background);
+    set_child_pgroup();
+    if (child_affinity != NULL)
     {
-        ret = -1;
+        sched_setaffinity(0, sizeof(cpu_set_t), child_affinity);
     }
-    else if (strcmp(command, "cd") == 0) // `cd` built-in command
+
+    // Redirect inputs and outputs as necessary. Files named on the command
+    // line take precedence over pipes.
+    if (input_file != NULL)
     {
-        if (argc < 2) // Bare `cd` invocation takes us to the `$HOME` dir
-        {
-            const char* target = getenv("HOME");
-            if (chdir(target) == -1)
-            {
-                write_stderr("could not cd to ", 16);
-                write_stderr(target, strlen(target));
-                fwrite_stderr("\n", 1);
-            }
-        }
-        else // Otherwise we change to the specified dir
+        input_fd = open_redirect(input_file, false);
+        if (input_fd == -1)
         {
-            const char* target = args[1];
-            if (chdir(target) == -1)
-            {
-                write_stderr("could not cd to ", 16);
-                write_stderr(target, strlen(target));
-                fwrite_stderr("\n", 1);
-            }
+            exit(1);
         }
     }
-    else if (strcmp(command, "status") == 0) // `status` built-in command
+    if (input_fd != -1 && dup2(input_fd, STDIN_FILENO) == -1)
     {
-        if (status_is_term)
-        {
-            write_stdout("terminated by signal ", 21);
-        }
-        else
-        {
-            write_stdout("exit value ", 11);
-        }
-
-        char num_str[12];
-        sprintf(num_str, "%d\n", status);
-
-        fwrite_stdout(num_str, strlen(num_str));
+        perror("dup2() failed!");
+        exit(1);
     }
-    else // Otherwise we `exec`, minding the PATH
+
+    if (output_file != NULL)
     {
-        ret = exec_command(
-            command,
-            args,
-            input_file,
-            output_file,
-            background
-        );
+        output_fd = open_redirect(output_file, true);
+        if (output_fd == -1)
+        {
+            exit(1);
+        }
     }
-
-    // Cleanup
-    free(command);
-    int i;
-    for (i = 1; i < argc; ++i)
+    if (output_fd != -1 && dup2(output_fd, STDOUT_FILENO) == -1)
     {
-        free(args[i]);
+        perror("dup2() failed!");
+        exit(1);
     }
-    if (input_file != NULL)
+    if (child_stderr != -1 && dup2(child_stderr, STDERR_FILENO) == -1)
     {
-        free(input_file);
+        perror("dup2() failed!");
+        exit(1);
     }
-    if (output_file != NULL)
+
+    // `exec()` away. Every other descriptor the shell has open is
+    // `O_CLOEXEC`, so pipe ends belonging to other stages go away here too.
+    trace_emit(trace, TRACE_EXEC, 0, (int64_t)fork_ticket);
+    if (exec_path != NULL)
     {
-        free(output_file);
+        execv(exec_path, args);
+
+        // The cache is stale, so tell the parent and do it the slow way
+        int exec_errno = errno;
+        if (write(report_fd, &exec_errno, sizeof(exec_errno)) < 0) {}
     }
+    execvp(command, args);
 
-    return ret;
+    // Youch
+    output_str(&stderr_buf, command);
+    output_str(&stderr_buf, ": no such file or directory\n");
+    output_flush(&stderr_buf);
+    exit(1);
 }
 
-int main_loop(void)
+pid_t spawn_command(const char*  command,
+                    const char*  exec_path,
+                    char* const* args,
+                    const char*  input_file,
+                    const char*  output_file,
+                    int          input_fd,
+                    int          output_fd,
+                    bool         background)
 {
-    // `getline` stuff
-    char* line = NULL;
-    size_t getline_buffer_size = 0;
-    ssize_t chars_read;
-
-    // Holds result of calling off to the command-processing function
-    int command_result;
-
-    // Main loop, for real
-    do
+    // The redirection targets are opened here in the parent rather than via
+    // `posix_spawn_file_actions_addopen()`, so that a failure can still be
+    // attributed to the right file with the usual error message
+    int opened_input_fd  = -1;
+    int opened_output_fd = -1;
+    if (input_file != NULL)
     {
-        int bg_res = handle_bg_processes(); // Collect up now-dead child
-                                            // processes and report them just
-                                            // before prompting the user
-        if (bg_res != 0) // Something went terribly wrong with handling the
-        {                // backgrounded children
-            if (line != NULL)
-            {
-                free(line);
-            }
-
-            return bg_res;
-        }
-
-        fwrite_stdout(": ", 2); // Prompt
-
-        while ((chars_read = getline(&line, &getline_buffer_size, stdin)) == -1)
+        input_fd = opened_input_fd = open_redirect(input_file, false);
+        if (input_fd == -1)
         {
-            // `getline()` was interrupted by the signal, so clear the buffer
-            // and re-prompt
-            clearerr(stdin);
+            status = 1;
+            status_is_term = false;
 
-            fwrite_stdout("\n: ", 3);
+            return 0;
         }
-
-        if ((command_result = process_command(line)) != 0)
+    }
+    if (output_file != NULL)
+    {
+        output_fd = opened_output_fd = open_redirect(output_file, true);
+        if (output_fd == -1)
         {
-            // "Please exit" result of calling out to process the command, so
-            // we exit
-            if (line != NULL)
+            if (opened_input_fd != -1)
             {
-                free(line);
+                close(opened_input_fd);
             }
 
-            return command_result;
+            status = 1;
+            status_is_term = false;
+
+            return 0;
         }
-    } while (1);
+    }
+
+    posix_spawn_file_actions_t file_actions;
+    posix_spawnattr_t          attr;
+    posix_spawn_file_actions_init(&file_actions);
+    posix_spawnattr_init(&attr);
 
-    // Clean up one last time
-    if (line != NULL)
+    // `dup2()` clears `O_CLOEXEC` on the new descriptor, and the originals
+    // get closed on `exec()`
+    if (input_fd != -1)
     {
-        free(line);
+        posix_spawn_file_actions_adddup2(&file_actions, input_fd, STDIN_FILENO);
+    }
+    if (output_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(
+            &file_actions,
+            output_fd,
+            STDOUT_FILENO
+        );
+    }
+    if (child_stderr != -1)
+    {
+        posix_spawn_file_actions_adddup2(
+            &file_actions,
+            child_stderr,
+            STDERR_FILENO
+        );
     }
 
-    return 0;
-}
+    // Signals the shell catches are reset to `SIG_DFL` in the child no matter
+    // what, but `SIGINT` is the one that has to be explicitly ignored for
+    // background processes. There is no spawn attribute for "ignore", so the
+    // shell briefly ignores it itself and lets the child inherit that.
+    sigset_t sig_default;
+    sigset_t sig_mask;
+    sigemptyset(&sig_default);
+    sigemptyset(&sig_mask);
+    sigaddset(&sig_default, SIGTSTP);
+    sigaddset(&sig_default, SIGTTOU);
+    if (!background)
+    {
+        sigaddset(&sig_default, SIGINT);
+    }
+    posix_spawnattr_setsigdefault(&attr, &sig_default);
+    posix_spawnattr_setsigmask(&attr, &sig_mask);
+    short spawn_flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (child_pgid != -1)
+    {
+        posix_spawnattr_setpgroup(&attr, child_pgid);
+        spawn_flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, spawn_flags);
 
-int main(void)
-{
-    // Establish general signal handling
-    struct sigaction SIGINT_ignore  = {0};
-    struct sigaction SIGTSTP_action = {0};
+    struct sigaction SIGINT_saved;
+    if (background)
+    {
+        struct sigaction SIGINT_action = {0};
+        SIGINT_action.sa_handler = SIG_IGN;
+        sigaction(SIGINT, &SIGINT_action, &SIGINT_saved);
+    }
+
+    // Go straight to the cached path if there is one, and fall back on
+    // searching the PATH if it has gone stale
+    uint64_t spawn_ns = monotonic_ns();
+    pid_t spawned_pid;
+    int spawn_res = ENOENT;
+    if (exec_path != NULL)
+    {
+        spawn_res = posix_spawn(
+            &spawned_pid,
+            exec_path,
+            &file_actions,
+            &attr,
+            args,
+            vars.envp
+        );
+        if (spawn_res == ENOENT || spawn_res == ENOEXEC)
+        {
+            path_cache_forget(&path_cache, command);
+        }
+    }
+    if (spawn_res == ENOENT || spawn_res == ENOEXEC)
+    {
+        spawn_res = posix_spawnp(
+            &spawned_pid,
+            command,
+            &file_actions,
+            &attr,
+            args,
+            vars.envp
+        );
+    }
+
+    if (background)
+    {
+        sigaction(SIGINT, &SIGINT_saved, NULL);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&file_actions);
+    if (opened_input_fd != -1)
+    {
+        close(opened_input_fd);
+    }
+    if (opened_output_fd != -1)
+    {
+        close(opened_output_fd);
+    }
+
+    switch (spawn_res)
+    {
+        case 0:
+        {
+            // There's no spawn attribute for affinity, so the child is
+            // pinned from out here, just after it has started
+            if (child_affinity != NULL)
+            {
+                sched_setaffinity(
+                    spawned_pid,
+                    sizeof(cpu_set_t),
+                    child_affinity
+                );
+            }
+
+            // `posix_spawn()` doesn't come back until the `exec()` is done
+            trace_emit_at(trace, spawn_ns, TRACE_SPAWN, spawned_pid, 0);
+            trace_emit(trace, TRACE_EXEC, spawned_pid, 0);
+
+            return spawned_pid;
+        }
+        case EAGAIN: // The same things that make `fork()` fail
+        case ENOMEM:
+        {
+            errno = spawn_res;
+
+            return -1;
+        }
+        default:     // Everything else is the `exec()` itself failing
+        {
+            output_str(&stderr_buf, command);
+            output_str(&stderr_buf, ": no such file or directory\n");
+            output_flush(&stderr_buf);
+
+            status = 1;
+            status_is_term = false;
+
+            return 0;
+        }
+    }
+}
+
+int relay(int in_fd, int out_fd, int tee_fd)
+{
+    ssize_t moved;
+    if (tee_fd != -1)
+    {
+        // Duplicate whatever is sitting in the input pipe into the output
+        // pipe without consuming it, then move that same amount into the
+        // side file. Both halves stay in the kernel.
+        while ((moved = tee(in_fd, out_fd, RELAY_CHUNK, 0)) > 0)
+        {
+            ssize_t left = moved;
+            while (left > 0)
+            {
+                ssize_t spliced = splice(
+                    in_fd,
+                    NULL,
+                    tee_fd,
+                    NULL,
+                    (size_t)left,
+                    SPLICE_F_MOVE
+                );
+                if (spliced <= 0)
+                {
+                    return spliced == 0 ? 0 : errno;
+                }
+                left -= spliced;
+            }
+        }
+    }
+    else
+    {
+        while ((moved = splice(
+            in_fd,
+            NULL,
+            out_fd,
+            NULL,
+            RELAY_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_MORE
+        )) > 0) {}
+    }
+
+    if (moved == 0)
+    {
+        return 0;
+    }
+    if (errno != EINVAL)
+    {
+        return errno;
+    }
+
+    // `EINVAL` means neither end is a pipe (or, for `tee()`, that one of
+    // them isn't), or the file can't be spliced to, e.g. a terminal. Only
+    // ever happens on the first call, so nothing has been moved yet and we
+    // can fall back to plain old copying through a buffer.
+    char buf[RELAY_CHUNK];
+    ssize_t bytes_read;
+    while ((bytes_read = read(in_fd, buf, sizeof(buf))) > 0)
+    {
+        if (write(out_fd, buf, (size_t)bytes_read) != bytes_read)
+        {
+            return errno;
+        }
+        if (tee_fd != -1
+            && write(tee_fd, buf, (size_t)bytes_read) != bytes_read)
+        {
+            return errno;
+        }
+    }
+
+    return bytes_read == 0 ? 0 : errno;
+}
+
+pid_t fork_relay(const char* input_file,
+                 const char* output_file,
+                 int         input_fd,
+                 int         output_fd,
+                 int         stray_fd,
+                 bool        background)
+{
+    uint64_t fork_ns = monotonic_ns();
+    pid_t spawned_pid = fork();
+    if (spawned_pid != 0) // In the parent process (or `fork()` failed)
+    {
+        trace_emit_at(trace, fork_ns, TRACE_FORK, spawned_pid, 0);
+
+        return spawned_pid;
+    }
+
+    // In the child process. Holding on to the helper's socket would keep it
+    // from noticing that the shell has gone.
+    if (helper_sock != -1)
+    {
+        close(helper_sock);
+    }
+    relay_child(
+        input_file,
+        output_file,
+        input_fd,
+        output_fd,
+        stray_fd,
+        background
+    );
+}
+
+void relay_child(const char* input_file,
+                 const char* output_file,
+                 int         input_fd,
+                 int         output_fd,
+                 int         stray_fd,
+                 bool        background)
+{
+    set_child_SIGINT(background);
+    set_child_pgroup();
+    if (child_affinity != NULL)
+    {
+        sched_setaffinity(0, sizeof(cpu_set_t), child_affinity);
+    }
+
+    // A relay doesn't `exec()`, so `O_CLOEXEC` does us no good. The rest of
+    // the pipeline's pipes are closed in the parent as it goes, so the only
+    // stray is the read end of our own output pipe, which has to go or we'd
+    // never see `EPIPE` if the next stage quits early.
+    if (stray_fd != -1)
+    {
+        close(stray_fd);
+    }
+    if (input_file != NULL)
+    {
+        if (input_fd != -1)
+        {
+            close(input_fd);
+        }
+        if ((input_fd = open_redirect(input_file, false)) == -1)
+        {
+            exit(1);
+        }
+    }
+    else if (input_fd == -1)
+    {
+        input_fd = STDIN_FILENO;
+    }
+
+    // With a next stage to feed, the output file becomes a side copy of the
+    // stream. Otherwise it's just where the stream goes.
+    int tee_fd = -1;
+    if (output_file != NULL)
+    {
+        int file_fd = open_redirect(output_file, true);
+        if (file_fd == -1)
+        {
+            exit(1);
+        }
+
+        if (output_fd != -1)
+        {
+            tee_fd = file_fd;
+        }
+        else
+        {
+            output_fd = file_fd;
+        }
+    }
+    else if (output_fd == -1)
+    {
+        output_fd = STDOUT_FILENO;
+    }
+
+    int r = relay(input_fd, output_fd, tee_fd);
+    if (r != 0 && r != EPIPE)
+    {
+        errno = r;
+        perror("relay failed");
+        exit(1);
+    }
+
+    exit(0);
+}
+
+int start_helper(void)
+{
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1)
+    {
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        close(socks[0]);
+        close(socks[1]);
+
+        return 1;
+    }
+    if (pid == 0) // In the helper
+    {
+        close(socks[0]);
+        helper_main(socks[1]);
+    }
+
+    close(socks[1]);
+    helper_sock = socks[0];
+    helper_pid = pid;
+
+    return 0;
+}
+
+void stop_helper(void)
+{
+    if (helper_sock == -1)
+    {
+        return;
+    }
+
+    close(helper_sock);
+    helper_sock = -1;
+
+    // It may already have been reaped along with everything else, if it
+    // died early
+    while (waitpid(helper_pid, NULL, 0) == -1 && errno == EINTR) {}
+}
+
+void helper_main(int sock)
+{
+    // Keyboard signals are the shell's business, not ours
+    struct sigaction ignore_action = {0};
+    ignore_action.sa_handler = SIG_IGN;
+    sigaction(SIGINT,  &ignore_action, NULL);
+    sigaction(SIGTSTP, &ignore_action, NULL);
+
+    // Every string is at least a `'\0'`, so there can't be more arguments
+    // than half the biggest request
+    char* buf = malloc(HELPER_MAX_REQUEST);
+    char** args = malloc((HELPER_MAX_REQUEST / 2 + 1) * sizeof(char*));
+    if (buf == NULL || args == NULL)
+    {
+        _exit(1);
+    }
+
+    // The helper keeps its own copy of the exported variables, the same way
+    // the shell does, so that keeping up with a change costs no more than
+    // it did the shell (`setenv()` is a scan of the whole environment)
+    if (var_table_init(&vars) != 0 || var_table_import(&vars, environ) != 0)
+    {
+        _exit(1);
+    }
+    environ = vars.envp;
+
+    while (1)
+    {
+        int fds[HELPER_FD_COUNT];
+        int fd_count;
+        ssize_t len = helper_recv(sock, buf, HELPER_MAX_REQUEST, fds,
+                                  &fd_count);
+        if (len <= 0) // The shell has hung up (or worse)
+        {
+            _exit(0);
+        }
+
+        // Unpack the request, giving up on anything malformed
+        helper_request_t request;
+        memset(&request, 0, sizeof(request));
+        if (len >= (ssize_t)sizeof(request))
+        {
+            memcpy(&request, buf, sizeof(request));
+        }
+        char* strings = buf + sizeof(request);
+        bool ok = len >= (ssize_t)sizeof(request)
+            && request.strings_len == (size_t)len - sizeof(request)
+            && request.strings_len > 0
+            && strings[request.strings_len - 1] == '\0'
+            && request.argc >= 0
+            && request.argc <= HELPER_MAX_REQUEST / 2;
+
+        char* pos = strings;
+        char* end = strings + (ok ? request.strings_len : 0);
+        const char* command = NULL;
+        const char* exec_path = NULL;
+        const char* input_file = NULL;
+        const char* output_file = NULL;
+        const char** fields[] = {
+            &command,
+            (request.flags & HELPER_EXEC_PATH) ? &exec_path : NULL,
+            (request.flags & HELPER_INPUT_FILE) ? &input_file : NULL,
+            (request.flags & HELPER_OUTPUT_FILE) ? &output_file : NULL
+        };
+        size_t f;
+        for (f = 0; ok && f < sizeof(fields) / sizeof(fields[0]); ++f)
+        {
+            if (fields[f] != NULL)
+            {
+                ok = pos < end;
+                *fields[f] = pos;
+                pos += strlen(pos) + 1;
+            }
+        }
+        int i;
+        for (i = 0; ok && i < request.argc; ++i)
+        {
+            ok = pos < end;
+            args[i] = pos;
+            pos += strlen(pos) + 1;
+        }
+        args[ok ? request.argc : 0] = NULL;
+
+        if (ok && request.op == HELPER_CHDIR)
+        {
+            if (chdir(command) == -1) {}
+        }
+        else if (ok && request.op == HELPER_SETENV)
+        {
+            size_t name_len = var_name_len(command);
+            if (name_len > 0 && command[name_len] == '=')
+            {
+                var_set(
+                    &vars,
+                    command,
+                    name_len,
+                    command + name_len + 1,
+                    true
+                );
+                environ = vars.envp;
+            }
+        }
+        else if (ok && request.op == HELPER_UNSETENV)
+        {
+            var_unset(&vars, command, strlen(command));
+            environ = vars.envp;
+        }
+
+        helper_response_t response = {-1, EINVAL};
+        if (ok && fd_count == HELPER_FD_COUNT
+            && (request.op == HELPER_EXEC || request.op == HELPER_RELAY))
+        {
+            bool background = (request.flags & HELPER_BACKGROUND) != 0;
+
+            int report_fds[2] = {-1, -1};
+            if (exec_path != NULL && pipe2(report_fds, O_CLOEXEC) == -1)
+            {
+                exec_path = NULL;
+            }
+
+            // The child pins itself, and joins its process group, just as
+            // if the shell had forked it
+            child_affinity = (request.flags & HELPER_AFFINITY)
+                ? &request.affinity
+                : NULL;
+            child_pgid = (request.flags & HELPER_PGROUP) ? request.pgid : -1;
+
+            response.pid = fork_sibling();
+            response.err = response.pid == -1 ? errno : 0;
+            if (response.pid == 0) // In the new child
+            {
+                close(sock);
+                if (report_fds[0] != -1)
+                {
+                    close(report_fds[0]);
+                }
+
+                int signo;
+                for (signo = 1; signo < 32; ++signo)
+                {
+                    struct sigaction action = {0};
+                    if (request.sig_default & (1u << signo))
+                    {
+                        action.sa_handler = SIG_DFL;
+                        sigaction(signo, &action, NULL);
+                    }
+                    else if (request.sig_ignore & (1u << signo))
+                    {
+                        action.sa_handler = SIG_IGN;
+                        sigaction(signo, &action, NULL);
+                    }
+                }
+                sigset_t empty_mask;
+                sigemptyset(&empty_mask);
+                sigprocmask(SIG_SETMASK, &empty_mask, NULL);
+
+                // The descriptors came in `O_CLOEXEC`, but a relay never
+                // gets as far as an `exec()`
+                int fd;
+                for (fd = 0; fd < HELPER_FD_COUNT; ++fd)
+                {
+                    if (dup2(fds[fd], fd) == -1)
+                    {
+                        perror("dup2() failed!");
+                        _exit(1);
+                    }
+                }
+                for (fd = 0; fd < HELPER_FD_COUNT; ++fd)
+                {
+                    if (fds[fd] >= HELPER_FD_COUNT)
+                    {
+                        close(fds[fd]);
+                    }
+                }
+
+                if (request.op == HELPER_RELAY)
+                {
+                    relay_child(
+                        input_file,
+                        output_file,
+                        (request.flags & HELPER_INPUT_FD) ? STDIN_FILENO : -1,
+                        (request.flags & HELPER_OUTPUT_FD) ? STDOUT_FILENO
+                                                           : -1,
+                        -1,
+                        background
+                    );
+                }
+                exec_child(
+                    command,
+                    exec_path,
+                    args,
+                    input_file,
+                    output_file,
+                    -1,
+                    -1,
+                    background,
+                    report_fds[1],
+                    request.trace_ticket
+                );
+            }
+
+            // Find out whether the cached path worked, for the shell to
+            // forget it if not
+            if (exec_path != NULL)
+            {
+                close(report_fds[1]);
+
+                int exec_errno;
+                if (response.pid > 0
+                    && read(report_fds[0], &exec_errno, sizeof(exec_errno))
+                       == sizeof(exec_errno))
+                {
+                    response.err = exec_errno;
+                }
+                close(report_fds[0]);
+            }
+        }
+
+        // The child has its own copies of these now
+        for (i = 0; i < fd_count; ++i)
+        {
+            close(fds[i]);
+        }
+
+        // Only launches get an answer
+        if (ok && request.op != HELPER_EXEC && request.op != HELPER_RELAY)
+        {
+            continue;
+        }
+        if (helper_send(sock, &response, sizeof(response), NULL, 0) != 0)
+        {
+            _exit(0);
+        }
+    }
+}
+
+int helper_pack(char* buf, size_t* len, const char* str)
+{
+    size_t str_size = strlen(str) + 1;
+    if (str_size > HELPER_MAX_REQUEST - *len)
+    {
+        return 1;
+    }
+    memcpy(buf + *len, str, str_size);
+    *len += str_size;
+
+    return 0;
+}
+
+int helper_launch(helper_op_t  op,
+                  const char*  command,
+                  const char*  exec_path,
+                  char* const* args,
+                  const char*  input_file,
+                  const char*  output_file,
+                  int          input_fd,
+                  int          output_fd,
+                  bool         background,
+                  pid_t*       pid)
+{
+    if (helper_sock == -1)
+    {
+        return 1;
+    }
+
+    union
+    {
+        helper_request_t header;
+        char             bytes[HELPER_MAX_REQUEST];
+    } msg;
+    memset(&msg.header, 0, sizeof(msg.header));
+    msg.header.op = op;
+
+    // Same signal setup as `set_child_SIGINT()` and `set_child_pgroup()`,
+    // plus undoing the helper's own ignoring of `SIGTSTP`
+    msg.header.sig_default = 1u << SIGTSTP | 1u << SIGTTOU;
+    if (background)
+    {
+        msg.header.flags |= HELPER_BACKGROUND;
+        msg.header.sig_ignore = 1u << SIGINT;
+    }
+    else
+    {
+        msg.header.sig_default |= 1u << SIGINT;
+    }
+
+    // Relays have no command; an empty one keeps the layout the same
+    size_t len = sizeof(msg.header);
+    int too_big = helper_pack(msg.bytes, &len, command != NULL ? command : "");
+    if (exec_path != NULL)
+    {
+        msg.header.flags |= HELPER_EXEC_PATH;
+        too_big |= helper_pack(msg.bytes, &len, exec_path);
+    }
+    if (input_file != NULL)
+    {
+        msg.header.flags |= HELPER_INPUT_FILE;
+        too_big |= helper_pack(msg.bytes, &len, input_file);
+    }
+    if (output_file != NULL)
+    {
+        msg.header.flags |= HELPER_OUTPUT_FILE;
+        too_big |= helper_pack(msg.bytes, &len, output_file);
+    }
+    if (input_fd != -1)
+    {
+        msg.header.flags |= HELPER_INPUT_FD;
+    }
+    if (output_fd != -1)
+    {
+        msg.header.flags |= HELPER_OUTPUT_FD;
+    }
+    if (child_affinity != NULL)
+    {
+        msg.header.flags |= HELPER_AFFINITY;
+        msg.header.affinity = *child_affinity;
+    }
+    if (child_pgid != -1)
+    {
+        msg.header.flags |= HELPER_PGROUP;
+        msg.header.pgid = child_pgid;
+    }
+    for (; args != NULL && *args != NULL && !too_big; ++args)
+    {
+        too_big |= helper_pack(msg.bytes, &len, *args);
+        msg.header.argc++;
+    }
+    if (too_big)
+    {
+        return 1;
+    }
+    msg.header.strings_len = (uint32_t)(len - sizeof(msg.header));
+
+    uint64_t fork_ns = monotonic_ns();
+    uint64_t fork_ticket = trace_reserve(trace);
+    msg.header.trace_ticket = fork_ticket;
+
+    // Without a pipe, the child gets the shell's own stdin or stdout (which
+    // may currently be redirected, e.g. by `parallel`)
+    int fds[HELPER_FD_COUNT] = {
+        input_fd != -1 ? input_fd : STDIN_FILENO,
+        output_fd != -1 ? output_fd : STDOUT_FILENO,
+        child_stderr != -1 ? child_stderr : STDERR_FILENO
+    };
+    helper_response_t response;
+    int unused_fds[HELPER_FD_COUNT];
+    int unused_count;
+    if (helper_send(helper_sock, msg.bytes, len, fds, HELPER_FD_COUNT) != 0
+        || helper_recv(helper_sock, &response, sizeof(response), unused_fds,
+                       &unused_count) != sizeof(response))
+    {
+        // The helper is gone. From here on the shell does its own forking.
+        close(helper_sock);
+        helper_sock = -1;
+        trace_fill(trace, fork_ticket, fork_ns, TRACE_FORK, -1, 0);
+
+        return 1;
+    }
+
+    trace_fill(trace, fork_ticket, fork_ns, TRACE_FORK, response.pid, 0);
+    if (response.pid == -1)
+    {
+        errno = response.err;
+    }
+    else if (exec_path != NULL
+             && (response.err == ENOENT || response.err == ENOEXEC))
+    {
+        path_cache_forget(&path_cache, command);
+    }
+    *pid = response.pid;
+
+    return 0;
+}
+
+pid_t helper_command(const char*  command,
+                     const char*  exec_path,
+                     char* const* args,
+                     const char*  input_file,
+                     const char*  output_file,
+                     int          input_fd,
+                     int          output_fd,
+                     bool         background)
+{
+    pid_t pid;
+    if (helper_launch(
+        HELPER_EXEC,
+        command,
+        exec_path,
+        args,
+        input_file,
+        output_file,
+        input_fd,
+        output_fd,
+        background,
+        &pid
+    ) != 0)
+    {
+        pid = fork_command(
+            command,
+            exec_path,
+            args,
+            input_file,
+            output_file,
+            input_fd,
+            output_fd,
+            background
+        );
+    }
+
+    return pid;
+}
+
+pid_t helper_relay(const char* input_file,
+                   const char* output_file,
+                   int         input_fd,
+                   int         output_fd,
+                   int         stray_fd,
+                   bool        background)
+{
+    pid_t pid;
+    if (helper_launch(
+        HELPER_RELAY,
+        NULL,
+        NULL,
+        NULL,
+        input_file,
+        output_file,
+        input_fd,
+        output_fd,
+        background,
+        &pid
+    ) != 0)
+    {
+        pid = fork_relay(
+            input_file,
+            output_file,
+            input_fd,
+            output_fd,
+            stray_fd,
+            background
+        );
+    }
+
+    return pid;
+}
+
+void helper_notify(helper_op_t op, const char* str)
+{
+    if (helper_sock == -1)
+    {
+        return;
+    }
+
+    union
+    {
+        helper_request_t header;
+        char             bytes[HELPER_MAX_REQUEST];
+    } msg;
+    memset(&msg.header, 0, sizeof(msg.header));
+    msg.header.op = op;
+
+    size_t len = sizeof(msg.header);
+    if (helper_pack(msg.bytes, &len, str) == 0)
+    {
+        msg.header.strings_len = (uint32_t)(len - sizeof(msg.header));
+        helper_send(helper_sock, msg.bytes, len, NULL, 0);
+    }
+}
+
+void helper_chdir(void)
+{
+    char* cwd = getcwd(NULL, 0);
+    if (cwd != NULL)
+    {
+        helper_notify(HELPER_CHDIR, cwd);
+        free(cwd);
+    }
+}
+
+void report_fg_status(int wstatus)
+{
+    // Set the "status" (and maybe alert the user) depending on how the
+    // child completed
+    if (WIFEXITED(wstatus)) // Child terminated normally
+    {
+        status = WEXITSTATUS(wstatus);
+        status_is_term = false;
+    }
+    else                    // Child was killed by a signal
+    {
+        status = WTERMSIG(wstatus);
+        status_is_term = true;
+
+        output_str(&stdout_buf, "terminated by signal ");
+        output_int(&stdout_buf, status);
+        output_append(&stdout_buf, "\n", 1);
+        output_flush(&stdout_buf);
+    }
+}
+
+void take_terminal(void)
+{
+    if (job_control)
+    {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+void report_job_state(const job_t* job, const char* state)
+{
+    output_append(&stdout_buf, "[", 1);
+    output_int(&stdout_buf, job->id);
+    output_str(&stdout_buf, "] ");
+    output_int(&stdout_buf, job->last_pid);
+    output_append(&stdout_buf, " ", 1);
+    output_str(&stdout_buf, state);
+    output_append(&stdout_buf, " ", 1);
+    output_str(&stdout_buf, job->command_line);
+    output_append(&stdout_buf, "\n", 1);
+    output_flush(&stdout_buf);
+}
+
+int launch_pipeline(const stage_t* stages,
+                    int            stage_count,
+                    bool           background,
+                    pid_t*         pids,
+                    int*           launched)
+{
+    int failed = 0;
+    *launched = 0;
+
+    // Anything still waiting to be printed has to beat the children's output
+    output_flush(&stdout_buf);
+
+    // A captured job's stdout and stderr go down a pipe that the shell
+    // drains. If the capture can't be set up, the job runs uncaptured.
+    capture_t* capture = NULL;
+    int capture_fd = -1;
+    if (background && captures.job_cap > 0)
+    {
+        capture = capture_new(&captures, &capture_fd);
+        if (capture == NULL)
+        {
+            perror("could not capture output");
+        }
+    }
+    child_stderr = capture_fd;
+
+    // Every stage is launched before any of them is waited on, each one
+    // reading from the pipe left behind by the one before it
+    int prev_read_fd = -1;
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        const stage_t* stage = &stages[i];
+        bool is_first = i == 0;
+        bool is_last  = i == stage_count - 1;
+
+        int pipe_fds[2] = {-1, -1};
+        if (!is_last && pipe2(pipe_fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe() failed!");
+            failed = 1;
+            break;
+        }
+
+        // Background pipelines are fed from, and drain into, "/dev/null"
+        // unless told otherwise
+        const char* input_file = stage->input_file;
+        if (input_file == NULL && is_first && background)
+        {
+            input_file = "/dev/null";
+        }
+        const char* output_file = stage->output_file;
+        int output_fd = pipe_fds[1];
+        if (output_file == NULL && is_last && background)
+        {
+            if (capture_fd != -1)
+            {
+                output_fd = capture_fd;
+            }
+            else
+            {
+                output_file = "/dev/null";
+            }
+        }
+        else if (is_last && child_stdout != -1)
+        {
+            output_fd = child_stdout;
+        }
+
+        // Find the command in the PATH here in the parent, where the
+        // answer can be remembered for next time
+        const char* exec_path = NULL;
+        if (stage->command != NULL)
+        {
+            exec_path = path_cache_lookup(
+                &path_cache,
+                stage->command,
+                var_get(&vars, "PATH", 4)
+            );
+        }
+
+        // How long it takes to get a PID back is counted by how it's done
+        metrics_spawn_t spawn_type = stage->command == NULL
+            ? METRICS_SPAWN_RELAY
+            : spawn_engine == ENGINE_SPAWN ? METRICS_SPAWN_SPAWN
+            : spawn_engine == ENGINE_HELPER ? METRICS_SPAWN_HELPER
+            : METRICS_SPAWN_FORK;
+        uint64_t spawn_start_ns = monotonic_ns();
+        pid_t spawned_pid;
+        if (stage->command == NULL && spawn_engine == ENGINE_HELPER)
+        {
+            spawned_pid = helper_relay(
+                input_file,
+                output_file,
+                prev_read_fd,
+                output_fd,
+                pipe_fds[0],
+                background
+            );
+        }
+        else if (stage->command == NULL)
+        {
+            spawned_pid = fork_relay(
+                input_file,
+                output_file,
+                prev_read_fd,
+                output_fd,
+                pipe_fds[0],
+                background
+            );
+        }
+        else if (spawn_engine == ENGINE_SPAWN)
+        {
+            spawned_pid = spawn_command(
+                stage->command,
+                exec_path,
+                stage->args,
+                input_file,
+                output_file,
+                prev_read_fd,
+                output_fd,
+                background
+            );
+        }
+        else if (spawn_engine == ENGINE_HELPER)
+        {
+            spawned_pid = helper_command(
+                stage->command,
+                exec_path,
+                stage->args,
+                input_file,
+                output_file,
+                prev_read_fd,
+                output_fd,
+                background
+            );
+        }
+        else
+        {
+            spawned_pid = fork_command(
+                stage->command,
+                exec_path,
+                stage->args,
+                input_file,
+                output_file,
+                prev_read_fd,
+                output_fd,
+                background
+            );
+        }
+
+        // The child has its own copies of these now
+        if (prev_read_fd != -1)
+        {
+            close(prev_read_fd);
+        }
+        if (pipe_fds[1] != -1)
+        {
+            close(pipe_fds[1]);
+        }
+        prev_read_fd = pipe_fds[0];
+
+        if (spawned_pid == -1)
+        {
+            perror("fork() failed!"); // Yikes
+            metrics.spawn_failures[spawn_type]++;
+            failed = 1;
+            break;
+        }
+        metrics_observe(
+            &metrics.spawns[spawn_type],
+            monotonic_ns() - spawn_start_ns
+        );
+
+        // A PID of 0 means the stage never got off the ground, and the user
+        // has already been told why. The rest of the pipeline will see EOF
+        // or `SIGPIPE` from it.
+        pids[i] = spawned_pid;
+        *launched = i + 1;
+
+        // The first stage to get going leads the group, and the rest join
+        // it. The terminal goes to it before anything has much chance to
+        // read from it.
+        if (spawned_pid > 0 && child_pgid != -1)
+        {
+            setpgid(spawned_pid, child_pgid);
+            if (child_pgid == 0)
+            {
+                child_pgid = spawned_pid;
+                if (job_control && !background)
+                {
+                    tcsetpgrp(STDIN_FILENO, spawned_pid);
+                }
+            }
+        }
+    }
+    if (prev_read_fd != -1)
+    {
+        close(prev_read_fd);
+    }
+
+    // The job has its own copies of the write end, and is known by its last
+    // PID. A job that didn't get going has nothing to capture.
+    child_stderr = -1;
+    if (capture != NULL)
+    {
+        close(capture_fd);
+        if (*launched == stage_count && pids[stage_count - 1] > 0)
+        {
+            capture->pid = pids[stage_count - 1];
+        }
+        else
+        {
+            capture_free(&captures, capture);
+        }
+    }
+
+    return failed;
+}
+
+char* format_pipeline(const stage_t* stages, int stage_count)
+{
+    // Add it all up first, so that there's just the one allocation
+    size_t len = 1;
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        char** arg;
+        for (arg = stages[i].args; *arg != NULL; ++arg)
+        {
+            len += strlen(*arg) + 1;
+        }
+        if (stages[i].input_file != NULL)
+        {
+            len += strlen(stages[i].input_file) + 3;
+        }
+        if (stages[i].output_file != NULL)
+        {
+            len += strlen(stages[i].output_file) + 3;
+        }
+        len += 2; // "| "
+    }
+
+    char* text = malloc(len);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+    char* pos = text;
+    for (i = 0; i < stage_count; ++i)
+    {
+        if (i > 0)
+        {
+            pos = stpcpy(pos, "| ");
+        }
+
+        char** arg;
+        for (arg = stages[i].args; *arg != NULL; ++arg)
+        {
+            pos = stpcpy(stpcpy(pos, *arg), " ");
+        }
+        if (stages[i].input_file != NULL)
+        {
+            pos = stpcpy(stpcpy(stpcpy(pos, "< "), stages[i].input_file), " ");
+        }
+        if (stages[i].output_file != NULL)
+        {
+            pos = stpcpy(stpcpy(stpcpy(pos, "> "), stages[i].output_file), " ");
+        }
+    }
+    if (pos > text) // Drop the trailing space
+    {
+        pos--;
+    }
+    *pos = '\0';
+
+    return text;
+}
+
+int register_bg_job(const stage_t*     stages,
+                    int                stage_count,
+                    const pid_t*       pids,
+                    pid_t              pgid,
+                    const placement_t* placement)
+{
+    // So alert the user as to its PID
+    pid_t last_pid = pids[stage_count - 1];
+    last_bg_pid = last_pid;
+    output_str(&stdout_buf, "background pid is ");
+    output_int(&stdout_buf, last_pid);
+    output_append(&stdout_buf, "\n", 1);
+    output_flush(&stdout_buf);
+
+    // Register the whole pipeline as one child job
+    char* command_line = format_pipeline(stages, stage_count);
+    job_t* job = command_line != NULL
+        ? job_new(pids, stage_count, command_line)
+        : NULL;
+    free(command_line);
+    if (job != NULL)
+    {
+        job->id = reserved_job_id;
+        reserved_job_id = 0; // The job will fill in the outcome
+        job->report_usage = report_bg_usage || timing_command;
+        job->placement = *placement;
+        job->history_at = history_at;
+        history_at = -1; // The job will fill in the outcome
+        job->submit_id = submit_id;
+        server_started(&server, submit_id);
+        submit_id = 0;
+        job->deadline.grace_ns = command_grace_ns;
+        job->pgid = pgid;
+        job->deadline.pgid = pgid;
+    }
+    if (job == NULL || job_table_add(&jobs, job) != 0)
+    {
+        perror("could not register background job");
+        if (job != NULL)
+        {
+            dag_record(&dag, job->id, DAG_FAILED);
+        }
+        free(job);
+
+        return 1;
+    }
+    metrics_set_jobs(&metrics, jobs.count);
+
+    // Its clock started when it was launched, not when it was queued
+    if (command_timeout_ns > 0)
+    {
+        deadline_set(
+            &deadlines,
+            &job->deadline,
+            job->start_ns + command_timeout_ns
+        );
+    }
+
+    return 0;
+}
+
+int exec_command(const stage_t* stages, int stage_count, bool background)
+{
+    pid_t* pids = malloc((size_t)stage_count * sizeof(pid_t));
+    if (pids == NULL)
+    {
+        perror("malloc() failed!");
+
+        return 1;
+    }
+
+    // Only `&` jobs are placed, unless `on` says otherwise
+    place_request_t request = line_placement;
+    if (!background && !placing_command)
+    {
+        request.policy = PLACE_INHERIT;
+    }
+    placement_t placement;
+    placer_place(&placer, &request, &placement);
+    if (placement.policy != PLACE_INHERIT)
+    {
+        child_affinity = &placement.cpus;
+    }
+
+    // Background jobs get a process group of their own, so that they can be
+    // signalled as a whole. So do foreground ones when they're to be handed
+    // the terminal; otherwise they stay in ours, so that a ^C still gets to
+    // them.
+    child_pgid = background || job_control ? 0 : -1;
+
+    uint64_t start_ns = monotonic_ns();
+    int launched;
+    int failed = launch_pipeline(
+        stages,
+        stage_count,
+        background,
+        pids,
+        &launched
+    );
+    child_affinity = NULL;
+    pid_t pgid = child_pgid > 0 ? child_pgid : 0;
+    child_pgid = -1;
+
+    // Under `cached`, the last stage is a relay copying the output into the
+    // cache, and it's the one before it that decides the "status"
+    int status_stage = stage_count - (caching_command ? 2 : 1);
+    pid_t last_pid = launched == stage_count ? pids[status_stage] : 0;
+    if (background && !failed && last_pid > 0)
+    {
+        failed = register_bg_job(stages, stage_count, pids, pgid, &placement);
+        if (failed)
+        {
+            placer_release(&placer, &placement);
+        }
+        free(pids);
+
+        return failed;
+    }
+
+    // Otherwise this is a foregrounded pipeline (or one that was cut short,
+    // in which case we still have to collect what did get launched), so we
+    // wait for it to complete (or be stopped). The last stage decides the
+    // "status".
+    deadline_t deadline;
+    deadline_init(&deadline, pids, launched);
+    deadline.grace_ns = command_grace_ns;
+    deadline.pgid = pgid;
+    if (!background && command_timeout_ns > 0)
+    {
+        deadline_set(&deadlines, &deadline, start_ns + command_timeout_ns);
+    }
+    job_usage_t usage;
+    memset(&usage, 0, sizeof(usage));
+    uint64_t wait_start_ns = monotonic_ns();
+    bool stopped = false;
+    int i;
+    for (i = 0; i < launched && !stopped; ++i)
+    {
+        if (pids[i] <= 0)
+        {
+            continue;
+        }
+
+        int wstatus = 0;
+        struct rusage ru;
+        int wait_res;
+        do
+        {
+            while (await_child(P_PID, (id_t)pids[i], WEXITED | WSTOPPED, 0)
+                       == -1
+                   && errno == EINTR)
+            {
+                // Background jobs shouldn't stall on full capture pipes
+                // while this one runs
+                if (capture_pending)
+                {
+                    capture_pending = 0;
+                    capture_drain(&captures);
+                }
+
+                // Shutting down doesn't wait on anybody's `timeout`
+                if (shutdown_requested && !deadline.terminated)
+                {
+                    deadline.grace_ns = shutdown_grace_ns;
+                    deadline_set(&deadlines, &deadline, monotonic_ns());
+                    deadline_heap_fire(&deadlines);
+                }
+            }
+            do // It's already exited, so this won't be for long
+            {
+                wait_res = wait4(pids[i], &wstatus, WUNTRACED, &ru);
+            } while (wait_res == -1 && errno == EINTR);
+
+            // A stage that went for the terminal before it was handed over
+            // has been stopped for it, and can simply carry on now
+        } while (wait_res != -1 && WIFSTOPPED(wstatus) && job_control
+                 && pgid > 0
+                 && (WSTOPSIG(wstatus) == SIGTTIN
+                     || WSTOPSIG(wstatus) == SIGTTOU)
+                 && killpg(pgid, SIGCONT) == 0);
+        if (wait_res == -1) // Not ours to wait on after all
+        {
+            perror("wait4() failed!");
+            pids[i] = 0;
+            break;
+        }
+        if (WIFSTOPPED(wstatus))
+        {
+            stopped = true;
+            break;
+        }
+        trace_emit(trace, TRACE_CHILD_EXIT, pids[i], wstatus);
+        job_usage_add(&usage, &ru);
+
+        if (pids[i] == last_pid && !background)
+        {
+            report_fg_status(wstatus);
+            trace_emit(trace, TRACE_REAP_REPORTED, pids[i], wstatus);
+        }
+        else if (caching_command && i == stage_count - 1)
+        {
+            cache_tee_ok = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+        }
+        pids[i] = 0; // So that the deadline leaves it be
+    }
+    if (!background)
+    {
+        take_terminal();
+        uint64_t end_ns = monotonic_ns();
+        usage.wall_ns = end_ns - start_ns;
+        fg_usage = usage;
+        if (launched > 0)
+        {
+            metrics_observe(&metrics.fg_wait, end_ns - wait_start_ns);
+        }
+    }
+
+    // A stopped pipeline (^Z) becomes a stopped background job, for `fg` or
+    // `bg` to carry on with. It keeps its CPUs, history entry, and
+    // `timeout`.
+    job_t* job = NULL;
+    if (stopped)
+    {
+        char* command_line = format_pipeline(stages, stage_count);
+        job = command_line != NULL
+            ? job_new(pids, launched, command_line)
+            : NULL;
+        free(command_line);
+        if (job != NULL && job_table_add(&jobs, job) != 0)
+        {
+            free(job);
+            job = NULL;
+        }
+    }
+    if (job != NULL)
+    {
+        metrics_set_jobs(&metrics, jobs.count);
+        job->state = JOB_STOPPED;
+        job->pgid = pgid;
+        job->usage = usage;
+        job->start_ns = start_ns;
+        job->placement = placement;
+        job->history_at = history_at;
+        history_at = -1;
+        job->deadline.pgid = pgid;
+        job->deadline.grace_ns = deadline.grace_ns;
+        if (deadline.index != DEADLINE_IDLE)
+        {
+            deadline_set(&deadlines, &job->deadline, deadline.at_ns);
+            job->deadline.terminated = deadline.terminated;
+        }
+        report_job_state(job, "stopped");
+    }
+    else if (stopped) // Better gone than stopped with no way to continue it
+    {
+        perror("could not register stopped job");
+        deadline_signal(&deadline, SIGKILL);
+    }
+    deadline_clear(&deadlines, &deadline);
+    if (job == NULL)
+    {
+        placer_release(&placer, &placement);
+    }
+
+    free(pids);
+
+    return failed;
+}
+
+int reap_children(void)
+{
+    // Clear the flag first, so that a child that dies while we're at it
+    // gets its own go-around. Every job that's done by the end of it exited
+    // no earlier than it was launched, and no later than the first
+    // `SIGCHLD` since the last go-around.
+    sigchld_pending = 0;
+    uint64_t exited_ns = sigchld_at_ns;
+    sigchld_at_ns = 0;
+
+    while (1)
+    {
+        int wstatus;
+        struct rusage ru;
+        pid_t pid = wait4(
+            -1,
+            &wstatus,
+            WNOHANG | WUNTRACED | WCONTINUED,
+            &ru
+        );
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == ECHILD) // No children at all
+            {
+                return 0;
+            }
+            perror("wait4() failed!"); // Oh no
+
+            return 1;
+        }
+        if (pid == 0) // Everything else is still going
+        {
+            return 0;
+        }
+
+        // Stopping or continuing any one process counts for its whole job
+        if (WIFSTOPPED(wstatus) || WIFCONTINUED(wstatus))
+        {
+            job_t* job = job_table_find(&jobs, pid);
+            if (job != NULL && job->state != JOB_DONE)
+            {
+                job->state = WIFSTOPPED(wstatus) ? JOB_STOPPED : JOB_RUNNING;
+            }
+            continue;
+        }
+
+        // Children that aren't ours to report (e.g. an orphaned relay) are
+        // simply let go
+        trace_emit(trace, TRACE_CHILD_EXIT, pid, wstatus);
+        job_t* job = job_table_reaped(&jobs, pid, wstatus, &ru);
+        if (job != NULL && job->state == JOB_DONE
+            && exited_ns != 0 && exited_ns < job->exited_ns)
+        {
+            job->exited_ns = exited_ns > job->start_ns
+                ? exited_ns
+                : job->start_ns;
+        }
+    }
+}
+
+int handle_bg_processes(void)
+{
+    // Jobs whose time is up get their signals first, so that the ones that
+    // die straight away are reaped here and now
+    if (deadlines.count > 0)
+    {
+        deadline_heap_fire(&deadlines);
+    }
+    export_metrics();
+
+    // Nothing has died since we last looked, so there's nothing to wait for
+    if (sigchld_pending)
+    {
+        int r = reap_children();
+        if (r != 0)
+        {
+            return r;
+        }
+    }
+
+    // Same goes for captured output waiting in pipes
+    if (capture_pending)
+    {
+        capture_pending = 0;
+        capture_drain(&captures);
+    }
+
+    job_t* job;
+    while ((job = job_table_pop_done(&jobs)) != NULL)
+    {
+        // Report dead child job. These all pile up and go out along with
+        // the next prompt.
+        metrics_observe(&metrics.reap_lag, monotonic_ns() - job->exited_ns);
+        output_str(&stdout_buf, "background pid ");
+        output_int(&stdout_buf, job->last_pid);
+        if (WIFEXITED(job->wstatus)) // Bg job exited normally
+        {
+            output_str(&stdout_buf, " is done: exit value ");
+            output_int(&stdout_buf, WEXITSTATUS(job->wstatus));
+        }
+        else                         // Bg job was killed by a signal
+        {
+            output_str(&stdout_buf, " is done: terminated by signal ");
+            output_int(&stdout_buf, WTERMSIG(job->wstatus));
+        }
+        if (job->report_usage)
+        {
+            char usage_str[192];
+            int len = job_usage_format(
+                &job->usage,
+                usage_str,
+                sizeof(usage_str)
+            );
+            output_str(&stdout_buf, " (");
+            output_append(&stdout_buf, usage_str, (size_t)len);
+            output_append(&stdout_buf, ")", 1);
+        }
+        output_append(&stdout_buf, "\n", 1);
+        trace_emit(trace, TRACE_REAP_REPORTED, job->last_pid, job->wstatus);
+        retire_job(job);
+    }
+
+    // Reaping made room for more jobs, so let some in, along with any that
+    // were only waiting on the ones that finished
+    release_held();
+    dispatch_pending();
+
+    return 0;
+}
+
+void retire_job(job_t* job)
+{
+    history_finish(
+        &history,
+        job->history_at,
+        WIFEXITED(job->wstatus)
+            ? WEXITSTATUS(job->wstatus)
+            : WTERMSIG(job->wstatus),
+        !WIFEXITED(job->wstatus),
+        job->usage.wall_ns,
+        true
+    );
+    if (job->submit_id != 0)
+    {
+        server_finished(
+            &server,
+            job->submit_id,
+            WIFEXITED(job->wstatus)
+                ? WEXITSTATUS(job->wstatus)
+                : WTERMSIG(job->wstatus),
+            !WIFEXITED(job->wstatus)
+        );
+    }
+
+    dag_record(
+        &dag,
+        job->id,
+        WIFEXITED(job->wstatus) && WEXITSTATUS(job->wstatus) == 0
+            ? DAG_SUCCEEDED
+            : DAG_FAILED
+    );
+
+    placer_release(&placer, &job->placement);
+    deadline_clear(&deadlines, &job->deadline);
+    job_table_remove(&jobs, job);
+    metrics_set_jobs(&metrics, jobs.count);
+}
+
+bool note_bg_exit(pid_t pid, int wstatus, const struct rusage* ru)
+{
+    return job_table_reaped(&jobs, pid, wstatus, ru) != NULL;
+}
+
+int wait_bg_processes(void)
+{
+    while (jobs.count > 0 || pending_head != NULL || held_head != NULL)
+    {
+        // What's left is `kill_children()`'s, which includes stopped jobs
+        // that nobody is left to continue (and whatever is held after them)
+        if (shutdown_requested
+            || (jobs.done_head == NULL && job_table_all_stopped(&jobs)))
+        {
+            return 0;
+        }
+
+        // Block until some child is done, but leave the actual reaping to
+        // `handle_bg_processes()`
+        if (jobs.done_head == NULL && jobs.count > 0)
+        {
+            output_flush(&stdout_buf); // Don't sit on reports while blocked
+            if (await_child(P_ALL, 0, WEXITED | WSTOPPED, 0) == -1
+                && errno != EINTR)
+            {
+                perror("waitid() failed!");
+
+                return 1;
+            }
+            sigchld_pending = 1;
+        }
+
+        int bg_res = handle_bg_processes();
+        if (bg_res != 0)
+        {
+            return bg_res;
+        }
+    }
+
+    return 0;
+}
+
+void export_metrics(void)
+{
+    if (!metrics_export_due(&metrics_out))
+    {
+        return;
+    }
+
+    int err = metrics_export_write(&metrics_out, &metrics);
+    if (err != 0 && !metrics_out.failing)
+    {
+        errno = err;
+        perror("could not write metrics");
+    }
+    metrics_out.failing = err != 0;
+}
+
+pending_job_t* copy_pipeline(const stage_t* stages, int stage_count)
+{
+    // Everything goes into one allocation: the header, the stages, each
+    // stage's `argv`, and then all of the strings
+    size_t ptr_count = 0;
+    size_t str_bytes = 0;
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        char** arg;
+        for (arg = stages[i].args; *arg != NULL; ++arg)
+        {
+            ptr_count++;
+            str_bytes += strlen(*arg) + 1;
+        }
+        ptr_count++; // The `NULL` terminator
+        if (stages[i].input_file != NULL)
+        {
+            str_bytes += strlen(stages[i].input_file) + 1;
+        }
+        if (stages[i].output_file != NULL)
+        {
+            str_bytes += strlen(stages[i].output_file) + 1;
+        }
+    }
+
+    pending_job_t* pending = malloc(
+        sizeof(pending_job_t)
+        + (size_t)stage_count * sizeof(stage_t)
+        + ptr_count * sizeof(char*)
+        + (size_t)line_dep_count * sizeof(int)
+        + str_bytes
+    );
+    if (pending == NULL)
+    {
+        return NULL;
+    }
+    pending->next = NULL;
+    pending->job_id = job_table_reserve_id(&jobs);
+    pending->timed = timing_command;
+    pending->placement = line_placement;
+    pending->history_at = history_at;
+    pending->submit_id = submit_id;
+    pending->timeout_ns = command_timeout_ns;
+    pending->grace_ns = command_grace_ns;
+    pending->stage_count = stage_count;
+
+    char** ptrs = (char**)(pending->stages + stage_count);
+    pending->deps = (int*)(ptrs + ptr_count);
+    pending->dep_count = line_dep_count;
+    memcpy(pending->deps, line_deps, (size_t)line_dep_count * sizeof(int));
+    char* strs = (char*)(pending->deps + line_dep_count);
+    for (i = 0; i < stage_count; ++i)
+    {
+        stage_t* copy = &pending->stages[i];
+        copy->args = ptrs;
+
+        char** arg;
+        for (arg = stages[i].args; *arg != NULL; ++arg)
+        {
+            size_t len = strlen(*arg) + 1;
+            memcpy(strs, *arg, len);
+            *ptrs++ = strs;
+            strs += len;
+        }
+        *ptrs++ = NULL;
+        copy->command = copy->args[0];
+        copy->argc = stages[i].argc;
+
+        copy->input_file = NULL;
+        if (stages[i].input_file != NULL)
+        {
+            size_t len = strlen(stages[i].input_file) + 1;
+            copy->input_file = memcpy(strs, stages[i].input_file, len);
+            strs += len;
+        }
+        copy->output_file = NULL;
+        if (stages[i].output_file != NULL)
+        {
+            size_t len = strlen(stages[i].output_file) + 1;
+            copy->output_file = memcpy(strs, stages[i].output_file, len);
+            strs += len;
+        }
+    }
+
+    return pending;
+}
+
+int schedule_bg(const stage_t* stages, int stage_count)
+{
+    // Jobs go straight out unless we're at the cap, or there are others
+    // already waiting their turn
+    if (max_jobs <= 0 || (jobs.count < max_jobs && pending_head == NULL))
+    {
+        return exec_command(stages, stage_count, true);
+    }
+
+    pending_job_t* pending = copy_pipeline(stages, stage_count);
+    if (pending == NULL)
+    {
+        perror("malloc() failed!");
+
+        return 1;
+    }
+    if (pending_tail != NULL)
+    {
+        pending_tail->next = pending;
+    }
+    else
+    {
+        pending_head = pending;
+    }
+    pending_tail = pending;
+    pending_count++;
+
+    history_at = -1; // The job will fill in the outcome
+    submit_id = 0;
+
+    output_str(&stdout_buf, "background job queued, ");
+    output_int(&stdout_buf, pending_count);
+    output_str(&stdout_buf, " pending\n");
+    output_flush(&stdout_buf);
+
+    return 0;
+}
+
+void dispatch_pending(void)
+{
+    while (pending_head != NULL && (max_jobs <= 0 || jobs.count < max_jobs))
+    {
+        pending_job_t* pending = pending_head;
+        pending_head = pending->next;
+        if (pending_head == NULL)
+        {
+            pending_tail = NULL;
+        }
+        pending_count--;
+
+        // Its `time`, `on`, and `timeout` prefixes (if any) come along
+        // with it
+        bool timing_line = timing_command;
+        place_request_t line_request = line_placement;
+        int64_t line_history_at = history_at;
+        uint64_t line_submit_id = submit_id;
+        uint64_t line_timeout_ns = command_timeout_ns;
+        uint64_t line_grace_ns = command_grace_ns;
+        int line_job_id = reserved_job_id;
+        timing_command = pending->timed;
+        line_placement = pending->placement;
+        history_at = pending->history_at;
+        submit_id = pending->submit_id;
+        command_timeout_ns = pending->timeout_ns;
+        command_grace_ns = pending->grace_ns;
+        reserved_job_id = pending->job_id;
+        exec_command(pending->stages, pending->stage_count, true);
+        if (submit_id != 0) // Couldn't be launched
+        {
+            server_finished(&server, submit_id, 1, false);
+        }
+        if (reserved_job_id != 0) // Likewise, which fails its dependents
+        {
+            dag_record(&dag, reserved_job_id, DAG_FAILED);
+        }
+        timing_command = timing_line;
+        line_placement = line_request;
+        history_at = line_history_at;
+        submit_id = line_submit_id;
+        command_timeout_ns = line_timeout_ns;
+        command_grace_ns = line_grace_ns;
+        reserved_job_id = line_job_id;
+        free(pending);
+    }
+}
+
+int hold_bg(const stage_t* stages, int stage_count)
+{
+    pending_job_t* pending = copy_pipeline(stages, stage_count);
+    if (pending == NULL)
+    {
+        perror("malloc() failed!");
+
+        return 1;
+    }
+    if (held_tail != NULL)
+    {
+        held_tail->next = pending;
+    }
+    else
+    {
+        held_head = pending;
+    }
+    held_tail = pending;
+
+    history_at = -1; // The job will fill in the outcome
+    submit_id = 0;
+
+    // Jobs that are already done don't hold it up
+    int failed_dep;
+    if (dag_check(&dag, pending->deps, pending->dep_count, &failed_dep)
+        == DAG_PENDING)
+    {
+        output_str(&stdout_buf, "background job ");
+        output_int(&stdout_buf, pending->job_id);
+        output_str(&stdout_buf, " held\n");
+        output_flush(&stdout_buf);
+    }
+    release_held();
+    dispatch_pending();
+
+    return 0;
+}
+
+void release_held(void)
+{
+    // One job being cancelled can settle others that are after it, which
+    // may be earlier in the list, so it's gone over until nothing changes
+    bool settled = true;
+    while (settled)
+    {
+        settled = false;
+        pending_job_t* prev = NULL;
+        pending_job_t* held = held_head;
+        while (held != NULL)
+        {
+            pending_job_t* next = held->next;
+            int failed_dep;
+            dag_outcome_t outcome = dag_check(
+                &dag,
+                held->deps,
+                held->dep_count,
+                &failed_dep
+            );
+            if (outcome == DAG_PENDING)
+            {
+                prev = held;
+                held = next;
+                continue;
+            }
+
+            if (prev != NULL)
+            {
+                prev->next = next;
+            }
+            else
+            {
+                held_head = next;
+            }
+            if (held_tail == held)
+            {
+                held_tail = prev;
+            }
+            held->next = NULL;
+            settled = true;
+
+            if (outcome == DAG_FAILED)
+            {
+                cancel_held(held, failed_dep);
+            }
+            else // Into the queue, to go out as soon as there's room
+            {
+                held->dep_count = 0;
+                if (pending_tail != NULL)
+                {
+                    pending_tail->next = held;
+                }
+                else
+                {
+                    pending_head = held;
+                }
+                pending_tail = held;
+                pending_count++;
+            }
+            held = next;
+        }
+    }
+}
+
+void cancel_held(pending_job_t* held, int failed_dep)
+{
+    dag_record(&dag, held->job_id, DAG_FAILED);
+    history_finish(&history, held->history_at, 1, false, 0, true);
+    if (held->submit_id != 0)
+    {
+        server_finished(&server, held->submit_id, 1, false);
+    }
+
+    // Reported along with the jobs that are done
+    output_str(&stdout_buf, "background job ");
+    output_int(&stdout_buf, held->job_id);
+    output_str(&stdout_buf, " is cancelled: job ");
+    output_int(&stdout_buf, failed_dep);
+    output_str(&stdout_buf, " failed\n");
+    free(held);
+}
+
+void free_pending(void)
+{
+    while (pending_head != NULL)
+    {
+        pending_job_t* pending = pending_head;
+        pending_head = pending->next;
+        free(pending);
+    }
+    pending_tail = NULL;
+    pending_count = 0;
+    while (held_head != NULL)
+    {
+        pending_job_t* held = held_head;
+        held_head = held->next;
+        free(held);
+    }
+    held_tail = NULL;
+}
+
+int substitute_braces(const char* arg,
+                      const char* item,
+                      size_t      item_len,
+                      char**      out)
+{
+    *out = NULL;
+    const char* at = strstr(arg, "{}");
+    if (at == NULL)
+    {
+        return 0;
+    }
+
+    // Count them all up first, so that there's just the one allocation
+    size_t count = 0;
+    const char* pos;
+    for (pos = at; pos != NULL; pos = strstr(pos + 2, "{}"))
+    {
+        count++;
+    }
+
+    size_t arg_len = strlen(arg);
+    char* result = malloc(arg_len - 2 * count + item_len * count + 1);
+    if (result == NULL)
+    {
+        return ENOMEM;
+    }
+    char* dst = result;
+    const char* src = arg;
+    for (pos = at; pos != NULL; pos = strstr(src, "{}"))
+    {
+        memcpy(dst, src, (size_t)(pos - src));
+        dst += pos - src;
+        memcpy(dst, item, item_len);
+        dst += item_len;
+        src = pos + 2;
+    }
+    strcpy(dst, src);
+    *out = result;
+
+    return 0;
+}
+
+int builtin_parallel(const stage_t* stage, int argc, bool background)
+{
+    // `parallel [-j N] command [args...]`, with "{}" standing in for each
+    // line of input (or tacked onto the end if it's not mentioned)
+    char** template = stage->args + 1;
+    int template_count = argc - 1;
+    int cap = max_jobs > 0 ? max_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (template_count >= 2 && strcmp(template[0], "-j") == 0)
+    {
+        cap = atoi(template[1]);
+        template += 2;
+        template_count -= 2;
+
+        // Background instances are queued behind the shell's `-j` instead
+        if (background)
+        {
+            output_str(&stderr_buf, "parallel: -j can't be used with &\n");
+            output_flush(&stderr_buf);
+
+            status = 1;
+            status_is_term = false;
+
+            return 0;
+        }
+    }
+    if (template_count < 1 || cap < 1)
+    {
+        output_str(&stderr_buf, "usage: parallel [-j N] command [args...]\n");
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+
+        return 0;
+    }
+
+    bool has_braces = false;
+    int i;
+    for (i = 0; i < template_count; ++i)
+    {
+        if (strstr(template[i], "{}") != NULL)
+        {
+            has_braces = true;
+        }
+    }
+
+    // The input is the "<" file if there is one, or else our stdin
+    line_reader_t input;
+    int input_fd = STDIN_FILENO;
+    if (stage->input_file != NULL)
+    {
+        input_fd = open_redirect(stage->input_file, false);
+        if (input_fd == -1)
+        {
+            status = 1;
+            status_is_term = false;
+
+            return 0;
+        }
+    }
+    if (reader_open(&input, input_fd, input_fd != STDIN_FILENO) != 0)
+    {
+        perror("reader_open() failed!");
+
+        return 1;
+    }
+
+    // Instances run with stdin from "/dev/null", so that they don't fight
+    // over the terminal. A ">" file with "{}" in its name is per instance;
+    // otherwise foreground instances all share it, by way of our stdout.
+    char dev_null[] = "/dev/null";
+    char** args = malloc(((size_t)template_count + 2) * sizeof(char*));
+    pid_t* running = malloc((size_t)cap * sizeof(pid_t));
+    if (args == NULL || running == NULL)
+    {
+        perror("malloc() failed!");
+        reader_close(&input);
+        free(args);
+        free(running);
+
+        return 1;
+    }
+    stage_t instance = {NULL, args, 0, dev_null, stage->output_file};
+    bool output_per_item = stage->output_file != NULL
+        && strstr(stage->output_file, "{}") != NULL;
+    int saved_stdout = -1;
+    if (stage->output_file != NULL && !output_per_item && !background)
+    {
+        int output_fd = open_redirect(stage->output_file, true);
+        if (output_fd == -1)
+        {
+            reader_close(&input);
+            free(args);
+            free(running);
+
+            status = 1;
+            status_is_term = false;
+
+            return 0;
+        }
+        saved_stdout = dup(STDOUT_FILENO);
+        dup2(output_fd, STDOUT_FILENO);
+        close(output_fd);
+        instance.output_file = NULL;
+    }
+
+    uint64_t start_ns = monotonic_ns();
+    job_usage_t usage;
+    memset(&usage, 0, sizeof(usage));
+    int running_count = 0;
+    int failures = 0;
+    deadline_t deadline; // For the foreground instances, all together
+    deadline_init(&deadline, running, 0);
+    deadline.grace_ns = command_grace_ns;
+    if (!background && command_timeout_ns > 0)
+    {
+        deadline_set(&deadlines, &deadline, start_ns + command_timeout_ns);
+    }
+    int ret = 0;
+    bool input_done = false;
+
+    while (!input_done || running_count > 0)
+    {
+        // Top up the running instances from the input
+        while (!input_done && (background || running_count < cap))
+        {
+            char* item;
+            ssize_t item_len = reader_next_line(&input, &item);
+            if (item_len == READER_INTERRUPTED)
+            {
+                continue;
+            }
+            if (item_len < 0)
+            {
+                input_done = true;
+                break;
+            }
+
+            int err = 0;
+            for (i = 0; i < template_count; ++i)
+            {
+                char* substituted;
+                if (substitute_braces(
+                        template[i],
+                        item,
+                        (size_t)item_len,
+                        &substituted
+                    ) != 0)
+                {
+                    err = ENOMEM;
+                }
+                args[i] = substituted != NULL ? substituted : template[i];
+            }
+            args[template_count] = has_braces ? NULL : item;
+            args[template_count + 1] = NULL;
+            instance.command = args[0];
+            instance.argc = has_braces ? template_count : template_count + 1;
+            if (output_per_item
+                && substitute_braces(
+                       stage->output_file,
+                       item,
+                       (size_t)item_len,
+                       &instance.output_file
+                   ) != 0)
+            {
+                err = ENOMEM;
+            }
+
+            if (err != 0)
+            {
+                errno = err;
+                perror("malloc() failed!");
+                ret = 1;
+            }
+            else if (background) // Background instances are the job scheduler's
+            {               // problem
+                instance.input_file = NULL;
+                ret = schedule_bg(&instance, 1);
+            }
+            else
+            {
+                pid_t pid;
+                int launched;
+                ret = launch_pipeline(&instance, 1, false, &pid, &launched);
+                if (launched == 1 && pid > 0)
+                {
+                    running[running_count++] = pid;
+                }
+                else if (ret == 0)
+                {
+                    failures++;
+                }
+            }
+
+            for (i = 0; i < template_count; ++i)
+            {
+                if (args[i] != template[i])
+                {
+                    free(args[i]);
+                }
+            }
+            if (output_per_item)
+            {
+                free(instance.output_file);
+            }
+            if (ret != 0)
+            {
+                input_done = true;
+                break;
+            }
+        }
+        if (running_count == 0)
+        {
+            continue;
+        }
+
+        // Wait for any instance to finish. Background jobs can finish in
+        // the meantime too, and get handed over to be reported as usual.
+        deadline.pid_count = running_count;
+        if (await_child(P_ALL, 0, WEXITED, 0) == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("waitid() failed!");
+                ret = 1;
+                break;
+            }
+
+            // Background jobs shouldn't stall on full capture pipes while
+            // these run
+            if (capture_pending)
+            {
+                capture_pending = 0;
+                capture_drain(&captures);
+            }
+
+            // Shutting down doesn't wait on anybody's `timeout`
+            if (shutdown_requested && !deadline.terminated)
+            {
+                deadline.grace_ns = shutdown_grace_ns;
+                deadline_set(&deadlines, &deadline, monotonic_ns());
+                deadline_heap_fire(&deadlines);
+            }
+
+            // Once they've been told to stop, no more get started
+            input_done = input_done || deadline.terminated;
+            continue;
+        }
+        int wstatus = 0;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &wstatus, WNOHANG, &ru);
+        if (pid == 0 || (pid == -1 && errno == EINTR))
+        {
+            continue;
+        }
+        if (pid == -1)
+        {
+            perror("wait4() failed!");
+            ret = 1;
+            break;
+        }
+        trace_emit(trace, TRACE_CHILD_EXIT, pid, wstatus);
+
+        for (i = 0; i < running_count; ++i)
+        {
+            if (running[i] == pid)
+            {
+                break;
+            }
+        }
+        if (i == running_count)
+        {
+            note_bg_exit(pid, wstatus, &ru);
+            continue;
+        }
+        running[i] = running[--running_count];
+        deadline.pid_count = running_count;
+        job_usage_add(&usage, &ru);
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+        {
+            failures++;
+        }
+    }
+
+    deadline_clear(&deadlines, &deadline);
+    reader_close(&input);
+    free(running);
+    free(args);
+    if (saved_stdout != -1)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+
+    // Like GNU `parallel`, the "status" is how many instances failed
+    if (!background)
+    {
+        status = failures < 255 ? failures : 255;
+        status_is_term = false;
+
+        usage.wall_ns = monotonic_ns() - start_ns;
+        fg_usage = usage;
+    }
+
+    return ret;
+}
+
+void builtin_trace(char** args, int argc)
+{
+    status = 0;
+    status_is_term = false;
+
+    if (trace == NULL)
+    {
+        output_str(&stderr_buf, "trace: tracing is unavailable\n");
+        output_flush(&stderr_buf);
+        status = 1;
+    }
+    else if (argc == 1) // Just say how it's going
+    {
+        uint64_t recorded = trace->next;
+        output_str(
+            &stdout_buf,
+            trace->enabled ? "tracing on, " : "tracing off, "
+        );
+        output_int(&stdout_buf, (long long)recorded);
+        output_str(&stdout_buf, " events (");
+        output_int(
+            &stdout_buf,
+            (long long)(recorded > TRACE_CAPACITY
+                ? recorded - TRACE_CAPACITY
+                : 0)
+        );
+        output_str(&stdout_buf, " dropped)\n");
+        output_flush(&stdout_buf);
+    }
+    else if (argc == 2 && strcmp(args[1], "on") == 0)
+    {
+        trace->enabled = 1;
+    }
+    else if (argc == 2 && strcmp(args[1], "off") == 0)
+    {
+        trace->enabled = 0;
+    }
+    else if (argc == 2 && strcmp(args[1], "clear") == 0)
+    {
+        trace_clear(trace);
+    }
+    else if (argc == 3 && strcmp(args[1], "dump") == 0)
+    {
+        FILE* out = fopen(args[2], "we");
+        if (out == NULL)
+        {
+            output_str(&stderr_buf, "cannot open ");
+            output_str(&stderr_buf, args[2]);
+            output_str(&stderr_buf, " for output\n");
+            output_flush(&stderr_buf);
+            status = 1;
+            return;
+        }
+        if (trace_dump(trace, out, shell_pid) < 0 || fclose(out) != 0)
+        {
+            perror("trace dump failed");
+            status = 1;
+        }
+    }
+    else
+    {
+        output_str(
+            &stderr_buf,
+            "usage: trace [on | off | clear | dump file]\n"
+        );
+        output_flush(&stderr_buf);
+        status = 1;
+    }
+}
+
+bool run_fast_builtin(const stage_t* stage)
+{
+    fast_builtin_fn fn = fast_builtin_lookup(stage->command);
+    if (fn == NULL)
+    {
+        return false;
+    }
+
+    uint64_t start_ns = monotonic_ns();
+    output_flush(&stdout_buf);
+
+    // Swap in the redirections, in the same order a child would open them,
+    // keeping the shell's own descriptors out of the way until afterwards.
+    // One the shell didn't have open at all is closed again afterwards.
+    const char* files[2] = {stage->input_file, stage->output_file};
+    int saved_fds[2] = {-1, -1};
+    bool swapped[2] = {false, false};
+    bool opened = true;
+    int i;
+    for (i = 0; i < 2 && opened; ++i)
+    {
+        if (files[i] == NULL)
+        {
+            continue;
+        }
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        if (saved_fds[i] == -1 && errno != EBADF)
+        {
+            perror("fcntl() failed!");
+            opened = false;
+            break;
+        }
+
+        // If it was closed, the file may well land on it by itself
+        int fd = open_redirect(files[i], i == STDOUT_FILENO);
+        opened = fd != -1;
+        if (opened && fd != i && dup2(fd, i) == -1)
+        {
+            perror("dup2() failed!");
+            opened = false;
+        }
+        if (fd != -1 && fd != i)
+        {
+            close(fd);
+        }
+
+        if (opened)
+        {
+            swapped[i] = true;
+        }
+        else if (saved_fds[i] != -1)
+        {
+            close(saved_fds[i]);
+            saved_fds[i] = -1;
+        }
+    }
+
+    // Writing to a pipe nobody reads has to kill the command, not the shell
+    int r = 1;
+    if (opened)
+    {
+        struct sigaction SIGPIPE_action = {0};
+        struct sigaction SIGPIPE_saved;
+        SIGPIPE_action.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &SIGPIPE_action, &SIGPIPE_saved);
+        r = fn(stage->argc, stage->args);
+        sigaction(SIGPIPE, &SIGPIPE_saved, NULL);
+    }
+
+    for (i = 0; i < 2; ++i)
+    {
+        if (!swapped[i])
+        {
+            continue;
+        }
+        if (saved_fds[i] == -1)
+        {
+            close(i);
+            continue;
+        }
+        if (dup2(saved_fds[i], i) == -1)
+        {
+            perror("dup2() failed!");
+        }
+        close(saved_fds[i]);
+    }
+
+    if (r == BUILTIN_DECLINE)
+    {
+        return false;
+    }
+
+    report_fg_status(r >= 0 ? W_EXITCODE(r, 0) : W_EXITCODE(0, -1 - r));
+    memset(&fg_usage, 0, sizeof(fg_usage));
+    fg_usage.wall_ns = monotonic_ns() - start_ns;
+
+    return true;
+}
+
+int builtin_jobs(void)
+{
+    job_t* job;
+    for (job = jobs.head; job != NULL; job = job->next)
+    {
+        char where[256];
+        int len = placement_format(
+            &placer,
+            &job->placement,
+            where,
+            sizeof(where)
+        );
+
+        output_append(&stdout_buf, "[", 1);
+        output_int(&stdout_buf, job->id);
+        output_str(&stdout_buf, "] ");
+        output_int(&stdout_buf, job->last_pid);
+        output_str(
+            &stdout_buf,
+            job->state == JOB_RUNNING ? " running ("
+                : job->state == JOB_STOPPED ? " stopped ("
+                : " done ("
+        );
+        output_append(
+            &stdout_buf,
+            where,
+            (size_t)len < sizeof(where) ? (size_t)len : sizeof(where) - 1
+        );
+        output_str(&stdout_buf, ") ");
+        output_str(&stdout_buf, job->command_line);
+        output_append(&stdout_buf, "\n", 1);
+    }
+
+    // Queued and held jobs haven't been placed yet
+    pending_job_t* pending = pending_head != NULL ? pending_head : held_head;
+    while (pending != NULL)
+    {
+        char* command_line = format_pipeline(
+            pending->stages,
+            pending->stage_count
+        );
+        output_append(&stdout_buf, "[", 1);
+        output_int(&stdout_buf, pending->job_id);
+        output_str(
+            &stdout_buf,
+            pending->dep_count > 0 ? "] after" : "] queued"
+        );
+        int d;
+        for (d = 0; d < pending->dep_count; ++d)
+        {
+            output_str(&stdout_buf, " %");
+            output_int(&stdout_buf, pending->deps[d]);
+        }
+        output_append(&stdout_buf, " ", 1);
+        output_str(&stdout_buf, command_line != NULL ? command_line : "?");
+        output_append(&stdout_buf, "\n", 1);
+        free(command_line);
+
+        pending = pending->next != NULL ? pending->next
+            : pending->dep_count == 0 ? held_head
+            : NULL;
+    }
+    output_flush(&stdout_buf);
+
+    return 0;
+}
+
+job_t* find_job(const char* spec, const char* who)
+{
+    job_t* job = NULL;
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+    {
+        job = jobs.tail;
+        while (job != NULL && job->state == JOB_DONE)
+        {
+            job = job->prev;
+        }
+    }
+    else
+    {
+        const char* digits = spec[0] == '%' ? spec + 1 : spec;
+        char* end;
+        long n = strtol(digits, &end, 10);
+        if (end != digits && *end == '\0' && n > 0 && n <= INT_MAX)
+        {
+            job = spec[0] == '%'
+                ? job_table_find_id(&jobs, (int)n)
+                : job_table_find(&jobs, (pid_t)n);
+        }
+    }
+
+    if (job == NULL)
+    {
+        output_str(&stderr_buf, who);
+        output_str(&stderr_buf, ": no such job\n");
+        output_flush(&stderr_buf);
+    }
+
+    return job;
+}
+
+int builtin_fg(char** args, int argc)
+{
+    job_t* job = find_job(argc >= 2 ? args[1] : NULL, "fg");
+    if (job == NULL)
+    {
+        return 0;
+    }
+    output_str(&stdout_buf, job->command_line);
+    output_append(&stdout_buf, "\n", 1);
+    output_flush(&stdout_buf);
+
+    // The terminal goes to it first, so that it doesn't go right back to
+    // being stopped for wanting it
+    if (job_control && job->pgid > 0)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        job->state = JOB_RUNNING;
+        deadline_signal(&job->deadline, SIGCONT);
+    }
+
+    // It's waited on like any other foreground job, but reaped through the
+    // job table, since that's where its processes are
+    while (job->state == JOB_RUNNING)
+    {
+        if (await_child(
+                job->pgid > 0 ? P_PGID : P_ALL,
+                (id_t)job->pgid,
+                WEXITED | WSTOPPED,
+                0
+            ) == -1
+            && errno != EINTR)
+        {
+            break;
+        }
+
+        if (capture_pending)
+        {
+            capture_pending = 0;
+            capture_drain(&captures);
+        }
+        if (shutdown_requested && !job->deadline.terminated)
+        {
+            job->deadline.grace_ns = shutdown_grace_ns;
+            deadline_set(&deadlines, &job->deadline, monotonic_ns());
+            deadline_heap_fire(&deadlines);
+        }
+        sigchld_pending = 1;
+        if (reap_children() != 0)
+        {
+            break;
+        }
+    }
+    take_terminal();
+
+    // A finished job is reported here and now, like any foreground one,
+    // rather than along with the next prompt
+    if (job->state == JOB_STOPPED)
+    {
+        report_job_state(job, "stopped");
+    }
+    else if (job->state == JOB_DONE)
+    {
+        job_table_take_done(&jobs, job);
+        report_fg_status(job->wstatus);
+        trace_emit(trace, TRACE_REAP_REPORTED, job->last_pid, job->wstatus);
+        fg_usage = job->usage;
+        retire_job(job);
+    }
+
+    return 0;
+}
+
+int builtin_bg(char** args, int argc)
+{
+    job_t* job = find_job(argc >= 2 ? args[1] : NULL, "bg");
+    if (job == NULL)
+    {
+        return 0;
+    }
+
+    if (job->state == JOB_STOPPED)
+    {
+        job->state = JOB_RUNNING;
+        deadline_signal(&job->deadline, SIGCONT);
+        report_job_state(job, "continued");
+    }
+    else
+    {
+        report_job_state(
+            job,
+            job->state == JOB_DONE ? "already done" : "already running"
+        );
+    }
+
+    return 0;
+}
+
+bool names_job(char* const* args)
+{
+    for (; *args != NULL; ++args)
+    {
+        if ((*args)[0] == '%')
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int builtin_kill(char** args, int argc)
+{
+    // "-15", "-TERM", or "-SIGTERM"
+    int signo = SIGTERM;
+    int first = 1;
+    if (argc >= 2 && args[1][0] == '-')
+    {
+        const char* name = args[1] + 1;
+        char* end;
+        long n = strtol(name, &end, 10);
+        signo = end != name && *end == '\0' && n >= 0 && n < NSIG
+            ? (int)n
+            : -1;
+        if (end == name)
+        {
+            name += strncmp(name, "SIG", 3) == 0 ? 3 : 0;
+            for (signo = NSIG - 1; signo > 0; --signo)
+            {
+                const char* abbrev = sigabbrev_np(signo);
+                if (abbrev != NULL && strcmp(abbrev, name) == 0)
+                {
+                    break;
+                }
+            }
+            signo = signo > 0 ? signo : -1;
+        }
+        first = 2;
+    }
+    if (signo == -1 || first >= argc)
+    {
+        output_str(&stderr_buf, "kill: usage: kill [-SIG] %N|pid...\n");
+        output_flush(&stderr_buf);
+
+        return 0;
+    }
+
+    // A job gets it all at once, whatever it has started included
+    int i;
+    for (i = first; i < argc; ++i)
+    {
+        if (args[i][0] == '%')
+        {
+            job_t* job = find_job(args[i], "kill");
+            if (job != NULL)
+            {
+                deadline_signal(&job->deadline, signo);
+            }
+            continue;
+        }
+
+        char* end;
+        long pid = strtol(args[i], &end, 10);
+        if (end == args[i] || *end != '\0' || kill((pid_t)pid, signo) == -1)
+        {
+            output_str(&stderr_buf, "kill: ");
+            output_str(&stderr_buf, args[i]);
+            output_str(&stderr_buf, ": no such process\n");
+            output_flush(&stderr_buf);
+        }
+    }
+
+    return 0;
+}
+
+int builtin_output(char** args, int argc)
+{
+    // Whatever is still in the pipes counts too
+    capture_pending = 0;
+    capture_drain(&captures);
+
+    if (argc < 2)
+    {
+        capture_t* capture;
+        for (capture = captures.head; capture != NULL; capture = capture->next)
+        {
+            output_int(&stdout_buf, capture->pid);
+            output_append(&stdout_buf, " ", 1);
+            output_int(&stdout_buf, (long long)capture->held);
+            output_append(&stdout_buf, "/", 1);
+            output_int(&stdout_buf, (long long)capture->written);
+            output_str(
+                &stdout_buf,
+                capture->pipe_fd != -1 ? " bytes, open\n" : " bytes\n"
+            );
+        }
+        output_flush(&stdout_buf);
+
+        return 0;
+    }
+
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        char* end;
+        long pid = strtol(args[i], &end, 10);
+        capture_t* capture = *end == '\0' && pid > 0
+            ? capture_find(&captures, (pid_t)pid)
+            : NULL;
+        if (capture == NULL)
+        {
+            output_str(&stderr_buf, "output: nothing captured for ");
+            output_str(&stderr_buf, args[i]);
+            output_append(&stderr_buf, "\n", 1);
+            output_flush(&stderr_buf);
+            continue;
+        }
+
+        output_flush(&stdout_buf);
+        int err = capture_send(&captures, capture, STDOUT_FILENO);
+        if (err != 0)
+        {
+            errno = err;
+            perror("output: sendfile() failed!");
+        }
+    }
+
+    return 0;
+}
+
+int builtin_hash(char** args, int argc)
+{
+    if (argc >= 2 && strcmp(args[1], "-r") == 0) // Forget everything
+    {
+        path_cache_clear(&path_cache);
+
+        return 0;
+    }
+
+    status = 0;
+    status_is_term = false;
+    if (argc >= 2) // Look up (and remember) the named commands
+    {
+        int i;
+        for (i = 1; i < argc; ++i)
+        {
+            const char* path = path_cache_lookup(
+                &path_cache,
+                args[i],
+                var_get(&vars, "PATH", 4)
+            );
+            if (path == NULL)
+            {
+                output_str(&stderr_buf, "hash: ");
+                output_str(&stderr_buf, args[i]);
+                output_str(&stderr_buf, ": not found\n");
+                output_flush(&stderr_buf);
+                status = 1;
+            }
+        }
+
+        return 0;
+    }
+
+    // Otherwise list what's remembered, hit counts right-aligned
+    output_str(&stdout_buf, "hits\tcommand\tpath\n");
+    size_t i;
+    for (i = 0; i < path_cache.slot_count; ++i)
+    {
+        const path_entry_t* entry = path_cache.slots[i];
+        if (entry != NULL)
+        {
+            char hits_str[INT_STR_SIZE];
+            size_t len = format_int(hits_str, (long long)entry->hits);
+            output_append(&stdout_buf, "    ", len < 4 ? 4 - len : 0);
+            output_append(&stdout_buf, hits_str, len);
+            output_append(&stdout_buf, "\t", 1);
+            output_str(&stdout_buf, entry->name);
+            output_append(&stdout_buf, "\t", 1);
+            output_str(&stdout_buf, entry->path);
+            output_append(&stdout_buf, "\n", 1);
+        }
+    }
+    output_int(&stdout_buf, (long long)path_cache.hits);
+    output_str(&stdout_buf, " hits, ");
+    output_int(&stdout_buf, (long long)path_cache.misses);
+    output_str(&stdout_buf, " misses\n");
+    output_flush(&stdout_buf);
+
+    return 0;
+}
+
+int builtin_stats(char** args, int argc)
+{
+    bool prometheus = argc >= 2 && strcmp(args[1], "-p") == 0;
+    if (argc > 2 || (argc == 2 && !prometheus))
+    {
+        output_str(&stderr_buf, "stats: usage: stats [-p]\n");
+        output_flush(&stderr_buf);
+
+        return 0;
+    }
+
+    if (prometheus)
+    {
+        metrics_write(&metrics, &stdout_buf);
+    }
+    else
+    {
+        metrics_print(&metrics, &stdout_buf);
+    }
+    output_flush(&stdout_buf);
+
+    return 0;
+}
+
+int shell_set_var(const char* name,
+                  size_t      len,
+                  const char* value,
+                  bool        export)
+{
+    int err = value != NULL
+        ? var_set(&vars, name, len, value, export)
+        : var_export(&vars, name, len);
+    if (err != 0)
+    {
+        return err;
+    }
+
+    // `envp` may have moved, and the helper's children get the helper's
+    // environment rather than ours
+    environ = vars.envp;
+    const var_t* var = *var_table_slot(&vars, name, len);
+    if (var->env_index != VAR_LOCAL)
+    {
+        helper_notify(HELPER_SETENV, var->entry);
+    }
+
+    return 0;
+}
+
+void shell_unset_var(const char* name)
+{
+    size_t len = strlen(name);
+    const var_t* var = *var_table_slot(&vars, name, len);
+    bool exported = var != NULL && var->env_index != VAR_LOCAL;
+    if (var_unset(&vars, name, len))
+    {
+        environ = vars.envp;
+        if (exported)
+        {
+            helper_notify(HELPER_UNSETENV, name);
+        }
+    }
+}
+
+bool is_assignment_line(const stage_t* stage)
+{
+    if (stage->input_file != NULL || stage->output_file != NULL)
+    {
+        return false;
+    }
+
+    int i;
+    for (i = 0; i < stage->argc; ++i)
+    {
+        size_t len = var_name_len(stage->args[i]);
+        if (len == 0 || stage->args[i][len] != '=')
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int builtin_assign(char** args, int argc)
+{
+    status = 0;
+    status_is_term = false;
+
+    int i;
+    for (i = 0; i < argc; ++i)
+    {
+        size_t len = var_name_len(args[i]);
+        if (shell_set_var(args[i], len, args[i] + len + 1, false) != 0)
+        {
+            perror("could not set variable");
+            status = 1;
+        }
+    }
+
+    return 0;
+}
+
+int builtin_export(char** args, int argc)
+{
+    status = 0;
+    status_is_term = false;
+
+    // A bare `export` lists what's exported
+    if (argc < 2)
+    {
+        size_t i;
+        for (i = 0; i < vars.env_count; ++i)
+        {
+            output_str(&stdout_buf, "export ");
+            output_str(&stdout_buf, vars.envp[i]);
+            output_append(&stdout_buf, "\n", 1);
+        }
+        output_flush(&stdout_buf);
+
+        return 0;
+    }
+
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        size_t len = var_name_len(args[i]);
+        if (len == 0 || (args[i][len] != '\0' && args[i][len] != '='))
+        {
+            output_str(&stderr_buf, "export: not a valid name: ");
+            output_str(&stderr_buf, args[i]);
+            output_append(&stderr_buf, "\n", 1);
+            output_flush(&stderr_buf);
+            status = 1;
+            continue;
+        }
+
+        const char* value = args[i][len] == '=' ? args[i] + len + 1 : NULL;
+        if (shell_set_var(args[i], len, value, true) != 0)
+        {
+            perror("could not export variable");
+            status = 1;
+        }
+    }
+
+    return 0;
+}
+
+int builtin_unset(char** args, int argc)
+{
+    status = 0;
+    status_is_term = false;
+
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        size_t len = var_name_len(args[i]);
+        if (len == 0 || args[i][len] != '\0')
+        {
+            output_str(&stderr_buf, "unset: not a valid name: ");
+            output_str(&stderr_buf, args[i]);
+            output_append(&stderr_buf, "\n", 1);
+            output_flush(&stderr_buf);
+            status = 1;
+            continue;
+        }
+        shell_unset_var(args[i]);
+    }
+
+    return 0;
+}
+
+int open_history(void)
+{
+    // An empty HISTFILE turns history off
+    const char* path = var_get(&vars, "HISTFILE", 8);
+    char* default_path = NULL;
+    if (path == NULL)
+    {
+        const char* home = var_get(&vars, "HOME", 4);
+        if (home == NULL)
+        {
+            return ENOENT;
+        }
+        default_path = malloc(strlen(home) + sizeof("/" HISTORY_FILE_NAME));
+        if (default_path == NULL)
+        {
+            return ENOMEM;
+        }
+        strcpy(stpcpy(default_path, home), "/" HISTORY_FILE_NAME);
+        path = default_path;
+    }
+
+    int err = path[0] != '\0' ? history_open(&history, path) : ENOENT;
+    free(default_path);
+
+    return err;
+}
+
+int builtin_history(char** args, int argc)
+{
+    status = 0;
+    status_is_term = false;
+    if (history.fd == -1 && open_history() != 0)
+    {
+        output_str(&stderr_buf, "history: no history log\n");
+        output_flush(&stderr_buf);
+        status = 1;
+
+        return 0;
+    }
+
+    // Gather up the offsets of the entries to show, in the order they ran
+    uint64_t* offsets = NULL;
+    size_t count = 0;
+    if (argc >= 3 && strcmp(args[1], "-s") == 0) // By prefix, via the index
+    {
+        // There's no quoting, so the rest of the words make up the prefix,
+        // one space apart
+        size_t prefix_len = 0;
+        int a;
+        for (a = 2; a < argc; ++a)
+        {
+            prefix_len += strlen(args[a]) + 1;
+        }
+        char* prefix = arena_alloc(&command_arena, prefix_len);
+        if (prefix == NULL)
+        {
+            perror("history: could not search");
+            status = 1;
+
+            return 0;
+        }
+        char* end = prefix;
+        for (a = 2; a < argc; ++a)
+        {
+            end = stpcpy(end, args[a]);
+            *end++ = ' ';
+        }
+        end[-1] = '\0';
+
+        size_t first;
+        ssize_t found = history_search(&history, prefix, &first);
+        if (found < 0)
+        {
+            perror("history: could not search");
+            status = 1;
+
+            return 0;
+        }
+        offsets = malloc(((size_t)found + 1) * sizeof(uint64_t));
+        if (offsets != NULL)
+        {
+            count = (size_t)found;
+            memcpy(
+                offsets,
+                history.index + first,
+                count * sizeof(uint64_t)
+            );
+            qsort(offsets, count, sizeof(uint64_t), history_compare_offsets);
+        }
+    }
+    else // The last N, walking back from the end
+    {
+        long wanted = argc >= 2 ? strtol(args[1], NULL, 10) : 0;
+        if (wanted <= 0)
+        {
+            wanted = HISTORY_DEFAULT_COUNT;
+        }
+        int err = history_map(&history);
+        if (err != 0)
+        {
+            errno = err;
+            perror("history: could not read");
+            status = 1;
+
+            return 0;
+        }
+        offsets = malloc((size_t)wanted * sizeof(uint64_t));
+        uint64_t at = history.map_len;
+        while (offsets != NULL && count < (size_t)wanted
+               && (at = history_prev(&history, at)) != 0)
+        {
+            offsets[(size_t)wanted - ++count] = at;
+        }
+        if (offsets != NULL)
+        {
+            memmove(
+                offsets,
+                offsets + ((size_t)wanted - count),
+                count * sizeof(uint64_t)
+            );
+        }
+    }
+    if (offsets == NULL)
+    {
+        perror("malloc() failed!");
+        status = 1;
+
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < count; ++i)
+    {
+        const history_entry_t* entry = history_entry_at(&history, offsets[i]);
+        if (entry == NULL)
+        {
+            continue;
+        }
+        char entry_str[96];
+        int len = history_format(entry, entry_str, sizeof(entry_str));
+        output_append(
+            &stdout_buf,
+            entry_str,
+            (size_t)len < sizeof(entry_str) ? (size_t)len
+                                            : sizeof(entry_str) - 1
+        );
+        output_str(&stdout_buf, history_entry_line(entry));
+        output_append(&stdout_buf, "\n", 1);
+    }
+    output_flush(&stdout_buf);
+    free(offsets);
+
+    return 0;
+}
+
+int open_results(void)
+{
+    if (results.dir == NULL)
+    {
+        const char* home = var_get(&vars, "HOME", 4);
+        if (home == NULL)
+        {
+            return ENOENT;
+        }
+        char* dir = malloc(strlen(home) + sizeof("/" CACHE_DIR_NAME));
+        if (dir == NULL)
+        {
+            return ENOMEM;
+        }
+        strcpy(stpcpy(dir, home), "/" CACHE_DIR_NAME);
+        cache_store_init(&results, dir, CACHE_DEFAULT_CAP);
+    }
+
+    return cache_open(&results);
+}
+
+bool make_cache_key(const stage_t* stages, int stage_count, cache_key_t* key)
+{
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        return false;
+    }
+    cache_key_add_str(key, cwd);
+    free(cwd);
+
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        const stage_t* stage = &stages[i];
+        if (stage->command == NULL
+            || (stage->output_file != NULL && i < stage_count - 1))
+        {
+            return false;
+        }
+
+        // The binary is whatever would be run, found the same way
+        const char* binary = path_cache_lookup(
+            &path_cache,
+            stage->command,
+            var_get(&vars, "PATH", 4)
+        );
+        binary = binary != NULL ? binary : stage->command;
+        struct stat st;
+        if (strchr(binary, '/') == NULL || stat(binary, &st) == -1)
+        {
+            return false;
+        }
+        cache_key_add_str(key, binary);
+        cache_key_add_stat(key, &st);
+
+        cache_key_add(key, &stage->argc, sizeof(stage->argc));
+        int a;
+        for (a = 0; a < stage->argc; ++a)
+        {
+            cache_key_add_str(key, stage->args[a]);
+        }
+
+        cache_key_add_str(key, stage->input_file);
+        if (stage->input_file != NULL
+            && cache_key_add_input(key, stage->input_file) != 0)
+        {
+            return false;
+        }
+    }
+
+    const char* names = var_get(&vars, "CACHE_VARS", 10);
+    cache_key_add_str(key, names);
+    while (names != NULL && *names != '\0')
+    {
+        size_t name_len = strcspn(names, ":");
+        cache_key_add_str(key, var_get(&vars, names, name_len));
+        names += name_len + (names[name_len] == ':');
+    }
+
+    return !key->failed;
+}
+
+int run_cached(stage_t* stages, int stage_count)
+{
+    cache_key_t key;
+    cache_key_init(&key);
+    int err = open_results();
+    if (err != 0)
+    {
+        errno = err;
+        perror("cached: could not open the cache");
+    }
+    if (err != 0 || !make_cache_key(stages, stage_count, &key))
+    {
+        cache_key_free(&key);
+
+        return exec_command(stages, stage_count, false);
+    }
+
+    // The output goes where it would have, ">" and all
+    stage_t* last = &stages[stage_count - 1];
+    int out_fd = STDOUT_FILENO;
+    if (last->output_file != NULL
+        && (out_fd = open_redirect(last->output_file, true)) == -1)
+    {
+        cache_key_free(&key);
+        status = 1;
+        status_is_term = false;
+
+        return 0;
+    }
+
+    int ret = 0;
+    cache_blob_t blob;
+    if (cache_lookup(&results, &key, &blob)) // Nothing to run
+    {
+        output_flush(&stdout_buf);
+        write_direct(out_fd, blob.output, (size_t)blob.output_len);
+        status = blob.exit_value;
+        status_is_term = false;
+        memset(&fg_usage, 0, sizeof(fg_usage));
+        cache_blob_close(&blob);
+    }
+    else
+    {
+        // The pipeline, plus a relay on the end that copies its output into
+        // the new blob as it passes it on
+        char* blob_path = NULL;
+        int blob_fd = cache_begin(&results, &blob_path);
+        stage_t* teed = blob_fd != -1
+            ? arena_alloc(
+                  &command_arena,
+                  ((size_t)stage_count + 1) * sizeof(stage_t)
+              )
+            : NULL;
+        if (teed == NULL)
+        {
+            if (blob_fd != -1)
+            {
+                cache_abort(blob_fd, blob_path);
+            }
+            perror("cached: could not start a blob");
+            if (out_fd != STDOUT_FILENO)
+            {
+                close(out_fd);
+            }
+            cache_key_free(&key);
+
+            return exec_command(stages, stage_count, false);
+        }
+        memcpy(teed, stages, (size_t)stage_count * sizeof(stage_t));
+        teed[stage_count - 1].output_file = NULL;
+        teed[stage_count].command = NULL;
+        teed[stage_count].args = &last->args[last->argc];
+        teed[stage_count].argc = 0;
+        teed[stage_count].input_file = NULL;
+        teed[stage_count].output_file = blob_path;
+
+        child_stdout = out_fd;
+        caching_command = true;
+        cache_tee_ok = false;
+        ret = exec_command(teed, stage_count + 1, false);
+        child_stdout = -1;
+        caching_command = false;
+
+        // Only what ran to completion, with every byte copied, is kept
+        if (ret == 0 && cache_tee_ok && !status_is_term
+            && !shutdown_requested)
+        {
+            err = cache_commit(&results, blob_fd, blob_path, &key, status);
+            if (err != 0)
+            {
+                errno = err;
+                perror("cached: could not save the result");
+            }
+        }
+        else
+        {
+            cache_abort(blob_fd, blob_path);
+        }
+    }
+
+    if (out_fd != STDOUT_FILENO)
+    {
+        close(out_fd);
+    }
+    cache_key_free(&key);
+
+    return ret;
+}
+
+parse_result_t parse_line(const char*      line,
+                          const lex_env_t* env,
+                          stage_t**        stages_out,
+                          int*             stage_count_out,
+                          bool*            background_out)
+{
+    token_t* tokens;
+    ssize_t token_count = lex_line(&command_arena, line, env, &tokens);
+    if (token_count < 0)
+    {
+        return PARSE_NO_MEMORY;
+    }
+    // Handle blank lines and comments (going by the line itself, since an
+    // expansion could start with a '#')
+    if (token_count == 0 || line[strspn(line, " \n")] == '#')
+    {
+        return PARSE_EMPTY;
+    }
+
+    // Size everything up front. Each stage's `argv` is a slice of `words`,
+    // with its own `NULL` terminator.
+    int stage_count = 1;
+    ssize_t t;
+    for (t = 0; t < token_count; ++t)
+    {
+        if (tokens[t].kind == TOKEN_PIPE)
+        {
+            stage_count++;
+        }
+    }
+    stage_t* stages = arena_alloc(
+        &command_arena,
+        (size_t)stage_count * sizeof(stage_t)
+    );
+    char** words = arena_alloc(
+        &command_arena,
+        ((size_t)token_count + (size_t)stage_count) * sizeof(char*)
+    );
+    if (stages == NULL || words == NULL)
+    {
+        return PARSE_NO_MEMORY;
+    }
+
+    // State management for the parsing
+    int word_count = 0;
+    stage_t* stage = &stages[0];
+    bool looking_for_input = false;
+    bool looking_for_output = false;
+    bool background = false; // Foreground by default
+    bool syntax_error = false;
+
+    stage->args = &words[0];
+    stage->argc = 0;
+    stage->input_file = NULL;
+    stage->output_file = NULL;
+
+    // Parse command, one token at a time
+    for (t = 0; t < token_count; ++t)
+    {
+        background = false;
+
+        switch (tokens[t].kind)
+        {
+            case TOKEN_INPUT:
+            {
+                looking_for_input = true;
+                break;
+            }
+            case TOKEN_OUTPUT:
+            {
+                looking_for_output = true;
+                break;
+            }
+            case TOKEN_BACKGROUND:
+            {
+                background = true;
+                break;
+            }
+            case TOKEN_PIPE:
+            {
+                // A stage needs either a command or something to relay
+                if (stage->argc == 0
+                    && stage->input_file == NULL
+                    && stage->output_file == NULL)
+                {
+                    syntax_error = true;
+                }
+
+                // Close off this stage and start on the next one
+                words[word_count++] = NULL;
+                stage++;
+                stage->args = &words[word_count];
+                stage->argc = 0;
+                stage->input_file = NULL;
+                stage->output_file = NULL;
+                break;
+            }
+            case TOKEN_WORD:
+            default:
+            {
+                if (looking_for_input) // Last one wins
+                {
+                    stage->input_file = tokens[t].text;
+                    looking_for_input = false;
+                }
+                else if (looking_for_output)
+                {
+                    stage->output_file = tokens[t].text;
+                    looking_for_output = false;
+                }
+                else
+                {
+                    words[word_count++] = tokens[t].text;
+                    stage->argc++;
+                }
+                break;
+            }
+        }
+    }
+
+    words[word_count] = NULL; // Last "arg" is just a `NULL` terminator
+    if (stage->argc == 0
+        && stage->input_file == NULL
+        && stage->output_file == NULL)
+    {
+        syntax_error = true;
+    }
+
+    // First arg is always the command name, if there is one
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        stages[i].command = stages[i].args[0];
+    }
+
+    *stages_out = stages;
+    *stage_count_out = stage_count;
+    *background_out = background;
+
+    return syntax_error ? PARSE_SYNTAX_ERROR : PARSE_OK;
+}
+
+void report_time(uint64_t start_ns, const struct rusage* self_before)
+{
+    job_usage_t usage = fg_usage;
+    usage.wall_ns = monotonic_ns() - start_ns;
+
+    // Built-ins (and the work of launching things) happen in the shell
+    // itself, so that counts too
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    usage.user_us += (uint64_t)(
+        (self.ru_utime.tv_sec - self_before->ru_utime.tv_sec) * 1000000
+        + (self.ru_utime.tv_usec - self_before->ru_utime.tv_usec)
+    );
+    usage.sys_us += (uint64_t)(
+        (self.ru_stime.tv_sec - self_before->ru_stime.tv_sec) * 1000000
+        + (self.ru_stime.tv_usec - self_before->ru_stime.tv_usec)
+    );
+    usage.minor_faults += self.ru_minflt - self_before->ru_minflt;
+    usage.major_faults += self.ru_majflt - self_before->ru_majflt;
+    usage.vol_switches += self.ru_nvcsw - self_before->ru_nvcsw;
+    usage.invol_switches += self.ru_nivcsw - self_before->ru_nivcsw;
+
+    char usage_str[192];
+    int len = job_usage_format(&usage, usage_str, sizeof(usage_str) - 1);
+    usage_str[len++] = '\n';
+    output_append(&stderr_buf, usage_str, (size_t)len);
+    output_flush(&stderr_buf);
+}
+
+void shell_lex_env(lex_env_t* env)
+{
+    env->vars = &vars;
+    env->pid_str = pid_str;
+    env->pid_len = pid_str_len;
+    env->status = status_is_term ? 128 + status : status;
+    env->last_bg = last_bg_pid;
+}
+
+int process_command(char* line)
+{
+    // Everything from the last line goes in one fell swoop
+    arena_reset(&command_arena);
+
+    lex_env_t env;
+    shell_lex_env(&env);
+    stage_t* stages;
+    int stage_count;
+    bool background;
+    parse_result_t parsed = parse_line(
+        line,
+        &env,
+        &stages,
+        &stage_count,
+        &background
+    );
+    trace_emit(
+        trace,
+        TRACE_PARSE_DONE,
+        shell_pid,
+        parsed == PARSE_OK ? stage_count : 0
+    );
+
+    return run_parsed_command(parsed, stages, stage_count, background);
+}
+
+int run_parsed_command(parse_result_t parsed,
+                       stage_t*       stages,
+                       int            stage_count,
+                       bool           background)
+{
+    int ret = 0;
+
+    if (parsed == PARSE_EMPTY)
+    {
+        return 0;
+    }
+    if (parsed == PARSE_NO_MEMORY)
+    {
+        perror("could not parse command");
+
+        return 1;
+    }
+    metrics.commands++;
+
+    // "&" only counts while it's allowed, which is toggled on receipt of a
+    // `SIGTSTP`
+    background = background && allow_bg;
+
+    int argc = parsed == PARSE_OK ? stages[0].argc : 0;
+    const char* command = stages[0].command;
+
+    // `time` is a prefix: whatever follows it runs as usual, and then gets
+    // reported on
+    uint64_t time_start_ns = 0;
+    struct rusage self_before;
+    if (parsed == PARSE_OK && command != NULL && strcmp(command, "time") == 0)
+    {
+        timing_command = true;
+        time_start_ns = monotonic_ns();
+        getrusage(RUSAGE_SELF, &self_before);
+        memset(&fg_usage, 0, sizeof(fg_usage));
+
+        stages[0].args++;
+        stages[0].argc--;
+        stages[0].command = stages[0].args[0];
+        command = stages[0].command;
+        argc = stages[0].argc;
+    }
+
+    // So is `on`, which says where whatever follows it should run
+    bool bad_placement = false;
+    if (parsed == PARSE_OK && command != NULL && strcmp(command, "on") == 0)
+    {
+        bad_placement = argc < 2
+            || !place_request_parse(
+                   &placer,
+                   stages[0].args[1],
+                   &line_placement
+               );
+        if (!bad_placement)
+        {
+            placing_command = true;
+            stages[0].args += 2;
+            stages[0].argc -= 2;
+            stages[0].command = stages[0].args[0];
+            command = stages[0].command;
+            argc = stages[0].argc;
+        }
+    }
+
+    // And `timeout`, which says how long whatever follows it gets before
+    // it's sent `SIGTERM`, and then (after `-k`'s grace period) `SIGKILL`
+    bool bad_timeout = false;
+    if (parsed == PARSE_OK && command != NULL
+        && strcmp(command, "timeout") == 0)
+    {
+        int skip = 1;
+        if (argc >= 3 && strcmp(stages[0].args[1], "-k") == 0)
+        {
+            bad_timeout = !deadline_parse_duration(
+                stages[0].args[2],
+                &command_grace_ns
+            );
+            skip = 3;
+        }
+        bad_timeout = bad_timeout || argc < skip + 2
+            || !deadline_parse_duration(
+                   stages[0].args[skip],
+                   &command_timeout_ns
+               )
+            || command_timeout_ns == 0;
+        if (!bad_timeout)
+        {
+            stages[0].args += skip + 1;
+            stages[0].argc -= skip + 1;
+            stages[0].command = stages[0].args[0];
+            command = stages[0].command;
+            argc = stages[0].argc;
+        }
+    }
+
+    // And `after`, which holds a background job until the jobs it names
+    // have all succeeded
+    bool bad_after = false;
+    const char* bad_dep = NULL;
+    if (parsed == PARSE_OK && command != NULL
+        && strcmp(command, "after") == 0)
+    {
+        int dep_count = 0;
+        while (dep_count + 1 < argc && stages[0].args[dep_count + 1][0] == '%')
+        {
+            dep_count++;
+        }
+        line_deps = arena_alloc(
+            &command_arena,
+            ((size_t)dep_count + 1) * sizeof(int)
+        );
+        bad_after = dep_count == 0 || dep_count + 1 >= argc || !background
+            || line_deps == NULL;
+        int d;
+        for (d = 1; !bad_after && d <= dep_count; ++d)
+        {
+            const char* spec = stages[0].args[d];
+            char* end;
+            long id = strtol(spec + 1, &end, 10);
+            if (end == spec + 1 || *end != '\0' || id <= 0
+                || id >= jobs.next_id)
+            {
+                bad_dep = spec;
+                bad_after = true;
+            }
+            line_deps[d - 1] = (int)id;
+        }
+        if (!bad_after)
+        {
+            line_dep_count = dep_count;
+            stages[0].args += dep_count + 1;
+            stages[0].argc -= dep_count + 1;
+            stages[0].command = stages[0].args[0];
+            command = stages[0].command;
+            argc = stages[0].argc;
+        }
+    }
+
+    // And `cached`, which plays back whatever follows it from the result
+    // cache, if it has been run before exactly the same way
+    bool cached = false;
+    if (parsed == PARSE_OK && command != NULL && argc >= 2
+        && strcmp(command, "cached") == 0)
+    {
+        cached = true;
+        stages[0].args++;
+        stages[0].argc--;
+        stages[0].command = stages[0].args[0];
+        command = stages[0].command;
+        argc = stages[0].argc;
+    }
+
+    // Start doing stuff based on the parsed command, built-ins first.
+    if (parsed == PARSE_SYNTAX_ERROR)
+    {
+        output_str(&stderr_buf, "syntax error: empty pipeline stage\n");
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+    }
+    else if (bad_placement)
+    {
+        output_str(&stderr_buf, "on: bad placement: ");
+        output_str(&stderr_buf, argc < 2 ? "(none)" : stages[0].args[1]);
+        output_str(
+            &stderr_buf,
+            "\n(use none, rr, pack, spread, nodeN, or a CPU list)\n"
+        );
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+    }
+    else if (bad_timeout)
+    {
+        output_str(
+            &stderr_buf,
+            "timeout: usage: timeout [-k grace] duration command...\n"
+            "(durations are seconds, or end in s, m, or h)\n"
+        );
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+    }
+    else if (bad_after)
+    {
+        if (bad_dep != NULL)
+        {
+            output_str(&stderr_buf, "after: no such job ");
+            output_str(&stderr_buf, bad_dep);
+            output_append(&stderr_buf, "\n", 1);
+        }
+        else
+        {
+            output_str(
+                &stderr_buf,
+                "after: usage: after %N... command... &\n"
+            );
+        }
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+    }
+    else if (stage_count == 1 && command == NULL
+             && stages[0].input_file == NULL && stages[0].output_file == NULL)
+    {
+        // A bare `time`, which has nothing to time
+    }
+    else if (cached && !background) // Never built-ins either
+    {
+        ret = run_cached(stages, stage_count);
+    }
+    else if (line_dep_count > 0) // Nor is anything held `after` others
+    {
+        ret = hold_bg(stages, stage_count);
+    }
+    else if (stage_count > 1 || command == NULL) // Pipelines (and relays)
+    {                                            // are never built-ins
+        ret = background
+            ? schedule_bg(stages, stage_count)
+            : exec_command(stages, stage_count, background);
+    }
+    else if (is_assignment_line(&stages[0])) // "NAME=value ..."
+    {
+        ret = builtin_assign(stages[0].args, argc);
+    }
+    else if (strcmp(command, "exit") == 0) // `exit` built-in command
+    {
+        ret = -1;
+    }
+    else if (strcmp(command, "cd") == 0) // `cd` built-in command
+    {
+        if (argc < 2) // Bare `cd` invocation takes us to the `$HOME` dir
+        {
+            const char* target = var_get(&vars, "HOME", 4);
+            if (target == NULL)
+            {
+                target = "";
+            }
+            if (chdir(target) == -1)
+            {
+                output_str(&stderr_buf, "could not cd to ");
+                output_str(&stderr_buf, target);
+                output_append(&stderr_buf, "\n", 1);
+                output_flush(&stderr_buf);
+            }
+        }
+        else // Otherwise we change to the specified dir
+        {
+            const char* target = stages[0].args[1];
+            if (chdir(target) == -1)
+            {
+                output_str(&stderr_buf, "could not cd to ");
+                output_str(&stderr_buf, target);
+                output_append(&stderr_buf, "\n", 1);
+                output_flush(&stderr_buf);
+            }
+        }
+
+        // Children are started by the helper, so it has to follow along
+        helper_chdir();
+    }
+    else if (strcmp(command, "status") == 0) // `status` built-in command
+    {
+        output_str(
+            &stdout_buf,
+            status_is_term ? "terminated by signal " : "exit value "
+        );
+        output_int(&stdout_buf, status);
+        output_append(&stdout_buf, "\n", 1);
+
+        // `status -v` also says what the last foreground job used
+        if (argc >= 2 && strcmp(stages[0].args[1], "-v") == 0)
+        {
+            char usage_str[192];
+            int len = job_usage_format(
+                &fg_usage,
+                usage_str,
+                sizeof(usage_str) - 1
+            );
+            usage_str[len++] = '\n';
+            output_append(&stdout_buf, usage_str, (size_t)len);
+        }
+        output_flush(&stdout_buf);
+    }
+    else if (strcmp(command, "export") == 0) // `export` built-in command
+    {
+        ret = builtin_export(stages[0].args, argc);
+    }
+    else if (strcmp(command, "unset") == 0) // `unset` built-in command
+    {
+        ret = builtin_unset(stages[0].args, argc);
+    }
+    else if (strcmp(command, "history") == 0) // `history` built-in command
+    {
+        ret = builtin_history(stages[0].args, argc);
+    }
+    else if (strcmp(command, "jobs") == 0) // `jobs` built-in command
+    {
+        ret = builtin_jobs();
+    }
+    else if (strcmp(command, "fg") == 0 && submit_id != 0) // Which would
+    {                                         // hold up the daemon's loop
+        output_str(&stderr_buf, "fg: not from a daemon-mode client\n");
+        output_flush(&stderr_buf);
+
+        status = 1;
+        status_is_term = false;
+    }
+    else if (strcmp(command, "fg") == 0) // `fg` built-in command
+    {
+        ret = builtin_fg(stages[0].args, argc);
+    }
+    else if (strcmp(command, "bg") == 0) // `bg` built-in command
+    {
+        ret = builtin_bg(stages[0].args, argc);
+    }
+    else if (strcmp(command, "kill") == 0 && names_job(stages[0].args))
+    {
+        ret = builtin_kill(stages[0].args, argc);
+    }
+    else if (strcmp(command, "output") == 0) // `output` built-in command
+    {
+        ret = builtin_output(stages[0].args, argc);
+    }
+    else if (strcmp(command, "hash") == 0) // `hash` built-in command
+    {
+        ret = builtin_hash(stages[0].args, argc);
+    }
+    else if (strcmp(command, "stats") == 0) // `stats` built-in command
+    {
+        ret = builtin_stats(stages[0].args, argc);
+    }
+    else if (strcmp(command, "parallel") == 0) // `parallel` built-in
+    {
+        ret = builtin_parallel(&stages[0], argc, background);
+    }
+    else if (strcmp(command, "trace") == 0) // `trace` built-in command
+    {
+        builtin_trace(stages[0].args, argc);
+    }
+    else if (!background && fast_builtins && !placing_command
+             && command_timeout_ns == 0 && run_fast_builtin(&stages[0]))
+    {
+        // `echo` and friends, done without ever leaving the shell, unless
+        // they're to run somewhere in particular, or have a deadline to
+        // be killed by
+    }
+    else // Otherwise we `exec`, minding the PATH
+    {
+        ret = background
+            ? schedule_bg(stages, stage_count)
+            : exec_command(stages, stage_count, background);
+    }
+
+    // Background jobs report their usage along with being done
+    if (timing_command && !background)
+    {
+        report_time(time_start_ns, &self_before);
+    }
+    timing_command = false;
+    placing_command = false;
+    line_placement = default_placement;
+    command_timeout_ns = 0;
+    command_grace_ns = DEADLINE_DEFAULT_GRACE_NS;
+    line_deps = NULL;
+    line_dep_count = 0;
+
+    return ret;
+}
+
+int compile_script(line_reader_t* reader, script_builder_t* builder)
+{
+    char* line;
+    ssize_t chars_read;
+    while ((chars_read = reader_next_line(reader, &line)) >= 0)
+    {
+        arena_reset(&command_arena);
+
+        // Every `$` stands for itself here, so that it's still there to
+        // expand when the line is run
+        stage_t* stages;
+        int stage_count;
+        bool background;
+        parse_result_t parsed = parse_line(
+            line,
+            NULL,
+            &stages,
+            &stage_count,
+            &background
+        );
+        if (parsed == PARSE_EMPTY)
+        {
+            continue;
+        }
+        if (parsed == PARSE_NO_MEMORY)
+        {
+            return ENOMEM;
+        }
+
+        int i;
+        for (i = 0; i < stage_count; ++i)
+        {
+            const stage_t* stage = &stages[i];
+            uint32_t first_word = (uint32_t)builder->word_count;
+            uint32_t input_file = SCRIPT_NONE;
+            uint32_t output_file = SCRIPT_NONE;
+            int a;
+            for (a = 0; a < stage->argc; ++a)
+            {
+                if (script_add_word(builder, stage->args[a]) == SCRIPT_NONE)
+                {
+                    return ENOMEM;
+                }
+            }
+            if (stage->input_file != NULL)
+            {
+                input_file = script_add_word(builder, stage->input_file);
+            }
+            if (stage->output_file != NULL)
+            {
+                output_file = script_add_word(builder, stage->output_file);
+            }
+            if ((stage->input_file != NULL && input_file == SCRIPT_NONE)
+                || (stage->output_file != NULL && output_file == SCRIPT_NONE)
+                || script_add_stage(
+                       builder,
+                       first_word,
+                       (uint32_t)stage->argc,
+                       input_file,
+                       output_file
+                   ) != 0)
+            {
+                return ENOMEM;
+            }
+        }
+
+        uint32_t flags = (background ? SCRIPT_BACKGROUND : 0)
+            | (parsed == PARSE_SYNTAX_ERROR ? SCRIPT_SYNTAX_ERROR : 0);
+        if (script_add_command(
+                builder,
+                (uint32_t)stage_count,
+                flags,
+                (size_t)chars_read
+            ) != 0)
+        {
+            return ENOMEM;
+        }
+    }
+    arena_reset(&command_arena);
+
+    return chars_read == READER_EOF ? 0 : EIO;
+}
+
+int open_script_image(const char* path, int fd, script_image_t* image)
+{
+    // Only a regular file stays put long enough to be worth compiling
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        return EINVAL;
+    }
+    char* image_path = script_image_path(path);
+    if (image_path == NULL)
+    {
+        return ENOMEM;
+    }
+
+    // Already compiled, and still up to date?
+    int err = script_image_load(image, image_path, &st);
+    if (err == 0)
+    {
+        free(image_path);
+        return 0;
+    }
+
+    // Otherwise it's compiled now, run from memory, and saved for next time
+    // (if the directory lets us)
+    line_reader_t reader;
+    script_builder_t builder;
+    script_builder_init(&builder);
+    err = reader_open(&reader, fd, false);
+    if (err == 0)
+    {
+        err = compile_script(&reader, &builder);
+        reader_close(&reader);
+    }
+    if (err == 0)
+    {
+        err = script_image_build(&builder, &st, image);
+    }
+    if (err == 0)
+    {
+        script_image_save(image, image_path);
+    }
+    script_builder_destroy(&builder);
+    free(image_path);
+
+    return err;
+}
+
+parse_result_t image_command(script_image_t* image,
+                             stage_t**       stages_out,
+                             int*            stage_count_out,
+                             bool*           background_out)
+{
+    const script_header_t* header = image->header;
+    const script_command_t* command = &image->commands[image->next++];
+
+    // The tables are checked as they're used, not when they're loaded
+    errno = EINVAL;
+    if (command->stage_count == 0
+        || command->stage_count > header->stage_count
+        || command->first_stage > header->stage_count - command->stage_count)
+    {
+        return PARSE_NO_MEMORY;
+    }
+
+    int stage_count = (int)command->stage_count;
+    const script_stage_t* image_stages = &image->stages[command->first_stage];
+    size_t word_count = 0;
+    int i;
+    for (i = 0; i < stage_count; ++i)
+    {
+        if (image_stages[i].argc > header->word_count
+            || image_stages[i].first_word
+               > header->word_count - image_stages[i].argc)
+        {
+            return PARSE_NO_MEMORY;
+        }
+        word_count += image_stages[i].argc + 1;
+    }
+
+    errno = ENOMEM;
+    stage_t* stages = arena_alloc(
+        &command_arena,
+        (size_t)stage_count * sizeof(stage_t)
+    );
+    char** words = arena_alloc(&command_arena, word_count * sizeof(char*));
+    if (stages == NULL || words == NULL)
+    {
+        return PARSE_NO_MEMORY;
+    }
+
+    // Only words with a `$` need anything more than pointing at
+    lex_env_t env;
+    shell_lex_env(&env);
+    for (i = 0; i < stage_count; ++i)
+    {
+        const script_stage_t* image_stage = &image_stages[i];
+        stage_t* stage = &stages[i];
+        stage->args = words;
+        stage->argc = (int)image_stage->argc;
+        stage->input_file = NULL;
+        stage->output_file = NULL;
+
+        uint32_t a;
+        for (a = 0; a < image_stage->argc; ++a)
+        {
+            *words = script_image_word(
+                image,
+                image_stage->first_word + a,
+                &command_arena,
+                &env
+            );
+            if (*words++ == NULL)
+            {
+                return PARSE_NO_MEMORY;
+            }
+        }
+        *words++ = NULL;
+        stage->command = stage->args[0];
+
+        if (image_stage->input_file != SCRIPT_NONE)
+        {
+            stage->input_file = script_image_word(
+                image,
+                image_stage->input_file,
+                &command_arena,
+                &env
+            );
+            if (stage->input_file == NULL)
+            {
+                return PARSE_NO_MEMORY;
+            }
+        }
+        if (image_stage->output_file != SCRIPT_NONE)
+        {
+            stage->output_file = script_image_word(
+                image,
+                image_stage->output_file,
+                &command_arena,
+                &env
+            );
+            if (stage->output_file == NULL)
+            {
+                return PARSE_NO_MEMORY;
+            }
+        }
+    }
+
+    *stages_out = stages;
+    *stage_count_out = stage_count;
+    *background_out = (command->flags & SCRIPT_BACKGROUND) != 0;
+
+    return (command->flags & SCRIPT_SYNTAX_ERROR) != 0
+        ? PARSE_SYNTAX_ERROR
+        : PARSE_OK;
+}
+
+int process_image_command(script_image_t* image)
+{
+    arena_reset(&command_arena);
+
+    trace_emit(
+        trace,
+        TRACE_LINE_READ,
+        shell_pid,
+        image->commands[image->next].line_len
+    );
+
+    stage_t* stages;
+    int stage_count;
+    bool background;
+    parse_result_t parsed = image_command(
+        image,
+        &stages,
+        &stage_count,
+        &background
+    );
+    trace_emit(
+        trace,
+        TRACE_PARSE_DONE,
+        shell_pid,
+        parsed == PARSE_OK ? stage_count : 0
+    );
+
+    return run_parsed_command(parsed, stages, stage_count, background);
+}
+
+int run_line(line_reader_t* reader,
+             char*          line,
+             ssize_t        len,
+             bool           interactive)
+{
+    trace_emit(trace, TRACE_LINE_READ, shell_pid, len);
+
+    // Children sharing our stdin should start reading after this line
+    reader_sync_offset(reader);
+
+    // What's typed at the prompt goes in the history log, and gets its
+    // outcome once it's done (or, for a background job, reaped)
+    uint64_t line_start_ns = monotonic_ns();
+    char first = line[strspn(line, " \n")];
+    if (interactive && first != '\0' && first != '#')
+    {
+        history_at = history_add(&history, line, time(NULL));
+    }
+
+    int command_result = process_command(line);
+    history_finish(
+        &history,
+        history_at,
+        status,
+        status_is_term,
+        monotonic_ns() - line_start_ns,
+        false
+    );
+    history_at = -1;
+
+    return command_result;
+}
+
+int await_input(line_reader_t* reader)
+{
+    // A `SIGCHLD` is let in, so that it's known when a job exited, but it
+    // doesn't re-prompt: it's only reaped at the next prompt anyway
+    sigchld_woke = 0;
+    struct pollfd fds[3] = {
+        {reader->fd, POLLIN, 0},
+        {deadlines.timer_fd, POLLIN, 0},
+        {metrics_out.timer_fd, POLLIN, 0}
+    };
+    if (poll(fds, 3, -1) == -1)
+    {
+        if (errno != EINTR)
+        {
+            return READER_ERROR;
+        }
+        return sigchld_woke && !capture_pending ? 0 : READER_INTERRUPTED;
+    }
+
+    if (fds[1].revents != 0)
+    {
+        deadline_heap_fire(&deadlines);
+    }
+    if (fds[2].revents != 0)
+    {
+        export_metrics();
+    }
+    reader->readable = fds[0].revents != 0;
+    reader->polled = deadlines.count > 0 || metrics_out.timer_fd != -1
+        || !reader->readable;
+
+    return 0;
+}
+
+int main_loop(line_reader_t*  reader,
+              script_image_t* image,
+              bool            interactive)
+{
+    char* line;
+    ssize_t chars_read;
+
+    // Holds result of calling off to the command-processing function
+    int command_result;
+
+    // Main loop, for real
+    do
+    {
+        if (shutdown_requested) // Which is as good as `exit`
+        {
+            return 0;
+        }
+
+        int bg_res = handle_bg_processes(); // Collect up now-dead child
+                                            // processes and report them just
+                                            // before prompting the user
+        if (bg_res != 0) // Something went terribly wrong with handling the
+        {                // backgrounded children
+            return bg_res;
+        }
+
+        // The prompt goes out with any background job reports, in one go
+        if (interactive)
+        {
+            output_append(&stdout_buf, ": ", 2);
+        }
+        output_flush(&stdout_buf);
+
+        if (image != NULL) // Compiled scripts come already parsed
+        {
+            if (image->next == image->header->command_count)
+            {
+                return wait_bg_processes();
+            }
+            if ((command_result = process_image_command(image)) != 0)
+            {
+                return command_result;
+            }
+            continue;
+        }
+
+        // A job's time can run out while we wait on the user, so while
+        // there are deadlines (or metrics to write out), stdin is only read
+        // once it's readable
+        reader->polled = (deadlines.count > 0 || metrics_out.timer_fd != -1)
+            && reader->map == NULL;
+        while ((chars_read = reader_next_line(reader, &line))
+                   == READER_INTERRUPTED
+               || chars_read == READER_WOULD_BLOCK)
+        {
+            if (shutdown_requested)
+            {
+                return 0;
+            }
+            if (chars_read == READER_WOULD_BLOCK)
+            {
+                chars_read = await_input(reader);
+                if (chars_read == 0)
+                {
+                    continue;
+                }
+                if (chars_read == READER_ERROR)
+                {
+                    break;
+                }
+            }
+
+            // Captured output came in, which is put away without bothering
+            // the user
+            if (capture_pending)
+            {
+                capture_pending = 0;
+                capture_drain(&captures);
+                continue;
+            }
+
+            // `read()` was interrupted by the signal, so re-prompt
+            if (interactive)
+            {
+                output_append(&stdout_buf, "\n: ", 3);
+                output_flush(&stdout_buf);
+            }
+        }
+
+        if (chars_read == READER_EOF) // Out of input, which is as good as
+        {                             // `exit`ing once the background work
+            return wait_bg_processes(); // is all done
+        }
+        if (chars_read == READER_ERROR)
+        {
+            perror("read() failed!");
+
+            return 1;
+        }
+
+        command_result = run_line(reader, line, chars_read, interactive);
+        if (command_result != 0)
+        {
+            // "Please exit" result of calling out to process the command, so
+            // we exit
+            return command_result;
+        }
+    } while (1);
+
+    return 0;
+}
+
+int serve_request(server_client_t* client, char* line)
+{
+    char reply[96];
+    size_t len;
+    if (strncmp(line, "run ", 4) == 0 && !allow_bg)
+    {
+        // The "&" would be ignored, and the daemon left waiting on the job
+        const char msg[] = "error foreground-only mode\n";
+        return server_send(client, msg, sizeof(msg) - 1);
+    }
+    if (strncmp(line, "run ", 4) == 0)
+    {
+        char* job_line = server_job_line(&server, line + 4);
+        if (job_line == NULL)
+        {
+            const char msg[] = "error out of memory\n";
+            return server_send(client, msg, sizeof(msg) - 1);
+        }
+
+        // The reply goes first, so that it can't come after the job's
+        // "done" event
+        uint64_t id = server_submit(&server);
+        memcpy(reply, "job ", 4);
+        len = 4 + format_int(reply + 4, (long long)id);
+        reply[len++] = '\n';
+        server_send(client, reply, len);
+
+        // Whatever doesn't turn into a job (a built-in, a syntax error) is
+        // done as soon as it's run. Only stdin gets to `exit`, or `fg`.
+        submit_id = id;
+        process_command(job_line);
+        if (submit_id != 0)
+        {
+            server_finished(&server, submit_id, status, status_is_term);
+            submit_id = 0;
+        }
+
+        return 0;
+    }
+
+    if (strncmp(line, "status ", 7) == 0)
+    {
+        char* end;
+        uint64_t id = strtoull(line + 7, &end, 10);
+        memcpy(reply, "status ", 7);
+        len = 7 + format_int(reply + 7, (long long)id);
+        reply[len++] = ' ';
+        len += server_format_result(
+            *end == '\0' ? server_result(&server, id) : NULL,
+            reply + len
+        );
+        reply[len++] = '\n';
+    }
+    else if (strcmp(line, "watch") == 0)
+    {
+        if (!client->watching)
+        {
+            client->watching = true;
+            server.watchers++;
+        }
+        memcpy(reply, "watching\n", 9);
+        len = 9;
+    }
+    else
+    {
+        memcpy(reply, "error unknown request\n", 22);
+        len = 22;
+    }
+
+    return server_send(client, reply, len);
+}
+
+void serve_client(server_client_t* client)
+{
+    client->reader.readable = true;
+    while (client->reading && !client->hung_up)
+    {
+        char* line;
+        ssize_t len = reader_next_line(&client->reader, &line);
+        if (len == READER_WOULD_BLOCK)
+        {
+            return;
+        }
+        if (len == READER_INTERRUPTED)
+        {
+            continue;
+        }
+        if (len < 0) // EOF or an error; either way, no more requests
+        {
+            client->reading = false;
+            return;
+        }
+
+        serve_request(client, line);
+    }
+}
+
+int serve_stdin(line_reader_t* reader, bool interactive, bool* stdin_open)
+{
+    reader->readable = true;
+    while (1)
+    {
+        char* line;
+        ssize_t len = reader_next_line(reader, &line);
+        if (len == READER_WOULD_BLOCK)
+        {
+            return 0;
+        }
+        if (len == READER_INTERRUPTED)
+        {
+            continue;
+        }
+        if (len == READER_EOF) // The server keeps going without it
+        {
+            epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, reader->fd, NULL);
+            *stdin_open = false;
+            return 0;
+        }
+        if (len == READER_ERROR)
+        {
+            perror("read() failed!");
+
+            return 1;
+        }
+
+        int command_result = run_line(reader, line, len, interactive);
+        if (command_result != 0)
+        {
+            return command_result;
+        }
+    }
+}
+
+int server_loop(line_reader_t* reader, bool interactive)
+{
+    // A file on stdin can't be waited on, so it's run through first, like a
+    // startup script. Anything else is served alongside the socket.
+    bool stdin_open = reader->map == NULL;
+    if (stdin_open)
+    {
+        reader->polled = true;
+        stdin_open = server_watch(&server, reader->fd, EPOLLIN, reader) == 0;
+    }
+    else
+    {
+        char* line;
+        ssize_t len;
+        while ((len = reader_next_line(reader, &line)) >= 0)
+        {
+            int command_result = run_line(reader, line, len, false);
+            if (command_result != 0)
+            {
+                return command_result;
+            }
+        }
+    }
+
+    // Jobs' deadlines are kept by one timer, and writing out the metrics by
+    // another, which wake us up along with everything else
+    if (deadlines.timer_fd != -1)
+    {
+        server_watch(&server, deadlines.timer_fd, EPOLLIN, &deadlines);
+    }
+    if (metrics_out.timer_fd != -1)
+    {
+        server_watch(&server, metrics_out.timer_fd, EPOLLIN, &metrics_out);
+    }
+
+    bool prompt = interactive && stdin_open;
+    while (!shutdown_requested)
+    {
+        int bg_res = handle_bg_processes();
+        if (bg_res != 0)
+        {
+            return bg_res;
+        }
+        server_sweep(&server);
+
+        if (prompt)
+        {
+            output_append(&stdout_buf, ": ", 2);
+            prompt = false;
+        }
+        output_flush(&stdout_buf);
+
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int count = epoll_wait(
+            server.epoll_fd,
+            events,
+            SERVER_MAX_EVENTS,
+            -1
+        );
+        if (count == -1)
+        {
+            if (errno == EINTR) // `SIGCHLD` and friends
+            {
+                continue;
+            }
+            perror("epoll_wait() failed!");
+
+            return 1;
+        }
+
+        int i;
+        for (i = 0; i < count; ++i)
+        {
+            void* tag = events[i].data.ptr;
+            if (tag == &server.wake_fd) // Just to get out of `epoll_wait()`
+            {
+                uint64_t pokes;
+                ssize_t ignored = read(server.wake_fd, &pokes, sizeof(pokes));
+                (void)ignored;
+            }
+            else if (tag == &deadlines)
+            {
+                deadline_heap_fire(&deadlines);
+            }
+            else if (tag == &metrics_out)
+            {
+                export_metrics();
+            }
+            else if (tag == &server.listen_fd)
+            {
+                int err = server_accept(&server);
+                if (err != 0)
+                {
+                    errno = err;
+                    perror("accept4() failed!");
+                }
+            }
+            else if (tag == reader)
+            {
+                int command_result = serve_stdin(
+                    reader,
+                    interactive,
+                    &stdin_open
+                );
+                if (command_result != 0)
+                {
+                    return command_result;
+                }
+                prompt = interactive && stdin_open;
+            }
+            else
+            {
+                server_client_t* client = tag;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    serve_client(client);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int run_spawn_benchmark(long iterations)
+{
+    char command[] = "true";
+    char* args[] = {command, NULL};
+    stage_t stage = {command, args, 1, NULL, NULL};
+    const char* engine_names[] = {"fork", "spawn", "helper"};
+    const spawn_engine_t engines[] = {
+        ENGINE_FORK,
+        ENGINE_SPAWN,
+        ENGINE_HELPER
+    };
+    const size_t ballast_sizes[] = {0, 256};
+    spawn_engine_t saved_engine = spawn_engine;
+
+    // Dirty heap pages are what make `fork()` expensive, so each engine is
+    // measured with the shell as it is and again with some dead weight
+    char* ballast = NULL;
+    size_t b;
+    for (b = 0; b < sizeof(ballast_sizes) / sizeof(ballast_sizes[0]); ++b)
+    {
+        if (ballast_sizes[b] > 0)
+        {
+            ballast = malloc(ballast_sizes[b] << 20);
+            if (ballast == NULL)
+            {
+                perror("malloc() failed!");
+                return 1;
+            }
+            memset(ballast, 1, ballast_sizes[b] << 20);
+        }
+
+        size_t e;
+        for (e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+        {
+            if (engines[e] == ENGINE_HELPER && helper_sock == -1)
+            {
+                continue;
+            }
+            spawn_engine = engines[e];
+
+            uint64_t start = monotonic_ns();
+            long i;
+            for (i = 0; i < iterations; ++i)
+            {
+                if (exec_command(&stage, 1, false) != 0)
+                {
+                    return 1;
+                }
+            }
+            double secs = (double)(monotonic_ns() - start) / 1e9;
+
+            printf(
+                "%-6s heap+%4zuMiB  %ld spawns in %.3fs: %.1f spawns/sec\n",
+                engine_names[e],
+                ballast_sizes[b],
+                iterations,
+                secs,
+                (double)iterations / secs
+            );
+            fflush(stdout);
+        }
+
+        free(ballast);
+        ballast = NULL;
+    }
+
+    spawn_engine = saved_engine;
+
+    return 0;
+}
+
+int run_lines_benchmark(long line_count)
+{
+    // Comments, blank lines, and a cheap built-in, so that what's measured
+    // is the reading and dispatching of lines rather than the commands
+    static const char* const lines[] = {"# comment\n", "\n", "cd .\n"};
+    const size_t line_kinds = sizeof(lines) / sizeof(lines[0]);
+
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp() failed!");
+        return 1;
+    }
+    unlink(path);
+
+    FILE* script = fdopen(dup(fd), "w");
+    long i;
+    for (i = 0; i < line_count; ++i)
+    {
+        fputs(lines[(size_t)i % line_kinds], script);
+    }
+    fclose(script);
+    lseek(fd, 0, SEEK_SET);
+
+    line_reader_t reader;
+    if (reader_open(&reader, fd, false) != 0)
+    {
+        perror("reader_open() failed!");
+        return 1;
+    }
+
+    uint64_t start = monotonic_ns();
+    int ret = main_loop(&reader, NULL, false);
+    double secs = (double)(monotonic_ns() - start) / 1e9;
+    reader_close(&reader);
+
+    printf(
+        "text:    %ld lines in %.3fs: %.0f lines/sec\n",
+        line_count,
+        secs,
+        (double)line_count / secs
+    );
+
+    // Then the same script compiled, which is paid for once, and run from
+    // the image, which is what every run after the first does
+    struct stat st;
+    script_builder_t builder;
+    script_image_t image;
+    script_builder_init(&builder);
+    fstat(fd, &st);
+    lseek(fd, 0, SEEK_SET);
+    start = monotonic_ns();
+    if (reader_open(&reader, fd, true) != 0
+        || compile_script(&reader, &builder) != 0
+        || script_image_build(&builder, &st, &image) != 0)
+    {
+        perror("could not compile the script");
+        return 1;
+    }
+    double compile_secs = (double)(monotonic_ns() - start) / 1e9;
+    reader_close(&reader);
+    script_builder_destroy(&builder);
+
+    start = monotonic_ns();
+    ret = ret != 0 ? ret : main_loop(NULL, &image, false);
+    secs = (double)(monotonic_ns() - start) / 1e9;
+    script_image_close(&image);
+
+    printf(
+        "compile: %ld lines in %.3fs: %.0f lines/sec\n",
+        line_count,
+        compile_secs,
+        (double)line_count / compile_secs
+    );
+    printf(
+        "image:   %ld lines in %.3fs: %.0f lines/sec\n",
+        line_count,
+        secs,
+        (double)line_count / secs
+    );
+
+    return ret;
+}
+
+int run_builtins_benchmark(long iterations)
+{
+    static const char* const lines[] = {
+        "true\n",
+        "echo hello world > /dev/null\n",
+        "printf %s=%d\\n answer 42 > /dev/null\n",
+        "test -d /\n",
+        "pwd > /dev/null\n",
+        "cat /dev/null\n"
+    };
+    bool saved_fast_builtins = fast_builtins;
+
+    size_t l;
+    for (l = 0; l < sizeof(lines) / sizeof(lines[0]); ++l)
+    {
+        double us[2];
+        int way;
+        for (way = 0; way < 2; ++way)
+        {
+            fast_builtins = way == 1;
+
+            uint64_t start = monotonic_ns();
+            long i;
+            for (i = 0; i < iterations; ++i)
+            {
+                char line[64];
+                strcpy(line, lines[l]);
+                if (process_command(line) != 0)
+                {
+                    fast_builtins = saved_fast_builtins;
+                    return 1;
+                }
+            }
+            us[way] = (double)(monotonic_ns() - start) / 1e3
+                    / (double)iterations;
+        }
+
+        printf(
+            "%-40.*s external %8.1fus  built-in %6.2fus  (%.0fx)\n",
+            (int)strlen(lines[l]) - 1,
+            lines[l],
+            us[0],
+            us[1],
+            us[0] / us[1]
+        );
+        fflush(stdout);
+    }
+
+    fast_builtins = saved_fast_builtins;
+
+    return 0;
+}
+
+int run_lex_benchmark(long iterations)
+{
+    // One line with a couple hundred arguments, which the old way couldn't
+    // have gone much past
+    char long_line[4096];
+    char* pos = stpcpy(long_line, "rm -f");
+    int a;
+    for (a = 0; a < 200; ++a)
+    {
+        pos += sprintf(pos, " obj%d.$$.o", a);
+    }
+    stpcpy(pos, "\n");
+
+    const char* const lines[] = {
+        "ls -la /tmp/work$$ > listing.$$ &\n",
+        "gcc -O2 -Wall -o prog main.c util.c parse.c -lm < /dev/null\n",
+        "sort -k2 -n data.txt | uniq -c | head -n 20 > top$$.txt\n",
+        "cp a b c d e f g h i j k l m n o p q r s t u v w x y z dest/\n",
+        "echo $$ $$$$ x$$y a$b $ end\n",
+        long_line
+    };
+    const size_t line_kinds = sizeof(lines) / sizeof(lines[0]);
+    char buf[sizeof(long_line)];
+
+    // The old way: `strtok()`, plus a `calloc()`, `sprintf()` of our PID,
+    // and `free()` for every token via `expand_pid()`
+    long tokens = 0;
+    uint64_t start = monotonic_ns();
+    long i;
+    for (i = 0; i < iterations; ++i)
+    {
+        strcpy(buf, lines[(size_t)i % line_kinds]);
+        char* token;
+        for (token = strtok(buf, " \n");
+             token != NULL;
+             token = strtok(NULL, " \n"))
+        {
+            free(expand_pid(token));
+            tokens++;
+        }
+    }
+    double legacy_secs = (double)(monotonic_ns() - start) / 1e9;
+    long legacy_tokens = tokens;
+
+    // The new way: one pass, straight into the arena
+    lex_env_t env;
+    shell_lex_env(&env);
+    tokens = 0;
+    start = monotonic_ns();
+    for (i = 0; i < iterations; ++i)
+    {
+        strcpy(buf, lines[(size_t)i % line_kinds]);
+        arena_reset(&command_arena);
+        token_t* toks;
+        tokens += lex_line(&command_arena, buf, &env, &toks);
+    }
+    double lex_secs = (double)(monotonic_ns() - start) / 1e9;
+
+    printf(
+        "strtok+expand_pid  %ld tokens in %.3fs: %.0f tokens/sec\n"
+        "lex_line+arena     %ld tokens in %.3fs: %.0f tokens/sec (%.1fx)\n",
+        legacy_tokens,
+        legacy_secs,
+        (double)legacy_tokens / legacy_secs,
+        tokens,
+        lex_secs,
+        (double)tokens / lex_secs,
+        ((double)tokens / lex_secs) / ((double)legacy_tokens / legacy_secs)
+    );
+
+    return 0;
+}
+
+int run_vars_benchmark(long var_count)
+{
+    // Fill the table (and so `environ`) with exported variables
+    char name[32];
+    char value[32];
+    long v;
+    for (v = 0; v < var_count; ++v)
+    {
+        snprintf(name, sizeof(name), "BENCH_VAR_%ld", v);
+        snprintf(value, sizeof(value), "value%ld", v);
+        if (shell_set_var(name, strlen(name), value, true) != 0)
+        {
+            perror("could not set variable");
+            return 1;
+        }
+    }
+
+    // Expand the one set last, which a `getenv()` finds at the very end
+    const long iterations = 200000;
+    snprintf(name, sizeof(name), "BENCH_VAR_%ld", var_count - 1);
+    char line[64];
+    snprintf(line, sizeof(line), "echo $%s\n", name);
+
+    uint64_t start = monotonic_ns();
+    size_t total = 0;
+    long i;
+    for (i = 0; i < iterations; ++i)
+    {
+        const char* found = getenv(name);
+        total += found != NULL ? strlen(found) : 0;
+    }
+    double getenv_secs = (double)(monotonic_ns() - start) / 1e9;
+
+    lex_env_t env;
+    shell_lex_env(&env);
+    start = monotonic_ns();
+    for (i = 0; i < iterations; ++i)
+    {
+        arena_reset(&command_arena);
+        token_t* toks;
+        if (lex_line(&command_arena, line, &env, &toks) == 2)
+        {
+            total += strlen(toks[1].text);
+        }
+    }
+    double lex_secs = (double)(monotonic_ns() - start) / 1e9;
+
+    // Changing an exported variable only touches its own `envp` entry
+    start = monotonic_ns();
+    for (i = 0; i < iterations; ++i)
+    {
+        snprintf(value, sizeof(value), "%ld", i);
+        shell_set_var(name, strlen(name), value, true);
+    }
+    double set_secs = (double)(monotonic_ns() - start) / 1e9;
+
+    printf(
+        "%ld exported variables (%zu bytes expanded)\n"
+        "getenv()          %.0f ns per lookup\n"
+        "lex_line()        %.0f ns per line with one expansion (%.1fx)\n"
+        "export NAME=...   %.0f ns per change\n",
+        var_count,
+        total,
+        getenv_secs * 1e9 / (double)iterations,
+        lex_secs * 1e9 / (double)iterations,
+        getenv_secs / lex_secs,
+        set_secs * 1e9 / (double)iterations
+    );
+
+    return 0;
+}
+
+int run_benchmark(const char* spec)
+{
+    // `spec` is "name" or "name=iterations"
+    const char* eq = strchr(spec, '=');
+    size_t name_len = eq != NULL ? (size_t)(eq - spec) : strlen(spec);
+    long iterations = eq != NULL ? strtol(eq + 1, NULL, 10) : 0;
+
+    if (name_len == 5 && strncmp(spec, "spawn", 5) == 0)
+    {
+        return run_spawn_benchmark(iterations > 0 ? iterations : 2000);
+    }
+    if (name_len == 8 && strncmp(spec, "builtins", 8) == 0)
+    {
+        return run_builtins_benchmark(iterations > 0 ? iterations : 1000);
+    }
+    if (name_len == 3 && strncmp(spec, "lex", 3) == 0)
+    {
+        return run_lex_benchmark(iterations > 0 ? iterations : 200000);
+    }
+    if (name_len == 5 && strncmp(spec, "lines", 5) == 0)
+    {
+        return run_lines_benchmark(iterations > 0 ? iterations : 3000000);
+    }
+    if (name_len == 4 && strncmp(spec, "vars", 4) == 0)
+    {
+        return run_vars_benchmark(iterations > 0 ? iterations : 5000);
+    }
+
+    output_str(&stderr_buf, "unknown benchmark: ");
+    output_str(&stderr_buf, spec);
+    output_append(&stderr_buf, "\n", 1);
+    output_flush(&stderr_buf);
+
+    return 1;
+}
+
+void usage(void)
+{
+    const char msg[] =
+        "usage: smallsh [-i] [-u] [-n] [-e helper|fork|spawn] [-j N] "
+        "[-p none|rr|pack|spread] [-c job_kib[,total_kib]] "
+        "[-C dir[,max_mib]] [-g grace] [-M path[,interval]] [-S socket] "
+        "[-b benchmark[=N]] [script]\n";
+    write_direct(STDERR_FILENO, msg, sizeof(msg) - 1);
+}
+
+int main(int argc, char** argv)
+{
+    // Command-line options
+    const char* benchmark = NULL;
+    const char* serve_path = NULL;
+    char* metrics_path = NULL;
+    uint64_t metrics_interval_ns = METRICS_DEFAULT_INTERVAL_NS;
+    bool force_interactive = false;
+    bool jobs_capped = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "ie:b:j:np:uc:C:g:M:S:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': // Prompt even when stdin isn't a terminal
+            {
+                force_interactive = true;
+                break;
+            }
+            case 'e': // Which engine launches external commands
+            {
+                if (strcmp(optarg, "fork") == 0)
+                {
+                    spawn_engine = ENGINE_FORK;
+                }
+                else if (strcmp(optarg, "spawn") == 0)
+                {
+                    spawn_engine = ENGINE_SPAWN;
+                }
+                else if (strcmp(optarg, "helper") == 0)
+                {
+                    spawn_engine = ENGINE_HELPER;
+                }
+                else
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'j': // Cap on concurrently running background jobs
+            {
+                max_jobs = atoi(optarg);
+                if (max_jobs < 0)
+                {
+                    usage();
+                    return 2;
+                }
+                jobs_capped = true;
+                break;
+            }
+            case 'p': // Where background jobs go
+            {
+                if (!place_policy_parse(optarg, &default_placement.policy))
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'n': // Read scripts line by line, no compiled images
+            {
+                script_images = false;
+                break;
+            }
+            case 'u': // Resource usage in every "is done" message
+            {
+                report_bg_usage = true;
+                break;
+            }
+            case 'c': // Capture background jobs' output
+            {
+                size_t job_cap;
+                size_t total_cap;
+                if (!capture_caps_parse(optarg, &job_cap, &total_cap))
+                {
+                    usage();
+                    return 2;
+                }
+                capture_store_init(&captures, job_cap, total_cap);
+                break;
+            }
+            case 'C': // Where `cached` keeps results, and how much
+            {
+                char* dir;
+                uint64_t cap;
+                if (!cache_spec_parse(optarg, &dir, &cap))
+                {
+                    usage();
+                    return 2;
+                }
+                cache_store_destroy(&results);
+                cache_store_init(&results, dir, cap);
+                break;
+            }
+            case 'g': // How long jobs get to exit when the shell does
+            {
+                if (!deadline_parse_duration(optarg, &shutdown_grace_ns))
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'M': // Where the metrics get written out, and how often
+            {
+                free(metrics_path);
+                if (!metrics_export_parse(
+                        optarg,
+                        &metrics_path,
+                        &metrics_interval_ns
+                    ))
+                {
+                    usage();
+                    return 2;
+                }
+                break;
+            }
+            case 'b': // Run a built-in benchmark instead of the shell
+            {
+                benchmark = optarg;
+                break;
+            }
+            case 'S': // Daemon mode: take commands over a socket too
+            {
+                serve_path = optarg;
+                break;
+            }
+            default:
+            {
+                usage();
+                return 2;
+            }
+        }
+    }
+    if (optind < argc - 1)
+    {
+        free(metrics_path);
+        usage();
+        return 2;
+    }
+
+    // The ring is shared with every child, so it has to be there before
+    // the helper is
+    trace = trace_open();
+
+    // The helper has to be started before the shell has grown, or there's
+    // no point. The benchmarks want it around whichever engine is picked.
+    if ((spawn_engine == ENGINE_HELPER || benchmark != NULL)
+        && start_helper() != 0
+        && spawn_engine == ENGINE_HELPER)
+    {
+        spawn_engine = ENGINE_FORK;
+    }
+
+    // Commands come from the named script, or else stdin. Only a terminal
+    // (or `-i`) gets prompted.
+    line_reader_t reader;
+    int input_fd = STDIN_FILENO;
+    bool interactive = false;
+    if (optind < argc)
+    {
+        input_fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if (input_fd == -1)
+        {
+            output_str(&stderr_buf, "cannot open ");
+            output_str(&stderr_buf, argv[optind]);
+            output_str(&stderr_buf, " for input\n");
+            output_flush(&stderr_buf);
+            return 1;
+        }
+    }
+    else
+    {
+        interactive = force_interactive || isatty(STDIN_FILENO);
+    }
+    if (reader_open(&reader, input_fd, input_fd != STDIN_FILENO) != 0)
+    {
+        perror("reader_open() failed!");
+        return 1;
+    }
+
+    // Scripts get one background job per CPU at a time by default. People
+    // at a terminal get what they ask for, so that a long-running job can't
+    // hold up the rest.
+    if (!jobs_capped && !interactive)
+    {
+        max_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // With job control, foreground jobs get the terminal while they run,
+    // and the shell takes it back after. Taking it back from the background
+    // would get us stopped, but for ignoring `SIGTTOU`.
+    shell_pgid = getpgrp();
+    job_control = interactive && isatty(STDIN_FILENO)
+        && tcgetpgrp(STDIN_FILENO) == shell_pgid
+        && tcgetattr(STDIN_FILENO, &shell_tmodes) == 0;
+    if (job_control)
+    {
+        struct sigaction SIGTTOU_ignore = {0};
+        SIGTTOU_ignore.sa_handler = SIG_IGN;
+        sigaction(SIGTTOU, &SIGTTOU_ignore, NULL);
+    }
+
+    // Establish general signal handling
+    struct sigaction SIGINT_ignore  = {0};
+    struct sigaction SIGTSTP_action = {0};
+    struct sigaction SIGCHLD_action = {0};
+    struct sigaction SIGIO_action   = {0};
+    struct sigaction SIGTERM_action = {0};
 
     SIGINT_ignore.sa_handler = SIGINT_main;
     sigfillset(&SIGINT_ignore.sa_mask);
@@ -485,19 +5842,137 @@ int main(void)
     SIGTSTP_action.sa_handler = SIGTSTP_main;
     sigfillset(&SIGTSTP_action.sa_mask);
 
+    // Children dying (or being stopped) shouldn't interrupt anything; the
+    // flag gets looked at before every prompt
+    SIGCHLD_action.sa_handler = SIGCHLD_main;
+    SIGCHLD_action.sa_flags = SA_RESTART;
+    sigfillset(&SIGCHLD_action.sa_mask);
+
+    // Captured output coming in should interrupt a blocked `read()`, so
+    // that it can be drained while the user is still typing
+    SIGIO_action.sa_handler = SIGIO_main;
+    sigfillset(&SIGIO_action.sa_mask);
+
+    // Neither should being asked to shut down, which ought to happen
+    // promptly even in the middle of a foreground job
+    SIGTERM_action.sa_handler = SIGTERM_main;
+    sigfillset(&SIGTERM_action.sa_mask);
+
     sigaction(SIGINT,  &SIGINT_ignore,  NULL);
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+    sigaction(SIGIO,   &SIGIO_action,   NULL);
+    sigaction(SIGTERM, &SIGTERM_action, NULL);
 
-    // Allocate space to store PIDs of backgrounded children
-    child_capacity = 12;
-    children = malloc(child_capacity * sizeof(pid_t));
+    // Our PID never changes, so it only needs formatting the once
+    shell_pid = getpid();
+    pid_str_len = format_int(pid_str, shell_pid);
+    arena_init(&command_arena);
 
-    // Start up the shell
-    int ret = main_loop();
+    // Set up the table of backgrounded child jobs, the PATH cache, where
+    // jobs get placed, and the variables. Everything in the environment is
+    // an exported variable, and from here on `environ` is the table's.
+    line_placement = default_placement;
+    dag_init(&dag);
+    if (job_table_init(&jobs) != 0 || path_cache_init(&path_cache) != 0
+        || placer_init(&placer) != 0 || var_table_init(&vars) != 0
+        || var_table_import(&vars, environ) != 0)
+    {
+        perror("could not allocate shell state");
+        return 1;
+    }
+    environ = vars.envp;
 
-    // Shell is closed, clean up
-    kill_children();
-    free(children); // Roaming `free` in child-process heaven, probably
+    // Without a timer, `timeout`s only go off when something else wakes us
+    int timer_err = deadline_heap_init(&deadlines);
+    if (timer_err != 0)
+    {
+        errno = timer_err;
+        perror("could not set up timeouts");
+    }
 
-    return ret;
+    // The metrics are kept whether or not they're written out
+    metrics_init(&metrics);
+    metrics_export_init(&metrics_out);
+    if (metrics_path != NULL && benchmark == NULL)
+    {
+        int err = metrics_export_open(
+            &metrics_out,
+            metrics_path,
+            metrics_interval_ns
+        );
+        if (err != 0)
+        {
+            errno = err;
+            perror("could not set up metrics");
+            metrics_export_close(&metrics_out);
+        }
+    }
+    else
+    {
+        free(metrics_path);
+    }
+
+    // A script runs from its compiled image, if it has (or can get) one.
+    // The `$$`s are only expanded as each line runs, so this waits until
+    // our PID is known.
+    script_image_t image = {0};
+    bool have_image = benchmark == NULL
+        && serve_path == NULL
+        && optind < argc
+        && script_images
+        && open_script_image(argv[optind], input_fd, &image) == 0;
+
+    // Only what's typed at a prompt is remembered. Opening the log only
+    // reads its header, however long it is.
+    history_init(&history);
+    if (interactive && benchmark == NULL)
+    {
+        open_history();
+    }
+
+    // In daemon mode, the socket is served alongside whatever stdin (or the
+    // script) has to say
+    int ret = 0;
+    if (serve_path != NULL && benchmark == NULL)
+    {
+        int err = server_open(&server, serve_path);
+        if (err != 0)
+        {
+            errno = err;
+            perror("could not open the socket");
+            ret = 1;
+        }
+    }
+
+    // Start up the shell (or just measure it)
+    if (ret == 0)
+    {
+        ret = benchmark != NULL ? run_benchmark(benchmark)
+            : server.listen_fd != -1 ? server_loop(&reader, interactive)
+            : main_loop(&reader, have_image ? &image : NULL, interactive);
+    }
+
+    // Shell is closed, clean up. The children go first, since they're
+    // still reported (and recorded, and captured) on their way out.
+    free_pending();
+    kill_children(); // Roaming `free` in child-process heaven, probably
+    deadline_heap_destroy(&deadlines);
+    metrics_export_close(&metrics_out);
+    dag_destroy(&dag);
+    server_close(&server);
+    capture_store_destroy(&captures);
+    cache_store_destroy(&results);
+    script_image_close(&image);
+    history_close(&history);
+    reader_close(&reader);
+    stop_helper();
+    path_cache_destroy(&path_cache);
+    environ = NULL;
+    var_table_destroy(&vars);
+    arena_destroy(&command_arena);
+    trace_close(trace);
+    output_flush(&stdout_buf);
+
+    return shutdown_requested ? 128 + SIGTERM : ret;
 }
@@ -1,7 +1,91 @@
 #pragma once
 
+#include "comitoz.builtins.h"
+#include "comitoz.cache.h"
+#include "comitoz.capture.h"
+#include "comitoz.dag.h"
+#include "comitoz.deadline.h"
+#include "comitoz.helper.h"
+#include "comitoz.history.h"
+#include "comitoz.jobs.h"
+#include "comitoz.lexer.h"
+#include "comitoz.metrics.h"
+#include "comitoz.pathcache.h"
+#include "comitoz.placement.h"
+#include "comitoz.reader.h"
+#include "comitoz.script.h"
+#include "comitoz.server.h"
+#include "comitoz.trace.h"
 #include "comitoz.utils.h"
 
+#include <stdint.h>       // uint64_t
+#include <sys/resource.h> // struct rusage
+#include <sys/types.h>    // pid_t, id_t
+#include <sys/wait.h>     // idtype_t
+
+
+/*** Constants ***/
+
+// How many bytes a relay stage asks the kernel to move at a time.
+#define RELAY_CHUNK 65536
+
+// How long shutting down waits on jobs after their grace period is up and
+// they've been sent `SIGKILL`, before giving up on them.
+#define SHUTDOWN_KILL_WAIT_NS 1000000000u
+
+
+/*** `typedef`s ***/
+
+// The different ways that `exec_command()` can get a child process going.
+//
+// * `ENGINE_FORK` - Plain `fork()`, then set up the child and `execvp()`.
+// * `ENGINE_SPAWN` - `posix_spawnp()`, which (on glibc) uses
+//                    `clone(CLONE_VM | CLONE_VFORK)` and so never copies the
+//                    shell's page tables.
+// * `ENGINE_HELPER` - Ask the spawn helper (see `start_helper()`) to do the
+//                     `fork()`, from its own tiny image.
+typedef enum {ENGINE_FORK, ENGINE_SPAWN, ENGINE_HELPER} spawn_engine_t;
+
+// One stage of a (possibly single-stage) pipeline, as parsed from the line.
+typedef struct
+{
+    char*  command;     // `args[0]`, or `NULL` if this is a relay stage
+    char** args;        // `NULL`-terminated `argv` for the command
+    int    argc;        // How many words `args` has
+    char*  input_file;  // From "<", or `NULL` if not redirected
+    char*  output_file; // From ">", or `NULL` if not redirected
+} stage_t;
+
+// How parsing a line went.
+typedef enum
+{
+    PARSE_OK,           // There's something to run
+    PARSE_EMPTY,        // Blank line, or a comment
+    PARSE_SYNTAX_ERROR, // A pipeline stage with nothing in it
+    PARSE_NO_MEMORY     // The arena couldn't grow
+} parse_result_t;
+
+// A background pipeline that is waiting for a free slot under the cap on
+// concurrently running jobs, or for the jobs it's `after`. Allocated in one
+// piece by `copy_pipeline()`, so it is `free()`d in one piece too.
+typedef struct pending_job
+{
+    struct pending_job* next;        // Next in line, or `NULL`
+    int                 job_id;      // Its job number, given out when it
+                                     // was queued
+    int*                deps;        // The jobs it's `after`, in the same
+    int                 dep_count;   // block; none once it isn't held
+    bool                timed;       // Was it launched under `time`?
+    place_request_t     placement;   // Where it should go, from `on` or
+                                     // `-p`
+    int64_t             history_at;  // Its line's history entry, or -1
+    uint64_t            submit_id;   // Its daemon-mode submission, or 0
+    uint64_t            timeout_ns;  // From `timeout`, or 0
+    uint64_t            grace_ns;    // From `timeout -k`
+    int                 stage_count; // How many entries `stages` has
+    stage_t             stages[];    // Followed by the `argv`s and strings
+} pending_job_t;
+
 
 /*** Forward declarations ***/
 
@@ -22,49 +106,796 @@ void SIGINT_main(int signo);
 // * `signo` - The signal number that triggered this function. Unused.
 void SIGTSTP_main(int signo);
 
-// Fearsomely `SIGTERM`s all child processes and leaves them for dead. Any
-// unruly children who do not properly respond to the `SIGTERM` are left in
-// the cold, uncaring hands of the kernel.
+// Signal handler for `SIGCHLD`s sent to the main shell. Just raises a flag,
+// so that the next call to `handle_bg_processes()` knows to go reaping.
+//
+// ## Parameters:
+// * `signo` - The signal number that triggered this function. Unused.
+void SIGCHLD_main(int signo);
+
+// Signal handler for the `SIGIO`s that captured jobs' pipes send when
+// there's output to read. Just raises a flag, so that the next call to
+// `handle_bg_processes()` knows to drain them. It's installed without
+// `SA_RESTART`, so that a shell blocked reading a line gets to do so too.
+//
+// ## Parameters:
+// * `signo` - The signal number that triggered this function. Unused.
+void SIGIO_main(int signo);
+
+// Wakes the daemon-mode server out of `epoll_wait()`, if there is one. Safe
+// to call from a signal handler.
+void wake_server(void);
+
+// Signal handler for `SIGTERM`s sent to the main shell. Raises a flag that
+// has the shell stop taking commands and shut down (see `kill_children()`).
+// It's installed without `SA_RESTART`, so that whatever the shell is blocked
+// on gets interrupted.
+//
+// ## Parameters:
+// * `signo` - The signal number that triggered this function. Unused.
+void SIGTERM_main(int signo);
+
+// Fearsomely `SIGTERM`s all child processes, and then reaps (and reports)
+// them as usual for the shutdown grace period (see `-g`). Any unruly
+// children still around after that get `SIGKILL`, and are waited on for up
+// to `SHUTDOWN_KILL_WAIT_NS` more before being left in the cold, uncaring
+// hands of the kernel. The job table is emptied out.
 void kill_children(void);
 
-// Handles `fork()`ing and `exec()`ing commands.
+// Blocks until a child has exited (without reaping it), a deadline has come
+// due (and been fired), or a signal has come in, whichever is first.
+//
+// ## Parameters:
+// * `idtype`, `id` - Which child, as for `waitid()`.
+// * `options` - `WEXITED`, or `WEXITED | WSTOPPED` to also stop for a
+//               child being stopped.
+// * `until_ns` - When to give up waiting, by `monotonic_ns()`, or 0 to not.
+//
+// **Returns** zero once a child has exited. Otherwise -1, with `errno` set
+// to `EINTR` if it's worth waiting again.
+int await_child(idtype_t idtype, id_t id, int options, uint64_t until_ns);
+
+// Sets up `SIGINT` handling in a freshly `fork()`ed child: the default
+// action for foreground processes and ignored for background ones.
+//
+// ## Parameters:
+// * `background` - Is the child going to be a background process?
+void set_child_SIGINT(bool background);
+
+// Puts a freshly `fork()`ed child in the process group given by
+// `child_pgid` (if any), and undoes the shell's ignoring of `SIGTTOU`. The
+// parent does the `setpgid()` too, since there's no telling which of them
+// gets there first.
+void set_child_pgroup(void);
+
+// Opens the target of a "<" or ">" redirection, `O_CLOEXEC`, and tells the
+// user if that didn't work out.
+//
+// ## Parameters:
+// * `path` - The file to open.
+// * `for_output` - Open for (truncating) writing, rather than reading?
 //
-// This function contains both the parent and child logic & behavior,
-// including setting up input/output redirection, signal handling, and waiting
-// for child processes.
+// **Returns** the file descriptor, or -1 on failure.
+int open_redirect(const char* path, bool for_output);
+
+// `fork()`s, and then in the child sets up signal handling and input/output
+// redirection before `exec()`ing the command. The child never returns from
+// this function.
 //
 // ## Parameters:
-// * `command` - A string that is the user's typed-in command, after "$$"
-//               expansion.
+// * `command` - The command to `exec()`, minding the PATH.
+// * `exec_path` - Where the PATH cache says `command` lives, or `NULL` to
+//                 have `execvp()` search for it. If the cached path turns out
+//                 to be stale, it is forgotten and the PATH is searched after
+//                 all.
 // * `args` - A `NULL`-terminated array of strings corresponding to the `argv`
 //            for the command, including `args[0]` being the same string as
 //            `command`.
-// * `input_file` - A string representing a path to an input file. Can be
-//                  `NULL`, in which case it is stdin for foreground processes
-//                  and "/dev/null" for background processes.
-// * `output_file` - A string representing a path to an output file. Can be
-//                   `NULL`, in which case it is stdout for foreground
-//                   processes and "/dev/null" for background processes.
+// * `input_file` - A string representing a path to an input file, or `NULL`.
+//                  Takes precedence over `input_fd`.
+// * `output_file` - A string representing a path to an output file, or
+//                   `NULL`. Takes precedence over `output_fd`.
+// * `input_fd` - Descriptor (generally a pipe) to use as stdin, or -1 to
+//                inherit the shell's.
+// * `output_fd` - Descriptor (generally a pipe) to use as stdout, or -1 to
+//                 inherit the shell's.
 // * `background` - Is this command to be run as a background process?
 //
+// **Returns** the PID of the child process, or -1 if `fork()` failed.
+pid_t fork_command(const char*  command,
+                   const char*  exec_path,
+                   char* const* args,
+                   const char*  input_file,
+                   const char*  output_file,
+                   int          input_fd,
+                   int          output_fd,
+                   bool         background);
+
+// The child's half of `fork_command()`: sets up signal handling and
+// redirections, and `exec()`s the command. Never returns.
+//
+// ## Parameters:
+// * `report_fd` - Where to write the `errno` if `exec_path` is no good; only
+//                 looked at when `exec_path` isn't `NULL`.
+// * `fork_ticket` - The trace ticket of the `TRACE_FORK` event for this
+//                   child, which its `TRACE_EXEC` event points back to.
+//
+// The rest of the parameters are the same as for `fork_command()`.
+_Noreturn void exec_child(const char*  command,
+                          const char*  exec_path,
+                          char* const* args,
+                          const char*  input_file,
+                          const char*  output_file,
+                          int          input_fd,
+                          int          output_fd,
+                          bool         background,
+                          int          report_fd,
+                          uint64_t     fork_ticket);
+
+// Does the same job as `fork_command()` via `posix_spawnp()`, expressing the
+// redirections as file actions and the signal defaults as spawn attributes.
+//
+// Failure to open a redirection target or to `exec()` the command is reported
+// to the user right here, with the same messages the `fork()` path's child
+// would print, and sets the "status" to 1.
+//
+// Parameters are the same as for `fork_command()`.
+//
+// **Returns** the PID of the child process, 0 if the command could not be
+// started (and the user has been told why), or -1 if the system is out of
+// processes or memory.
+pid_t spawn_command(const char*  command,
+                    const char*  exec_path,
+                    char* const* args,
+                    const char*  input_file,
+                    const char*  output_file,
+                    int          input_fd,
+                    int          output_fd,
+                    bool         background);
+
+// Moves everything from one descriptor to another until EOF, using
+// `splice()` so that the data never gets copied through user space. If
+// `tee_fd` is given, the stream is also duplicated into it with `tee()`.
+//
+// Falls back to `read()`/`write()` when the kernel won't splice between the
+// descriptors in question (e.g. file to file, or pipe to terminal).
+//
+// ## Parameters:
+// * `in_fd` - Where the data comes from.
+// * `out_fd` - Where the data goes. Must be a pipe if `tee_fd` is given.
+// * `tee_fd` - Where a side copy of the data goes, or -1 for none.
+//
+// **Returns** zero on success, or an `errno` value.
+int relay(int in_fd, int out_fd, int tee_fd);
+
+// `fork()`s a relay stage: a pipeline stage with redirections but no command,
+// which just pumps its input to its output with `relay()`.
+//
+// * At the head of a pipeline, "< file" feeds the file into the pipeline.
+// * In the middle, "> file" saves a copy of the stream as it passes through.
+// * At the end, "> file" drains the pipeline into the file.
+//
+// ## Parameters:
+// * `stray_fd` - A descriptor the child has to close before relaying, or -1.
+//
+// The rest of the parameters are the same as for `fork_command()`.
+//
+// **Returns** the PID of the child process, or -1 if `fork()` failed.
+pid_t fork_relay(const char* input_file,
+                 const char* output_file,
+                 int         input_fd,
+                 int         output_fd,
+                 int         stray_fd,
+                 bool        background);
+
+// The child's half of `fork_relay()`: opens the redirections and relays
+// until EOF, then exits. Never returns.
+//
+// Parameters are the same as for `fork_relay()`.
+_Noreturn void relay_child(const char* input_file,
+                           const char* output_file,
+                           int         input_fd,
+                           int         output_fd,
+                           int         stray_fd,
+                           bool        background);
+
+// Starts the spawn helper: a second process, `fork()`ed while the shell is
+// still small, that launches children on the shell's behalf. Every launch
+// after that costs a `fork()` of the helper's few pages rather than of the
+// shell's whole heap.
+//
+// The helper's children are created with `fork_sibling()`, so they are the
+// shell's children as far as `wait()` and `SIGCHLD` are concerned.
+//
+// **Returns** zero on success, or non-zero if the helper could not be
+// started (in which case the shell does its own forking).
+int start_helper(void);
+
+// Hangs up on the spawn helper, which then exits, and reaps it.
+void stop_helper(void);
+
+// The spawn helper's main loop, which serves launch requests until the shell
+// hangs up. Never returns.
+//
+// ## Parameters:
+// * `sock` - The helper's end of the socket to the shell.
+_Noreturn void helper_main(int sock);
+
+// Appends a string, `'\0'` and all, to a request being put together for the
+// spawn helper.
+//
+// ## Parameters:
+// * `buf` - The request, `HELPER_MAX_REQUEST` bytes long.
+// * `len` - How much of `buf` is used so far. Updated.
+// * `str` - The string to append.
+//
+// **Returns** non-zero if it doesn't fit.
+int helper_pack(char* buf, size_t* len, const char* str);
+
+// Sends a launch request to the spawn helper and waits for the answer.
+//
+// ## Parameters:
+// * `op` - `HELPER_EXEC` or `HELPER_RELAY`.
+// * `pid` - Set to the PID of the child process, or -1 (with `errno` set) if
+//           the helper couldn't create one.
+//
+// The rest of the parameters are the same as for `fork_command()`, except
+// that `command`, `exec_path`, and `args` are `NULL` for a relay.
+//
+// **Returns** zero if the helper took the request, or non-zero if the
+// caller has to launch the child itself: the request is too big, or the
+// helper is gone.
+int helper_launch(helper_op_t  op,
+                  const char*  command,
+                  const char*  exec_path,
+                  char* const* args,
+                  const char*  input_file,
+                  const char*  output_file,
+                  int          input_fd,
+                  int          output_fd,
+                  bool         background,
+                  pid_t*       pid);
+
+// Does the same job as `fork_command()` by way of the spawn helper, falling
+// back on `fork_command()` itself when the helper can't.
+//
+// Parameters are the same as for `fork_command()`.
+//
+// **Returns** the PID of the child process, or -1 if it couldn't be created.
+pid_t helper_command(const char*  command,
+                     const char*  exec_path,
+                     char* const* args,
+                     const char*  input_file,
+                     const char*  output_file,
+                     int          input_fd,
+                     int          output_fd,
+                     bool         background);
+
+// Does the same job as `fork_relay()` by way of the spawn helper, falling
+// back on `fork_relay()` itself when the helper can't.
+//
+// Parameters are the same as for `fork_relay()`. `stray_fd` is never sent
+// to the helper, so only matters for the fallback.
+//
+// **Returns** the PID of the child process, or -1 if it couldn't be created.
+pid_t helper_relay(const char* input_file,
+                   const char* output_file,
+                   int         input_fd,
+                   int         output_fd,
+                   int         stray_fd,
+                   bool        background);
+
+// Sends the spawn helper a request that only carries one string, and has no
+// answer. If the string is too big to send, the helper just misses out.
+//
+// ## Parameters:
+// * `op` - `HELPER_CHDIR`, `HELPER_SETENV`, or `HELPER_UNSETENV`.
+// * `str` - The directory, "NAME=value", or name.
+void helper_notify(helper_op_t op, const char* str);
+
+// Brings the spawn helper's working directory in line with the shell's, so
+// that relative paths mean the same thing to the children it starts.
+void helper_chdir(void);
+
+// Sets the "status" from a foreground child's wait status, alerting the user
+// if it was killed by a signal.
+//
+// ## Parameters:
+// * `wstatus` - The wait status, as filled in by `waitpid()`.
+void report_fg_status(int wstatus);
+
+// Gives the terminal back to the shell after a foreground job, along with
+// the terminal modes the shell started with, in case the job changed them
+// and then stopped. Does nothing without job control.
+void take_terminal(void);
+
+// Tells the user what's become of a job, e.g. "[3] 4242 stopped make".
+//
+// ## Parameters:
+// * `job` - The job.
+// * `state` - What's become of it.
+void report_job_state(const job_t* job, const char* state);
+
+// Launches every stage of a pipeline, connected by pipes, with whichever
+// engine the shell was started with, but doesn't wait for any of them.
+//
+// With `child_pgid` at 0, the stages go in a new process group, led by the
+// first one launched, and `child_pgid` is left set to it. With job control,
+// a foreground pipeline's group is handed the terminal straight away. With
+// `child_stdout` set, the last stage's stdout goes there, and a relay stage
+// copies what it passes on into its ">" file.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are. At least one.
+// * `background` - Should the stages be set up as background processes? If
+//                  so, the first stage's stdin defaults to "/dev/null", as
+//                  does the last stage's stdout unless output is being
+//                  captured (see `-c`), in which case it and every stage's
+//                  stderr go to the job's capture.
+// * `pids` - Filled in with one PID per stage launched. Stages that could not
+//            be started (and the user has been told why) get 0.
+// * `launched` - Set to how many entries of `pids` were filled in. Less than
+//                `stage_count` only on catastrophic failure.
+//
+// **Returns** non-zero only on catastrophic failure.
+int launch_pipeline(const stage_t* stages,
+                    int            stage_count,
+                    bool           background,
+                    pid_t*         pids,
+                    int*           launched);
+
+// Spells out a parsed pipeline as text, for the job table.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are.
+//
+// **Returns** a `malloc()`ed string, or `NULL` if out of memory.
+char* format_pipeline(const stage_t* stages, int stage_count);
+
+// Tells the user about a newly launched background job, and adds it to the
+// job table.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are.
+// * `pids` - One PID per stage, as filled in by `launch_pipeline()`.
+// * `pgid` - The job's process group, or 0 if it's in the shell's.
+// * `placement` - Where the job was placed, which it keeps until it's
+//                 reported as done.
+//
+// **Returns** non-zero only on catastrophic failure.
+int register_bg_job(const stage_t*     stages,
+                    int                stage_count,
+                    const pid_t*       pids,
+                    pid_t              pgid,
+                    const placement_t* placement);
+
+// Handles launching pipelines, and then waiting for them or registering them
+// as background children. A foreground pipeline that gets stopped (e.g. by
+// ^Z) is registered as a stopped background job.
+//
+// The last stage's outcome is what ends up in the "status", and is what gets
+// reported for a background pipeline. Under `cached`, where the last stage
+// is the relay copying the output into the cache, it's the one before.
+// What a foreground pipeline's stages used, all together, ends up in
+// `fg_usage`.
+//
+// Background pipelines (and any under `on`) are placed according to
+// `line_placement`, and every stage is pinned to the same CPUs.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are. At least one.
+// * `background` - Is this pipeline to be run in the background? If so,
+//                  the first stage's stdin and the last stage's stdout
+//                  default to "/dev/null".
+//
 // **Returns** non-zero only on catastrophic failure.
-int exec_command(const char*  command,
-                 char* const* args,
-                 const char*  input_file,
-                 const char*  output_file,
-                 bool         background);
+int exec_command(const stage_t* stages, int stage_count, bool background);
+
+// Reaps every child that has terminated, with `wait4(-1, WNOHANG)`, handing
+// each (and what it used) to the job table. Costs one call per dead child,
+// plus one. Jobs whose processes have been stopped or continued since are
+// marked as such. Jobs that are done are taken to have exited when the
+// first `SIGCHLD` since the last time came in, for the reap lag metric.
+//
+// **Returns** zero on success.
+int reap_children(void);
+
+// Records how a finished job turned out (in the history log, for daemon-mode
+// watchers, and for the jobs held `after` it), lets go of its CPUs and
+// deadline, and takes it out of the job table.
+void retire_job(job_t* job);
 
-// Checks all currently stored background child processes to see if any of
-// them have terminated since we last checked, waiting for them, deregistering
-// them from the list of background children, and alerting the user.
+// Reaps background child processes if a `SIGCHLD` has come in since we last
+// checked, then alerts the user about each job that is now completely done
+// (every stage of its pipeline) and takes it out of the job table.
+//
+// The cost is proportional to how many children have died, not how many are
+// running.
+//
+// Once that's done, held jobs whose jobs are done are let go, and queued
+// background jobs are let in to take the place of the ones that finished.
 //
 // **Returns** zero on success.
 int handle_bg_processes(void);
 
+// Hands over a background child that something other than
+// `handle_bg_processes()` happened to reap, so that it still gets reported.
+//
+// ## Parameters:
+// * `pid` - The reaped child.
+// * `wstatus` - Its wait status, as filled in by `wait4()`.
+// * `ru` - What it used, as filled in by `wait4()`.
+//
+// **Returns** whether `pid` belonged to a background job.
+bool note_bg_exit(pid_t pid, int wstatus, const struct rusage* ru);
+
+// Blocks until every background job, queued and held ones included, has
+// finished and been reported.
+//
+// **Returns** zero on success.
+int wait_bg_processes(void);
+
+// Writes the metrics out to `-M`'s path, if they're due. A write that fails
+// is complained about once, and then tried again each time it's due until
+// it works.
+void export_metrics(void);
+
+// Makes a self-contained copy of a parsed pipeline, so that it can outlive
+// the line it was parsed from. It's given a job number now, and takes the
+// current line's prefixes (`after` included) with it.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are.
+//
+// **Returns** a single `malloc()`ed block, or `NULL` if out of memory.
+pending_job_t* copy_pipeline(const stage_t* stages, int stage_count);
+
+// Launches a background pipeline if there is room under the cap on running
+// jobs, or else adds it to the back of the queue.
+//
+// Parameters are the same as for `exec_command()`.
+//
+// **Returns** non-zero only on catastrophic failure.
+int schedule_bg(const stage_t* stages, int stage_count);
+
+// Launches queued background jobs, oldest first, for as long as there is room
+// under the cap.
+void dispatch_pending(void);
+
+// Holds a background pipeline until the jobs it's `after` (`line_deps`) have
+// all succeeded.
+//
+// Parameters are the same as for `exec_command()`.
+//
+// **Returns** non-zero only on catastrophic failure.
+int hold_bg(const stage_t* stages, int stage_count);
+
+// Settles every held job whose fate is now known: those whose jobs have all
+// succeeded join the back of the queue, and those with one that failed are
+// cancelled, which fails whatever is held after them in turn.
+void release_held(void);
+
+// Cancels a held job, which counts as it failing.
+//
+// ## Parameters:
+// * `held` - The job, no longer held; `free()`d.
+// * `failed_dep` - The number of the job it was after that failed.
+void cancel_held(pending_job_t* held, int failed_dep);
+
+// Throws away every queued and held background job without running it.
+void free_pending(void);
+
+// Replaces every "{}" in a `parallel` argument with an item of input.
+//
+// ## Parameters:
+// * `arg` - The argument from the command template.
+// * `item` - The item to put in place of "{}".
+// * `item_len` - The length of `item`.
+// * `out` - Set to the result, `malloc()`ed, or to `NULL` if `arg` has no
+//           "{}" in it (or there was no memory for it).
+//
+// **Returns** zero, or `ENOMEM`.
+int substitute_braces(const char* arg,
+                      const char* item,
+                      size_t      item_len,
+                      char**      out);
+
+// The `parallel` built-in command: runs a command template once per line of
+// input, with at most N instances going at once.
+//
+// Input comes from the "<" file, or else stdin. In the foreground, instances
+// share the shell's stdout, and the "status" ends up as the number of
+// instances that failed. In the background, each instance is a background
+// job of its own, and goes through the job scheduler.
+//
+// ## Parameters:
+// * `stage` - The parsed `parallel` command.
+// * `argc` - How many words `stage->args` has.
+// * `background` - Was the command backgrounded?
+//
+// **Returns** non-zero only on catastrophic failure.
+int builtin_parallel(const stage_t* stage, int argc, bool background);
+
+// The `jobs` built-in command. Lists every background job with its number,
+// PID (that of its last stage), whether it's running, stopped, or done,
+// where it was placed, and its command line, followed by any jobs still
+// queued behind the `-j` cap.
+//
+// **Returns** zero.
+int builtin_jobs(void);
+
+// Finds the job that a `fg`, `bg`, or `kill` argument means: "%N" for job
+// number N, "%%" (or nothing at all) for the newest job that isn't done,
+// or a PID of any of a job's processes. Tells the user if there's no such
+// job.
+//
+// ## Parameters:
+// * `spec` - The argument, or `NULL`.
+// * `who` - The built-in's name, for the error message.
+//
+// **Returns** the job, or `NULL`.
+job_t* find_job(const char* spec, const char* who);
+
+// The `fg` built-in command. Continues a job in the foreground, giving it
+// the terminal (with job control) and waiting for it as if it had just been
+// started there. A job that is stopped again goes back in the job table.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_fg(char** args, int argc);
+
+// The `bg` built-in command. Continues a stopped job in the background.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_bg(char** args, int argc);
+
+// Says whether a `kill` line names a job ("%N"), in which case the shell
+// does it with `builtin_kill()` rather than running the `kill` utility.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+bool names_job(char* const* args);
+
+// The `kill` built-in command, `kill [-SIG] %N|pid...`. Jobs are signalled
+// with one `killpg()` each (see `deadline_signal()`), so whatever they
+// started gets it too. The signal is a number or a name, with or without
+// "SIG", and defaults to `SIGTERM`.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_kill(char** args, int argc);
+
+// The `output` built-in command. `output pid` writes out what's been
+// captured of the background job with that PID (see `-c`), straight from its
+// ring with `sendfile()`. A bare `output` lists every capture: its PID, how
+// many bytes are kept and how many were written, and whether the job is
+// still writing.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_output(char** args, int argc);
+
+// The `hash` built-in command, for looking at the PATH cache.
+//
+// * `hash` lists each remembered command, where it lives, and how many times
+//   it has been launched from the cache, along with overall hits and misses.
+// * `hash -r` forgets everything.
+// * `hash name...` looks up (and remembers) each named command.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_hash(char** args, int argc);
+
+// The `stats` built-in command. Prints what the shell has counted since it
+// started (see `metrics_t`): commands, background jobs, how long launching
+// each kind of stage took, fork failures, waits on foreground pipelines,
+// and how long background jobs went unreported after exiting. `stats -p`
+// prints the same in Prometheus's text format, as `-M` writes it out.
+//
+// ## Parameters:
+// * `args` - The `NULL`-terminated `argv` for the command.
+// * `argc` - How many words `args` has.
+//
+// **Returns** zero.
+int builtin_stats(char** args, int argc);
+
+// Sets a shell variable, keeping `environ` and the spawn helper's
+// environment in step if it's exported.
+//
+// ## Parameters:
+// * `name` - The name, which needn't be `'\0'`-terminated. Must be a valid
+//            one (see `var_name_len()`).
+// * `len` - The length of `name`.
+// * `value` - The new value, or `NULL` to just export the variable as it is.
+// * `export` - Should it be exported?
+//
+// **Returns** zero on success, or an `errno` value.
+int shell_set_var(const char* name,
+                  size_t      len,
+                  const char* value,
+                  bool        export);
+
+// Gets rid of a shell variable, if it's set, keeping `environ` and the
+// spawn helper's environment in step.
+void shell_unset_var(const char* name);
+
+// Works out whether a command is nothing but "NAME=value" words (and no
+// redirections), which sets shell variables rather than running anything.
+bool is_assignment_line(const stage_t* stage);
+
+// Sets a shell variable for each "NAME=value" word. A variable that's
+// already exported stays that way, with the new value.
+//
+// ## Parameters:
+// * `args` - The words, every one of which is an assignment.
+// * `argc` - How many words there are.
+//
+// **Returns** zero.
+int builtin_assign(char** args, int argc);
+
+// The `export` built-in. `export NAME=value` sets a variable and exports
+// it; `export NAME` exports it as it is (or empty, if it isn't set). With
+// no arguments, lists every exported variable.
+//
+// ## Parameters:
+// * `args` - The arguments given, with `args[0]` being "export".
+// * `argc` - How many arguments there are.
+//
+// **Returns** zero.
+int builtin_export(char** args, int argc);
+
+// The `unset` built-in: gets rid of each named variable, exported or not.
+//
+// ## Parameters:
+// * `args` - The arguments given, with `args[0]` being "unset".
+// * `argc` - How many arguments there are.
+//
+// **Returns** zero.
+int builtin_unset(char** args, int argc);
+
+// Opens the history log named by HISTFILE, or else `~/.smallsh_history`. An
+// empty HISTFILE means no history.
+//
+// **Returns** zero on success, or an `errno` value.
+int open_history(void);
+
+// The `history` built-in.
+//
+// * `history [N]` - Shows the last N entries (16 by default), oldest first.
+// * `history -s prefix` - Shows every entry whose line starts with
+//                         `prefix`, oldest first.
+//
+// Each entry comes with when it was run, its exit status (or the signal
+// that killed it), and how long it took.
+//
+// ## Parameters:
+// * `args` - The arguments given, with `args[0]` being "history".
+// * `argc` - How many arguments there are.
+//
+// **Returns** zero.
+int builtin_history(char** args, int argc);
+
+// Opens the result cache for `cached`: the one given by `-C`, or else
+// `~/.smallsh_cache`.
+//
+// **Returns** zero on success, or an `errno` value.
+int open_results(void);
+
+// Works out the key for a `cached` pipeline: the working directory; each
+// stage's arguments, the binary it runs (by path, identity, size, and
+// mtime), and its "<" file (see `cache_key_add_input()`); and the value of
+// every variable named in CACHE_VARS, which is a ':'-separated list.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order.
+// * `stage_count` - How many stages there are.
+// * `key` - Filled in.
+//
+// **Returns** whether the pipeline can be cached at all. Relay stages, ">"
+// files anywhere but at the end, and commands that can't be found (or
+// inputs that can't be read) rule it out.
+bool make_cache_key(const stage_t* stages, int stage_count, cache_key_t* key);
+
+// Runs a pipeline under `cached`. If it has been run before with the same
+// key, its stdout and exit value are played back from the cache without
+// anything being launched. Otherwise it's run in the foreground with
+// `exec_command()`, with a relay stage on the end that copies its stdout
+// into a new blob on the way out, and the blob is kept if the pipeline
+// exits (rather than being killed, or stopped). Either way the "status"
+// ends up as if it had run. Anything that can't be cached just runs.
+//
+// ## Parameters:
+// * `stages` - The stages of the pipeline, in order, without the `cached`.
+// * `stage_count` - How many stages there are.
+//
+// **Returns** non-zero only on catastrophic failure.
+int run_cached(stage_t* stages, int stage_count);
+
+// Gathers up what `$`s currently expand to.
+void shell_lex_env(lex_env_t* env);
+
+// Splits a line into a pipeline, with every `$` expanded, via `lex_line()`.
+// Everything it produces lives in the command arena until the next line.
+//
+// ## Parameters:
+// * `line` - A string representing the literal line entered into the shell
+//            by the user.
+// * `env` - What `$`s expand to (see `shell_lex_env()`), or `NULL` to leave
+//           them all for later.
+// * `stages_out` - Set to point at the stages of the pipeline.
+// * `stage_count_out` - Set to how many stages there are.
+// * `background_out` - Set to whether the line ended in "&", whether or not
+//                      background commands are currently allowed.
+//
+// **Returns** how it went. The outputs are only set for `PARSE_OK` and
+// `PARSE_SYNTAX_ERROR`.
+parse_result_t parse_line(const char*      line,
+                          const lex_env_t* env,
+                          stage_t**        stages_out,
+                          int*             stage_count_out,
+                          bool*            background_out);
+
+// The `trace` built-in.
+//
+// * `trace` - Says whether tracing is on, and how many events there are.
+// * `trace on`, `trace off` - Starts or stops recording events.
+// * `trace clear` - Throws away what's been recorded.
+// * `trace dump file` - Writes the events out to `file` as Chrome
+//                       trace-event JSON.
+//
+// ## Parameters:
+// * `args` - The arguments given, with `args[0]` being "trace".
+// * `argc` - How many arguments there are.
+void builtin_trace(char** args, int argc);
+
+// Runs a command in-process if it's one of the fast built-ins (see
+// `fast_builtin_lookup()`), rather than paying for a `fork()` and `exec()`.
+// Redirections are done by swapping the shell's own stdin and stdout for the
+// duration, and the "status" is set just as the real utility would have had
+// it.
+//
+// ## Parameters:
+// * `stage` - The command, which must be a single foreground one.
+//
+// **Returns** `true` if the command was run, or `false` if it has to be
+// launched the usual way.
+bool run_fast_builtin(const stage_t* stage);
+
+// Prints what a `time`d line used to stderr: the last foreground job's
+// usage, plus whatever the shell itself used in the meantime.
+//
+// ## Parameters:
+// * `start_ns` - `monotonic_ns()` from before the line ran.
+// * `self_before` - `getrusage(RUSAGE_SELF)` from before the line ran.
+void report_time(uint64_t start_ns, const struct rusage* self_before);
+
 // Parses a command and redirects its content to the corresponding
 // behavior.
 //
-// This function does the "$$" expansion as well as all built-in commands.
+// This function does all built-in commands.
+// Commands may be chained together with "|" into a pipeline, and each stage
+// may have its own "<" and ">" redirections.
 //
 // ## Parameters:
 // * `line` - A string representing the literal line entered into the shell
@@ -73,11 +904,209 @@ int handle_bg_processes(void);
 // **Returns** non-zero when the program should exit, and zero otherwise.
 int process_command(char* line);
 
+// Does whatever a parsed line says to, be it a built-in, a pipeline, or an
+// error message. This is the part of `process_command()` that comes after
+// the parsing, shared with compiled scripts.
+//
+// ## Parameters:
+// * `parsed` - How parsing went.
+// * `stages` - The stages of the pipeline, if there is one.
+// * `stage_count` - How many stages there are.
+// * `background` - Did the line end in "&"? Ignored while background
+//                  commands aren't allowed.
+//
+// **Returns** non-zero when the program should exit, and zero otherwise.
+int run_parsed_command(parse_result_t parsed,
+                       stage_t*       stages,
+                       int            stage_count,
+                       bool           background);
+
+// Parses every line of a script, with each `$` left unexpanded, into the
+// tables of a script image. Blank lines and comments are left out.
+//
+// ## Parameters:
+// * `reader` - The script.
+// * `builder` - Where the commands go.
+//
+// **Returns** zero on success, or an `errno` value.
+int compile_script(line_reader_t* reader, script_builder_t* builder);
+
+// Gets a script ready to run as a compiled image: the one saved beside it
+// if that's still up to date, or else a new one, which is saved there for
+// next time if it can be.
+//
+// ## Parameters:
+// * `path` - Where the script is.
+// * `fd` - The script, open. Its offset is left alone.
+// * `image` - Set up to run the script.
+//
+// **Returns** zero on success, or an `errno` value, in which case the
+// script should be read line by line as usual.
+int open_script_image(const char* path, int fd, script_image_t* image);
+
+// Takes the next command from a compiled script, building its pipeline in
+// the command arena just as `parse_line()` would have, with `$`s expanded.
+// Words without a `$` point straight into the image.
+//
+// ## Parameters:
+// * `image` - The script. Moved on to the command after.
+// * `stages_out` - Set to point at the stages of the pipeline.
+// * `stage_count_out` - Set to how many stages there are.
+// * `background_out` - Set to whether the line ended in "&".
+//
+// **Returns** how it went; `PARSE_NO_MEMORY` (with `errno` set) if the
+// arena couldn't grow or the image is corrupt.
+parse_result_t image_command(script_image_t* image,
+                             stage_t**       stages_out,
+                             int*            stage_count_out,
+                             bool*           background_out);
+
+// Runs the next command from a compiled script, like `process_command()`
+// does for a line.
+//
+// ## Parameters:
+// * `image` - The script. Moved on to the command after.
+//
+// **Returns** non-zero when the program should exit, and zero otherwise.
+int process_image_command(script_image_t* image);
+
+// Runs one line of input: records it in the history (if it was typed at a
+// prompt), runs it, and fills in its outcome.
+//
+// ## Parameters:
+// * `reader` - Where the line came from.
+// * `line` - The line, without its newline.
+// * `len` - The length of `line`.
+// * `interactive` - Was it typed at a prompt?
+//
+// **Returns** non-zero when the program should exit, and zero otherwise.
+int run_line(line_reader_t* reader,
+             char*          line,
+             ssize_t        len,
+             bool           interactive);
+
+// Waits for a polled reader's fd to become readable, firing deadlines and
+// writing out the metrics as they come due in the meantime.
+//
+// **Returns** zero (try reading again), `READER_INTERRUPTED`, or
+// `READER_ERROR` (see `errno`).
+int await_input(line_reader_t* reader);
+
 // Enters the main loop, spitting out a prompt and waiting for commands,
 // forking and executing external commands via calling other functions.
 //
-// Handles re-prompting when `getline()` is interrupted (generally, by some
-// signal handler).
+// Handles re-prompting when reading is interrupted (generally, by some
+// signal handler). Running out of input is the same as `exit`, and so is a
+// `SIGTERM`.
+//
+// ## Parameters:
+// * `reader` - Where the commands come from, one per line.
+// * `image` - A compiled script to take the commands from instead, or
+//             `NULL`.
+// * `interactive` - Should the user be prompted? Scripts and piped-in
+//                   commands aren't.
 //
 // **Returns** zero on success.
-int main_loop(void);
+int main_loop(line_reader_t*  reader,
+              script_image_t* image,
+              bool            interactive);
+
+// Handles one request from a daemon-mode client (see `server_t`). A `run`
+// is run right away, as a background job, and refused in foreground-only
+// mode, where it would have the daemon wait on it.
+//
+// ## Parameters:
+// * `client` - Who it's from, and who gets the reply.
+// * `line` - The request, without its newline.
+//
+// **Returns** zero on success, or an `errno` value if the reply couldn't be
+// queued up (and the client is to be dropped).
+int serve_request(server_client_t* client, char* line);
+
+// Handles every whole request a client has sent, now that its socket is
+// readable. A client that has sent EOF stops being read from.
+void serve_client(server_client_t* client);
+
+// Runs every whole line waiting on stdin, now that it's readable, in daemon
+// mode.
+//
+// ## Parameters:
+// * `reader` - Stdin.
+// * `interactive` - Was it typed at a prompt?
+// * `stdin_open` - Set to false once stdin runs out, after which the
+//                  server carries on without it.
+//
+// **Returns** non-zero when the program should exit, and zero otherwise.
+int serve_stdin(line_reader_t* reader, bool interactive, bool* stdin_open);
+
+// The main loop for daemon mode (`-S`): serves the socket and stdin at once,
+// with `epoll`. Everything run by clients is a background job. Running out
+// of stdin doesn't end it; only `exit` (or a signal) does.
+//
+// ## Parameters:
+// * `reader` - Stdin, or the script. A script (or any file) is run
+//              through first, and then the socket is served on its own.
+// * `interactive` - Should the user be prompted?
+//
+// **Returns** zero on success.
+int server_loop(line_reader_t* reader, bool interactive);
+
+// Launches `true` in the foreground over and over with each spawn engine, and
+// prints out spawns/sec for each, both as-is and with a large, dirty heap.
+//
+// ## Parameters:
+// * `iterations` - How many times to launch `true`, per engine per heap size.
+//
+// **Returns** zero on success.
+int run_spawn_benchmark(long iterations);
+
+// Runs a script of comments, blank lines, and `cd .` through the same path
+// that script mode uses, and then compiled and run from an image, and prints
+// out lines/sec for each (and for compiling it).
+//
+// ## Parameters:
+// * `line_count` - How many lines the script should have.
+//
+// **Returns** zero on success.
+int run_lines_benchmark(long line_count);
+
+// Runs a handful of lines that the fast built-ins handle, over and over,
+// both as external commands and as built-ins, and prints out the time per
+// command for each.
+//
+// ## Parameters:
+// * `iterations` - How many times to run each line each way.
+//
+// **Returns** zero on success.
+int run_builtins_benchmark(long iterations);
+
+// Tokenizes a handful of typical lines over and over, the old way (`strtok()`
+// and `expand_pid()`) and with `lex_line()`, and prints out tokens/sec for
+// each.
+//
+// ## Parameters:
+// * `iterations` - How many lines to tokenize each way.
+//
+// **Returns** zero on success.
+int run_lex_benchmark(long iterations);
+
+// Exports a lot of variables, then compares looking the last one up with
+// `getenv()` against expanding it with `lex_line()`, and times changing it.
+//
+// ## Parameters:
+// * `var_count` - How many variables to export.
+//
+// **Returns** zero on success.
+int run_vars_benchmark(long var_count);
+
+// Runs one of the built-in benchmarks instead of the interactive shell.
+//
+// ## Parameters:
+// * `spec` - The benchmark name, optionally followed by "=N" to set the
+//            number of iterations.
+//
+// **Returns** zero on success.
+int run_benchmark(const char* spec);
+
+// Prints the command-line synopsis to stderr.
+void usage(void);
@@ -0,0 +1,920 @@
+#define _GNU_SOURCE // pipe2
+
+#include "comitoz.stress.h"
+#include "comitoz.utils.h"
+
+#include <dirent.h>    // opendir, readdir, closedir
+#include <errno.h>     // errno, EAGAIN, EINTR
+#include <fcntl.h>     // fcntl, O_CLOEXEC, O_NONBLOCK
+#include <poll.h>      // poll, POLLIN, POLLOUT
+#include <signal.h>    // kill, signal, SIGINT, SIGTSTP, SIGPIPE, SIG_IGN
+#include <stddef.h>    // offsetof
+#include <stdlib.h>    // malloc, realloc, calloc, free, strtol, qsort, rand_r
+#include <stdio.h>     // fprintf, fopen, fgets, fclose, snprintf, perror
+#include <string.h>    // memcpy, memmove, memset, strstr, strrchr, strlen
+#include <sys/ioctl.h> // ioctl, FIONREAD
+#include <sys/types.h> // pid_t
+#include <sys/wait.h>  // waitpid
+#include <time.h>      // time
+#include <unistd.h>    // fork, execv, dup2, read, write, setpgid, sysconf
+
+
+/*** Implementations ***/
+
+int stress_start(stress_session_t* session, char* const argv[])
+{
+    int in_pipe[2];
+    int out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) == -1 || pipe2(out_pipe, O_CLOEXEC) == -1)
+    {
+        perror("pipe2() failed!");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork() failed!");
+        return 1;
+    }
+    if (pid == 0)
+    {
+        setpgid(0, 0);
+        dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(out_pipe[1], STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    // Both sides set the group, so that it's there before either goes on
+    setpgid(pid, pid);
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+    fcntl(out_pipe[0], F_SETFL, O_NONBLOCK);
+    session->pid = pid;
+    session->to_shell = in_pipe[1];
+    session->from_shell = out_pipe[0];
+
+    return 0;
+}
+
+int stress_queue(stress_session_t* session, const char* str, size_t len)
+{
+    if (session->input_len + len > session->input_cap)
+    {
+        size_t new_cap = session->input_cap > 0 ? session->input_cap : 4096;
+        while (new_cap < session->input_len + len)
+        {
+            new_cap *= 2;
+        }
+        char* grown = realloc(session->input, new_cap);
+        if (grown == NULL)
+        {
+            return 1;
+        }
+        session->input = grown;
+        session->input_cap = new_cap;
+    }
+    memcpy(session->input + session->input_len, str, len);
+    session->input_len += len;
+
+    return 0;
+}
+
+int stress_flush(stress_session_t* session)
+{
+    size_t written_total = 0;
+    while (written_total < session->input_len)
+    {
+        ssize_t written = write(
+            session->to_shell,
+            session->input + written_total,
+            session->input_len - written_total
+        );
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            return 1;
+        }
+        written_total += (size_t)written;
+    }
+
+    memmove(
+        session->input,
+        session->input + written_total,
+        session->input_len - written_total
+    );
+    session->input_len -= written_total;
+
+    return 0;
+}
+
+void stress_drain(stress_session_t* session)
+{
+    char buf[16384];
+    while (1)
+    {
+        ssize_t bytes_read = read(session->from_shell, buf, sizeof(buf));
+        if (bytes_read == 0)
+        {
+            session->shell_gone = true;
+            return;
+        }
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN)
+            {
+                session->shell_gone = true;
+            }
+            return;
+        }
+
+        ssize_t i;
+        for (i = 0; i < bytes_read; ++i)
+        {
+            if (buf[i] == '\n')
+            {
+                session->line[session->line_len] = '\0';
+                stress_line(session, session->line);
+                session->line_len = 0;
+            }
+            else if (session->line_len + 1 < sizeof(session->line))
+            {
+                session->line[session->line_len++] = buf[i];
+            }
+        }
+    }
+}
+
+stress_launch_t* stress_launch_slot(stress_session_t* session, pid_t pid)
+{
+    size_t slot = (size_t)pid & (STRESS_LAUNCH_SLOTS - 1);
+    while (session->launches[slot].pid != 0
+           && session->launches[slot].pid != pid)
+    {
+        slot = (slot + 1) & (STRESS_LAUNCH_SLOTS - 1);
+    }
+
+    return &session->launches[slot];
+}
+
+void stress_line(stress_session_t* session, const char* line)
+{
+    // Whatever else is on the line (e.g. a foreground-only mode message,
+    // which has no newline of its own), the report is at the end of it
+    const char* report = strstr(line, "background pid ");
+    if (report == NULL)
+    {
+        if (strstr(line, STRESS_SYNC_WORD) != NULL)
+        {
+            session->synced = true;
+        }
+        const char* queued = strstr(line, "background job queued, ");
+        if (queued != NULL)
+        {
+            session->queued = strtol(queued + 23, NULL, 10);
+        }
+        return;
+    }
+    report += 15;
+
+    uint64_t now = monotonic_ns();
+    if (strncmp(report, "is ", 3) == 0)
+    {
+        pid_t pid = (pid_t)strtol(report + 3, NULL, 10);
+        stress_launch_t* launch = stress_launch_slot(session, pid);
+        if (pid <= 0 || launch->pid != 0)
+        {
+            return;
+        }
+        launch->pid = pid;
+        launch->launched_ns = now;
+        session->outstanding++;
+        session->launched++;
+        if (session->queued > 0)
+        {
+            session->queued--;
+        }
+        return;
+    }
+
+    char* end;
+    pid_t pid = (pid_t)strtol(report, &end, 10);
+    if (end == report || strncmp(end, " is done", 8) != 0)
+    {
+        return;
+    }
+    stress_launch_t* launch = stress_launch_slot(session, pid);
+    if (launch->pid == 0)
+    {
+        session->lost++;
+        return;
+    }
+
+    if (session->lag_count == session->lag_cap)
+    {
+        size_t new_cap = session->lag_cap > 0 ? session->lag_cap * 2 : 1024;
+        uint64_t* grown = realloc(session->lags, new_cap * sizeof(uint64_t));
+        if (grown == NULL)
+        {
+            return;
+        }
+        session->lags = grown;
+        session->lag_cap = new_cap;
+    }
+    session->lags[session->lag_count++] = now - launch->launched_ns;
+    session->last_report_ns = now;
+    session->outstanding--;
+    session->reported++;
+
+    // Re-seat everything in the probe run after the hole, so that lookups
+    // don't stop short at it
+    launch->pid = 0;
+    size_t i = (size_t)(launch - session->launches);
+    for (i = (i + 1) & (STRESS_LAUNCH_SLOTS - 1);
+         session->launches[i].pid != 0;
+         i = (i + 1) & (STRESS_LAUNCH_SLOTS - 1))
+    {
+        stress_launch_t moved = session->launches[i];
+        session->launches[i].pid = 0;
+        *stress_launch_slot(session, moved.pid) = moved;
+    }
+}
+
+long count_zombies(pid_t parent)
+{
+    DIR* proc = opendir("/proc");
+    if (proc == NULL)
+    {
+        return -1;
+    }
+
+    long zombies = 0;
+    struct dirent* entry;
+    while ((entry = readdir(proc)) != NULL)
+    {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+        {
+            continue;
+        }
+
+        char path[300];
+        snprintf(path, sizeof(path), "/proc/%s/stat", entry->d_name);
+        FILE* stat_file = fopen(path, "r");
+        if (stat_file == NULL)
+        {
+            continue; // Gone already
+        }
+        char stat[512];
+        size_t len = fread(stat, 1, sizeof(stat) - 1, stat_file);
+        fclose(stat_file);
+        stat[len] = '\0';
+
+        // "pid (comm) state ppid ...", where `comm` can have anything in
+        // it, parentheses included
+        char* after_comm = strrchr(stat, ')');
+        char state;
+        long ppid;
+        if (after_comm != NULL
+            && sscanf(after_comm + 1, " %c %ld", &state, &ppid) == 2
+            && state == 'Z'
+            && ppid == parent)
+        {
+            zombies++;
+        }
+    }
+    closedir(proc);
+
+    return zombies;
+}
+
+long count_fds(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/fd", (long)pid);
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    long fds = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+        {
+            fds++;
+        }
+    }
+    closedir(dir);
+
+    return fds;
+}
+
+long read_rss(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", (long)pid);
+    FILE* status_file = fopen(path, "r");
+    if (status_file == NULL)
+    {
+        return -1;
+    }
+
+    long rss = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), status_file) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+        {
+            break;
+        }
+    }
+    fclose(status_file);
+
+    return rss;
+}
+
+int stress_sample(stress_session_t* session, uint64_t start_ns)
+{
+    if (session->sample_count == session->sample_cap)
+    {
+        size_t new_cap = session->sample_cap > 0
+            ? session->sample_cap * 2
+            : 256;
+        stress_sample_t* grown = realloc(
+            session->samples,
+            new_cap * sizeof(stress_sample_t)
+        );
+        if (grown == NULL)
+        {
+            return 1;
+        }
+        session->samples = grown;
+        session->sample_cap = new_cap;
+    }
+
+    stress_sample_t* sample = &session->samples[session->sample_count];
+    sample->at_ns = monotonic_ns() - start_ns;
+    sample->rss = read_rss(session->pid);
+    sample->fds = count_fds(session->pid);
+    sample->zombies = count_zombies(session->pid);
+    if (sample->rss >= 0 && sample->fds >= 0) // Still there
+    {
+        session->sample_count++;
+    }
+
+    return 0;
+}
+
+int stress_step(stress_session_t* session,
+                unsigned*         seed,
+                const char*       big_args,
+                size_t            big_len)
+{
+    static const char* const foreground[] = {
+        "true\n",
+        "status\n",
+        "cd .\n",
+        "echo stress $$ $?\n",
+        "sleep 0.02\n", // Something for a `SIGINT` to land on
+        "/bin/true x y z\n"
+    };
+
+    int pick = rand_r(seed) % 100;
+    if (pick < 40) // A burst of background jobs
+    {
+        int count = 1 + rand_r(seed) % STRESS_MAX_BURST;
+        int i;
+        for (i = 0; i < count; ++i)
+        {
+            const char* job = rand_r(seed) % 4 == 0
+                ? "sleep 0.01 &\n"
+                : "true &\n";
+            if (stress_queue(session, job, strlen(job)) != 0)
+            {
+                return 1;
+            }
+        }
+        session->bursts++;
+    }
+    else if (pick < 48) // A `SIGINT` storm, to the shell and whatever is
+    {                   // in the foreground
+        int count = 1 + rand_r(seed) % STRESS_MAX_STORM;
+        int i;
+        for (i = 0; i < count; ++i)
+        {
+            kill(-session->pid, SIGINT);
+        }
+        session->storms++;
+    }
+    else if (pick < 52) // Foreground-only mode on or off. Only the shell
+    {                   // gets it: its children would stop.
+        kill(session->pid, SIGTSTP);
+        session->toggles++;
+    }
+    else if (pick < 54) // As big an argument list as `execve()` takes
+    {
+        if (stress_queue(session, big_args, big_len) != 0)
+        {
+            return 1;
+        }
+        session->big_lines++;
+    }
+    else
+    {
+        const char* line = foreground[
+            (size_t)rand_r(seed) % (sizeof(foreground) / sizeof(char*))
+        ];
+        if (stress_queue(session, line, strlen(line)) != 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+char* build_big_line(size_t* len)
+{
+    static const char command[] = "/bin/true";
+    static const char word[] = " xxxxxxx";
+
+    // Everything `execve()` copies counts against `ARG_MAX`: the strings,
+    // and a pointer for each
+    extern char** environ;
+    long budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0)
+    {
+        budget = 131072;
+    }
+    char** env;
+    for (env = environ; *env != NULL; ++env)
+    {
+        budget -= (long)(strlen(*env) + 1 + sizeof(char*));
+    }
+    budget -= (long)(sizeof(command) + 2 * sizeof(char*));
+
+    // Stay a little under, for whatever the shell adds to the environment
+    long words = budget / (long)(sizeof(word) + sizeof(char*)) * 15 / 16;
+    if (words < 1)
+    {
+        words = 1;
+    }
+
+    size_t word_len = sizeof(word) - 1;
+    *len = sizeof(command) - 1 + (size_t)words * word_len + 1;
+    char* line = malloc(*len);
+    if (line == NULL)
+    {
+        return NULL;
+    }
+    memcpy(line, command, sizeof(command) - 1);
+    char* p = line + sizeof(command) - 1;
+    long i;
+    for (i = 0; i < words; ++i)
+    {
+        memcpy(p, word, word_len);
+        p += word_len;
+    }
+    *p = '\n';
+
+    return line;
+}
+
+void sample_range(const stress_sample_t* samples,
+                  size_t                 from,
+                  size_t                 to,
+                  size_t                 field,
+                  long*                  min,
+                  long*                  max)
+{
+    *min = *max = *(const long*)((const char*)&samples[from] + field);
+    size_t i;
+    for (i = from + 1; i < to; ++i)
+    {
+        long value = *(const long*)((const char*)&samples[i] + field);
+        if (value < *min)
+        {
+            *min = value;
+        }
+        if (value > *max)
+        {
+            *max = value;
+        }
+    }
+}
+
+int check_growth(const stress_session_t* session,
+                 const char*             name,
+                 size_t                  field,
+                 long                    slack,
+                 FILE*                   out)
+{
+    size_t n = session->sample_count;
+    long early_min, early_max, late_min, late_max;
+    sample_range(session->samples, n / 4, n / 2, field,
+                 &early_min, &early_max);
+    sample_range(session->samples, n - n / 4, n, field,
+                 &late_min, &late_max);
+
+    bool grew = late_min > early_max + slack;
+    fprintf(
+        out,
+        "%-8s %s  early %ld..%ld  late %ld..%ld  slack %ld\n",
+        name,
+        grew ? "FAIL" : "ok  ",
+        early_min,
+        early_max,
+        late_min,
+        late_max,
+        slack
+    );
+
+    return grew;
+}
+
+void write_samples(const stress_session_t* session, FILE* out)
+{
+    fprintf(out, "seconds,rss_kib,fds,zombies\n");
+    size_t i;
+    for (i = 0; i < session->sample_count; ++i)
+    {
+        const stress_sample_t* s = &session->samples[i];
+        fprintf(
+            out,
+            "%.3f,%ld,%ld,%ld\n",
+            (double)s->at_ns / 1e9,
+            s->rss,
+            s->fds,
+            s->zombies
+        );
+    }
+}
+
+int run_session(stress_session_t*      session,
+                char* const            argv[],
+                const stress_config_t* config)
+{
+    size_t big_len;
+    char* big_args = build_big_line(&big_len);
+    session->launches = calloc(STRESS_LAUNCH_SLOTS, sizeof(stress_launch_t));
+    if (big_args == NULL || session->launches == NULL)
+    {
+        free(big_args);
+        perror("out of memory");
+        return 1;
+    }
+    if (stress_start(session, argv) != 0)
+    {
+        free(big_args);
+        return 1;
+    }
+
+    unsigned seed = config->seed;
+    uint64_t start = monotonic_ns();
+    uint64_t load_end = start + (uint64_t)config->secs * 1000000000u;
+    uint64_t lag_limit = (uint64_t)config->lag_limit * 1000000u;
+    uint64_t next_sample = start;
+    uint64_t last_input = start;
+    int ret = 0;
+
+    // Load until the time is up, then wait for every job to get reported,
+    // ticking the shell along. Jobs can still be launched from lines sent
+    // before the end, so the wait only ends once the shell has got through
+    // them all and echoed back the sync word. Jobs held back by the shell's
+    // `-j` cap can take a while to get through, so the wait is only given
+    // up on when no job has been reported for the lag limit.
+    bool loading = true;
+    while (!session->shell_gone)
+    {
+        // Samples are only taken under load, so that the growth checks
+        // compare like with like
+        uint64_t now = monotonic_ns();
+        if (loading && now >= next_sample)
+        {
+            if (stress_sample(session, start) != 0)
+            {
+                ret = 1;
+                break;
+            }
+            next_sample += STRESS_SAMPLE_MS * 1000000u;
+        }
+
+        if (loading && now >= load_end)
+        {
+            loading = false;
+            const char sync[] = "echo " STRESS_SYNC_WORD "\n";
+            stress_queue(session, sync, sizeof(sync) - 1);
+        }
+        if (!loading
+            && (now >= (session->last_report_ns > load_end
+                        ? session->last_report_ns
+                        : load_end) + lag_limit
+                || (session->synced
+                    && session->outstanding == 0
+                    && session->queued == 0)))
+        {
+            break;
+        }
+
+        // More load only once the shell has caught up with the last of it
+        int unread = 0;
+        ioctl(session->to_shell, FIONREAD, &unread);
+        if (loading
+            && session->input_len == 0
+            && unread < 4096
+            && session->outstanding + session->queued < STRESS_MAX_IN_FLIGHT)
+        {
+            if (stress_step(session, &seed, big_args, big_len) != 0)
+            {
+                ret = 1;
+                break;
+            }
+        }
+        if (session->input_len == 0
+            && now - last_input >= STRESS_TICK_MS * 1000000u)
+        {
+            stress_queue(session, "\n", 1);
+        }
+        if (session->input_len > 0)
+        {
+            last_input = now;
+            if (stress_flush(session) != 0)
+            {
+                break;
+            }
+        }
+
+        struct pollfd fds[2] = {
+            {session->from_shell, POLLIN, 0},
+            {session->to_shell, session->input_len > 0 ? POLLOUT : 0, 0}
+        };
+        poll(fds, 2, STRESS_TICK_MS);
+        stress_drain(session);
+    }
+
+    // Done: let the shell go, and see that it goes cleanly. Its input is
+    // closed once `exit` is through, for shells that want EOF instead, and
+    // one that still hasn't gone after the lag limit is killed.
+    session->died_early = session->shell_gone;
+    stress_queue(session, "exit\n", 5);
+    uint64_t exit_deadline = monotonic_ns() + lag_limit;
+    while (!session->shell_gone)
+    {
+        if (session->to_shell != -1
+            && (stress_flush(session) != 0 || session->input_len == 0))
+        {
+            close(session->to_shell);
+            session->to_shell = -1;
+        }
+        if (monotonic_ns() >= exit_deadline)
+        {
+            kill(-session->pid, SIGKILL);
+            break;
+        }
+        struct pollfd fds[2] = {
+            {session->from_shell, POLLIN, 0},
+            {session->to_shell, POLLOUT, 0}
+        };
+        poll(fds, session->to_shell != -1 ? 2 : 1, 100);
+        stress_drain(session);
+    }
+    if (session->to_shell != -1)
+    {
+        close(session->to_shell);
+    }
+    close(session->from_shell);
+    waitpid(session->pid, &session->wstatus, 0);
+    free(big_args);
+
+    return ret;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+int judge_session(stress_session_t*      session,
+                  const stress_config_t*  config,
+                  FILE*                   out)
+{
+    int failed = 0;
+    fprintf(
+        out,
+        "seed %u, %zu samples; %ld bursts, %ld SIGINT storms, "
+        "%ld SIGTSTPs, %ld huge argument lists\n"
+        "jobs    %ld launched, %ld reported done, %ld never reported, "
+        "%ld reported but never launched\n",
+        config->seed,
+        session->sample_count,
+        session->bursts,
+        session->storms,
+        session->toggles,
+        session->big_lines,
+        session->launched,
+        session->reported,
+        session->outstanding,
+        session->lost
+    );
+    if (session->outstanding > 0 || session->lost > 0)
+    {
+        failed = 1;
+    }
+    // How `exit` itself exits is up to the shell, but not being killed is
+    if (session->died_early || WIFSIGNALED(session->wstatus))
+    {
+        fprintf(
+            out,
+            "shell   FAIL  %s: %s %d\n",
+            session->died_early ? "went away mid-session" : "had to be killed",
+            WIFEXITED(session->wstatus) ? "exit value" : "signal",
+            WIFEXITED(session->wstatus)
+                ? WEXITSTATUS(session->wstatus)
+                : WTERMSIG(session->wstatus)
+        );
+        failed = 1;
+    }
+
+    if (session->lag_count > 0)
+    {
+        qsort(session->lags, session->lag_count, sizeof(uint64_t),
+              compare_u64);
+        uint64_t p99 = session->lags[(session->lag_count * 99) / 100];
+        uint64_t max = session->lags[session->lag_count - 1];
+        bool too_slow = max / 1000000u > (uint64_t)config->lag_limit;
+        fprintf(
+            out,
+            "lag      %s  p50 %.3fms  p99 %.3fms  max %.3fms  limit %ldms\n",
+            too_slow ? "FAIL" : "ok  ",
+            (double)session->lags[session->lag_count / 2] / 1e6,
+            (double)p99 / 1e6,
+            (double)max / 1e6,
+            config->lag_limit
+        );
+        if (too_slow)
+        {
+            failed = 1;
+        }
+    }
+
+    // Too short a session to tell growth from warm-up
+    if (session->sample_count < 8)
+    {
+        fprintf(out, "too few samples to check for growth\n");
+    }
+    else
+    {
+        failed |= check_growth(session, "rss_kib",
+                               offsetof(stress_sample_t, rss),
+                               config->rss_slack, out);
+        failed |= check_growth(session, "fds",
+                               offsetof(stress_sample_t, fds),
+                               config->fd_slack, out);
+        failed |= check_growth(session, "zombies",
+                               offsetof(stress_sample_t, zombies),
+                               config->zombie_slack, out);
+    }
+
+    fprintf(out, "%s\n", failed ? "FAIL" : "PASS");
+
+    return failed;
+}
+
+void usage(void)
+{
+    const char msg[] =
+        "usage: smallsh-stress [-t secs] [-s seed] [-r rss_kib] [-d fds] "
+        "[-z zombies] [-l lag_ms] [-o samples.csv] [shell [args...]]\n";
+    fputs(msg, stderr);
+}
+
+int main(int argc, char** argv)
+{
+    stress_config_t config = {
+        STRESS_DEFAULT_SECS,
+        (unsigned)time(NULL),
+        STRESS_DEFAULT_RSS_SLACK,
+        STRESS_DEFAULT_FD_SLACK,
+        STRESS_DEFAULT_ZOMBIE_SLACK,
+        STRESS_DEFAULT_LAG_LIMIT
+    };
+    const char* samples_path = NULL;
+    int opt;
+
+    // Everything after the shell's path is the shell's
+    while ((opt = getopt(argc, argv, "+t:s:r:d:z:l:o:")) != -1)
+    {
+        long* limit = NULL;
+        switch (opt)
+        {
+            case 't': // Session length
+            {
+                limit = &config.secs;
+                break;
+            }
+            case 's': // Seed, to replay a failed session
+            {
+                config.seed = (unsigned)strtoul(optarg, NULL, 10);
+                break;
+            }
+            case 'r': // RSS growth slack
+            {
+                limit = &config.rss_slack;
+                break;
+            }
+            case 'd': // Descriptor growth slack
+            {
+                limit = &config.fd_slack;
+                break;
+            }
+            case 'z': // Zombie growth slack
+            {
+                limit = &config.zombie_slack;
+                break;
+            }
+            case 'l': // Reaping lag limit
+            {
+                limit = &config.lag_limit;
+                break;
+            }
+            case 'o': // Where to write every sample
+            {
+                samples_path = optarg;
+                break;
+            }
+            default:
+            {
+                usage();
+                return 2;
+            }
+        }
+        if (limit != NULL)
+        {
+            char* end;
+            *limit = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || *limit < 0)
+            {
+                usage();
+                return 2;
+            }
+        }
+    }
+
+    char default_shell[] = "./smallsh";
+    char* default_argv[] = {default_shell, NULL};
+    char* const* shell_argv = optind < argc ? argv + optind : default_argv;
+
+    // The shell going away mid-write should show up as a failed session
+    signal(SIGPIPE, SIG_IGN);
+
+    stress_session_t session;
+    memset(&session, 0, sizeof(session));
+    fprintf(stdout, "stressing %s for %lds\n", shell_argv[0], config.secs);
+    fflush(stdout);
+    int ret = run_session(&session, shell_argv, &config);
+    if (ret == 0)
+    {
+        ret = judge_session(&session, &config, stdout);
+    }
+
+    if (samples_path != NULL)
+    {
+        FILE* out = fopen(samples_path, "w");
+        if (out == NULL)
+        {
+            perror("could not open samples file");
+            ret = 1;
+        }
+        else
+        {
+            write_samples(&session, out);
+            fclose(out);
+        }
+    }
+
+    free(session.input);
+    free(session.launches);
+    free(session.lags);
+    free(session.samples);
+
+    return ret;
+}
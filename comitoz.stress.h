@@ -0,0 +1,285 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <stdint.h>    // uint64_t
+#include <stdio.h>     // FILE
+#include <sys/types.h> // pid_t
+
+
+/*** Constants ***/
+
+// Default length of a session, in seconds.
+#define STRESS_DEFAULT_SECS 30
+
+// How often the shell's resource use gets sampled, in milliseconds.
+#define STRESS_SAMPLE_MS 100
+
+// How long the shell is left without input before it's sent a blank line,
+// in milliseconds. Jobs only get reported when a line comes in, so this
+// bounds how much of the measured reaping lag is the driver's own doing.
+#define STRESS_TICK_MS 10
+
+// Default slack, in KiB, for RSS growth between the start of the session
+// (after warm-up) and the end.
+#define STRESS_DEFAULT_RSS_SLACK 8192
+
+// Default slack for growth in open descriptors.
+#define STRESS_DEFAULT_FD_SLACK 2
+
+// Default slack for growth in unreaped children.
+#define STRESS_DEFAULT_ZOMBIE_SLACK 16
+
+// Default limit on reaping lag, in milliseconds.
+#define STRESS_DEFAULT_LAG_LIMIT 2000
+
+// Most background jobs started in one burst.
+#define STRESS_MAX_BURST 200
+
+// Most `SIGINT`s sent in one storm.
+#define STRESS_MAX_STORM 50
+
+// Input that's queued up for the shell but not yet written, past which no
+// more is generated. Keeps the driver from getting ahead of the shell.
+#define STRESS_INPUT_HIGH_WATER 65536
+
+// Most jobs let be in flight (launched and not yet reported done, or queued
+// up by the shell's `-j` cap) before the driver holds off on more. Keeps it
+// from mistaking its own backlog for the shell leaking.
+#define STRESS_MAX_IN_FLIGHT 1000
+
+// Echoed once the load stops. When it comes back, the shell has launched
+// (or queued) every job it's going to.
+#define STRESS_SYNC_WORD "smallsh-stress-sync"
+
+// Slots in the table of launched-but-unreported jobs. Always a power of two,
+// and well over the most jobs that can be outstanding at once.
+#define STRESS_LAUNCH_SLOTS 65536
+
+
+/*** `typedef`s ***/
+
+// What a session is allowed to get away with.
+typedef struct
+{
+    long     secs;         // How long to run for
+    unsigned seed;         // For `rand_r()`
+    long     rss_slack;    // KiB
+    long     fd_slack;
+    long     zombie_slack;
+    long     lag_limit;    // Milliseconds
+} stress_config_t;
+
+// The shell's resource use at one point in time.
+typedef struct
+{
+    uint64_t at_ns;   // Since the session started
+    long     rss;     // KiB
+    long     fds;     // Open descriptors
+    long     zombies; // Children that have exited but not been reaped
+} stress_sample_t;
+
+// A background job the shell has reported launching, but not yet reported
+// done.
+typedef struct
+{
+    pid_t    pid; // 0 for an empty slot
+    uint64_t launched_ns;
+} stress_launch_t;
+
+// Everything about a session in progress.
+typedef struct
+{
+    pid_t  pid;        // The shell
+    int    to_shell;   // Its stdin; non-blocking
+    int    from_shell; // Its stdout and stderr; non-blocking
+
+    char*  input;      // Queued up to be written to the shell
+    size_t input_len;
+    size_t input_cap;
+
+    char   line[4096]; // Output line being put together; longer lines are
+    size_t line_len;   // cut short, which is fine for what's looked for
+
+    stress_launch_t* launches;       // Open-addressed by PID, linear
+                                     // probing
+    long             outstanding;    // How many of `launches` are filled
+    long             launched;
+    long             reported;
+    long             lost;           // "Done" reports for PIDs never
+                                     // launched
+    long             queued;         // Last pending count the shell
+                                     // reported, less launches since
+    uint64_t         last_report_ns; // When a job was last reported done
+
+    uint64_t* lags;    // Every job's reaping lag, in nanoseconds
+    size_t    lag_count;
+    size_t    lag_cap;
+
+    stress_sample_t* samples;
+    size_t           sample_count;
+    size_t           sample_cap;
+
+    long bursts;     // Counts of what's been thrown at the shell
+    long storms;
+    long toggles;
+    long big_lines;
+    bool synced;     // Has `STRESS_SYNC_WORD` come back?
+    bool shell_gone; // Has its output hit EOF?
+    bool died_early; // Did it before being told to `exit`?
+    int  wstatus;    // How it exited
+} stress_session_t;
+
+
+/*** Forward declarations ***/
+
+// Starts the shell on non-blocking pipes, in a process group of its own so
+// that `SIGINT` storms can go to it and its foreground children at once, as
+// a ^C at a terminal would.
+//
+// ## Parameters:
+// * `session` - Set up to describe the running shell.
+// * `argv` - `NULL`-terminated `argv` for the shell; `argv[0]` is the path.
+//
+// **Returns** non-zero on failure.
+int stress_start(stress_session_t* session, char* const argv[]);
+
+// Queues up input for the shell.
+//
+// **Returns** non-zero if out of memory.
+int stress_queue(stress_session_t* session, const char* str, size_t len);
+
+// Writes as much queued input as the shell will take without blocking.
+//
+// **Returns** non-zero if the shell can't be written to any more.
+int stress_flush(stress_session_t* session);
+
+// Reads whatever output the shell has ready, and keeps track of the jobs
+// it reports launching and finishing.
+void stress_drain(stress_session_t* session);
+
+// Takes in one whole line of the shell's output.
+void stress_line(stress_session_t* session, const char* line);
+
+// Finds the slot that holds a launched job, or the empty slot where it
+// would go.
+stress_launch_t* stress_launch_slot(stress_session_t* session, pid_t pid);
+
+// Counts how many of a process's children are zombies, by going through
+// every process in /proc.
+long count_zombies(pid_t parent);
+
+// Counts a process's open descriptors.
+//
+// **Returns** the count, or -1 if it couldn't be read.
+long count_fds(pid_t pid);
+
+// Reads a process's resident set size.
+//
+// **Returns** the RSS in KiB, or -1 if it couldn't be read.
+long read_rss(pid_t pid);
+
+// Samples the shell's resource use and records it.
+//
+// **Returns** non-zero if out of memory.
+int stress_sample(stress_session_t* session, uint64_t start_ns);
+
+// Throws one randomly picked thing at the shell: a burst of background
+// jobs, a `SIGINT` storm, a `SIGTSTP` (toggling foreground-only mode), a
+// line with an argument list near `ARG_MAX`, or just a foreground command.
+//
+// ## Parameters:
+// * `session` - The session.
+// * `seed` - State for `rand_r()`.
+// * `big_args` - A line of `/bin/true` with arguments just short of what
+//                `execve()` will take, newline included.
+// * `big_len` - The length of `big_args`.
+//
+// **Returns** non-zero if out of memory.
+int stress_step(stress_session_t* session,
+                unsigned*         seed,
+                const char*       big_args,
+                size_t            big_len);
+
+// Builds a `/bin/true` line with an argument list just short of
+// `ARG_MAX`, once the environment the shell passes on is accounted for.
+//
+// ## Parameters:
+// * `len` - Set to the length of the line, newline included.
+//
+// **Returns** the line, `malloc()`ed, or `NULL` if out of memory.
+char* build_big_line(size_t* len);
+
+// Finds the least and greatest value of one field across a window of
+// samples.
+//
+// ## Parameters:
+// * `samples`, `from`, `to` - The samples, and the window `[from, to)`,
+//                             which mustn't be empty.
+// * `field` - `offsetof()` the `long` field in `stress_sample_t`.
+// * `min`, `max` - Set to the least and greatest values.
+void sample_range(const stress_sample_t* samples,
+                  size_t                 from,
+                  size_t                 to,
+                  size_t                 field,
+                  long*                  min,
+                  long*                  max);
+
+// Checks one resource for growth without bound: the least it gets in the
+// last quarter of the session mustn't be more than `slack` over the most it
+// got in the second quarter (the first being warm-up). A leak raises the
+// floor past the old ceiling; a one-off spike doesn't.
+//
+// ## Parameters:
+// * `session` - The finished session.
+// * `name` - What the resource is called, for the report.
+// * `field` - `offsetof()` the `long` field in `stress_sample_t`.
+// * `slack` - How much growth is let go.
+// * `out` - Where to report to.
+//
+// **Returns** non-zero if the resource grew too much.
+int check_growth(const stress_session_t* session,
+                 const char*             name,
+                 size_t                  field,
+                 long                    slack,
+                 FILE*                   out);
+
+// Writes out every sample as CSV, with a header row.
+void write_samples(const stress_session_t* session, FILE* out);
+
+// Runs a whole session against a shell: load until the time is up, then
+// waiting for every job launched to be reported, then `exit`.
+//
+// ## Parameters:
+// * `session` - Zeroed; filled in as the session goes.
+// * `argv` - `NULL`-terminated `argv` for the shell.
+// * `config` - How long to run for, and the seed.
+//
+// **Returns** non-zero if the session couldn't be run at all.
+int run_session(stress_session_t*      session,
+                char* const            argv[],
+                const stress_config_t* config);
+
+// Orders two `uint64_t`s, for `qsort()`.
+int compare_u64(const void* a, const void* b);
+
+// Decides whether a session passed, and reports on it. Sorts the lags.
+//
+// **Returns** non-zero if it failed.
+int judge_session(stress_session_t*      session,
+                  const stress_config_t*  config,
+                  FILE*                   out);
+
+// Prints out how to invoke the driver.
+void usage(void);
+
+// Runs a stress session against a shell binary.
+//
+// ## Parameters:
+// * `argc` - Number of arguments passed in.
+// * `argv` - `[-t secs] [-s seed] [-r rss_kib] [-d fds] [-z zombies]
+//            [-l lag_ms] [-o samples.csv] [shell [shell args...]]`. The
+//            shell defaults to "./smallsh".
+//
+// **Returns** 0 if the shell held up, 1 if it didn't, and 2 on bad usage.
+int main(int argc, char** argv);
@@ -0,0 +1,430 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <stdint.h>    // uint64_t, int64_t, int32_t, UINT64_MAX
+#include <stdio.h>     // FILE, fprintf
+#include <stdlib.h>    // calloc, free
+#include <sys/mman.h>  // mmap, munmap, MAP_SHARED, MAP_ANONYMOUS
+#include <sys/types.h> // pid_t
+
+
+/*** Constants ***/
+
+// How many events the ring holds before the oldest get overwritten. Always a
+// power of two.
+#define TRACE_CAPACITY 16384
+
+// What `trace_reserve()` hands out when tracing is off.
+#define TRACE_NO_TICKET UINT64_MAX
+
+
+/*** `typedef`s ***/
+
+// What happened.
+//
+// * `TRACE_LINE_READ` - A line came in. `arg` is its length.
+// * `TRACE_PARSE_DONE` - It's been parsed. `arg` is the number of stages.
+// * `TRACE_FORK` - `fork()` was called (timestamped just before); `pid` is
+//                  the child.
+// * `TRACE_SPAWN` - `posix_spawn()` was called (timestamped just before);
+//                   `pid` is the child.
+// * `TRACE_EXEC` - The child is `exec()`ing. Emitted by the child itself
+//                  just before `exec()` for `fork()`ed children, in which
+//                  case `pid` is 0 and `arg` is the ticket of the matching
+//                  `TRACE_FORK`; for spawned ones, it's when `posix_spawn()`
+//                  returned, which it only does after the `exec()`.
+// * `TRACE_CHILD_EXIT` - The shell reaped a child. `arg` is its wait status.
+// * `TRACE_REAP_REPORTED` - The shell told the user about it. `arg` is its
+//                           wait status.
+typedef enum
+{
+    TRACE_LINE_READ,
+    TRACE_PARSE_DONE,
+    TRACE_FORK,
+    TRACE_SPAWN,
+    TRACE_EXEC,
+    TRACE_CHILD_EXIT,
+    TRACE_REAP_REPORTED,
+    TRACE_KIND_COUNT
+} trace_kind_t;
+
+// One slot of the ring.
+typedef struct
+{
+    uint64_t ns;   // `monotonic_ns()` when it happened
+    uint64_t seq;  // Ticket it was written for, plus one; 0 if never written
+    int32_t  kind; // See `trace_kind_t`
+    int32_t  pid;  // Process it's about (the shell's own PID for line events)
+    int64_t  arg;  // Depends on `kind`
+} trace_event_t;
+
+// A fixed-size ring of timestamped events, allocated once up front.
+//
+// It lives in a shared anonymous mapping, so that `fork()`ed children can
+// write to the same ring right up until they `exec()`. Writers claim a slot
+// by atomically taking a ticket, fill it in, and then publish it by storing
+// the ticket into `seq`. Emitting an event is a clock read (from the vDSO)
+// and a few stores: no allocation, no lock, and no system call.
+typedef struct
+{
+    uint64_t      next;    // Tickets handed out so far
+    int           enabled; // Is anything being recorded?
+    trace_event_t events[TRACE_CAPACITY];
+} trace_ring_t;
+
+// Per-child timestamps, gathered up while dumping so that each phase of a
+// child's life can be drawn as a span.
+typedef struct
+{
+    pid_t    pid;     // 0 if the slot is empty
+    uint64_t fork_ns; // `TRACE_FORK` or `TRACE_SPAWN`, or 0 if not seen
+    uint64_t exec_ns; // `TRACE_EXEC`, or 0 if not seen
+    uint64_t exit_ns; // `TRACE_CHILD_EXIT`, or 0 if not seen
+} trace_child_t;
+
+
+/*** Implementations ***/
+
+// Maps a new, empty ring, with tracing turned on.
+//
+// **Returns** the ring, or `NULL` if it couldn't be mapped.
+trace_ring_t* trace_open(void)
+{
+    // Untouched pages cost nothing, and the kernel hands them out zeroed
+    void* map = mmap(
+        NULL,
+        sizeof(trace_ring_t),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    trace_ring_t* ring = map;
+    ring->enabled = 1;
+
+    return ring;
+}
+
+// Unmaps a ring.
+void trace_close(trace_ring_t* ring)
+{
+    if (ring != NULL)
+    {
+        munmap(ring, sizeof(trace_ring_t));
+    }
+}
+
+// Claims the next slot, to be filled in later with `trace_fill()`. Useful
+// when what goes in the event isn't known until after it's happened.
+//
+// **Returns** the slot's ticket, or `TRACE_NO_TICKET` if tracing is off.
+uint64_t trace_reserve(trace_ring_t* ring)
+{
+    if (ring == NULL || !ring->enabled)
+    {
+        return TRACE_NO_TICKET;
+    }
+
+    return __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+}
+
+// Fills in and publishes a slot claimed with `trace_reserve()`.
+//
+// ## Parameters:
+// * `ring` - The ring.
+// * `ticket` - From `trace_reserve()`. Nothing happens for
+//              `TRACE_NO_TICKET`.
+// * `ns` - When it happened.
+// * `kind`, `pid`, `arg` - See `trace_event_t`.
+void trace_fill(trace_ring_t* ring,
+                uint64_t      ticket,
+                uint64_t      ns,
+                trace_kind_t  kind,
+                pid_t         pid,
+                int64_t       arg)
+{
+    if (ticket == TRACE_NO_TICKET)
+    {
+        return;
+    }
+
+    trace_event_t* event = &ring->events[ticket & (TRACE_CAPACITY - 1)];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    event->ns = ns;
+    event->kind = (int32_t)kind;
+    event->pid = (int32_t)pid;
+    event->arg = arg;
+    __atomic_store_n(&event->seq, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// Records an event that happened at a given time.
+void trace_emit_at(trace_ring_t* ring,
+                   uint64_t      ns,
+                   trace_kind_t  kind,
+                   pid_t         pid,
+                   int64_t       arg)
+{
+    trace_fill(ring, trace_reserve(ring), ns, kind, pid, arg);
+}
+
+// Records an event that's happening now.
+void trace_emit(trace_ring_t* ring, trace_kind_t kind, pid_t pid, int64_t arg)
+{
+    if (ring != NULL && ring->enabled)
+    {
+        trace_emit_at(ring, monotonic_ns(), kind, pid, arg);
+    }
+}
+
+// Throws away every event recorded so far.
+void trace_clear(trace_ring_t* ring)
+{
+    size_t i;
+    for (i = 0; i < TRACE_CAPACITY; ++i)
+    {
+        __atomic_store_n(&ring->events[i].seq, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&ring->next, 0, __ATOMIC_RELAXED);
+}
+
+// Looks up the published event for a ticket.
+//
+// **Returns** the event, or `NULL` if it has been overwritten or isn't
+// finished being written.
+const trace_event_t* trace_event(const trace_ring_t* ring, uint64_t ticket)
+{
+    const trace_event_t* event = &ring->events[ticket & (TRACE_CAPACITY - 1)];
+
+    return __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE) == ticket + 1
+        ? event
+        : NULL;
+}
+
+// Finds (or makes) the entry for a child in an open-addressed table with a
+// power-of-two number of slots, which mustn't be full.
+trace_child_t* trace_child(trace_child_t* children, size_t count, pid_t pid)
+{
+    size_t slot = ((size_t)pid * 2654435769u) & (count - 1);
+    while (children[slot].pid != 0 && children[slot].pid != pid)
+    {
+        slot = (slot + 1) & (count - 1);
+    }
+    children[slot].pid = pid;
+
+    return &children[slot];
+}
+
+// Writes one Chrome trace event.
+//
+// ## Parameters:
+// * `out` - Where to write it.
+// * `first` - Is this the first event (i.e. no leading comma)?
+// * `name` - What to call it.
+// * `ns` - When it started.
+// * `dur_ns` - How long it went on for, or 0 for an instant event.
+// * `shell_pid` - Goes in "pid", so that everything shows up together.
+// * `tid` - The process it's about, which gets its own track.
+// * `arg` - Goes in "args".
+void trace_write_event(FILE*       out,
+                       bool*       first,
+                       const char* name,
+                       uint64_t    ns,
+                       uint64_t    dur_ns,
+                       pid_t       shell_pid,
+                       pid_t       tid,
+                       int64_t     arg)
+{
+    fprintf(
+        out,
+        "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,",
+        *first ? "" : ",",
+        name,
+        dur_ns > 0 ? "X" : "i",
+        (double)ns / 1e3
+    );
+    if (dur_ns > 0)
+    {
+        fprintf(out, "\"dur\":%.3f,", (double)dur_ns / 1e3);
+    }
+    else
+    {
+        fprintf(out, "\"s\":\"t\",");
+    }
+    fprintf(
+        out,
+        "\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%lld}}",
+        (int)shell_pid,
+        (int)tid,
+        (long long)arg
+    );
+    *first = false;
+}
+
+// Writes out everything in the ring as Chrome trace-event JSON (for
+// chrome://tracing or Perfetto). Every event shows up as an instant event on
+// the track of the process it's about, along with spans for each line's
+// parsing ("parse") and each child's "launch" (fork to exec), "run" (exec to
+// reaped), and "reap delay" (reaped to reported).
+//
+// ## Parameters:
+// * `ring` - The ring.
+// * `out` - Where to write the JSON.
+// * `shell_pid` - The shell's own PID.
+//
+// **Returns** the number of events written out, or -1 if out of memory.
+long trace_dump(const trace_ring_t* ring, FILE* out, pid_t shell_pid)
+{
+    static const char* const names[TRACE_KIND_COUNT] = {
+        "line read",
+        "parse done",
+        "fork",
+        "spawn",
+        "exec",
+        "child exit",
+        "reap reported"
+    };
+
+    uint64_t end = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    uint64_t start = end > TRACE_CAPACITY ? end - TRACE_CAPACITY : 0;
+    size_t child_count = 2 * TRACE_CAPACITY;
+    trace_child_t* children = calloc(child_count, sizeof(trace_child_t));
+    if (children == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(
+        out,
+        "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+        "\"args\":{\"name\":\"smallsh\"}}",
+        (int)shell_pid,
+        (int)shell_pid
+    );
+    bool first = false;
+    long written = 0;
+    uint64_t line_ns = 0;
+    uint64_t ticket;
+    for (ticket = start; ticket < end; ++ticket)
+    {
+        const trace_event_t* event = trace_event(ring, ticket);
+        if (event == NULL || event->kind < 0
+            || event->kind >= TRACE_KIND_COUNT)
+        {
+            continue;
+        }
+
+        // A `fork()`ed child doesn't know its own PID without asking the
+        // kernel, so it leaves a pointer to its parent's `TRACE_FORK` instead
+        pid_t pid = event->pid;
+        if (event->kind == TRACE_EXEC && pid == 0)
+        {
+            const trace_event_t* fork_event = event->arg >= 0
+                ? trace_event(ring, (uint64_t)event->arg)
+                : NULL;
+            if (fork_event == NULL)
+            {
+                continue;
+            }
+            pid = fork_event->pid;
+        }
+        pid_t tid = pid > 0 ? pid : shell_pid;
+        trace_child_t* child = pid > 0 && pid != shell_pid
+            ? trace_child(children, child_count, pid)
+            : NULL;
+
+        trace_write_event(
+            out,
+            &first,
+            names[event->kind],
+            event->ns,
+            0,
+            shell_pid,
+            tid,
+            event->arg
+        );
+        written++;
+
+        switch ((trace_kind_t)event->kind)
+        {
+            case TRACE_LINE_READ:
+            {
+                line_ns = event->ns;
+                break;
+            }
+            case TRACE_PARSE_DONE:
+            {
+                if (line_ns != 0 && event->ns >= line_ns)
+                {
+                    trace_write_event(out, &first, "parse", line_ns,
+                                      event->ns - line_ns + 1, shell_pid,
+                                      tid, event->arg);
+                }
+                break;
+            }
+            case TRACE_FORK:
+            case TRACE_SPAWN:
+            {
+                if (child != NULL)
+                {
+                    child->fork_ns = event->ns;
+                }
+                break;
+            }
+            case TRACE_EXEC:
+            {
+                if (child != NULL && child->fork_ns != 0)
+                {
+                    child->exec_ns = event->ns;
+                    trace_write_event(out, &first, "launch", child->fork_ns,
+                                      event->ns - child->fork_ns + 1,
+                                      shell_pid, tid, 0);
+                }
+                break;
+            }
+            case TRACE_CHILD_EXIT:
+            {
+                if (child != NULL)
+                {
+                    child->exit_ns = event->ns;
+                    uint64_t run_start = child->exec_ns != 0
+                        ? child->exec_ns
+                        : child->fork_ns;
+                    if (run_start != 0)
+                    {
+                        trace_write_event(out, &first, "run", run_start,
+                                          event->ns - run_start + 1,
+                                          shell_pid, tid, event->arg);
+                    }
+                }
+                break;
+            }
+            case TRACE_REAP_REPORTED:
+            {
+                if (child != NULL && child->exit_ns != 0)
+                {
+                    trace_write_event(out, &first, "reap delay",
+                                      child->exit_ns,
+                                      event->ns - child->exit_ns + 1,
+                                      shell_pid, tid, event->arg);
+                }
+                break;
+            }
+            case TRACE_KIND_COUNT:
+            default:
+            {
+                break;
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(children);
+
+    return written;
+}
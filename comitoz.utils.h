@@ -1,10 +1,11 @@
 #pragma once
 
-#include <errno.h>  // errno
+#include <stdint.h> // uint64_t
 #include <stdlib.h> // calloc, realloc
-#include <stdio.h>  // fflush, ferror
+#include <stdio.h>  // sprintf
 #include <string.h> // strlen, strncat, strstr
-#include <unistd.h> // getpid, STDOUT_FILENO, STDERR_FILENO, write
+#include <time.h>   // clock_gettime, CLOCK_MONOTONIC
+#include <unistd.h> // getpid
 
 
 /*** `typedef`s ***/
@@ -13,67 +14,15 @@ typedef enum {false, true} bool;
 
 /*** Implementations ***/
 
-// Prints to stdout, in a reentrant way.
+// Reads the monotonic clock.
 //
-// ## Parameters:
-// * `str` - The string to print.
-// * `size` - The length of the string, in terms of `strlen()`, i.e. not
-//            including the trailing `'\0'`.
-//
-// **Returns** non-zero on failure.
-int write_stdout(const char* str, size_t size)
-{
-    if (write(STDOUT_FILENO, str, size) < 0)
-    {
-        return errno;
-    }
-
-    return 0;
-}
-
-// Same thing as `write_stdout()`, but also flushes `stdout`.
-int fwrite_stdout(const char* str, size_t size)
-{
-    int r = write_stdout(str, size);
-    if (r != 0)
-    {
-        return r;
-    }
-
-    if (fflush(stdout) != 0)
-    {
-        return ferror(stdout);
-    }
-
-    return 0;
-}
-
-// Self-explanatory; same thing as `write_stdout()` but for stderr.
-int write_stderr(const char* str, size_t size)
-{
-    if (write(STDERR_FILENO, str, size) < 0)
-    {
-        return errno;
-    }
-
-    return 0;
-}
-
-// Self-explanatory; same thing as `fwrite_stdout()` but for stderr.
-int fwrite_stderr(const char* str, size_t size)
+// **Returns** the current `CLOCK_MONOTONIC` time, in nanoseconds.
+uint64_t monotonic_ns(void)
 {
-    int r = write_stderr(str, size);
-    if (r != 0)
-    {
-        return r;
-    }
-
-    if (fflush(stderr) != 0)
-    {
-        return ferror(stderr);
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return 0;
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
 // Expand all instances of "$$" into the current PID, returning a pointer to
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "comitoz.utils.h"
+
+#include <errno.h>  // ENOMEM
+#include <stdint.h> // uint64_t, SIZE_MAX
+#include <stdlib.h> // calloc, malloc, realloc, free
+#include <string.h> // memcmp, memcpy, strchr, strlen
+
+
+/*** Constants ***/
+
+// Starting number of slots in a variable table. Always a power of two.
+#define VAR_TABLE_MIN_SLOTS 64
+
+// Starting size of a variable table's `envp`, terminator included.
+#define VAR_ENV_MIN_CAP 64
+
+// `var_t.env_index` of a variable that isn't exported.
+#define VAR_LOCAL SIZE_MAX
+
+
+/*** `typedef`s ***/
+
+// One shell variable. It's kept as a single "NAME=value" string, so that an
+// exported one can go in the environment exactly as it is.
+typedef struct
+{
+    char*  entry;     // "NAME=value", `malloc()`ed
+    size_t name_len;  // Length of the NAME part
+    size_t env_index; // Where `entry` is in the table's `envp`, or
+                      // `VAR_LOCAL`
+} var_t;
+
+// Every shell variable, hashed by name so that expanding one costs a single
+// probe no matter how many there are.
+//
+// The exported ones also make up `envp`, ready to hand to `execve()`. It's
+// kept up to date as variables change, one entry at a time: setting a
+// variable swaps in its new entry, exporting one appends it, and unsetting
+// one moves the last entry into the hole. Nothing about it is rebuilt per
+// launch, or at all.
+typedef struct
+{
+    var_t** slots;      // Open-addressed by name, linear probing
+    size_t  slot_count; // Size of `slots`; a power of two
+    size_t  count;      // How many slots are filled
+    char**  envp;       // Every exported entry, then `NULL`
+    size_t  env_count;  // How many exported entries there are
+    size_t  env_cap;    // Size of `envp`
+} var_table_t;
+
+
+/*** Implementations ***/
+
+// Sets up an empty variable table.
+//
+// **Returns** zero on success, or an `errno` value.
+int var_table_init(var_table_t* table)
+{
+    table->slot_count = VAR_TABLE_MIN_SLOTS;
+    table->slots = calloc(table->slot_count, sizeof(var_t*));
+    table->count = 0;
+    table->env_cap = VAR_ENV_MIN_CAP;
+    table->envp = calloc(table->env_cap, sizeof(char*));
+    table->env_count = 0;
+
+    return table->slots != NULL && table->envp != NULL ? 0 : ENOMEM;
+}
+
+// Works out how much of a string is a variable name: a letter or '_', then
+// any number of letters, digits, and '_'s.
+//
+// **Returns** the length of the name at the start of `str`, or 0 if there
+// isn't one.
+size_t var_name_len(const char* str)
+{
+    const char* p = str;
+    if (!((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || *p == '_'))
+    {
+        return 0;
+    }
+    for (++p;
+         (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z')
+         || (*p >= '0' && *p <= '9') || *p == '_';
+         ++p)
+    {
+    }
+
+    return (size_t)(p - str);
+}
+
+// FNV-1a over a name, which needn't be `'\0'`-terminated.
+size_t var_hash(const char* name, size_t len)
+{
+    uint64_t h = 14695981039346656037u;
+    size_t i;
+    for (i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211u;
+    }
+
+    return (size_t)h;
+}
+
+// Finds the slot that holds a variable, or the empty slot where it would
+// go.
+var_t** var_table_slot(const var_table_t* table, const char* name, size_t len)
+{
+    size_t slot = var_hash(name, len) & (table->slot_count - 1);
+    var_t* var;
+    while ((var = table->slots[slot]) != NULL
+           && (var->name_len != len || memcmp(var->entry, name, len) != 0))
+    {
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+
+    return &table->slots[slot];
+}
+
+// Looks a variable up.
+//
+// ## Parameters:
+// * `table` - The variables.
+// * `name` - The name, which needn't be `'\0'`-terminated.
+// * `len` - The length of `name`.
+//
+// **Returns** the variable's value, which stays valid until it's next set
+// or unset, or `NULL` if there's no such variable.
+const char* var_get(const var_table_t* table, const char* name, size_t len)
+{
+    const var_t* var = *var_table_slot(table, name, len);
+
+    return var != NULL ? var->entry + var->name_len + 1 : NULL;
+}
+
+// Adds a variable's entry to the end of `envp`.
+//
+// **Returns** zero on success, or an `errno` value.
+int var_env_append(var_table_t* table, var_t* var)
+{
+    if (table->env_count + 1 == table->env_cap)
+    {
+        char** grown = realloc(
+            table->envp,
+            2 * table->env_cap * sizeof(char*)
+        );
+        if (grown == NULL)
+        {
+            return ENOMEM;
+        }
+        table->envp = grown;
+        table->env_cap *= 2;
+    }
+    var->env_index = table->env_count;
+    table->envp[table->env_count++] = var->entry;
+    table->envp[table->env_count] = NULL;
+
+    return 0;
+}
+
+// Sets a variable, creating it if need be.
+//
+// ## Parameters:
+// * `table` - The variables.
+// * `name` - The name, which needn't be `'\0'`-terminated. Assumed to be a
+//            valid one (see `var_name_len()`).
+// * `len` - The length of `name`.
+// * `value` - The new value.
+// * `export` - Should the variable be exported, if it isn't already?
+//              Exported variables never go back to being local.
+//
+// **Returns** zero on success, or an `errno` value (and the variable is left
+// as it was).
+int var_set(var_table_t* table,
+            const char*  name,
+            size_t       len,
+            const char*  value,
+            bool         export)
+{
+    var_t** slot = var_table_slot(table, name, len);
+    size_t value_len = strlen(value);
+
+    // Build the new entry first, so that running out of memory leaves the
+    // variable as it was
+    char* entry = malloc(len + value_len + 2);
+    if (entry == NULL)
+    {
+        return ENOMEM;
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, value_len + 1);
+
+    var_t* var = *slot;
+    if (var == NULL)
+    {
+        // Keep the load under 1/2
+        if ((table->count + 1) * 2 > table->slot_count)
+        {
+            var_t** old_slots = table->slots;
+            size_t old_count = table->slot_count;
+            table->slots = calloc(2 * old_count, sizeof(var_t*));
+            if (table->slots == NULL)
+            {
+                table->slots = old_slots;
+                free(entry);
+                return ENOMEM;
+            }
+            table->slot_count = 2 * old_count;
+
+            size_t i;
+            for (i = 0; i < old_count; ++i)
+            {
+                if (old_slots[i] != NULL)
+                {
+                    *var_table_slot(
+                        table,
+                        old_slots[i]->entry,
+                        old_slots[i]->name_len
+                    ) = old_slots[i];
+                }
+            }
+            free(old_slots);
+            slot = var_table_slot(table, name, len);
+        }
+
+        var = malloc(sizeof(var_t));
+        if (var == NULL)
+        {
+            free(entry);
+            return ENOMEM;
+        }
+        var->entry = entry;
+        var->name_len = len;
+        var->env_index = VAR_LOCAL;
+        *slot = var;
+        table->count++;
+    }
+    else
+    {
+        free(var->entry);
+        var->entry = entry;
+        if (var->env_index != VAR_LOCAL)
+        {
+            table->envp[var->env_index] = entry;
+        }
+    }
+
+    if (export && var->env_index == VAR_LOCAL)
+    {
+        return var_env_append(table, var);
+    }
+
+    return 0;
+}
+
+// Exports a variable, creating it (empty) if there's no such variable.
+//
+// **Returns** zero on success, or an `errno` value.
+int var_export(var_table_t* table, const char* name, size_t len)
+{
+    var_t* var = *var_table_slot(table, name, len);
+    if (var == NULL)
+    {
+        return var_set(table, name, len, "", true);
+    }
+
+    return var->env_index == VAR_LOCAL ? var_env_append(table, var) : 0;
+}
+
+// Gets rid of a variable, if there is one by that name.
+//
+// **Returns** whether there was.
+bool var_unset(var_table_t* table, const char* name, size_t len)
+{
+    var_t** slot = var_table_slot(table, name, len);
+    var_t* var = *slot;
+    if (var == NULL)
+    {
+        return false;
+    }
+
+    // Fill its hole in `envp` with the last entry
+    if (var->env_index != VAR_LOCAL)
+    {
+        char* last = table->envp[--table->env_count];
+        table->envp[var->env_index] = last;
+        table->envp[table->env_count] = NULL;
+        if (last != var->entry)
+        {
+            const char* eq = strchr(last, '=');
+            (*var_table_slot(table, last, (size_t)(eq - last)))->env_index =
+                var->env_index;
+        }
+    }
+
+    free(var->entry);
+    free(var);
+    *slot = NULL;
+    table->count--;
+
+    // Re-seat everything in the probe run after the hole, so that lookups
+    // don't stop short at it
+    size_t i = (size_t)(slot - table->slots);
+    for (i = (i + 1) & (table->slot_count - 1);
+         table->slots[i] != NULL;
+         i = (i + 1) & (table->slot_count - 1))
+    {
+        var_t* moved = table->slots[i];
+        table->slots[i] = NULL;
+        *var_table_slot(table, moved->entry, moved->name_len) = moved;
+    }
+
+    return true;
+}
+
+// Takes in an environment (e.g. `environ`), every entry of which becomes an
+// exported variable. Entries without a valid name are skipped.
+//
+// **Returns** zero on success, or an `errno` value.
+int var_table_import(var_table_t* table, char* const* env)
+{
+    for (; *env != NULL; ++env)
+    {
+        size_t len = var_name_len(*env);
+        if (len == 0 || (*env)[len] != '=')
+        {
+            continue;
+        }
+        int err = var_set(table, *env, len, *env + len + 1, true);
+        if (err != 0)
+        {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+// `free()`s everything a variable table holds.
+void var_table_destroy(var_table_t* table)
+{
+    size_t i;
+    for (i = 0; i < table->slot_count; ++i)
+    {
+        if (table->slots[i] != NULL)
+        {
+            free(table->slots[i]->entry);
+            free(table->slots[i]);
+        }
+    }
+    free(table->slots);
+    free(table->envp);
+    table->slots = NULL;
+    table->envp = NULL;
+    table->count = 0;
+    table->env_count = 0;
+}